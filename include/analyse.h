@@ -0,0 +1,26 @@
+/*
+ * Copyright (C) 2023 Sayu <mail@sayurc.moe>
+ *
+ * This file is part of Athena.
+ *
+ * Athena is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ * 
+ * Athena is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef ANALYSE_H
+#define ANALYSE_H
+
+#define ANALYSE_DEFAULT_DEPTH 10
+
+void analyse(FILE *input, FILE *output, int depth, int workers_nb);
+
+#endif
@@ -21,6 +21,13 @@
 
 #define U64(n) UINT64_C(n)
 
+/*
+ * Used for small functions that take a color or another constant as argument,
+ * so that every call with a constant gets its own copy of the function with the
+ * branches on that argument removed.
+ */
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
 typedef int8_t  i8;
 typedef int16_t i16;
 typedef int32_t i32;
@@ -31,6 +38,10 @@ typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
 
+void init_cpu_features(void);
+bool cpu_has_fast_pext(void);
+bool cpu_has_avx2(void);
+bool cpu_has_avx512(void);
 u64 pext(u64 n, u64 mask);
 int popcnt(u64 n);
 int get_ls1b(u64 n);
@@ -35,6 +35,13 @@ enum move_picker_stage {
 	MOVE_PICKER_STAGE_BAD_CAPTURE,
 };
 
+/*
+ * History of the quiet moves indexed by the piece that moves and its target
+ * square. The continuation history has one of these for each piece and target
+ * square of a previous move.
+ */
+typedef i16 PieceToHistory[12][64];
+
 /*
  * This struct stores data about the moves so we don't have to recompute the
  * scores every time we need to pick a new move.
@@ -53,18 +60,51 @@ struct move_picker_context {
 	int index;
 	int refutation_index;
 	struct move_with_score moves[256];
-	Move refutations[2];
+	Move refutations[3];
 	int refutations_end;
+	/* The attackers of the target squares of the captures, only the
+	 * squares in known_attackers have been computed. */
+	u64 attackers[64];
+	u64 known_attackers;
 	const int (*butterfly_history)[64][64];
+	/* The continuation histories of the moves played one and two plies
+	 * before, NULL when there is no such move. */
+	const PieceToHistory *continuation_history[2];
+};
+
+/*
+ * The pawn structure rarely changes between nodes that are close in the search
+ * tree, so the pawn terms of the evaluation are cached in a table indexed by
+ * the pawn hash of the position. Each search thread has its own table.
+ */
+#define PAWN_TABLE_SIZE 8192
+
+struct pawn_entry {
+	u64 hash;
+	/* Passed and isolated pawns of both colors. */
+	u64 passed_pawns;
+	u64 isolated_pawns;
+	/* Score of the pawn structure from white's point of view. */
+	i16 mg;
+	i16 eg;
+};
+
+struct pawn_table {
+	struct pawn_entry entries[PAWN_TABLE_SIZE];
 };
 
 Move pick_next_move(struct move_picker_context *ctx, Position *pos);
-void init_move_picker_context(struct move_picker_context *ctx, Move tt_move,
-			      const Move *refutations, int refutations_nb,
-			      const int (*butterfly_history)[64][64],
-			      bool skip_quiets);
-int evaluate(const Position *pos);
+void init_move_picker_context(
+	struct move_picker_context *ctx, Move tt_move, const Move *refutations,
+	int refutations_nb, const int (*butterfly_history)[64][64],
+	const PieceToHistory *const *continuation_history, bool skip_quiets);
+void skip_quiet_moves(struct move_picker_context *ctx);
+int evaluate(Position *pos, struct pawn_table *pawn_table);
+void clear_pawn_table(struct pawn_table *table);
+int get_piece_square_value(Piece piece, Square sq, bool middle_game);
 bool wins_exchange(Move move, int threshold, const Position *pos);
+bool move_picker_wins_exchange(struct move_picker_context *ctx, Move move,
+			       int threshold, const Position *pos);
 #ifdef TEST
 void test_eval(void);
 #endif
@@ -58,11 +58,11 @@ struct move_with_score {
 
 Move lan_to_move(const char *lan, const Position *pos, bool *success);
 void move_to_lan(char *lan, Move move);
-bool move_is_legal(Position *pos, Move move);
 void undo_move(Position *pos, Move move);
 void do_move(Position *pos, Move move);
 void undo_null_move(Position *pos);
 void do_null_move(Position *pos);
+u64 get_hash_after_move(const Position *pos, Move move);
 Move create_move(Square from, Square to, MoveType type);
 bool move_is_quiet(Move move);
 bool move_is_capture(Move move);
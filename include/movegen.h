@@ -19,12 +19,19 @@
 #ifndef MOVEGEN_H
 #define MOVEGEN_H
 
+/*
+ * MOVE_GEN_TYPE_ALL generates the captures and the quiet moves in a single
+ * pass, in no particular order.
+ */
 enum move_gen_type {
 	MOVE_GEN_TYPE_QUIET,
 	MOVE_GEN_TYPE_CAPTURE,
+	MOVE_GEN_TYPE_ALL,
 };
 
 bool move_is_pseudo_legal(Move move, const Position *pos);
+bool move_is_legal(const Position *pos, Move move);
+void update_check_info(Position *pos);
 u64 get_pawn_attacks(Square sq, Color c);
 u64 get_west_ray(Square sq);
 u64 get_east_ray(Square sq);
@@ -43,12 +50,13 @@ u64 shift_bb_north(u64 bb, int n);
 u64 shift_bb_east(u64 bb, int n);
 u64 shift_bb_west(u64 bb, int n);
 u64 get_file_bitboard(File file);
-u64 movegen_perft(Position *pos, int depth);
 u64 get_attackers(Square sq, const Position *pos);
 bool square_is_attacked_by_pawn(Square sq, Color by_side, const Position *pos);
 bool is_square_attacked(Square sq, Color by_side, const Position *pos);
 int get_pseudo_legal_moves(struct move_with_score *moves, enum move_gen_type type,
 			   const Position *restrict pos);
+int get_legal_moves(struct move_with_score *moves, enum move_gen_type type,
+		    const Position *restrict pos);
 void movegen_init(void);
 #ifdef TEST
 void test_movegen(void);
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2023 Sayu <mail@sayurc.moe>
+ *
+ * This file is part of Athena.
+ *
+ * Athena is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ * 
+ * Athena is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef NNUE_H
+#define NNUE_H
+
+int load_network(const char *path);
+void free_network(void);
+void enable_nnue(bool enable);
+bool nnue_is_enabled(void);
+void add_to_accumulators(Position *pos, Piece piece, Square sq);
+void remove_from_accumulators(Position *pos, Piece piece, Square sq);
+void invalidate_accumulators(Position *pos);
+int evaluate_nnue(Position *pos);
+
+#ifdef TEST
+void test_nnue(void);
+#endif
+
+#endif
@@ -22,8 +22,23 @@
 #define INITIAL_PHASE 0
 #define FINAL_PHASE 256
 
+/*
+ * The longest possible chess game is 8848.5 full moves long, so there are at
+ * most 8848.5 * 2 = 17697 half moves in a game.
+ */
 #define POSITION_STACK_CAPACITY 17697
 
+/*
+ * Number of free irreversible states a copied position has room for before its
+ * stack needs to grow. It covers the deepest line the search can play.
+ */
+#define POSITION_STACK_RESERVE 256
+
+/*
+ * Enough room for the FEN of any position and the null terminator.
+ */
+#define FEN_MAX_LEN 128
+
 typedef enum direction {
 	NORTH,
 	NORTHEAST,
@@ -101,30 +116,78 @@ typedef enum castling_side {
 	CASTLING_SIDE_KING,
 } CastlingSide;
 
+/*
+ * Each state holds the full Zobrist key of its position, so the stack of states
+ * is also the history of the keys of the game.
+ */
 struct irreversible_state {
 	u64 hash;
 	u8 castling_rights_and_enpassant;
 	u8 halfmove_clock;
 	u8 captured_piece;
+	/* The enemy pieces giving check to the side to move and the pieces of
+	 * the side to move that are pinned to its king. */
+	u64 checkers;
+	u64 pinned;
 };
 
+/*
+ * Size of the first layer of the NNUE for each side.
+ */
+#define NNUE_ACCUMULATOR_SIZE 256
+
+/*
+ * The first layer of the NNUE, one for each side's point of view. It's kept up
+ * to date as the pieces are placed and removed. The features depend on the
+ * position of the side's king, so when the king moves the accumulator is marked
+ * as dirty and it's computed from scratch when needed.
+ */
+struct accumulator {
+	i16 values[2][NNUE_ACCUMULATOR_SIZE];
+	bool dirty[2];
+};
+
+/*
+ * The irreversible states are kept in a stack allocated on the heap that grows
+ * as moves are made, so the position itself stays small. The stack is owned by
+ * the position: it must be released with free_position, and a position can
+ * only be duplicated with copy_position. Assigning a position to another moves
+ * the ownership of the stack to the destination.
+ */
 typedef struct position {
-	u64 hash;
 	size_t irr_state_cap;
 	size_t irr_state_idx;
+	struct irreversible_state *irr_states;
 	u8 side_to_move;
 	short fullmove_counter;
 	u64 color_bb[2];
 	u64 type_bb[6];
 	Piece board[64];
-	/* The longest possible chess game is 8848.5 full moves long, so we need
-	 * space for at most 8848.5 * 2 = 17697 half moves. */
-	struct irreversible_state irr_states[POSITION_STACK_CAPACITY];
+	/* Sums of the material and piece-square table values of all the
+	 * pieces from white's point of view, and of the phase weights of all
+	 * the pieces. They are updated as the pieces are placed and removed so
+	 * the evaluation doesn't have to compute them from scratch. */
+	int mg_psqt;
+	int eg_psqt;
+	int phase_weight;
+	/* Zobrist key of the pawns only, used to index the pawn hash table. */
+	u64 pawn_hash;
+	struct accumulator accumulator;
 } Position;
 
 u64 get_position_hash(const Position *pos);
+u64 get_polyglot_key(const Position *pos);
+u64 get_pawn_hash(const Position *pos);
+u64 get_checkers(const Position *pos);
+u64 get_pinned_pieces(const Position *pos);
+void set_check_info(Position *pos, u64 checkers, u64 pinned);
+u64 get_piece_square_hash(Piece piece, Square sq);
+u64 get_side_to_move_hash(void);
+u64 get_en_passant_hash(File file);
 int get_phase(const Position *pos);
+int get_psqt_score(const Position *pos, bool middle_game);
 bool pos_equal(const Position *pos1, const Position *pos2);
+bool is_repetition(const Position *pos);
 void decrement_fullmove_counter(Position *pos);
 void increment_fullmove_counter(Position *pos);
 void remove_castling(Position *pos, Color c, CastlingSide side);
@@ -155,6 +218,7 @@ void backtrack_irreversible_state(Position *pos);
 void start_new_irreversible_state(Position *pos);
 void copy_position(Position *copy, const Position *pos);
 int init_position(Position *pos, const char *fen);
+void free_position(Position *pos);
 Square file_rank_to_square(File f, Rank r);
 File get_file(Square sq);
 Rank get_rank(Square sq);
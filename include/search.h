@@ -19,9 +19,12 @@
 #ifndef SEARCH_H
 #define SEARCH_H
 
+#define MAX_MULTIPV 256
+
 /*
- * The flags INFO_FLAG_MATE and INFO_FLAG_CP are mutually exclusive and the flag
- * INFO_FLAG_LBOUND should be set only if one of them is set.
+ * The flags INFO_FLAG_MATE and INFO_FLAG_CP are mutually exclusive, and so are
+ * the flags INFO_FLAG_LBOUND and INFO_FLAG_UBOUND, which should be set only if
+ * one of the first two is set.
  */
 enum info_flag {
 	INFO_FLAG_DEPTH  = 0x1,
@@ -31,44 +34,105 @@ enum info_flag {
 	INFO_FLAG_TIME   = 0x1 << 4,
 	INFO_FLAG_CP     = 0x1 << 5,
 	INFO_FLAG_LBOUND = 0x1 << 6,
+	INFO_FLAG_UBOUND = 0x1 << 7,
+	INFO_FLAG_MULTIPV = 0x1 << 8,
+	INFO_FLAG_PV = 0x1 << 9,
 };
 
+/*
+ * The moves of the PV are only valid while the info sender runs.
+ */
 struct info {
 	enum info_flag flags;
 	int depth;
+	int multipv;
 	int cp;
 	int mate;
 	long long nodes;
 	long long nps;
 	long long time;
+	const Move *pv;
+	int pv_length;
+};
+
+/*
+ * Counters of what the search did, used to tune the pruning and the move
+ * ordering. Each thread counts in its own context during a search and they are
+ * reset when a new search starts, so after a search the contexts hold the
+ * counters of that search.
+ */
+struct search_statistics {
+	long long nodes;
+	long long quiescence_nodes;
+	long long tt_probes;
+	long long tt_hits;
+	long long tt_cutoffs;
+	long long tb_hits;
+	long long null_move_prunes;
+	long long reverse_futility_prunes;
+	long long futility_prunes;
+	long long late_move_prunes;
+	long long lmr_researches;
+	long long fail_highs;
+	long long first_move_fail_highs;
+	long long qsearch_see_prunes;
+	long long illegal_moves;
 };
 
 struct search_context {
 	/* [side_to_move][from][to] */
 	int butterfly_history[2][64][64];
+	/* [piece][to] of the previous move. */
+	PieceToHistory continuation_history[12][64];
+	Move counter_moves[12][64];
+	struct pawn_table pawn_table;
+	struct search_statistics stats;
 };
 
+/*
+ * The position is the root of the search with the moves of the game already
+ * played, so its stack of keys is used to find repetitions of positions from
+ * before the search.
+ */
 struct search_argument {
 	Position pos;
 	int depth;
 	int mate;
 	int movestogo;
+	/* Number of best root moves searched and reported, it is reduced to
+	 * the number of legal moves. */
+	int multipv;
 	long long nodes;
 	long long time[2];
 	long long inc[2];
 	long long movetime;
 	void (*info_sender)(const struct info *);
-	void (*best_move_sender)(Move);
+	/* The ponder move is the expected reply to the best move, it is 0 if
+	 * there is none. */
+	void (*best_move_sender)(Move best_move, Move ponder_move);
+	/* If it is not NULL it is called with the statistics of all the
+	 * threads before the best move is sent. */
+	void (*statistics_sender)(const struct search_statistics *);
 	atomic_bool *stop;
-	Move moves[POSITION_STACK_CAPACITY];
-	int moves_nb;
-	struct search_context ctx;
-#ifdef SEARCH_STATISTICS
-	FILE *log_file;
-#endif
+	/* While it is true the time limits are ignored, the caller sets it to
+	 * false when the opponent plays the expected move and from then on the
+	 * limits apply to the time since the search started. It may be NULL if
+	 * the search never ponders. */
+	atomic_bool *ponder;
+	/* Number of search threads, including the main one. */
+	int threads;
+	/* There is one context for each thread, the first one belongs to the
+	 * main thread. */
+	struct search_context *ctx;
 };
 
+void search_init(void);
 void *search(void *arg);
 void init_search_context(struct search_context *ctx);
+void sum_search_statistics(struct search_statistics *total,
+			   const struct search_context *ctx, int threads_nb);
+#ifdef TEST
+void test_search(void);
+#endif
 
 #endif
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2023 Sayu <mail@sayurc.moe>
+ *
+ * This file is part of Athena.
+ *
+ * Athena is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ * 
+ * Athena is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#ifndef TB_H
+#define TB_H
+
+/*
+ * A cursed win is a win that takes too long for the fifty-move rule and a
+ * blessed loss is a loss that the rule saves, so both are draws in a game.
+ */
+typedef enum wdl {
+	WDL_LOSS = -2,
+	WDL_BLESSED_LOSS = -1,
+	WDL_DRAW = 0,
+	WDL_CURSED_WIN = 1,
+	WDL_WIN = 2,
+} Wdl;
+
+int tb_init(const char *paths);
+void tb_free(void);
+int get_tb_largest(void);
+bool probe_wdl(Wdl *wdl, Position *pos);
+bool probe_dtz(int *dtz, Position *pos);
+int filter_root_moves(Move *moves, int moves_nb, Position *pos);
+
+#ifdef TEST
+void test_tb(void);
+#endif
+
+#endif
@@ -19,7 +19,17 @@
 #ifndef TT_H
 #define TT_H
 
+/*
+ * The depth of an entry is stored in a byte, deeper searches are stored with
+ * this depth.
+ */
+#define TT_MAX_DEPTH 255
+
+/*
+ * BOUND_NONE marks an empty entry and is never returned by get_tt_entry.
+ */
 typedef enum bound {
+	BOUND_NONE,
 	BOUND_LOWER,
 	BOUND_UPPER,
 	BOUND_EXACT,
@@ -27,6 +37,8 @@ typedef enum bound {
 
 typedef struct node_data {
 	i16 score;
+	/* Static evaluation of the position. */
+	i16 eval;
 	u8 depth;
 	u8 bound;
 	u64 hash;
@@ -35,12 +47,15 @@ typedef struct node_data {
 
 bool get_tt_entry(NodeData *data, const Position *pos);
 void store_tt_entry(const NodeData *data);
-void init_tt_entry(NodeData *node_data, int score, int depth, Bound bound,
-		   Move best_move, const Position *pos);
-void prefetch_tt(void);
-void clear_tt(void);
-void resize_tt(size_t size);
-void tt_init(size_t size);
+void init_tt_entry(NodeData *node_data, int score, int eval, int depth,
+		   Bound bound, Move best_move, const Position *pos);
+void increment_tt_generation(void);
+void prefetch_tt(u64 hash);
+void clear_tt(int threads_nb);
+void resize_tt(size_t size, int threads_nb);
+void tt_init(size_t size, int threads_nb);
 void tt_free(void);
+int save_tt(const char *path);
+int load_tt(const char *path);
 
 #endif
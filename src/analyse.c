@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2023 Sayu <mail@sayurc.moe>
+ *
+ * This file is part of Athena.
+ *
+ * Athena is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ * 
+ * Athena is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include <bit.h>
+#include <pos.h>
+#include <move.h>
+#include <eval.h>
+#include <tt.h>
+#include <search.h>
+#include <analyse.h>
+
+/*
+ * The input and the output are shared by all the workers, each worker takes
+ * the next line when it finishes its search.
+ */
+struct shared_data {
+	FILE *input;
+	FILE *output;
+	pthread_mutex_t input_mutex;
+	pthread_mutex_t output_mutex;
+	int lines_nb;
+	int depth;
+};
+
+struct worker {
+	pthread_t thread;
+	struct shared_data *shared;
+	struct search_argument arg;
+	atomic_bool stop;
+};
+
+/*
+ * The last exact score and depth reported by the search, the node count and
+ * the best move. The callbacks of the search don't know which worker called
+ * them, but each worker runs its search in its own thread so the results are
+ * kept per thread.
+ */
+struct result {
+	int depth;
+	bool mate;
+	int score;
+	long long nodes;
+	Move best_move;
+};
+
+static void *run_worker(void *arg);
+static bool read_line(char *line, int size, FILE *fp);
+static int parse_fen(char *fen, const char *line);
+static void receive_info(const struct info *info);
+static void receive_best_move(Move best_move, Move ponder_move);
+
+static _Thread_local struct result result;
+
+/*
+ * Searches each position of the input to the given depth and writes the results
+ * as soon as they are found, so they come in the order the searches finish and
+ * not in the order of the input. Each result starts with the number of the line
+ * of the position. The lines are FENs or EPDs, in which case the operations
+ * after the first four fields are ignored.
+ *
+ * Each worker runs a single threaded search with its own search context. The
+ * workers share the transposition table, which must be initialized by the
+ * caller, so they still profit from the positions the others have searched.
+ */
+void analyse(FILE *input, FILE *output, int depth, int workers_nb)
+{
+	struct shared_data shared;
+	shared.input = input;
+	shared.output = output;
+	shared.lines_nb = 0;
+	shared.depth = depth;
+	if (pthread_mutex_init(&shared.input_mutex, NULL) ||
+	    pthread_mutex_init(&shared.output_mutex, NULL)) {
+		fprintf(stderr, "Internal error.\n");
+		exit(1);
+	}
+
+	struct worker *const workers =
+		malloc((size_t)workers_nb * sizeof(*workers));
+	if (!workers) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	/* If a worker can't be created we run the ones we already have, and
+	 * if there are none the calling thread does the work. */
+	int created_nb = 0;
+	for (int i = 0; i < workers_nb; ++i) {
+		workers[i].shared = &shared;
+		if (pthread_create(&workers[i].thread, NULL, run_worker,
+				   &workers[i])) {
+			perror("Athena");
+			break;
+		}
+		++created_nb;
+	}
+	if (!created_nb)
+		run_worker(&workers[0]);
+	for (int i = 0; i < created_nb; ++i) {
+		if (pthread_join(workers[i].thread, NULL)) {
+			fprintf(stderr, "Internal error.\n");
+			exit(1);
+		}
+	}
+
+	free(workers);
+	pthread_mutex_destroy(&shared.output_mutex);
+	pthread_mutex_destroy(&shared.input_mutex);
+}
+
+static void *run_worker(void *arg)
+{
+	struct worker *const worker = arg;
+	struct shared_data *const shared = worker->shared;
+	struct search_argument *const search_arg = &worker->arg;
+
+	search_arg->depth = shared->depth;
+	search_arg->mate = 0;
+	search_arg->movestogo = 0;
+	search_arg->multipv = 1;
+	search_arg->nodes = LLONG_MAX;
+	search_arg->time[COLOR_WHITE] = search_arg->time[COLOR_BLACK] = 0;
+	search_arg->inc[COLOR_WHITE] = search_arg->inc[COLOR_BLACK] = 0;
+	search_arg->movetime = 0;
+	search_arg->info_sender = receive_info;
+	search_arg->best_move_sender = receive_best_move;
+	search_arg->statistics_sender = NULL;
+	search_arg->stop = &worker->stop;
+	search_arg->ponder = NULL;
+	search_arg->threads = 1;
+	search_arg->ctx = malloc(sizeof(*search_arg->ctx));
+	if (!search_arg->ctx) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	while (true) {
+		char line[BUFSIZ];
+		pthread_mutex_lock(&shared->input_mutex);
+		const bool found = read_line(line, sizeof(line), shared->input);
+		const int line_number = ++shared->lines_nb;
+		pthread_mutex_unlock(&shared->input_mutex);
+		if (!found)
+			break;
+
+		char fen[FEN_MAX_LEN];
+		if (parse_fen(fen, line) ||
+		    init_position(&search_arg->pos, fen)) {
+			pthread_mutex_lock(&shared->output_mutex);
+			fprintf(stderr, "Invalid position on line %d.\n",
+				line_number);
+			pthread_mutex_unlock(&shared->output_mutex);
+			continue;
+		}
+
+		/* The histories are cleared so the result of a position
+		 * doesn't depend on the positions the worker searched
+		 * before. */
+		init_search_context(search_arg->ctx);
+		atomic_store(&worker->stop, false);
+		result.depth = 0;
+		result.mate = false;
+		result.score = 0;
+		result.nodes = 0;
+		result.best_move = 0;
+		search(search_arg);
+		free_position(&search_arg->pos);
+
+		char lan[MAX_LAN_LEN + 1];
+		move_to_lan(lan, result.best_move);
+		pthread_mutex_lock(&shared->output_mutex);
+		fprintf(shared->output,
+			"%d bestmove %s score %s %d depth %d nodes %lld fen "
+			"%s\n",
+			line_number, result.best_move ? lan : "(none)",
+			result.mate ? "mate" : "cp", result.score,
+			result.depth, result.nodes, fen);
+		fflush(shared->output);
+		pthread_mutex_unlock(&shared->output_mutex);
+	}
+
+	free(search_arg->ctx);
+	return NULL;
+}
+
+/*
+ * Reads a line without the line break, the rest of a line that doesn't fit is
+ * discarded. Returns false at the end of the file.
+ */
+static bool read_line(char *line, int size, FILE *fp)
+{
+	if (!fgets(line, size, fp))
+		return false;
+	const size_t len = strlen(line);
+	if (len && line[len - 1] == '\n') {
+		line[len - 1] = '\0';
+	} else {
+		int ch;
+		do
+			ch = fgetc(fp);
+		while (ch != '\n' && ch != EOF);
+	}
+	return true;
+}
+
+/*
+ * Makes a FEN from a line with a FEN or an EPD. EPDs don't have the halfmove
+ * clock and the fullmove counter, so they are set to 0 and 1. Returns 0 on
+ * success and 1 if the line doesn't start with the four fields of a position,
+ * the fields themselves are checked by init_position.
+ */
+static int parse_fen(char *fen, const char *line)
+{
+	char board[72], side[2], castling[5], en_passant[3];
+	int halfmove_clock = 0, fullmove_counter = 1;
+	const int fields_nb = sscanf(line, "%71s %1s %4s %2s %d %d", board,
+				     side, castling, en_passant,
+				     &halfmove_clock, &fullmove_counter);
+	if (fields_nb < 4)
+		return 1;
+	if (fields_nb < 6) {
+		halfmove_clock = 0;
+		fullmove_counter = 1;
+	}
+	snprintf(fen, FEN_MAX_LEN, "%s %s %s %s %d %d", board, side, castling,
+		 en_passant, halfmove_clock, fullmove_counter);
+	return 0;
+}
+
+/*
+ * Only the exact scores are kept, the bounds of the aspiration windows are not
+ * the result of an iteration. The node count includes the previous iterations,
+ * so the last one is the total.
+ */
+static void receive_info(const struct info *info)
+{
+	if (info->flags & INFO_FLAG_NODES)
+		result.nodes = info->nodes;
+	if (info->flags & (INFO_FLAG_LBOUND | INFO_FLAG_UBOUND))
+		return;
+	if (info->flags & INFO_FLAG_DEPTH)
+		result.depth = info->depth;
+	if (info->flags & INFO_FLAG_MATE) {
+		result.mate = true;
+		result.score = info->mate;
+	} else if (info->flags & INFO_FLAG_CP) {
+		result.mate = false;
+		result.score = info->cp;
+	}
+}
+
+static void receive_best_move(Move best_move, Move ponder_move)
+{
+	(void)ponder_move;
+	result.best_move = best_move;
+}
@@ -19,17 +19,74 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "bit.h"
+
+/*
+ * The instructions that are not part of the base x86-64 instruction set are
+ * chosen at runtime so the same binary runs on any x86-64 CPU. They are written
+ * with inline assembly instead of intrinsics because the intrinsics can only be
+ * inlined into functions compiled for the same instruction set, and these
+ * functions are called in the hottest parts of the engine.
+ */
 #ifdef ARCH_x64
-#include <immintrin.h>
+static bool has_popcnt;
+static bool has_bmi2;
 #endif
+static bool has_fast_pext;
+static bool has_avx2;
+static bool has_avx512;
 
-#include "bit.h"
+void init_cpu_features(void)
+{
+#ifdef ARCH_x64
+	__builtin_cpu_init();
+	has_popcnt = __builtin_cpu_supports("popcnt");
+	has_bmi2 = __builtin_cpu_supports("bmi2");
+	/* Before Zen 3 the AMD CPUs implement PEXT in microcode, it takes more
+	 * than a hundred cycles depending on the mask so the magic numbers are
+	 * faster. */
+	has_fast_pext = has_bmi2 && !__builtin_cpu_is("amdfam15h") &&
+			!__builtin_cpu_is("amdfam17h");
+	has_avx2 = __builtin_cpu_supports("avx2");
+	/* The NNUE works on 8-bit and 16-bit integers, which need AVX-512BW. */
+	has_avx512 = __builtin_cpu_supports("avx512f") &&
+		     __builtin_cpu_supports("avx512bw");
+#endif
+}
+
+/*
+ * Returns true if the CPU has a PEXT instruction faster than the multiplication
+ * of the magic bitboards, which is when the slider attacks should be indexed
+ * with PEXT.
+ */
+bool cpu_has_fast_pext(void)
+{
+	return has_fast_pext;
+}
+
+/*
+ * The kernels of the NNUE are compiled for these instruction sets and chosen
+ * at runtime.
+ */
+bool cpu_has_avx2(void)
+{
+	return has_avx2;
+}
+
+bool cpu_has_avx512(void)
+{
+	return has_avx512;
+}
 
 u64 pext(u64 n, u64 mask)
 {
-#ifdef USE_BMI2
-	return _pext_u64(n, mask);
-#else
+#ifdef ARCH_x64
+	if (has_bmi2) {
+		u64 ret;
+		__asm__("pextq %2, %1, %0" : "=r"(ret) : "r"(n), "rm"(mask));
+		return ret;
+	}
+#endif
 	u64 ret = 0;
 	for (u64 bits = 1; mask; bits += bits) {
 		if (n & mask & -mask)
@@ -37,14 +94,17 @@ u64 pext(u64 n, u64 mask)
 		mask &= mask - 1;
 	}
 	return ret;
-#endif
 }
 
 int popcnt(u64 n)
 {
-#ifdef USE_POPCNT
-	return (int)_mm_popcnt_u64(n);
-#else
+#ifdef ARCH_x64
+	if (has_popcnt) {
+		u64 ret;
+		__asm__("popcntq %1, %0" : "=r"(ret) : "rm"(n) : "cc");
+		return (int)ret;
+	}
+#endif
 	const u64 k1 = U64(0x5555555555555555);
 	const u64 k2 = U64(0x3333333333333333);
 	const u64 k4 = U64(0x0f0f0f0f0f0f0f0f);
@@ -54,7 +114,6 @@ int popcnt(u64 n)
 	n = (n       +  (n >> 4)) & k4 ;
 	n = (n * kf) >> 56;
 	return (int)n;
-#endif
 }
 
 /*
@@ -68,12 +127,16 @@ int unset_ls1b(u64 *n)
 }
 
 /*
- * Returns the index of the least significant 1 bit.
+ * Returns the index of the least significant 1 bit. BSF and BSR are part of
+ * the base x86-64 instruction set, so unlike TZCNT and LZCNT they don't need a
+ * runtime check. The result is undefined if n is 0.
  */
 int get_ls1b(u64 n)
 {
-#ifdef USE_BMI
-	return (int)_tzcnt_u64(n);
+#ifdef ARCH_x64
+	u64 ret;
+	__asm__("bsfq %1, %0" : "=r"(ret) : "rm"(n) : "cc");
+	return (int)ret;
 #else
 	const int index[64] = {
 		0,  47,  1, 56, 48, 27,  2, 60,
@@ -95,8 +158,10 @@ int get_ls1b(u64 n)
  * Returns the index of the most significant 1 bit.
  */
 int get_ms1b(u64 n) {
-#ifdef USE_BMI
-	return (int)(63 ^ _lzcnt_u64(n));
+#ifdef ARCH_x64
+	u64 ret;
+	__asm__("bsrq %1, %0" : "=r"(ret) : "rm"(n) : "cc");
+	return (int)ret;
 #else
 	const int index64[64] = {
 		 0, 47,  1, 56, 48, 27,  2, 60,
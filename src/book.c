@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) 2023 Sayu <mail@sayurc.moe>
+ *
+ * This file is part of Athena.
+ *
+ * Athena is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ * 
+ * Athena is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+/*
+ * Opening books in the format of Polyglot. A book is a file of entries of 16
+ * bytes sorted by the key of the position, each with a move and its weight,
+ * and all the numbers are big-endian. The file is mapped into memory instead
+ * of being read, so loading a book costs nothing however big it is, and it is
+ * searched with a binary search on the key. When the book has several moves for
+ * a position one of them is chosen at random with a probability proportional to
+ * its weight.
+ *
+ * The moves are encoded in 16 bits in the following form:
+ *
+ *  0 000 000 000 000 000
+ * |_|___|___|___|___|___|
+ *    |   |   |   |   |
+ *    |   |   |   |   to file
+ *    |   |   |   to rank
+ *    |   |   from file
+ *    |   from rank
+ *    promotion piece
+ *
+ * The promotion piece is 0 for none and from 1 to 4 for the knight, the bishop,
+ * the rook and the queen. Castling moves are encoded as the king capturing its
+ * own rook.
+ */
+
+/* Needed for mmap on Linux. */
+#define _DEFAULT_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(__linux__) && !defined(ARCH_WASM)
+#define USE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <bit.h>
+#include <rng.h>
+#include <pos.h>
+#include <move.h>
+#include <movegen.h>
+#include <book.h>
+
+#define ENTRY_SIZE 16
+
+static u64 read_key(size_t idx);
+static Move read_move(size_t idx, const Position *pos);
+static unsigned read_weight(size_t idx);
+static u64 read_big_endian(const unsigned char *bytes, int len);
+
+static struct {
+	const unsigned char *entries;
+	size_t entries_nb;
+	size_t size;
+	bool mapped; /* The entries were mapped with mmap. */
+} book = { .entries = NULL, .entries_nb = 0, .size = 0, .mapped = false };
+
+/*
+ * Returns 0 on success and 1 if the file can't be read or its size is not a
+ * multiple of the size of an entry, in which case the book we had before is
+ * kept, if any. Without mmap the file is read into memory.
+ */
+int load_book(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		return 1;
+
+	long size = -1;
+	if (!fseek(fp, 0, SEEK_END))
+		size = ftell(fp);
+	if (size <= 0 || size % ENTRY_SIZE || fseek(fp, 0, SEEK_SET)) {
+		fclose(fp);
+		return 1;
+	}
+
+	const unsigned char *entries = NULL;
+	bool mapped = false;
+#ifdef USE_MMAP
+	void *const ptr = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE,
+			       fileno(fp), 0);
+	if (ptr != MAP_FAILED) {
+		entries = ptr;
+		mapped = true;
+	}
+#endif
+	if (!entries) {
+		unsigned char *const buf = malloc((size_t)size);
+		if (!buf) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+		if (fread(buf, 1, (size_t)size, fp) != (size_t)size) {
+			free(buf);
+			fclose(fp);
+			return 1;
+		}
+		entries = buf;
+	}
+	fclose(fp);
+
+	free_book();
+	book.entries = entries;
+	book.entries_nb = (size_t)size / ENTRY_SIZE;
+	book.size = (size_t)size;
+	book.mapped = mapped;
+
+	/* The engine is often started once for each game, so without a new
+	 * seed it would play the same opening every time. */
+	seed_rng((u64)time(NULL));
+	return 0;
+}
+
+void free_book(void)
+{
+#ifdef USE_MMAP
+	if (book.mapped)
+		munmap((void *)book.entries, book.size);
+	else
+		free((void *)book.entries);
+#else
+	free((void *)book.entries);
+#endif
+	book.entries = NULL;
+	book.entries_nb = 0;
+	book.size = 0;
+	book.mapped = false;
+}
+
+/*
+ * Returns a move of the book for the position, or 0 if there is none. Moves
+ * that are not legal in the position, which happens when another position has
+ * the same key, and moves with weight 0 are never chosen.
+ */
+Move probe_book(const Position *pos)
+{
+	const u64 key = get_polyglot_key(pos);
+
+	size_t low = 0;
+	size_t high = book.entries_nb;
+	while (low < high) {
+		const size_t mid = low + (high - low) / 2;
+		if (read_key(mid) < key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	unsigned long total = 0;
+	for (size_t i = low; i < book.entries_nb && read_key(i) == key; ++i) {
+		if (read_move(i, pos))
+			total += read_weight(i);
+	}
+	if (!total)
+		return 0;
+
+	unsigned long r = (unsigned long)(next_rand() % total);
+	for (size_t i = low;; ++i) {
+		const Move move = read_move(i, pos);
+		if (!move)
+			continue;
+		const unsigned weight = read_weight(i);
+		if (r < weight)
+			return move;
+		r -= weight;
+	}
+}
+
+static u64 read_key(size_t idx)
+{
+	return read_big_endian(book.entries + idx * ENTRY_SIZE, 8);
+}
+
+/*
+ * Returns the move of the entry if it is legal in the position and 0 otherwise.
+ */
+static Move read_move(size_t idx, const Position *pos)
+{
+	const unsigned m =
+		(unsigned)read_big_endian(book.entries + idx * ENTRY_SIZE + 8,
+					  2);
+	const Square from = (Square)((m >> 6) & 0x3f);
+	Square to = (Square)(m & 0x3f);
+	const unsigned promotion = (m >> 12) & 0x7;
+	if (promotion > 4)
+		return 0;
+
+	const Piece piece = get_piece_at(pos, from);
+	const Piece target = get_piece_at(pos, to);
+	if (piece != PIECE_NONE && target != PIECE_NONE &&
+	    get_piece_type(piece) == PIECE_TYPE_KING &&
+	    get_piece_type(target) == PIECE_TYPE_ROOK &&
+	    get_piece_color(piece) == get_piece_color(target))
+		to = to > from ? from + 2 : from - 2;
+
+	char lan[MAX_LAN_LEN + 1];
+	lan[0] = (char)('a' + get_file(from));
+	lan[1] = (char)('1' + get_rank(from));
+	lan[2] = (char)('a' + get_file(to));
+	lan[3] = (char)('1' + get_rank(to));
+	lan[4] = promotion ? " nbrq"[promotion] : '\0';
+	lan[5] = '\0';
+
+	bool success;
+	const Move move = lan_to_move(lan, pos, &success);
+	if (!success || !move_is_legal(pos, move))
+		return 0;
+	return move;
+}
+
+static unsigned read_weight(size_t idx)
+{
+	return (unsigned)read_big_endian(book.entries + idx * ENTRY_SIZE + 10,
+					 2);
+}
+
+static u64 read_big_endian(const unsigned char *bytes, int len)
+{
+	u64 n = 0;
+	for (int i = 0; i < len; ++i)
+		n = (n << 8) | bytes[i];
+	return n;
+}
@@ -27,6 +27,13 @@
 #include <move.h>
 #include <movegen.h>
 #include <eval.h>
+#include <nnue.h>
+
+/*
+ * Score of a quiet queen promotion in the move ordering, higher than any
+ * history value.
+ */
+#define QUEEN_PROMOTION_SCORE 20000
 
 struct score {
 	int mg;
@@ -167,17 +174,28 @@ static const int eg_king_sq_table[64] = {
 };
 /* clang-format on */
 
-static struct score evaluate_king(const Position *pos, Square sq);
+static struct score evaluate_pieces(const Position *pos, Color c);
+static void add_score(struct score *score, struct score term);
 static struct score evaluate_queen(const Position *pos, Square sq);
 static struct score evaluate_rook(const Position *pos, Square sq);
 static struct score evaluate_bishop(const Position *pos, Square sq);
 static struct score evaluate_knight(const Position *pos, Square sq);
-static struct score evaluate_pawn(const Position *pos, Square sq);
+static struct score evaluate_pawn_structure(const Position *pos,
+					    struct pawn_table *table);
+static void evaluate_pawns(struct pawn_entry *entry, const Position *pos);
+static struct score evaluate_pawn(const Position *pos, Square sq,
+				  struct pawn_entry *entry);
 static int distance_to_closest_piece(Square sq, Piece piece,
 				     const Position *pos);
 static void insertion_sort(struct move_with_score *moves, int nb);
-static int evaluate_move(Move move, const struct move_picker_context *ctx,
-			 const Position *pos);
+static void move_best_to_front(struct move_with_score *moves, int nb);
+static bool is_refutation(const struct move_picker_context *ctx, Move move);
+static void score_captures(struct move_with_score *moves, int nb,
+			   const Position *pos);
+static int evaluate_move(Move move, int phase, const Position *pos);
+static int evaluate_quiet_move(Move move,
+			       const struct move_picker_context *ctx,
+			       const Position *pos);
 static struct score evaluate_king_move(Move move, const Position *pos);
 static struct score evaluate_queen_move(Move move, const Position *pos);
 static struct score evaluate_rook_move(Move move, const Position *pos);
@@ -186,6 +204,10 @@ static struct score evaluate_knight_move(Move move, const Position *pos);
 static struct score evaluate_pawn_move(Move move, const Position *pos);
 static int get_square_value(Piece piece, Square sq, bool middle_game);
 static int mvv_lva(Move move, const Position *pos);
+static u64 get_target_attackers(struct move_picker_context *ctx, Square sq,
+				const Position *pos);
+static bool exchange_is_won(Move move, int threshold, u64 attackers,
+			    const Position *pos);
 static bool is_outpost(const Position *pos, Square sq, Color side);
 static int get_number_of_adjacent_friendly_pawns(const Position *pos, Square sq,
 						 Color side);
@@ -217,15 +239,16 @@ top:
 		++ctx->stage;
 		if (!move_is_capture(ctx->tt_move) && ctx->skip_quiets)
 			goto top;
+		/* The transposition table is shared by the search threads, so
+		 * an entry may be read while another thread is writing it and
+		 * the move may not even belong to this position. */
+		if (!move_is_pseudo_legal(ctx->tt_move, pos))
+			goto top;
 		return ctx->tt_move;
 	case MOVE_PICKER_STAGE_CAPTURE_INIT: {
 		int added = get_pseudo_legal_moves(ctx->moves,
 						   MOVE_GEN_TYPE_CAPTURE, pos);
-		for (int i = 0; i < added; ++i) {
-			const Move move = ctx->moves[i].move;
-			ctx->moves[i].score =
-				(i16)evaluate_move(move, ctx, pos);
-		}
+		score_captures(ctx->moves, added, pos);
 		/* In MOVE_PICKER_STAGE_GOOD_CAPTURE and
 		 * MOVE_PICKER_STAGE_BAD_CAPTURE we want to simply return the
 		 * next winning captures or losing captures, respectively. But
@@ -253,9 +276,9 @@ top:
 
 		for (; ctx->index < ctx->captures_end; ++ctx->index) {
 			const Move move = ctx->moves[ctx->index].move;
-			if (wins_exchange(move,
-					  -ctx->moves[ctx->index].score / 8,
-					  pos)) {
+			if (move_picker_wins_exchange(
+				    ctx, move,
+				    -ctx->moves[ctx->index].score / 8, pos)) {
 				++ctx->index;
 				return move;
 			}
@@ -274,7 +297,8 @@ top:
 		++ctx->stage;
 		[[fallthrough]];
 	case MOVE_PICKER_STAGE_REFUTATION:
-		if (ctx->refutation_index == ctx->refutations_end) {
+		if (ctx->refutation_index == ctx->refutations_end ||
+		    ctx->skip_quiets) {
 			++ctx->stage;
 			goto top;
 		}
@@ -304,9 +328,8 @@ top:
 		for (int i = ctx->index; i < ctx->quiets_end; ++i) {
 			const Move move = ctx->moves[i].move;
 			ctx->moves[i].score =
-				(i16)evaluate_move(move, ctx, pos);
+				(i16)evaluate_quiet_move(move, ctx, pos);
 		}
-		insertion_sort(&ctx->moves[ctx->index], added);
 
 		++ctx->stage;
 		[[fallthrough]];
@@ -321,9 +344,13 @@ top:
 			++ctx->stage;
 			goto top;
 		}
+		/* Most nodes are cut off after a few moves, so instead of
+		 * sorting all the quiet moves we only look for the best of the
+		 * ones that are left. */
+		move_best_to_front(&ctx->moves[ctx->index],
+				   ctx->quiets_end - ctx->index);
 		if (ctx->moves[ctx->index].move == ctx->tt_move ||
-		    ctx->moves[ctx->index].move == ctx->refutations[0] ||
-		    ctx->moves[ctx->index].move == ctx->refutations[1]) {
+		    is_refutation(ctx, ctx->moves[ctx->index].move)) {
 			++ctx->index;
 			goto top;
 		}
@@ -349,15 +376,26 @@ top:
 	}
 }
 
+/*
+ * The picker stops returning quiet moves. If the quiet moves were not generated
+ * yet they never are.
+ */
+void skip_quiet_moves(struct move_picker_context *ctx)
+{
+	ctx->skip_quiets = true;
+}
+
 /*
  * tt_move should be 0 if there is no transposition table move. There must be
- * at most two refutation moves, the refutations pointer may be NULL if and only
- * if refutations_nb is 0.
+ * at most three refutation moves, the refutations pointer may be NULL if and
+ * only if refutations_nb is 0. The continuation histories of the moves one and
+ * two plies before are given in this order and may be NULL, and so may the
+ * whole array.
  */
-void init_move_picker_context(struct move_picker_context *ctx, Move tt_move,
-			      const Move *refutations, int refutations_nb,
-			      const int (*butterfly_history)[64][64],
-			      bool skip_quiets)
+void init_move_picker_context(
+	struct move_picker_context *ctx, Move tt_move, const Move *refutations,
+	int refutations_nb, const int (*butterfly_history)[64][64],
+	const PieceToHistory *const *continuation_history, bool skip_quiets)
 {
 	ctx->skip_quiets = skip_quiets;
 	ctx->captures_end = 0;
@@ -373,45 +411,41 @@ void init_move_picker_context(struct move_picker_context *ctx, Move tt_move,
 				    MOVE_PICKER_STAGE_CAPTURE_INIT;
 	ctx->index = 0;
 	ctx->refutation_index = 0;
+	ctx->known_attackers = 0;
 	ctx->butterfly_history = butterfly_history;
+	for (int i = 0; i < 2; ++i) {
+		ctx->continuation_history[i] =
+			continuation_history ? continuation_history[i] : NULL;
+	}
 }
 
-int evaluate(const Position *pos)
+/*
+ * The material and piece-square table scores are kept up to date by the
+ * position itself, so here we only compute the positional terms. The pawn
+ * terms are looked up in the pawn table, which can be NULL if the caller has
+ * none, in which case they are always computed.
+ *
+ * If the NNUE is enabled it's used instead. The position is not const because
+ * the NNUE may have to refresh its accumulators.
+ */
+int evaluate(Position *pos, struct pawn_table *pawn_table)
 {
-	struct score (*const piece_functions[])(const Position *, Square) = {
-		[PIECE_TYPE_PAWN] = evaluate_pawn,
-		[PIECE_TYPE_KNIGHT] = evaluate_knight,
-		[PIECE_TYPE_BISHOP] = evaluate_bishop,
-		[PIECE_TYPE_ROOK] = evaluate_rook,
-		[PIECE_TYPE_QUEEN] = evaluate_queen,
-		[PIECE_TYPE_KING] = evaluate_king,
-	};
+	if (nnue_is_enabled())
+		return evaluate_nnue(pos);
 
 	const Color color = get_side_to_move(pos);
 	const int phase = get_phase(pos);
 
-	struct score score;
-	score.mg = 0;
-	score.eg = 0;
+	const struct score white = evaluate_pieces(pos, COLOR_WHITE);
+	const struct score black = evaluate_pieces(pos, COLOR_BLACK);
+	const struct score pawns = evaluate_pawn_structure(pos, pawn_table);
 
-	for (Color c = COLOR_WHITE; c <= COLOR_BLACK; ++c) {
-		for (PieceType pt = PIECE_TYPE_PAWN; pt <= PIECE_TYPE_KING;
-		     ++pt) {
-			const Piece piece = create_piece(pt, c);
-			u64 bb = get_piece_bitboard(pos, piece);
-			while (bb) {
-				const Square sq = (Square)unset_ls1b(&bb);
-				const struct score piece_score =
-					piece_functions[pt](pos, sq);
-				if (c == color) {
-					score.mg += piece_score.mg;
-					score.eg += piece_score.eg;
-				} else {
-					score.mg -= piece_score.mg;
-					score.eg -= piece_score.eg;
-				}
-			}
-		}
+	struct score score;
+	score.mg = get_psqt_score(pos, true) + white.mg - black.mg + pawns.mg;
+	score.eg = get_psqt_score(pos, false) + white.eg - black.eg + pawns.eg;
+	if (color == COLOR_BLACK) {
+		score.mg = -score.mg;
+		score.eg = -score.eg;
 	}
 
 	/* Linear interpolation of (INITIAL_PHASE, score.mg) and
@@ -421,6 +455,16 @@ int evaluate(const Position *pos)
 	       FINAL_PHASE;
 }
 
+/*
+ * An entry filled with zeros is the correct entry for a position without pawns,
+ * whose pawn hash is 0, so clearing the table doesn't need a separate marker
+ * for empty entries.
+ */
+void clear_pawn_table(struct pawn_table *table)
+{
+	memset(table->entries, 0, sizeof(table->entries));
+}
+
 /*
  * SEE (Static Exchange Evaluation). Returns true if the side to move wins the
  * exchange by a piece value greater than the threshold, and returns false
@@ -439,13 +483,44 @@ int evaluate(const Position *pos)
  *   pieces, meaning our opponent can't capture.
  */
 bool wins_exchange(Move move, int threshold, const Position *pos)
+{
+	const u64 attackers = get_attackers(get_move_target(move), pos);
+	return exchange_is_won(move, threshold, attackers, pos);
+}
+
+/*
+ * Same as wins_exchange but for the moves of the move picker. Several captures
+ * often go to the same square, and the search may ask again about a capture the
+ * move picker already checked, so the attackers of each target square are
+ * computed once for the position and kept in the context.
+ */
+bool move_picker_wins_exchange(struct move_picker_context *ctx, Move move,
+			       int threshold, const Position *pos)
+{
+	const u64 attackers =
+		get_target_attackers(ctx, get_move_target(move), pos);
+	return exchange_is_won(move, threshold, attackers, pos);
+}
+
+static u64 get_target_attackers(struct move_picker_context *ctx, Square sq,
+				const Position *pos)
+{
+	const u64 bb = U64(0x1) << sq;
+	if (!(ctx->known_attackers & bb)) {
+		ctx->attackers[sq] = get_attackers(sq, pos);
+		ctx->known_attackers |= bb;
+	}
+	return ctx->attackers[sq];
+}
+
+static bool exchange_is_won(Move move, int threshold, u64 attackers,
+			    const Position *pos)
 {
 	const Square from = get_move_origin(move);
 	const Square to = get_move_target(move);
 	const Color initial_side = get_side_to_move(pos);
 
 	bool first_capture = true;
-	u64 attackers = get_attackers(to, pos);
 	Piece piece_to_be_captured;
 	if (get_move_type(move) == MOVE_EP_CAPTURE) {
 		piece_to_be_captured = initial_side == COLOR_WHITE ?
@@ -521,31 +596,55 @@ bool wins_exchange(Move move, int threshold, const Position *pos)
 		return -score > threshold;
 }
 
-static struct score evaluate_king(const Position *pos, Square sq)
+/*
+ * Returns the sum of the positional terms of the pieces of one side. The king
+ * has no positional terms besides its piece-square table value, and the pawns
+ * are evaluated separately by evaluate_pawn_structure.
+ */
+static struct score evaluate_pieces(const Position *pos, Color c)
 {
-	const Piece piece = get_piece_at(pos, sq);
-
 	struct score score;
 	score.mg = 0;
 	score.eg = 0;
 
-	score.mg += get_square_value(piece, sq, true);
-	score.eg += get_square_value(piece, sq, false);
+	u64 bb = get_piece_bitboard(pos, create_piece(PIECE_TYPE_KNIGHT, c));
+	while (bb) {
+		const Square sq = (Square)unset_ls1b(&bb);
+		add_score(&score, evaluate_knight(pos, sq));
+	}
+	bb = get_piece_bitboard(pos, create_piece(PIECE_TYPE_BISHOP, c));
+	while (bb) {
+		const Square sq = (Square)unset_ls1b(&bb);
+		add_score(&score, evaluate_bishop(pos, sq));
+	}
+	bb = get_piece_bitboard(pos, create_piece(PIECE_TYPE_ROOK, c));
+	while (bb) {
+		const Square sq = (Square)unset_ls1b(&bb);
+		add_score(&score, evaluate_rook(pos, sq));
+	}
+	bb = get_piece_bitboard(pos, create_piece(PIECE_TYPE_QUEEN, c));
+	while (bb) {
+		const Square sq = (Square)unset_ls1b(&bb);
+		add_score(&score, evaluate_queen(pos, sq));
+	}
 
 	return score;
 }
 
+static void add_score(struct score *score, struct score term)
+{
+	score->mg += term.mg;
+	score->eg += term.eg;
+}
+
 static struct score evaluate_queen(const Position *pos, Square sq)
 {
 	const Piece piece = get_piece_at(pos, sq);
 	const Color color = get_piece_color(piece);
 
 	struct score score;
-	score.mg = point_value[PIECE_TYPE_QUEEN];
-	score.eg = point_value[PIECE_TYPE_QUEEN];
-
-	score.mg += get_square_value(piece, sq, true);
-	score.eg += get_square_value(piece, sq, false);
+	score.mg = 0;
+	score.eg = 0;
 
 	const Rank rank = get_rank(sq);
 	if ((color == COLOR_WHITE && rank >= RANK_5) ||
@@ -573,11 +672,8 @@ static struct score evaluate_rook(const Position *pos, Square sq)
 	const Color piece_color = get_piece_color(piece);
 
 	struct score score;
-	score.mg = point_value[PIECE_TYPE_ROOK];
-	score.eg = point_value[PIECE_TYPE_ROOK];
-
-	score.mg += get_square_value(piece, sq, true);
-	score.eg += get_square_value(piece, sq, false);
+	score.mg = 0;
+	score.eg = 0;
 
 	const Piece friendly_pawn = create_piece(PIECE_TYPE_PAWN, piece_color);
 	const Piece enemy_pawn = create_piece(PIECE_TYPE_PAWN, !piece_color);
@@ -605,11 +701,8 @@ static struct score evaluate_bishop(const Position *pos, Square sq)
 	const Color side = get_piece_color(piece);
 
 	struct score score;
-	score.mg = point_value[PIECE_TYPE_BISHOP];
-	score.eg = point_value[PIECE_TYPE_BISHOP];
-
-	score.mg += get_square_value(piece, sq, true);
-	score.eg += get_square_value(piece, sq, false);
+	score.mg = 0;
+	score.eg = 0;
 
 	if (is_outpost(pos, sq, side)) {
 		score.mg += 26;
@@ -625,11 +718,8 @@ static struct score evaluate_knight(const Position *pos, Square sq)
 	const Color side = get_piece_color(piece);
 
 	struct score score;
-	score.mg = point_value[PIECE_TYPE_KNIGHT];
-	score.eg = point_value[PIECE_TYPE_KNIGHT];
-
-	score.mg += get_square_value(piece, sq, true);
-	score.eg += get_square_value(piece, sq, false);
+	score.mg = 0;
+	score.eg = 0;
 
 	if (is_outpost(pos, sq, side)) {
 		score.mg += 30;
@@ -640,21 +730,65 @@ static struct score evaluate_knight(const Position *pos, Square sq)
 }
 
 /*
- * Evaluate the score for a single pawn on the square sq.
+ * Returns the score of the pawn structure from white's point of view, probing
+ * the pawn table first if there is one.
  */
-static struct score evaluate_pawn(const Position *pos, Square sq)
+static struct score evaluate_pawn_structure(const Position *pos,
+					    struct pawn_table *table)
 {
-	Color c = get_piece_color(get_piece_at(pos, sq));
-	const Piece piece = create_piece(PIECE_TYPE_PAWN, c);
+	const u64 hash = get_pawn_hash(pos);
+
+	struct pawn_entry local_entry;
+	struct pawn_entry *entry = &local_entry;
+	if (table)
+		entry = &table->entries[hash & (PAWN_TABLE_SIZE - 1)];
+	if (!table || entry->hash != hash)
+		evaluate_pawns(entry, pos);
 
-	/* Material score. */
 	struct score score;
-	score.mg = point_value[PIECE_TYPE_PAWN];
-	score.eg = point_value[PIECE_TYPE_PAWN];
+	score.mg = entry->mg;
+	score.eg = entry->eg;
+	return score;
+}
+
+/*
+ * Fills the pawn table entry with the pawn structure of the position.
+ */
+static void evaluate_pawns(struct pawn_entry *entry, const Position *pos)
+{
+	struct score score;
+	score.mg = 0;
+	score.eg = 0;
+
+	entry->hash = get_pawn_hash(pos);
+	entry->passed_pawns = 0;
+	entry->isolated_pawns = 0;
+	for (Color c = COLOR_WHITE; c <= COLOR_BLACK; ++c) {
+		const Piece pawn = create_piece(PIECE_TYPE_PAWN, c);
+		u64 bb = get_piece_bitboard(pos, pawn);
+		while (bb) {
+			const Square sq = (Square)unset_ls1b(&bb);
+			const struct score term = evaluate_pawn(pos, sq, entry);
+			score.mg += c == COLOR_WHITE ? term.mg : -term.mg;
+			score.eg += c == COLOR_WHITE ? term.eg : -term.eg;
+		}
+	}
+	entry->mg = (i16)score.mg;
+	entry->eg = (i16)score.eg;
+}
 
-	/* Piece-square-table score. */
-	score.mg += get_square_value(piece, sq, true);
-	score.eg += get_square_value(piece, sq, false);
+/*
+ * Evaluate the score for a single pawn on the square sq. The pawn is also
+ * added to the passed and isolated pawns of the entry when it is one.
+ */
+static struct score evaluate_pawn(const Position *pos, Square sq,
+				  struct pawn_entry *entry)
+{
+	Color c = get_piece_color(get_piece_at(pos, sq));
+
+	struct score score;
+	score.mg = 0;
+	score.eg = 0;
 
 	/* Penalty for doubled pawns. */
 	if (get_number_of_friendly_pawn_blockers(pos, sq, c)) {
@@ -664,12 +798,14 @@ static struct score evaluate_pawn(const Position *pos, Square sq)
 
 	/* Bonus for passed pawn. */
 	if (get_number_of_enemy_pawn_stoppers(pos, sq, c) == 0) {
+		entry->passed_pawns |= U64(0x1) << sq;
 		score.mg += 10;
 		score.eg += 22;
 	}
 
 	/* Penalty for isolated pawn. */
 	if (get_number_of_adjacent_friendly_pawns(pos, sq, c) == 0) {
+		entry->isolated_pawns |= U64(0x1) << sq;
 		score.mg -= 5;
 		score.eg -= 15;
 	}
@@ -720,14 +856,41 @@ static void insertion_sort(struct move_with_score *moves, int nb)
 }
 
 /*
- * This function tries to guess how good a move is without actually searching
- * the position, the better the guess the more nodes will be pruned in the
- * alpha-beta pruning search. Of course, since it is the position evaluation
+ * Swaps the move with the highest score with the first one. Between moves with
+ * the same score the first one found wins.
+ */
+static void move_best_to_front(struct move_with_score *moves, int nb)
+{
+	int best = 0;
+	for (int i = 1; i < nb; ++i) {
+		if (moves[i].score > moves[best].score)
+			best = i;
+	}
+	const struct move_with_score tmp = moves[0];
+	moves[0] = moves[best];
+	moves[best] = tmp;
+}
+
+static bool is_refutation(const struct move_picker_context *ctx, Move move)
+{
+	for (int i = 0; i < ctx->refutations_end; ++i) {
+		if (ctx->refutations[i] == move)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * This function tries to guess how good a capture is without actually
+ * searching the position, the better the guess the more nodes will be pruned in
+ * the alpha-beta pruning search. Of course, since it is the position evaluation
  * function that decides how good a move actually is during the search, this
  * function has to be adjusted accordingly to it.
+ *
+ * The game phase is the same for all the moves of a position, so the caller
+ * computes it once.
  */
-static int evaluate_move(Move move, const struct move_picker_context *ctx,
-			 const Position *pos)
+static int evaluate_move(Move move, int phase, const Position *pos)
 {
 	struct score (*const piece_functions[])(Move, const Position *) = {
 		[PIECE_TYPE_PAWN] = evaluate_pawn_move,
@@ -738,26 +901,17 @@ static int evaluate_move(Move move, const struct move_picker_context *ctx,
 		[PIECE_TYPE_KING] = evaluate_king_move,
 	};
 
-	const int phase = get_phase(pos);
-
 	struct score score;
 	score.mg = 0;
 	score.eg = 0;
 
 	const Square from = get_move_origin(move);
-	const Square to = get_move_target(move);
 	const Piece piece = get_piece_at(pos, from);
-	const Color color = get_piece_color(piece);
 	const PieceType piece_type = get_piece_type(piece);
 
-	if (move_is_capture(move)) {
-		const int tmp = mvv_lva(move, pos);
-		score.mg += tmp;
-		score.eg += tmp;
-	} else {
-		score.mg += ctx->butterfly_history[color][from][to];
-		score.eg += ctx->butterfly_history[color][from][to];
-	}
+	const int tmp = mvv_lva(move, pos);
+	score.mg += tmp;
+	score.eg += tmp;
 
 	struct score piece_score = piece_functions[piece_type](move, pos);
 	score.mg += piece_score.mg;
@@ -768,6 +922,43 @@ static int evaluate_move(Move move, const struct move_picker_context *ctx,
 	       FINAL_PHASE;
 }
 
+/*
+ * Scores the whole list of captures in one pass, so what only depends on the
+ * position is computed once instead of once for each capture.
+ */
+static void score_captures(struct move_with_score *moves, int nb,
+			   const Position *pos)
+{
+	const int phase = get_phase(pos);
+	for (int i = 0; i < nb; ++i)
+		moves[i].score = (i16)evaluate_move(moves[i].move, phase, pos);
+}
+
+/*
+ * The quiet moves are ordered by their butterfly and continuation histories
+ * alone, which only costs a few table lookups. The sum is scaled down to fit
+ * the score of the move. Queen promotions are always tried first since they are
+ * almost never bad.
+ */
+static int evaluate_quiet_move(Move move,
+			       const struct move_picker_context *ctx,
+			       const Position *pos)
+{
+	const Square from = get_move_origin(move);
+	const Square to = get_move_target(move);
+	const Color color = get_side_to_move(pos);
+	const Piece piece = get_piece_at(pos, from);
+
+	if (get_move_type(move) == MOVE_QUEEN_PROMOTION)
+		return QUEEN_PROMOTION_SCORE;
+	int score = ctx->butterfly_history[color][from][to];
+	for (int i = 0; i < 2; ++i) {
+		if (ctx->continuation_history[i])
+			score += (*ctx->continuation_history[i])[piece][to];
+	}
+	return score / 4;
+}
+
 static struct score evaluate_king_move(Move move, const Position *pos)
 {
 	const Color side = get_side_to_move(pos);
@@ -961,6 +1152,19 @@ static struct score evaluate_pawn_move(Move move, const Position *pos)
 	return score;
 }
 
+/*
+ * Returns the material plus piece-square table value of the piece on the
+ * square from white's point of view, so black pieces have negative values. The
+ * sum over all the pieces is kept in the position.
+ */
+int get_piece_square_value(Piece piece, Square sq, bool middle_game)
+{
+	const PieceType pt = get_piece_type(piece);
+	const int material = pt == PIECE_TYPE_KING ? 0 : point_value[pt];
+	const int value = material + get_square_value(piece, sq, middle_game);
+	return get_piece_color(piece) == COLOR_WHITE ? value : -value;
+}
+
 static int get_square_value(Piece piece, Square sq, bool middle_game)
 {
 	const int *mg_table[] = {
@@ -1210,6 +1414,7 @@ static void test_distance_to_closest_piece(void)
 		init_position(pos, data[i].fen);
 		const int result = distance_to_closest_piece(
 			data[i].sq, data[i].piece, pos);
+		free_position(pos);
 		TEST_ASSERT_MESSAGE(result == data[i].expected_result,
 				    data[i].fen);
 	}
@@ -1246,6 +1451,7 @@ static void test_is_outpost(void)
 		init_position(&pos, data[i].fen);
 		const bool result =
 			is_outpost(&pos, data[i].sq, get_side_to_move(&pos));
+		free_position(&pos);
 		TEST_ASSERT_MESSAGE(result == data[i].expected_result,
 				    data[i].fen);
 	}
@@ -1287,6 +1493,7 @@ static void test_wins_exchange(void)
 		if (!s)
 			abort();
 		const bool result = wins_exchange(move, 0, &pos);
+		free_position(&pos);
 		TEST_ASSERT_MESSAGE(result == data[i].expected_result,
 				    data[i].fen);
 	}
@@ -18,10 +18,12 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include <uci.h>
@@ -31,14 +33,121 @@
 #include <tt.h>
 #include <movegen.h>
 #include <eval.h>
+#include <nnue.h>
+#include <search.h>
+#include <tb.h>
+#include <bench.h>
+#include <analyse.h>
 
 #if !defined(TEST) && !defined(ARCH_WASM)
-int main(void)
+static int run_bench(int argc, char **argv);
+static int run_analyse(int argc, char **argv);
+static int parse_argument(int *value, const char *str, int min, int max);
+
+int main(int argc, char **argv)
 {
+	if (argc > 1 && !strcmp(argv[1], "bench"))
+		return run_bench(argc - 2, argv + 2);
+	if (argc > 1 && !strcmp(argv[1], "analyse"))
+		return run_analyse(argc - 2, argv + 2);
+
 	uci_loop();
 
 	return EXIT_SUCCESS;
 }
+
+/*
+ * The arguments are the depth, the number of threads and the size of the
+ * transposition table in MiB, in this order. All of them are optional.
+ */
+static int run_bench(int argc, char **argv)
+{
+	int depth = BENCH_DEFAULT_DEPTH, threads = 1, hash = 16;
+
+	if (argc > 3 || (argc > 0 && parse_argument(&depth, argv[0], 1, 256)) ||
+	    (argc > 1 && parse_argument(&threads, argv[1], 1, 256)) ||
+	    (argc > 2 && parse_argument(&hash, argv[2], 1, 32768))) {
+		fprintf(stderr,
+			"Usage: athena bench [depth] [threads] [hash]\n");
+		return EXIT_FAILURE;
+	}
+
+	movegen_init();
+	search_init();
+	tt_init((size_t)hash, threads);
+
+	struct bench_result result;
+	bench(&result, depth, threads);
+	printf("Nodes searched: %lld\n", result.nodes);
+	printf("Time: %lld ms\n", result.time);
+	printf("Nodes/second: %lld\n", result.nps);
+
+	tt_free();
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * The positions are read from the input file, or from the standard input if
+ * there is no input file or it is "-". Every option takes a value.
+ */
+static int run_analyse(int argc, char **argv)
+{
+	const char *path = "-";
+	int depth = ANALYSE_DEFAULT_DEPTH, workers = 1, hash = 16;
+
+	bool error = argc % 2;
+	for (int i = 0; !error && i < argc; i += 2) {
+		if (!strcmp(argv[i], "--input"))
+			path = argv[i + 1];
+		else if (!strcmp(argv[i], "--depth"))
+			error = parse_argument(&depth, argv[i + 1], 1, 256);
+		else if (!strcmp(argv[i], "--workers"))
+			error = parse_argument(&workers, argv[i + 1], 1, 256);
+		else if (!strcmp(argv[i], "--hash"))
+			error = parse_argument(&hash, argv[i + 1], 1, 32768);
+		else
+			error = true;
+	}
+	if (error) {
+		fprintf(stderr, "Usage: athena analyse [--input file] "
+				"[--depth depth] [--workers workers] "
+				"[--hash hash]\n");
+		return EXIT_FAILURE;
+	}
+
+	FILE *const input = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (!input) {
+		perror("Athena");
+		return EXIT_FAILURE;
+	}
+
+	movegen_init();
+	search_init();
+	tt_init((size_t)hash, workers);
+
+	analyse(input, stdout, depth, workers);
+
+	tt_free();
+	if (input != stdin)
+		fclose(input);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Returns 0 if the string is an integer between min and max, and 1 otherwise.
+ */
+static int parse_argument(int *value, const char *str, int min, int max)
+{
+	char *endptr = NULL;
+	errno = 0;
+	const long n = strtol(str, &endptr, 10);
+	if (errno == ERANGE || endptr == str || *endptr || n < min || n > max)
+		return 1;
+	*value = (int)n;
+	return 0;
+}
 #endif
 
 #ifdef TEST
@@ -59,6 +168,9 @@ int main(void)
 
 	RUN_TEST(test_movegen);
 	RUN_TEST(test_eval);
+	RUN_TEST(test_nnue);
+	RUN_TEST(test_search);
+	RUN_TEST(test_tb);
 
 	UNITY_END();
 }
@@ -45,8 +45,12 @@ static const CastlingSide castling_table[] = {
  * Since the functions to do and undo moves do basically the same thing, I
  * created this macro. The conditionals that check the choice of doing or
  * undoing are optimized out.
+ *
+ * The key of the position is in the irreversible state, so when undoing a move
+ * all the changes must be done before backtracking, otherwise they would change
+ * the key of the previous position.
  */
-#define ACTION_FOR_MOVE(do_or_undo)\
+#define ACTION_FOR_MOVE(do_or_undo, color)\
 const int choice_do = 0;\
 const int choice_undo = !choice_do;\
 const MoveType type = get_move_type(move);\
@@ -54,38 +58,50 @@ const Square from = get_move_origin(move);\
 const Square to = get_move_target(move);\
 const Piece piece = choice_##do_or_undo == choice_do ?\
 get_piece_at(pos, from) : get_piece_at(pos, to);\
-const Color color = get_piece_color(piece);\
 \
 if (choice_##do_or_undo == choice_do)\
 	start_new_irreversible_state(pos);\
 \
-if (type == MOVE_OTHER)\
-	do_or_undo##_other(pos, from, to, piece);\
-else if (type == MOVE_DOUBLE_PAWN_PUSH)\
-	do_or_undo##_double_push(pos, from, to, piece);\
-else if (type == MOVE_QUEEN_CASTLE || type == MOVE_KING_CASTLE)\
-	do_or_undo##_castling(pos, from, to, piece, castling_table[type]);\
-else if (type == MOVE_CAPTURE)\
-	do_or_undo##_capture(pos, from, to, piece);\
-else if (type == MOVE_EP_CAPTURE)\
-	do_or_undo##_ep_capture(pos, from, to, piece);\
-else if (type >= MOVE_KNIGHT_PROMOTION && type <= MOVE_QUEEN_PROMOTION)\
+switch (type) {\
+case MOVE_OTHER:\
+	do_or_undo##_other(pos, from, to, piece, color);\
+	break;\
+case MOVE_DOUBLE_PAWN_PUSH:\
+	do_or_undo##_double_push(pos, from, to, piece, color);\
+	break;\
+case MOVE_KING_CASTLE:\
+case MOVE_QUEEN_CASTLE:\
+	do_or_undo##_castling(pos, from, to, piece, castling_table[type],\
+	                      color);\
+	break;\
+case MOVE_CAPTURE:\
+	do_or_undo##_capture(pos, from, to, piece, color);\
+	break;\
+case MOVE_EP_CAPTURE:\
+	do_or_undo##_ep_capture(pos, from, to, piece, color);\
+	break;\
+case MOVE_KNIGHT_PROMOTION:\
+case MOVE_ROOK_PROMOTION:\
+case MOVE_BISHOP_PROMOTION:\
+case MOVE_QUEEN_PROMOTION:\
 	do_or_undo##_promotion(pos, from, to, promotion_table[color][type - 6],\
-	                       0);\
-else if (type >= MOVE_KNIGHT_PROMOTION_CAPTURE)\
+	                       0, color);\
+	break;\
+default:\
 	do_or_undo##_promotion(pos, from, to,\
-	                       promotion_table[color][type - 10], 1);\
+	                       promotion_table[color][type - 10], 1, color);\
+	break;\
+}\
 \
+flip_side_to_move(pos);\
 if (choice_##do_or_undo == choice_undo)\
-	backtrack_irreversible_state(pos);\
-flip_side_to_move(pos);
+	backtrack_irreversible_state(pos);
 
 Move lan_to_move(const char *lan, const Position *pos, bool *success)
 {
 	char test_lan[MAX_LAN_LEN + 1];
 	struct move_with_score moves[256];
-	int len = get_pseudo_legal_moves(moves, MOVE_GEN_TYPE_CAPTURE, pos);
-	len += get_pseudo_legal_moves(moves + len, MOVE_GEN_TYPE_QUIET, pos);
+	const int len = get_pseudo_legal_moves(moves, MOVE_GEN_TYPE_ALL, pos);
 	for (int i = 0; i < len; ++i) {
 		Move move = moves[i].move;
 		move_to_lan(test_lan, move);
@@ -166,6 +182,7 @@ void do_null_move(Position *pos)
 
 	if (c == COLOR_BLACK)
 		increment_fullmove_counter(pos);
+	update_check_info(pos);
 }
 
 void undo_null_move(Position *pos)
@@ -174,11 +191,52 @@ void undo_null_move(Position *pos)
 	backtrack_irreversible_state(pos);
 }
 
-static void do_promotion(Position *pos, Square from, Square to,
-			 Piece promoted_to, int is_capture)
+/*
+ * Returns the hash the position will have after the move without doing it.
+ * Only the pieces that are moved, captured or promoted, the side to move and
+ * the en passant square of the current position are taken into account, so the
+ * result is wrong when the move changes the castling rights, enables en passant
+ * or is a castling move. This is only meant to know in advance which
+ * transposition table bucket the child node will probe, and a wrong hash just
+ * wastes a prefetch.
+ */
+u64 get_hash_after_move(const Position *pos, Move move)
 {
-	const Color c = get_piece_color(promoted_to);
+	const MoveType type = get_move_type(move);
+	const Square from = get_move_origin(move);
+	const Square to = get_move_target(move);
+	const Piece piece = get_piece_at(pos, from);
+
+	u64 hash = get_position_hash(pos) ^ get_side_to_move_hash();
+	if (has_en_passant_square(pos)) {
+		const File file = get_file(get_en_passant_square(pos));
+		hash ^= get_en_passant_hash(file);
+	}
+	hash ^= get_piece_square_hash(piece, from);
+	if (move_is_promotion(move)) {
+		const Color c = get_piece_color(piece);
+		const Piece promoted_to =
+			create_piece(get_promotion_piece_type(move), c);
+		hash ^= get_piece_square_hash(promoted_to, to);
+	} else {
+		hash ^= get_piece_square_hash(piece, to);
+	}
 
+	if (type == MOVE_EP_CAPTURE) {
+		const Square sq = file_rank_to_square(get_file(to),
+						      get_rank(from));
+		hash ^= get_piece_square_hash(get_piece_at(pos, sq), sq);
+	} else if (move_is_capture(move)) {
+		hash ^= get_piece_square_hash(get_piece_at(pos, to), to);
+	}
+
+	return hash;
+}
+
+static ALWAYS_INLINE void do_promotion(Position *pos, Square from, Square to,
+				       Piece promoted_to, int is_capture,
+				       Color c)
+{
 	if (is_capture) {
 		const Piece captured_piece = get_piece_at(pos, to);
 		if (captured_piece == PIECE_WHITE_ROOK && to == A1)
@@ -202,10 +260,11 @@ static void do_promotion(Position *pos, Square from, Square to,
 		increment_fullmove_counter(pos);
 }
 
-static void undo_promotion(Position *pos, Square from, Square to,
-			   Piece promoted_to, int is_capture)
+static ALWAYS_INLINE void undo_promotion(Position *pos, Square from,
+					 Square to, Piece promoted_to,
+					 int is_capture, Color c)
 {
-	const Color c = get_piece_color(promoted_to);
+	(void)promoted_to;
 	const Piece pawn = c == COLOR_WHITE ? PIECE_WHITE_PAWN :
 	                                      PIECE_BLACK_PAWN;
 
@@ -215,10 +274,9 @@ static void undo_promotion(Position *pos, Square from, Square to,
 		place_piece(pos, to, get_captured_piece(pos));
 }
 
-static void do_castling(Position *pos, Square from, Square to, Piece piece,
-			CastlingSide side)
+static ALWAYS_INLINE void do_castling(Position *pos, Square from, Square to,
+				      Piece piece, CastlingSide side, Color c)
 {
-	const Color c = get_piece_color(piece);
 	const Piece rook = c == COLOR_WHITE ? PIECE_WHITE_ROOK :
 	                                      PIECE_BLACK_ROOK;
 	Square rook_from, rook_to;
@@ -244,10 +302,9 @@ static void do_castling(Position *pos, Square from, Square to, Piece piece,
 		increment_fullmove_counter(pos);
 }
 
-static void undo_castling(Position *pos, Square from, Square to, Piece piece,
-			  CastlingSide side)
+static ALWAYS_INLINE void undo_castling(Position *pos, Square from, Square to,
+					Piece piece, CastlingSide side, Color c)
 {
-	const Color c = get_piece_color(piece);
 	const Piece rook = c == COLOR_WHITE ? PIECE_WHITE_ROOK :
 	                                      PIECE_BLACK_ROOK;
 	Square rook_from, rook_to;
@@ -269,9 +326,9 @@ static void undo_castling(Position *pos, Square from, Square to, Piece piece,
 		decrement_fullmove_counter(pos);
 }
 
-static void do_ep_capture(Position *pos, Square from, Square to, Piece piece)
+static ALWAYS_INLINE void do_ep_capture(Position *pos, Square from, Square to,
+					Piece piece, Color c)
 {
-	const Color c = get_piece_color(piece);
 	const Square pawn_sq = c == COLOR_WHITE ? to - 8 : to + 8;
 	const Piece pawn = c == COLOR_WHITE ? PIECE_BLACK_PAWN :
 	                                      PIECE_WHITE_PAWN;
@@ -287,9 +344,9 @@ static void do_ep_capture(Position *pos, Square from, Square to, Piece piece)
 		increment_fullmove_counter(pos);
 }
 
-static void undo_ep_capture(Position *pos, Square from, Square to, Piece piece)
+static ALWAYS_INLINE void undo_ep_capture(Position *pos, Square from, Square to,
+					  Piece piece, Color c)
 {
-	const Color c = get_piece_color(piece);
 	const Square pawn_sq = c == COLOR_WHITE ? to - 8 : to + 8;
 	const Piece pawn = c == COLOR_WHITE ? PIECE_BLACK_PAWN :
 	                                      PIECE_WHITE_PAWN;
@@ -302,10 +359,10 @@ static void undo_ep_capture(Position *pos, Square from, Square to, Piece piece)
 		decrement_fullmove_counter(pos);
 }
 
-static void do_capture(Position *pos, Square from, Square to, Piece piece)
+static ALWAYS_INLINE void do_capture(Position *pos, Square from, Square to,
+				     Piece piece, Color c)
 {
 	const PieceType piece_type = get_piece_type(piece);
-	const Color piece_color = get_piece_color(piece);
 	const Piece captured_piece = get_piece_at(pos, to);
 
 	unset_enpassant(pos);
@@ -317,18 +374,18 @@ static void do_capture(Position *pos, Square from, Square to, Piece piece)
 
 	switch (piece_type) {
 	case PIECE_TYPE_KING:
-		remove_castling(pos, piece_color, CASTLING_SIDE_KING);
-		remove_castling(pos, piece_color, CASTLING_SIDE_QUEEN);
+		remove_castling(pos, c, CASTLING_SIDE_KING);
+		remove_castling(pos, c, CASTLING_SIDE_QUEEN);
 		break;
 	case PIECE_TYPE_ROOK:
-		if (piece_color == COLOR_WHITE && from == A1)
-			remove_castling(pos, piece_color, CASTLING_SIDE_QUEEN);
-		else if (piece_color == COLOR_WHITE && from == H1)
-			remove_castling(pos, piece_color, CASTLING_SIDE_KING);
-		else if (piece_color == COLOR_BLACK && from == A8)
-			remove_castling(pos, piece_color, CASTLING_SIDE_QUEEN);
-		else if (piece_color == COLOR_BLACK && from == H8)
-			remove_castling(pos, piece_color, CASTLING_SIDE_KING);
+		if (c == COLOR_WHITE && from == A1)
+			remove_castling(pos, c, CASTLING_SIDE_QUEEN);
+		else if (c == COLOR_WHITE && from == H1)
+			remove_castling(pos, c, CASTLING_SIDE_KING);
+		else if (c == COLOR_BLACK && from == A8)
+			remove_castling(pos, c, CASTLING_SIDE_QUEEN);
+		else if (c == COLOR_BLACK && from == H8)
+			remove_castling(pos, c, CASTLING_SIDE_KING);
 		break;
 	default:
 		break;
@@ -345,26 +402,26 @@ static void do_capture(Position *pos, Square from, Square to, Piece piece)
 			remove_castling(pos, COLOR_BLACK, CASTLING_SIDE_KING);
 	}
 
-	if (piece_color == COLOR_BLACK)
+	if (c == COLOR_BLACK)
 		increment_fullmove_counter(pos);
 }
 
-static void undo_capture(Position *pos, Square from, Square to, Piece piece)
+static ALWAYS_INLINE void undo_capture(Position *pos, Square from, Square to,
+				       Piece piece, Color c)
 {
-	const Color piece_color = get_piece_color(piece);
 	const Piece captured_piece = get_captured_piece(pos);
 
 	remove_piece(pos, to);
 	place_piece(pos, from, piece);
 	place_piece(pos, to, captured_piece);
 
-	if (piece_color == COLOR_BLACK)
+	if (c == COLOR_BLACK)
 		decrement_fullmove_counter(pos);
 }
 
-static void do_double_push(Position *pos, Square from, Square to, Piece piece)
+static ALWAYS_INLINE void do_double_push(Position *pos, Square from, Square to,
+					 Piece piece, Color c)
 {
-	const Color c = get_piece_color(piece);
 
 	unset_enpassant(pos);
 	increment_halfmove_clock(pos);
@@ -382,9 +439,9 @@ static void do_double_push(Position *pos, Square from, Square to, Piece piece)
 		increment_fullmove_counter(pos);
 }
 
-static void undo_double_push(Position *pos, Square from, Square to, Piece piece)
+static ALWAYS_INLINE void undo_double_push(Position *pos, Square from,
+					   Square to, Piece piece, Color c)
 {
-	const Color c = get_piece_color(piece);
 
 	remove_piece(pos, to);
 	place_piece(pos, from, piece);
@@ -394,10 +451,10 @@ static void undo_double_push(Position *pos, Square from, Square to, Piece piece)
 		decrement_fullmove_counter(pos);
 }
 
-static void do_other(Position *pos, Square from, Square to, Piece piece)
+static ALWAYS_INLINE void do_other(Position *pos, Square from, Square to,
+				   Piece piece, Color c)
 {
 	const PieceType pt = get_piece_type(piece);
-	const Color c = get_piece_color(piece);
 
 	unset_enpassant(pos);
 	increment_halfmove_clock(pos);
@@ -430,9 +487,9 @@ static void do_other(Position *pos, Square from, Square to, Piece piece)
 		increment_fullmove_counter(pos);
 }
 
-static void undo_other(Position *pos, Square from, Square to, Piece piece)
+static ALWAYS_INLINE void undo_other(Position *pos, Square from, Square to,
+				     Piece piece, Color c)
 {
-	const Color c = get_piece_color(piece);
 
 	remove_piece(pos, to);
 	place_piece(pos, from, piece);
@@ -441,33 +498,36 @@ static void undo_other(Position *pos, Square from, Square to, Piece piece)
 		decrement_fullmove_counter(pos);
 }
 
-/*
- * This function returns true is a move is legal and false otherwise. Although
- * the pos argument is non-const the original position is restored so it is safe
- * to call it. A const argument would require copying the position to make
- * changes in the copy and that would be slower.
- */
-bool move_is_legal(Position *pos, Move move)
+static ALWAYS_INLINE void undo_move_for_color(Position *pos, Move move,
+					      Color c)
 {
-	const Color color = get_side_to_move(pos);
-	do_move(pos, move);
-	const Square sq = get_king_square(pos, color);
-	if (is_square_attacked(sq, !color, pos)) {
-		undo_move(pos, move);
-		return false;
-	}
-	undo_move(pos, move);
-	return true;
+	ACTION_FOR_MOVE(undo, c);
+}
+
+static ALWAYS_INLINE void do_move_for_color(Position *pos, Move move, Color c)
+{
+	ACTION_FOR_MOVE(do, c);
+	update_check_info(pos);
 }
 
+/*
+ * The side that made the move is known from the side to move, so we call the
+ * version of the function for that color, where the color is a constant.
+ */
 void undo_move(Position *pos, Move move)
 {
-	ACTION_FOR_MOVE(undo);
+	if (get_side_to_move(pos) == COLOR_WHITE)
+		undo_move_for_color(pos, move, COLOR_BLACK);
+	else
+		undo_move_for_color(pos, move, COLOR_WHITE);
 }
 
 void do_move(Position *pos, Move move)
 {
-	ACTION_FOR_MOVE(do);
+	if (get_side_to_move(pos) == COLOR_WHITE)
+		do_move_for_color(pos, move, COLOR_WHITE);
+	else
+		do_move_for_color(pos, move, COLOR_BLACK);
 }
 
 Move create_move(Square from, Square to, MoveType type)
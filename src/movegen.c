@@ -42,23 +42,42 @@ typedef struct move_list {
 	int len;
 } MoveList;
 
-static void gen_moves(MoveList *restrict list, PieceType piece_type,
-		      enum move_gen_type type, const Position *restrict pos);
-static void gen_king_moves(MoveList *restrict list, enum move_gen_type type,
-			   const Position *restrict pos);
-static void gen_queen_castling(MoveList *restrict list,
-			       const Position *restrict pos);
-static void gen_king_castling(MoveList *restrict list,
-			      const Position *restrict pos);
-static void gen_pawn_moves(MoveList *restrict list, enum move_gen_type type,
-			   const Position *restrict pos);
-static void gen_pawn_attacks(MoveList *restrict list, Square from,
-			     u64 enemy_pieces, Color color);
-static void gen_double_pushes(MoveList *restrict list, Square from, u64 occ,
-			      Color color);
-static void gen_pushes(MoveList *restrict list, Square from, u64 occ,
-		       Color color);
-static void add_move(MoveList *restrict list, Move move);
+static ALWAYS_INLINE void gen_all_moves(MoveList *restrict list,
+					enum move_gen_type type,
+					const Position *restrict pos,
+					Color color);
+static ALWAYS_INLINE void gen_piece_moves(MoveList *restrict list,
+					  PieceType piece_type,
+					  enum move_gen_type type,
+					  const Position *restrict pos,
+					  Color color, u64 enemy_pieces,
+					  u64 occ);
+static ALWAYS_INLINE void gen_king_moves(MoveList *restrict list,
+					 enum move_gen_type type,
+					 const Position *restrict pos,
+					 Color color, u64 enemy_pieces,
+					 u64 occ);
+static ALWAYS_INLINE void gen_queen_castling(MoveList *restrict list,
+					     const Position *restrict pos,
+					     Color color);
+static ALWAYS_INLINE void gen_king_castling(MoveList *restrict list,
+					    const Position *restrict pos,
+					    Color color);
+static ALWAYS_INLINE void gen_pawn_moves(MoveList *restrict list,
+					 enum move_gen_type type,
+					 const Position *restrict pos,
+					 Color color, u64 enemy_pieces,
+					 u64 occ);
+static ALWAYS_INLINE void gen_en_passant(MoveList *restrict list,
+					 const Position *restrict pos,
+					 Color color, u64 pawns);
+static ALWAYS_INLINE void add_pawn_moves(MoveList *restrict list, u64 targets,
+					 int distance, MoveType move_type);
+static ALWAYS_INLINE void add_promotions(MoveList *restrict list, u64 targets,
+					 int distance, MoveType first_type);
+static ALWAYS_INLINE void add_moves(MoveList *restrict list, Square from,
+				    u64 targets, MoveType move_type);
+static ALWAYS_INLINE void add_move(MoveList *restrict list, Move move);
 static u64 get_king_attacks(Square sq);
 static u64 get_queen_attacks(Square sq, u64 occ);
 static u64 get_rook_attacks(Square sq, u64 occ);
@@ -75,6 +94,11 @@ static u64 slow_get_rook_attacks(Square sq, u64 occ);
 static u64 slow_get_bishop_attacks(Square sq, u64 occ);
 static u64 gen_ray_attacks(u64 occ, Direction dir, Square sq);
 static void init_rays(void);
+static void init_lines(void);
+static bool is_square_attacked_with_occupancy(Square sq, Color by_side,
+					      u64 occ, const Position *pos);
+static bool en_passant_is_legal(const Position *pos, Square from, Square to,
+				Square king_sq);
 
 /*
  * The bitboards for each rank and file contain all the squares of a rank or
@@ -111,19 +135,30 @@ static const u64 file_bitboards[] = {
 static u64 ray_bitboards[8][64];
 static Magic rook_magics[64];
 static Magic bishop_magics[64];
+/* The slider attack tables are indexed with PEXT instead of the magic numbers
+ * when the CPU has a fast PEXT, this is decided when the tables are built. */
+static bool use_pext;
 static u64 king_attack_table[64];
 static u64 rook_attack_table[0x19000];
 static u64 bishop_attack_table[0x1480];
 static u64 knight_attack_table[64];
+/* Squares strictly between two squares, and the full line going through two
+ * squares, or 0 if the squares are not on the same rank, file or diagonal. */
+static u64 between_bitboards[64][64];
+static u64 line_bitboards[64][64];
 
 void movegen_init(void)
 {
+	init_cpu_features();
+	use_pext = cpu_has_fast_pext();
+
 	seed_rng(2718281828459045235);
 	init_rays();
 	init_knight_attacks();
 	init_bishop_attacks();
 	init_rook_attacks();
 	init_king_attacks();
+	init_lines();
 }
 
 u64 get_file_bitboard(File file)
@@ -160,12 +195,14 @@ bool move_is_pseudo_legal(Move move, const Position *pos)
 		list.ptr = &moves[0];
 		list.len = 0;
 
+		const Piece pawn = create_piece(PIECE_TYPE_PAWN, side);
 		if (move_type == MOVE_EP_CAPTURE) {
-			gen_pawn_moves(&list, MOVE_GEN_TYPE_CAPTURE, pos);
+			gen_en_passant(&list, pos, side,
+				       get_piece_bitboard(pos, pawn));
 		} else if (move_type == MOVE_KING_CASTLE) {
-			gen_king_castling(&list, pos);
+			gen_king_castling(&list, pos, side);
 		} else if (move_type == MOVE_QUEEN_CASTLE) {
-			gen_queen_castling(&list, pos);
+			gen_queen_castling(&list, pos, side);
 		}
 		for (int i = 0; i < list.len; ++i) {
 			if (move == moves[i].move)
@@ -302,31 +339,106 @@ bool is_square_attacked(Square sq, Color by_side, const Position *restrict pos)
 {
 	const u64 occ = get_color_bitboard(pos, by_side) |
 			get_color_bitboard(pos, !by_side);
+	return is_square_attacked_with_occupancy(sq, by_side, occ, pos);
+}
 
-	Piece piece = create_piece(PIECE_TYPE_PAWN, by_side);
+/*
+ * Returns true if a move that is already known to be pseudo-legal is legal.
+ * Instead of doing the move and looking for attacks on the king we use the
+ * checkers and pinned pieces of the position, so only king moves and en
+ * passant captures have to look at the enemy attacks.
+ */
+bool move_is_legal(const Position *restrict pos, Move move)
+{
+	const Color color = get_side_to_move(pos);
+	const Square from = get_move_origin(move);
+	const Square to = get_move_target(move);
+	const Square king_sq = get_king_square(pos, color);
+	const u64 target_bb = U64(0x1) << to;
+
+	if (get_move_type(move) == MOVE_EP_CAPTURE)
+		return en_passant_is_legal(pos, from, to, king_sq);
+
+	if (from == king_sq) {
+		/* Castling moves are only generated when the king is not in
+		 * check and doesn't go through attacked squares. */
+		if (move_is_castling(move))
+			return true;
+		/* The king can't hide from a slider behind itself, so it's
+		 * removed from the occupancy. */
+		const u64 occ = (get_color_bitboard(pos, COLOR_WHITE) |
+				 get_color_bitboard(pos, COLOR_BLACK)) &
+				~(U64(0x1) << from);
+		return !is_square_attacked_with_occupancy(to, !color, occ,
+							  pos);
+	}
+
+	const u64 checkers = get_checkers(pos);
+	if (checkers) {
+		/* Only the king can get out of a double check. */
+		if (checkers & (checkers - 1))
+			return false;
+		/* Otherwise the checker must be captured or blocked. */
+		const Square checker_sq = (Square)get_ls1b(checkers);
+		if (!((between_bitboards[king_sq][checker_sq] | checkers) &
+		      target_bb))
+			return false;
+	}
+
+	/* A pinned piece can only move along the pin. */
+	if (get_pinned_pieces(pos) & (U64(0x1) << from))
+		return line_bitboards[king_sq][from] & target_bb;
+	return true;
+}
+
+/*
+ * Computes the checkers and pinned pieces of the side to move and stores them
+ * in the position. This must be called every time the board or the side to
+ * move changes.
+ */
+void update_check_info(Position *restrict pos)
+{
+	const Color color = get_side_to_move(pos);
+	const Piece king = create_piece(PIECE_TYPE_KING, color);
+	if (!get_piece_bitboard(pos, king)) {
+		set_check_info(pos, 0, 0);
+		return;
+	}
+	const Square king_sq = get_king_square(pos, color);
+	const u64 friendly_bb = get_color_bitboard(pos, color);
+	const u64 occ = friendly_bb | get_color_bitboard(pos, !color);
+
+	Piece piece = create_piece(PIECE_TYPE_PAWN, !color);
 	const u64 pawns = get_piece_bitboard(pos, piece);
-	if (get_pawn_attacks(sq, !by_side) & pawns)
-		return true;
-	piece = create_piece(PIECE_TYPE_KNIGHT, by_side);
+	piece = create_piece(PIECE_TYPE_KNIGHT, !color);
 	const u64 knights = get_piece_bitboard(pos, piece);
-	if (get_knight_attacks(sq) & knights)
-		return true;
-	piece = create_piece(PIECE_TYPE_ROOK, by_side);
+	piece = create_piece(PIECE_TYPE_QUEEN, !color);
 	u64 rooks_queens = get_piece_bitboard(pos, piece);
-	piece = create_piece(PIECE_TYPE_QUEEN, by_side);
+	u64 bishops_queens = rooks_queens;
+	piece = create_piece(PIECE_TYPE_ROOK, !color);
 	rooks_queens |= get_piece_bitboard(pos, piece);
-	if (get_rook_attacks(sq, occ) & rooks_queens)
-		return true;
-	u64 bishops_queens = get_piece_bitboard(pos, piece);
-	piece = create_piece(PIECE_TYPE_BISHOP, by_side);
+	piece = create_piece(PIECE_TYPE_BISHOP, !color);
 	bishops_queens |= get_piece_bitboard(pos, piece);
-	if (get_bishop_attacks(sq, occ) & bishops_queens)
-		return true;
-	piece = create_piece(PIECE_TYPE_KING, by_side);
-	const u64 king = get_piece_bitboard(pos, piece);
-	if (get_king_attacks(sq) & king)
-		return true;
-	return false;
+
+	const u64 checkers =
+		(get_pawn_attacks(king_sq, color) & pawns) |
+		(get_knight_attacks(king_sq) & knights) |
+		(get_rook_attacks(king_sq, occ) & rooks_queens) |
+		(get_bishop_attacks(king_sq, occ) & bishops_queens);
+
+	/* The sliders that would attack the king on an empty board pin the
+	 * piece between them and the king if it's the only one. */
+	u64 pinned = 0;
+	u64 snipers = (get_rook_attacks(king_sq, 0) & rooks_queens) |
+		      (get_bishop_attacks(king_sq, 0) & bishops_queens);
+	while (snipers) {
+		const Square sq = (Square)unset_ls1b(&snipers);
+		const u64 blockers = between_bitboards[king_sq][sq] & occ;
+		if (blockers && !(blockers & (blockers - 1)))
+			pinned |= blockers & friendly_bb;
+	}
+
+	set_check_info(pos, checkers, pinned);
 }
 
 /*
@@ -344,16 +456,52 @@ int get_pseudo_legal_moves(struct move_with_score *moves,
 	list.ptr = moves;
 	list.len = 0;
 
-	gen_moves(&list, PIECE_TYPE_PAWN, type, pos);
-	gen_moves(&list, PIECE_TYPE_KNIGHT, type, pos);
-	gen_moves(&list, PIECE_TYPE_ROOK, type, pos);
-	gen_moves(&list, PIECE_TYPE_BISHOP, type, pos);
-	gen_moves(&list, PIECE_TYPE_QUEEN, type, pos);
-	gen_moves(&list, PIECE_TYPE_KING, type, pos);
+	const bool white = get_side_to_move(pos) == COLOR_WHITE;
+	switch (type) {
+	case MOVE_GEN_TYPE_QUIET:
+		if (white)
+			gen_all_moves(&list, MOVE_GEN_TYPE_QUIET, pos,
+				      COLOR_WHITE);
+		else
+			gen_all_moves(&list, MOVE_GEN_TYPE_QUIET, pos,
+				      COLOR_BLACK);
+		break;
+	case MOVE_GEN_TYPE_CAPTURE:
+		if (white)
+			gen_all_moves(&list, MOVE_GEN_TYPE_CAPTURE, pos,
+				      COLOR_WHITE);
+		else
+			gen_all_moves(&list, MOVE_GEN_TYPE_CAPTURE, pos,
+				      COLOR_BLACK);
+		break;
+	case MOVE_GEN_TYPE_ALL:
+		if (white)
+			gen_all_moves(&list, MOVE_GEN_TYPE_ALL, pos,
+				      COLOR_WHITE);
+		else
+			gen_all_moves(&list, MOVE_GEN_TYPE_ALL, pos,
+				      COLOR_BLACK);
+		break;
+	}
 
 	return list.len;
 }
 
+/*
+ * The same as get_pseudo_legal_moves, but only the legal moves are added.
+ */
+int get_legal_moves(struct move_with_score *moves, enum move_gen_type type,
+		    const Position *restrict pos)
+{
+	const int len = get_pseudo_legal_moves(moves, type, pos);
+	int legal_len = 0;
+	for (int i = 0; i < len; ++i) {
+		if (move_is_legal(pos, moves[i].move))
+			moves[legal_len++] = moves[i];
+	}
+	return legal_len;
+}
+
 /*
  * Returns a bitboard of the pieces from both sides attacking a square. Note
  * that this only counts pieces that are attacking a square directly, so a rook
@@ -388,26 +536,6 @@ u64 get_attackers(Square sq, const Position *restrict pos)
 	       (get_rook_attacks(sq, occ) & rooks_queens);
 }
 
-u64 movegen_perft(Position *restrict pos, int depth)
-{
-	u64 nodes = 0;
-
-	if (!depth)
-		return 1;
-	struct move_with_score moves[256];
-	int len = get_pseudo_legal_moves(moves, MOVE_GEN_TYPE_CAPTURE, pos);
-	len += get_pseudo_legal_moves(moves + len, MOVE_GEN_TYPE_QUIET, pos);
-	for (int i = 0; i < len; ++i) {
-		Move move = moves[i].move;
-		if (!move_is_legal(pos, move))
-			continue;
-		do_move(pos, move);
-		nodes += movegen_perft(pos, depth - 1);
-		undo_move(pos, move);
-	}
-	return nodes;
-}
-
 u64 get_west_ray(Square sq)
 {
 	return (1ull << sq) - (1ull << (sq & 56));
@@ -513,27 +641,41 @@ u64 shift_bb_east(u64 bb, int n)
 	return bb;
 }
 
-static void gen_moves(MoveList *restrict list, PieceType piece_type,
-		      enum move_gen_type type, const Position *restrict pos)
+/*
+ * The generator is specialized for each color and type of moves: the functions
+ * are always inlined and get_pseudo_legal_moves calls gen_all_moves with
+ * constant arguments, so the pawn directions, the promotion rank and the
+ * castling squares become constants and the branches on the type of moves are
+ * removed.
+ */
+static ALWAYS_INLINE void gen_all_moves(MoveList *restrict list,
+					enum move_gen_type type,
+					const Position *restrict pos,
+					Color color)
 {
-	switch (piece_type) {
-	case PIECE_TYPE_PAWN:
-		gen_pawn_moves(list, type, pos);
-		return;
-	case PIECE_TYPE_KING:
-		gen_king_moves(list, type, pos);
-		return;
-	default:
-		break;
-	}
-
-	const Color color = get_side_to_move(pos);
-	const Piece piece = create_piece(piece_type, color);
-	const u64 occ = get_color_bitboard(pos, color) |
-			get_color_bitboard(pos, !color);
 	const u64 enemy_pieces = get_color_bitboard(pos, !color);
+	const u64 occ = enemy_pieces | get_color_bitboard(pos, color);
 
-	u64 bb = get_piece_bitboard(pos, piece);
+	gen_pawn_moves(list, type, pos, color, enemy_pieces, occ);
+	gen_piece_moves(list, PIECE_TYPE_KNIGHT, type, pos, color, enemy_pieces,
+			occ);
+	gen_piece_moves(list, PIECE_TYPE_ROOK, type, pos, color, enemy_pieces,
+			occ);
+	gen_piece_moves(list, PIECE_TYPE_BISHOP, type, pos, color, enemy_pieces,
+			occ);
+	gen_piece_moves(list, PIECE_TYPE_QUEEN, type, pos, color, enemy_pieces,
+			occ);
+	gen_king_moves(list, type, pos, color, enemy_pieces, occ);
+}
+
+static ALWAYS_INLINE void gen_piece_moves(MoveList *restrict list,
+					  PieceType piece_type,
+					  enum move_gen_type type,
+					  const Position *restrict pos,
+					  Color color, u64 enemy_pieces,
+					  u64 occ)
+{
+	u64 bb = get_piece_bitboard(pos, create_piece(piece_type, color));
 	while (bb) {
 		const Square from = (Square)unset_ls1b(&bb);
 		u64 targets = 0;
@@ -553,192 +695,198 @@ static void gen_moves(MoveList *restrict list, PieceType piece_type,
 		default:
 			abort();
 		}
-		if (type == MOVE_GEN_TYPE_CAPTURE)
-			targets &= enemy_pieces;
-		else
-			targets &= ~occ;
-		while (targets) {
-			const Square to = (Square)unset_ls1b(&targets);
-			const Move move =
-				get_piece_at(pos, to) == PIECE_NONE ?
-					create_move(from, to, MOVE_OTHER) :
-					create_move(from, to, MOVE_CAPTURE);
-			add_move(list, move);
-		}
+		if (type != MOVE_GEN_TYPE_QUIET)
+			add_moves(list, from, targets & enemy_pieces,
+				  MOVE_CAPTURE);
+		if (type != MOVE_GEN_TYPE_CAPTURE)
+			add_moves(list, from, targets & ~occ, MOVE_OTHER);
 	}
 }
 
-static void gen_king_moves(MoveList *restrict list, enum move_gen_type type,
-			   const Position *restrict pos)
+static ALWAYS_INLINE void gen_king_moves(MoveList *restrict list,
+					 enum move_gen_type type,
+					 const Position *restrict pos,
+					 Color color, u64 enemy_pieces, u64 occ)
 {
-	const Color color = get_side_to_move(pos);
 	const Square from = get_king_square(pos, color);
-	const u64 occ = get_color_bitboard(pos, color) |
-			get_color_bitboard(pos, !color);
-	const u64 enemy_pieces = get_color_bitboard(pos, !color);
+	const u64 targets = get_king_attacks(from);
 
+	if (type != MOVE_GEN_TYPE_QUIET)
+		add_moves(list, from, targets & enemy_pieces, MOVE_CAPTURE);
 	if (type != MOVE_GEN_TYPE_CAPTURE) {
-		gen_king_castling(list, pos);
-		gen_queen_castling(list, pos);
-	}
-
-	u64 targets;
-	if (type == MOVE_GEN_TYPE_CAPTURE)
-		targets = get_king_attacks(from) & enemy_pieces;
-	else
-		targets = get_king_attacks(from) & ~occ;
-	while (targets) {
-		const Square to = (Square)unset_ls1b(&targets);
-		const Move move = get_piece_at(pos, to) == PIECE_NONE ?
-					  create_move(from, to, MOVE_OTHER) :
-					  create_move(from, to, MOVE_CAPTURE);
-		add_move(list, move);
+		add_moves(list, from, targets & ~occ, MOVE_OTHER);
+		gen_king_castling(list, pos, color);
+		gen_queen_castling(list, pos, color);
 	}
 }
 
-static void gen_queen_castling(MoveList *restrict list,
-			       const Position *restrict pos)
+static ALWAYS_INLINE void gen_queen_castling(MoveList *restrict list,
+					     const Position *restrict pos,
+					     Color color)
 {
-	const Color color = get_side_to_move(pos);
-	const Square from = get_king_square(pos, color);
+	if (!has_castling_right(pos, color, CASTLING_SIDE_QUEEN))
+		return;
 
-	if (has_castling_right(pos, color, CASTLING_SIDE_QUEEN)) {
-		const Square q_castling_test_sq1 = color == COLOR_WHITE ? D1 :
-									  D8;
-		const Square q_castling_test_sq2 = color == COLOR_WHITE ? C1 :
-									  C8;
-		const Square q_castling_test_sq3 = color == COLOR_WHITE ? B1 :
-									  B8;
-		if (get_piece_at(pos, q_castling_test_sq1) == PIECE_NONE &&
-		    get_piece_at(pos, q_castling_test_sq2) == PIECE_NONE &&
-		    get_piece_at(pos, q_castling_test_sq3) == PIECE_NONE &&
-		    !is_square_attacked(q_castling_test_sq1, !color, pos) &&
-		    !is_square_attacked(q_castling_test_sq2, !color, pos) &&
-		    !is_square_attacked(from, !color, pos)) {
-			const Square to = color == COLOR_WHITE ? C1 : C8;
-			const Move move =
-				create_move(from, to, MOVE_QUEEN_CASTLE);
-			add_move(list, move);
-		}
-	}
+	const Square from = color == COLOR_WHITE ? E1 : E8;
+	const Square sq1 = color == COLOR_WHITE ? D1 : D8;
+	const Square sq2 = color == COLOR_WHITE ? C1 : C8;
+	const Square sq3 = color == COLOR_WHITE ? B1 : B8;
+	if (get_piece_at(pos, sq1) == PIECE_NONE &&
+	    get_piece_at(pos, sq2) == PIECE_NONE &&
+	    get_piece_at(pos, sq3) == PIECE_NONE &&
+	    !is_square_attacked(sq1, !color, pos) &&
+	    !is_square_attacked(sq2, !color, pos) &&
+	    !is_square_attacked(from, !color, pos))
+		add_move(list, create_move(from, sq2, MOVE_QUEEN_CASTLE));
 }
 
-static void gen_king_castling(MoveList *restrict list,
-			      const Position *restrict pos)
+static ALWAYS_INLINE void gen_king_castling(MoveList *restrict list,
+					    const Position *restrict pos,
+					    Color color)
 {
-	const Color color = get_side_to_move(pos);
-	const Square from = get_king_square(pos, color);
+	if (!has_castling_right(pos, color, CASTLING_SIDE_KING))
+		return;
 
-	if (has_castling_right(pos, color, CASTLING_SIDE_KING)) {
-		const Square k_castling_test_sq1 = color == COLOR_WHITE ? F1 :
-									  F8;
-		const Square k_castling_test_sq2 = color == COLOR_WHITE ? G1 :
-									  G8;
-		if (get_piece_at(pos, k_castling_test_sq1) == PIECE_NONE &&
-		    get_piece_at(pos, k_castling_test_sq2) == PIECE_NONE &&
-		    !is_square_attacked(k_castling_test_sq1, !color, pos) &&
-		    !is_square_attacked(k_castling_test_sq2, !color, pos) &&
-		    !is_square_attacked(from, !color, pos)) {
-			const Square to = color == COLOR_WHITE ? G1 : G8;
-			const Move move =
-				create_move(from, to, MOVE_KING_CASTLE);
-			add_move(list, move);
-		}
-	}
+	const Square from = color == COLOR_WHITE ? E1 : E8;
+	const Square sq1 = color == COLOR_WHITE ? F1 : F8;
+	const Square sq2 = color == COLOR_WHITE ? G1 : G8;
+	if (get_piece_at(pos, sq1) == PIECE_NONE &&
+	    get_piece_at(pos, sq2) == PIECE_NONE &&
+	    !is_square_attacked(sq1, !color, pos) &&
+	    !is_square_attacked(sq2, !color, pos) &&
+	    !is_square_attacked(from, !color, pos))
+		add_move(list, create_move(from, sq2, MOVE_KING_CASTLE));
 }
 
-static void gen_pawn_moves(MoveList *restrict list, enum move_gen_type type,
-			   const Position *restrict pos)
+/*
+ * The pawn moves are generated for all the pawns at once by shifting the pawn
+ * bitboard, the origin of each move is then found from its target by going back
+ * in the direction of the shift.
+ */
+static ALWAYS_INLINE void gen_pawn_moves(MoveList *restrict list,
+					 enum move_gen_type type,
+					 const Position *restrict pos,
+					 Color color, u64 enemy_pieces, u64 occ)
 {
-	const Color color = get_side_to_move(pos);
-	const Piece piece = create_piece(PIECE_TYPE_PAWN, color);
-	const u64 enemy_pieces = get_color_bitboard(pos, !color);
-	const u64 occ = enemy_pieces | get_color_bitboard(pos, color);
-
-	u64 bb = get_piece_bitboard(pos, piece);
-	if (has_en_passant_square(pos) && type == MOVE_GEN_TYPE_CAPTURE) {
-		const Square sq = get_en_passant_square(pos);
-
-		if (!square_is_attacked_by_pawn(sq, color, pos))
-			goto next;
-
-		u64 attackers = get_pawn_attacks(sq, !color) & bb;
-		while (attackers) {
-			const Square from = (Square)unset_ls1b(&attackers);
-			const Square to = sq;
-			const Move move =
-				create_move(from, to, MOVE_EP_CAPTURE);
-			add_move(list, move);
-		}
+	const int up = color == COLOR_WHITE ? 8 : -8;
+	const u64 seventh_rank = color == COLOR_WHITE ? rank_bitboards[RANK_7] :
+							rank_bitboards[RANK_2];
+	const u64 third_rank = color == COLOR_WHITE ? rank_bitboards[RANK_3] :
+						      rank_bitboards[RANK_6];
+	const u64 pawns =
+		get_piece_bitboard(pos, create_piece(PIECE_TYPE_PAWN, color));
+	const u64 promoting_pawns = pawns & seventh_rank;
+	const u64 other_pawns = pawns & ~seventh_rank;
+
+	if (type != MOVE_GEN_TYPE_QUIET) {
+		const u64 west = color == COLOR_WHITE ?
+					 shift_bb_northwest(other_pawns, 1) :
+					 shift_bb_southwest(other_pawns, 1);
+		const u64 east = color == COLOR_WHITE ?
+					 shift_bb_northeast(other_pawns, 1) :
+					 shift_bb_southeast(other_pawns, 1);
+		add_pawn_moves(list, west & enemy_pieces, up - 1,
+			       MOVE_CAPTURE);
+		add_pawn_moves(list, east & enemy_pieces, up + 1,
+			       MOVE_CAPTURE);
+
+		const u64 promotion_west =
+			color == COLOR_WHITE ?
+				shift_bb_northwest(promoting_pawns, 1) :
+				shift_bb_southwest(promoting_pawns, 1);
+		const u64 promotion_east =
+			color == COLOR_WHITE ?
+				shift_bb_northeast(promoting_pawns, 1) :
+				shift_bb_southeast(promoting_pawns, 1);
+		add_promotions(list, promotion_west & enemy_pieces, up - 1,
+			       MOVE_KNIGHT_PROMOTION_CAPTURE);
+		add_promotions(list, promotion_east & enemy_pieces, up + 1,
+			       MOVE_KNIGHT_PROMOTION_CAPTURE);
+
+		gen_en_passant(list, pos, color, pawns);
 	}
-next:
 
-	while (bb) {
-		const Square from = (Square)unset_ls1b(&bb);
-		if (type == MOVE_GEN_TYPE_CAPTURE) {
-			gen_pawn_attacks(list, from, enemy_pieces, color);
-		} else if (type == MOVE_GEN_TYPE_QUIET) {
-			gen_pushes(list, from, occ, color);
-			gen_double_pushes(list, from, occ, color);
-		}
+	if (type != MOVE_GEN_TYPE_CAPTURE) {
+		const u64 pushes = (color == COLOR_WHITE ?
+					    shift_bb_north(other_pawns, 1) :
+					    shift_bb_south(other_pawns, 1)) &
+				   ~occ;
+		const u64 double_pushes =
+			(color == COLOR_WHITE ?
+				 shift_bb_north(pushes & third_rank, 1) :
+				 shift_bb_south(pushes & third_rank, 1)) &
+			~occ;
+		add_pawn_moves(list, pushes, up, MOVE_OTHER);
+		add_pawn_moves(list, double_pushes, 2 * up,
+			       MOVE_DOUBLE_PAWN_PUSH);
+
+		const u64 promotions =
+			(color == COLOR_WHITE ?
+				 shift_bb_north(promoting_pawns, 1) :
+				 shift_bb_south(promoting_pawns, 1)) &
+			~occ;
+		add_promotions(list, promotions, up, MOVE_KNIGHT_PROMOTION);
 	}
 }
 
-static void gen_pawn_attacks(MoveList *restrict list, Square from,
-			     u64 enemy_pieces, Color color)
+static ALWAYS_INLINE void gen_en_passant(MoveList *restrict list,
+					 const Position *restrict pos,
+					 Color color, u64 pawns)
 {
-	u64 targets = get_pawn_attacks(from, color) & enemy_pieces;
-	while (targets) {
-		const Square to = (Square)unset_ls1b(&targets);
-		if ((color == COLOR_WHITE && get_rank(to) == RANK_8) ||
-		    (color == COLOR_BLACK && get_rank(to) == RANK_1)) {
-			for (MoveType move_type = MOVE_KNIGHT_PROMOTION_CAPTURE;
-			     move_type <= MOVE_QUEEN_PROMOTION_CAPTURE;
-			     ++move_type) {
-				const Move move =
-					create_move(from, to, move_type);
-				add_move(list, move);
-			}
-		} else {
-			const Move move = create_move(from, to, MOVE_CAPTURE);
-			add_move(list, move);
-		}
+	if (!has_en_passant_square(pos))
+		return;
+
+	const Square to = get_en_passant_square(pos);
+	u64 attackers = get_pawn_attacks(to, !color) & pawns;
+	while (attackers) {
+		const Square from = (Square)unset_ls1b(&attackers);
+		add_move(list, create_move(from, to, MOVE_EP_CAPTURE));
 	}
 }
 
-static void gen_double_pushes(MoveList *restrict list, Square from, u64 occ,
-			      Color color)
+/*
+ * Adds a move to each target square from the square distance squares before
+ * it.
+ */
+static ALWAYS_INLINE void add_pawn_moves(MoveList *restrict list, u64 targets,
+					 int distance, MoveType move_type)
 {
-	u64 targets = get_double_push(from, occ, color);
-	if (targets) {
-		const Square to = (Square)get_ls1b(targets);
-		const Move move = create_move(from, to, MOVE_DOUBLE_PAWN_PUSH);
-		add_move(list, move);
+	while (targets) {
+		const int to = unset_ls1b(&targets);
+		add_move(list, create_move((Square)(to - distance), (Square)to,
+					   move_type));
 	}
 }
 
-static void gen_pushes(MoveList *restrict list, Square from, u64 occ,
-		       Color color)
+/*
+ * The same as add_pawn_moves, but all the promotions are added for each target.
+ * The first promotion type is the knight promotion, with or without capture,
+ * and the others follow it.
+ */
+static ALWAYS_INLINE void add_promotions(MoveList *restrict list, u64 targets,
+					 int distance, MoveType first_type)
 {
-	u64 targets = get_single_push(from, occ, color);
-	if (targets) {
-		const Square to = (Square)get_ls1b(targets);
-		if ((color == COLOR_WHITE && get_rank(to) == RANK_8) ||
-		    (color == COLOR_BLACK && get_rank(to) == RANK_1)) {
-			for (MoveType move_type = MOVE_KNIGHT_PROMOTION;
-			     move_type <= MOVE_QUEEN_PROMOTION; ++move_type) {
-				const Move move =
-					create_move(from, to, move_type);
-				add_move(list, move);
-			}
-		} else {
-			const Move move = create_move(from, to, MOVE_OTHER);
+	while (targets) {
+		const int to = unset_ls1b(&targets);
+		for (MoveType i = 0; i < 4; ++i) {
+			const Move move =
+				create_move((Square)(to - distance), (Square)to,
+					    first_type + i);
 			add_move(list, move);
 		}
 	}
 }
 
-static void add_move(MoveList *restrict list, Move move)
+static ALWAYS_INLINE void add_moves(MoveList *restrict list, Square from,
+				    u64 targets, MoveType move_type)
+{
+	while (targets) {
+		const Square to = (Square)unset_ls1b(&targets);
+		add_move(list, create_move(from, to, move_type));
+	}
+}
+
+static ALWAYS_INLINE void add_move(MoveList *restrict list, Move move)
 {
 	struct move_with_score move_with_score;
 	move_with_score.move = move;
@@ -760,21 +908,19 @@ static u64 get_queen_attacks(Square sq, u64 occ)
 static u64 get_rook_attacks(Square sq, u64 occ)
 {
 	const u64 *const aptr = rook_magics[sq].ptr;
-#ifdef USE_BMI2
-	return aptr[pext(occ, rook_magics[sq].mask)];
-#endif
+	if (use_pext)
+		return aptr[pext(occ, rook_magics[sq].mask)];
 	occ &= rook_magics[sq].mask;
 	occ *= rook_magics[sq].num;
 	occ >>= rook_magics[sq].shift;
 	return aptr[occ];
 }
 
-__attribute__((noinline)) static u64 get_bishop_attacks(Square sq, u64 occ)
+static u64 get_bishop_attacks(Square sq, u64 occ)
 {
 	const u64 *const aptr = bishop_magics[sq].ptr;
-#ifdef USE_BMI2
-	return aptr[pext(occ, bishop_magics[sq].mask)];
-#endif
+	if (use_pext)
+		return aptr[pext(occ, bishop_magics[sq].mask)];
 	occ &= bishop_magics[sq].mask;
 	occ *= bishop_magics[sq].num;
 	occ >>= bishop_magics[sq].shift;
@@ -892,9 +1038,8 @@ static void init_sliding_atacks(PieceType pt)
 			/* With BMI2 we have the PEXT instruction which allows
 			 * us to extract the 1 bits from the occupancies
 			 * without the need for magic numbers. */
-#ifdef USE_BMI2
-			m->ptr[pext(bb, m->mask)] = ref[size];
-#endif
+			if (use_pext)
+				m->ptr[pext(bb, m->mask)] = ref[size];
 
 			/* This is the Carry-Rippler method to generate all
 			 * possible permutations of bits along the mask. */
@@ -902,9 +1047,8 @@ static void init_sliding_atacks(PieceType pt)
 			++size;
 		} while (bb);
 
-#ifdef USE_BMI2
-		continue;
-#endif
+		if (use_pext)
+			continue;
 
 		memset(attempts, 0, sizeof(attempts));
 		unsigned current_attempt = 0;
@@ -964,6 +1108,89 @@ static u64 gen_ray_attacks(u64 occ, Direction dir, Square sq)
 	return attacks ^ ray_bitboards[dir][sq];
 }
 
+/*
+ * The attacks of a slider on an empty board tell us if two squares are on the
+ * same line, and the attacks of each of the two squares with the other one as
+ * the only blocker meet on the squares between them.
+ */
+static void init_lines(void)
+{
+	for (Square a = A1; a <= H8; ++a) {
+		for (Square b = A1; b <= H8; ++b) {
+			const u64 a_bb = U64(0x1) << a;
+			const u64 b_bb = U64(0x1) << b;
+			u64 line = 0;
+			u64 between = 0;
+			if (a != b && get_rook_attacks(a, 0) & b_bb) {
+				line = get_rook_attacks(a, 0) &
+				       get_rook_attacks(b, 0);
+				between = get_rook_attacks(a, b_bb) &
+					  get_rook_attacks(b, a_bb);
+			} else if (a != b && get_bishop_attacks(a, 0) & b_bb) {
+				line = get_bishop_attacks(a, 0) &
+				       get_bishop_attacks(b, 0);
+				between = get_bishop_attacks(a, b_bb) &
+					  get_bishop_attacks(b, a_bb);
+			}
+			if (line)
+				line |= a_bb | b_bb;
+			line_bitboards[a][b] = line;
+			between_bitboards[a][b] = between;
+		}
+	}
+}
+
+/*
+ * Only the pieces in occ are considered, so this can be used to test a square
+ * as if some pieces had moved.
+ */
+static bool is_square_attacked_with_occupancy(Square sq, Color by_side,
+					      u64 occ, const Position *pos)
+{
+	Piece piece = create_piece(PIECE_TYPE_PAWN, by_side);
+	const u64 pawns = get_piece_bitboard(pos, piece) & occ;
+	if (get_pawn_attacks(sq, !by_side) & pawns)
+		return true;
+	piece = create_piece(PIECE_TYPE_KNIGHT, by_side);
+	const u64 knights = get_piece_bitboard(pos, piece) & occ;
+	if (get_knight_attacks(sq) & knights)
+		return true;
+	piece = create_piece(PIECE_TYPE_ROOK, by_side);
+	u64 rooks_queens = get_piece_bitboard(pos, piece);
+	piece = create_piece(PIECE_TYPE_QUEEN, by_side);
+	rooks_queens |= get_piece_bitboard(pos, piece);
+	if (get_rook_attacks(sq, occ) & rooks_queens & occ)
+		return true;
+	u64 bishops_queens = get_piece_bitboard(pos, piece);
+	piece = create_piece(PIECE_TYPE_BISHOP, by_side);
+	bishops_queens |= get_piece_bitboard(pos, piece);
+	if (get_bishop_attacks(sq, occ) & bishops_queens & occ)
+		return true;
+	piece = create_piece(PIECE_TYPE_KING, by_side);
+	const u64 king = get_piece_bitboard(pos, piece);
+	if (get_king_attacks(sq) & king)
+		return true;
+	return false;
+}
+
+/*
+ * En passant is the only move that removes two pieces from the same rank, so a
+ * pawn that is not pinned can still expose the king to a slider. We just check
+ * the attacks on the king on the board after the capture.
+ */
+static bool en_passant_is_legal(const Position *pos, Square from, Square to,
+				Square king_sq)
+{
+	const Color color = get_side_to_move(pos);
+	/* The captured pawn is right behind the target square. */
+	const u64 captured_bb = U64(0x1) << (to ^ 8);
+	const u64 occ = ((get_color_bitboard(pos, COLOR_WHITE) |
+			  get_color_bitboard(pos, COLOR_BLACK)) &
+			 ~(U64(0x1) << from) & ~captured_bb) |
+			U64(0x1) << to;
+	return !is_square_attacked_with_occupancy(king_sq, !color, occ, pos);
+}
+
 static void init_rays(void)
 {
 	for (Square sq = A1; sq <= H8; ++sq) {
@@ -982,13 +1209,17 @@ static void init_rays(void)
 
 #include <unity/unity.h>
 
+#include <perft.h>
+
 static void recursively_test_move_is_pseudo_legal_true(Position *pos,
 						       int depth);
 static void test_move_is_pseudo_legal(void);
+static void test_perft(void);
 
 void test_movegen(void)
 {
 	test_move_is_pseudo_legal();
+	test_perft();
 }
 
 /*
@@ -1085,6 +1316,7 @@ static void test_move_is_pseudo_legal(void)
 	     ++i) {
 		init_position(pos, phases_fen[i]);
 		recursively_test_move_is_pseudo_legal_true(pos, 5);
+		free_position(pos);
 	}
 
 	for (size_t i = 0; i < sizeof(false_data) / sizeof(false_data[0]);
@@ -1102,9 +1334,41 @@ static void test_move_is_pseudo_legal(void)
 		TEST_ASSERT_MESSAGE(!move_is_pseudo_legal(move, pos),
 				    fail_message);
 		free(fail_message);
+		free_position(pos);
 	}
 
 	free(pos);
 }
 
+/*
+ * The positions and node counts are the ones from the Chess Programming Wiki.
+ * The search uses two threads and a small table so the hash and the split of
+ * the root moves are tested too.
+ */
+static void test_perft(void)
+{
+	/* clang-format off */
+	const struct perft_data {
+		const char *fen;
+		int depth;
+		u64 nodes;
+	} data[] = {
+		{"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 4, 197281},
+		{"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 3, 97862},
+		{"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 5, 674624},
+		{"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 4, 422333},
+		{"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", 3, 62379},
+		{"r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10", 3, 89890},
+	};
+	/* clang-format on */
+
+	for (size_t i = 0; i < sizeof(data) / sizeof(data[0]); ++i) {
+		Position pos;
+		init_position(&pos, data[i].fen);
+		const u64 nodes = perft(&pos, data[i].depth, 2, 1, NULL);
+		free_position(&pos);
+		TEST_ASSERT_MESSAGE(nodes == data[i].nodes, data[i].fen);
+	}
+}
+
 #endif
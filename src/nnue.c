@@ -0,0 +1,972 @@
+/*
+ * Copyright (C) 2023 Sayu <mail@sayurc.moe>
+ *
+ * This file is part of Athena.
+ *
+ * Athena is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ * 
+ * Athena is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+/*
+ * This is the NNUE (Efficiently Updatable Neural Network) evaluation. The
+ * network has the following layers:
+ *
+ * - The feature transformer, which takes the HalfKP features of each side and
+ *   outputs NNUE_ACCUMULATOR_SIZE values for each side. A HalfKP feature is a
+ *   tuple (king square, piece, square) for every piece that isn't a king, so
+ *   only a few features change with each move and the output, which is kept in
+ *   the accumulators of the position, can be updated incrementally;
+ * - Two hidden layers with HIDDEN1_SIZE and HIDDEN2_SIZE neurons;
+ * - The output neuron.
+ *
+ * The accumulators are int16 and the weights of the other layers are int8. All
+ * the activations are clipped to [0, ACTIVATION_MAX], where ACTIVATION_MAX is
+ * 1.0, and the weights of the hidden layers are scaled by 2^WEIGHT_SHIFT.
+ *
+ * The kernels are vectorized with AVX-512 (which must include AVX-512BW), AVX2
+ * or SSE2 on x86-64, NEON on AArch64 and WebAssembly SIMD when the build
+ * enables it. Otherwise plain C is used. SSE2 is part of x86-64, while AVX2 and
+ * AVX-512 are detected at runtime like the other extensions, with their kernels
+ * compiled for these instruction sets only, so the same binary runs on every
+ * x86-64 CPU.
+ */
+
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(ARCH_x64)
+#include <immintrin.h>
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx2,avx512f,avx512bw")))
+#elif defined(__aarch64__)
+#define USE_NEON
+#include <arm_neon.h>
+#elif defined(ARCH_WASM) && defined(__wasm_simd128__)
+#define USE_WASM_SIMD
+#include <wasm_simd128.h>
+#endif
+
+#include <bit.h>
+#include <pos.h>
+#include <nnue.h>
+
+#define FEATURES_NB (64 * 10 * 64)
+#define INPUT_SIZE (2 * NNUE_ACCUMULATOR_SIZE)
+#define HIDDEN1_SIZE 32
+#define HIDDEN2_SIZE 32
+#define ACTIVATION_MAX 127
+#define WEIGHT_SHIFT 6
+/* The output of the network is divided by this to get centipawns. */
+#define OUTPUT_SCALE 16
+/* The evaluation must stay far from the mate scores. */
+#define MAX_SCORE 16000
+
+#define NETWORK_MAGIC "ATHENANN"
+#define NETWORK_MAGIC_LEN 8
+#define NETWORK_VERSION 1
+
+struct network {
+	alignas(64) i16 feature_biases[NNUE_ACCUMULATOR_SIZE];
+	alignas(64) i16 feature_weights[FEATURES_NB][NNUE_ACCUMULATOR_SIZE];
+	alignas(64) i32 hidden1_biases[HIDDEN1_SIZE];
+	alignas(64) i8 hidden1_weights[HIDDEN1_SIZE][INPUT_SIZE];
+	alignas(64) i32 hidden2_biases[HIDDEN2_SIZE];
+	alignas(64) i8 hidden2_weights[HIDDEN2_SIZE][HIDDEN1_SIZE];
+	alignas(64) i8 output_weights[HIDDEN2_SIZE];
+	i32 output_bias;
+};
+
+static int get_feature_index(Color perspective, Square king_sq, Piece piece,
+			     Square sq);
+static void update_accumulators(Position *pos, Piece piece, Square sq,
+				bool added);
+static void refresh_accumulator(Position *pos, Color c);
+static void add_weights(i16 *restrict values, const i16 *restrict weights);
+static void subtract_weights(i16 *restrict values,
+			     const i16 *restrict weights);
+static void transform(u8 *restrict output, const i16 *restrict input);
+static void propagate(u8 *restrict output, const u8 *restrict input,
+		      const i8 *restrict weights, const i32 *restrict biases,
+		      int input_size, int output_size);
+static i32 dot_product(const u8 *restrict input, const i8 *restrict weights,
+		       int size);
+#ifdef ARCH_x64
+static void add_weights_sse2(i16 *restrict values,
+			     const i16 *restrict weights);
+static void subtract_weights_sse2(i16 *restrict values,
+				  const i16 *restrict weights);
+static void transform_sse2(u8 *restrict output, const i16 *restrict input);
+static i32 dot_product_sse2(const u8 *restrict input,
+			    const i8 *restrict weights, int size);
+TARGET_AVX2 static void add_weights_avx2(i16 *restrict values,
+					 const i16 *restrict weights);
+TARGET_AVX2 static void subtract_weights_avx2(i16 *restrict values,
+					      const i16 *restrict weights);
+TARGET_AVX2 static void transform_avx2(u8 *restrict output,
+				       const i16 *restrict input);
+TARGET_AVX2 static i32 dot_product_avx2(const u8 *restrict input,
+					const i8 *restrict weights, int size);
+TARGET_AVX512 static void add_weights_avx512(i16 *restrict values,
+					     const i16 *restrict weights);
+TARGET_AVX512 static void subtract_weights_avx512(i16 *restrict values,
+						  const i16 *restrict weights);
+TARGET_AVX512 static i32 dot_product_avx512(const u8 *restrict input,
+					    const i8 *restrict weights,
+					    int size);
+#endif
+static void select_kernels(void);
+static bool read_integers(FILE *fp, void *ptr, size_t size, size_t nb);
+static bool read_dimension(FILE *fp, u32 expected);
+
+static struct network *network = NULL;
+static bool enabled = false;
+
+#ifdef ARCH_x64
+enum kernels {
+	KERNELS_SSE2,
+	KERNELS_AVX2,
+	KERNELS_AVX512,
+};
+
+static enum kernels kernels = KERNELS_SSE2;
+#endif
+
+/*
+ * The file starts with NETWORK_MAGIC, the version and the size of each layer,
+ * followed by the biases and weights of each layer in order. All the numbers
+ * are little-endian. The weights of a neuron are contiguous. Returns 0 on
+ * success and 1 otherwise, in which case the network that was loaded before is
+ * kept.
+ */
+int load_network(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		return 1;
+
+	/* The size is a multiple of the alignment because of the members
+	 * aligned to 64 bytes. */
+	struct network *net = aligned_alloc(64, sizeof(struct network));
+	if (!net) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	char magic[NETWORK_MAGIC_LEN];
+	bool ok = fread(magic, 1, NETWORK_MAGIC_LEN, fp) ==
+			  NETWORK_MAGIC_LEN &&
+		  !memcmp(magic, NETWORK_MAGIC, NETWORK_MAGIC_LEN);
+	ok = ok && read_dimension(fp, NETWORK_VERSION) &&
+	     read_dimension(fp, FEATURES_NB) &&
+	     read_dimension(fp, NNUE_ACCUMULATOR_SIZE) &&
+	     read_dimension(fp, HIDDEN1_SIZE) &&
+	     read_dimension(fp, HIDDEN2_SIZE);
+	ok = ok &&
+	     read_integers(fp, net->feature_biases, sizeof(i16),
+			   NNUE_ACCUMULATOR_SIZE) &&
+	     read_integers(fp, net->feature_weights, sizeof(i16),
+			   (size_t)FEATURES_NB * NNUE_ACCUMULATOR_SIZE) &&
+	     read_integers(fp, net->hidden1_biases, sizeof(i32),
+			   HIDDEN1_SIZE) &&
+	     read_integers(fp, net->hidden1_weights, sizeof(i8),
+			   HIDDEN1_SIZE * INPUT_SIZE) &&
+	     read_integers(fp, net->hidden2_biases, sizeof(i32),
+			   HIDDEN2_SIZE) &&
+	     read_integers(fp, net->hidden2_weights, sizeof(i8),
+			   HIDDEN2_SIZE * HIDDEN1_SIZE) &&
+	     read_integers(fp, &net->output_bias, sizeof(i32), 1) &&
+	     read_integers(fp, net->output_weights, sizeof(i8), HIDDEN2_SIZE);
+	/* Anything after the last layer means the file is not what we think
+	 * it is. */
+	ok = ok && fgetc(fp) == EOF;
+	fclose(fp);
+
+	if (!ok) {
+		free(net);
+		return 1;
+	}
+	free(network);
+	network = net;
+	select_kernels();
+	return 0;
+}
+
+void free_network(void)
+{
+	free(network);
+	network = NULL;
+}
+
+/*
+ * The NNUE is only used when it's enabled and a network is loaded.
+ */
+void enable_nnue(bool enable)
+{
+	enabled = enable;
+}
+
+bool nnue_is_enabled(void)
+{
+	return enabled && network;
+}
+
+void add_to_accumulators(Position *pos, Piece piece, Square sq)
+{
+	update_accumulators(pos, piece, sq, true);
+}
+
+void remove_from_accumulators(Position *pos, Piece piece, Square sq)
+{
+	update_accumulators(pos, piece, sq, false);
+}
+
+/*
+ * Marks both accumulators as dirty. This must be called before the pieces are
+ * placed on a new position.
+ */
+void invalidate_accumulators(Position *pos)
+{
+	pos->accumulator.dirty[COLOR_WHITE] = true;
+	pos->accumulator.dirty[COLOR_BLACK] = true;
+}
+
+/*
+ * Returns the evaluation of the position from the point of view of the side to
+ * move. The position is only changed to refresh the dirty accumulators.
+ */
+int evaluate_nnue(Position *pos)
+{
+	struct accumulator *const acc = &pos->accumulator;
+	for (Color c = COLOR_WHITE; c <= COLOR_BLACK; ++c) {
+		if (acc->dirty[c])
+			refresh_accumulator(pos, c);
+	}
+
+	/* The side to move always comes first so the network knows whose turn
+	 * it is. */
+	alignas(64) u8 input[INPUT_SIZE];
+	alignas(64) u8 hidden1[HIDDEN1_SIZE];
+	alignas(64) u8 hidden2[HIDDEN2_SIZE];
+	const Color color = get_side_to_move(pos);
+	transform(input, acc->values[color]);
+	transform(input + NNUE_ACCUMULATOR_SIZE, acc->values[!color]);
+	propagate(hidden1, input, &network->hidden1_weights[0][0],
+		  network->hidden1_biases, INPUT_SIZE, HIDDEN1_SIZE);
+	propagate(hidden2, hidden1, &network->hidden2_weights[0][0],
+		  network->hidden2_biases, HIDDEN1_SIZE, HIDDEN2_SIZE);
+	const i32 output =
+		network->output_bias +
+		dot_product(hidden2, network->output_weights, HIDDEN2_SIZE);
+
+	const int score = output / OUTPUT_SCALE;
+	if (score > MAX_SCORE)
+		return MAX_SCORE;
+	if (score < -MAX_SCORE)
+		return -MAX_SCORE;
+	return score;
+}
+
+/*
+ * Black sees the board flipped vertically so a piece is seen the same way by
+ * both sides. The pieces are numbered from 0 to 9 with the friendly pieces on
+ * the even numbers, which is the piece itself with the color relative to the
+ * perspective.
+ */
+static int get_feature_index(Color perspective, Square king_sq, Piece piece,
+			     Square sq)
+{
+	const int flip = perspective == COLOR_WHITE ? 0 : 56;
+	const int piece_index = (int)piece ^ (int)perspective;
+	return (((int)king_sq ^ flip) * 10 + piece_index) * 64 +
+	       ((int)sq ^ flip);
+}
+
+/*
+ * When the NNUE is not enabled the accumulators are only marked as dirty, so
+ * they are computed from scratch if the NNUE is enabled later.
+ */
+static void update_accumulators(Position *pos, Piece piece, Square sq,
+				bool added)
+{
+	struct accumulator *const acc = &pos->accumulator;
+	if (!nnue_is_enabled()) {
+		invalidate_accumulators(pos);
+		return;
+	}
+	/* Every feature of the side depends on its king. */
+	if (get_piece_type(piece) == PIECE_TYPE_KING) {
+		acc->dirty[get_piece_color(piece)] = true;
+		return;
+	}
+
+	for (Color c = COLOR_WHITE; c <= COLOR_BLACK; ++c) {
+		if (acc->dirty[c])
+			continue;
+		const Square king_sq = get_king_square(pos, c);
+		const int index = get_feature_index(c, king_sq, piece, sq);
+		if (added)
+			add_weights(acc->values[c],
+				    network->feature_weights[index]);
+		else
+			subtract_weights(acc->values[c],
+					 network->feature_weights[index]);
+	}
+}
+
+static void refresh_accumulator(Position *pos, Color c)
+{
+	i16 *const values = pos->accumulator.values[c];
+	memcpy(values, network->feature_biases,
+	       sizeof(network->feature_biases));
+
+	const u64 white_king = get_piece_bitboard(pos, PIECE_WHITE_KING);
+	const u64 black_king = get_piece_bitboard(pos, PIECE_BLACK_KING);
+	const u64 king_bb = c == COLOR_WHITE ? white_king : black_king;
+	/* A position without a king is not legal, but we don't want to read
+	 * outside the weights if one is set up anyway. */
+	if (king_bb) {
+		const Square king_sq = (Square)get_ls1b(king_bb);
+		u64 bb = (get_color_bitboard(pos, COLOR_WHITE) |
+			  get_color_bitboard(pos, COLOR_BLACK)) &
+			 ~(white_king | black_king);
+		while (bb) {
+			const Square sq = (Square)unset_ls1b(&bb);
+			const Piece piece = get_piece_at(pos, sq);
+			const int index =
+				get_feature_index(c, king_sq, piece, sq);
+			add_weights(values, network->feature_weights[index]);
+		}
+	}
+	pos->accumulator.dirty[c] = false;
+}
+
+/*
+ * On x86-64 the kernels are dispatched on the instruction set chosen when the
+ * network was loaded.
+ */
+static void add_weights(i16 *restrict values, const i16 *restrict weights)
+{
+#if defined(ARCH_x64)
+	switch (kernels) {
+	case KERNELS_AVX512:
+		add_weights_avx512(values, weights);
+		break;
+	case KERNELS_AVX2:
+		add_weights_avx2(values, weights);
+		break;
+	default:
+		add_weights_sse2(values, weights);
+		break;
+	}
+#elif defined(USE_NEON)
+	for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; i += 8) {
+		vst1q_s16(&values[i], vaddq_s16(vld1q_s16(&values[i]),
+						vld1q_s16(&weights[i])));
+	}
+#elif defined(USE_WASM_SIMD)
+	for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; i += 8) {
+		wasm_v128_store(&values[i],
+				wasm_i16x8_add(wasm_v128_load(&values[i]),
+					       wasm_v128_load(&weights[i])));
+	}
+#else
+	for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; ++i)
+		values[i] = (i16)(values[i] + weights[i]);
+#endif
+}
+
+static void subtract_weights(i16 *restrict values,
+			     const i16 *restrict weights)
+{
+#if defined(ARCH_x64)
+	switch (kernels) {
+	case KERNELS_AVX512:
+		subtract_weights_avx512(values, weights);
+		break;
+	case KERNELS_AVX2:
+		subtract_weights_avx2(values, weights);
+		break;
+	default:
+		subtract_weights_sse2(values, weights);
+		break;
+	}
+#elif defined(USE_NEON)
+	for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; i += 8) {
+		vst1q_s16(&values[i], vsubq_s16(vld1q_s16(&values[i]),
+						vld1q_s16(&weights[i])));
+	}
+#elif defined(USE_WASM_SIMD)
+	for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; i += 8) {
+		wasm_v128_store(&values[i],
+				wasm_i16x8_sub(wasm_v128_load(&values[i]),
+					       wasm_v128_load(&weights[i])));
+	}
+#else
+	for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; ++i)
+		values[i] = (i16)(values[i] - weights[i]);
+#endif
+}
+
+/*
+ * Clips the NNUE_ACCUMULATOR_SIZE values of an accumulator to
+ * [0, ACTIVATION_MAX]. The results fit in 8 bits, which lets the next layer
+ * multiply them with 8-bit instructions. AVX-512 uses the AVX2 kernel.
+ */
+static void transform(u8 *restrict output, const i16 *restrict input)
+{
+#if defined(ARCH_x64)
+	if (kernels == KERNELS_SSE2)
+		transform_sse2(output, input);
+	else
+		transform_avx2(output, input);
+#elif defined(USE_NEON)
+	const int16x8_t max = vdupq_n_s16(ACTIVATION_MAX);
+	for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; i += 16) {
+		const int16x8_t a = vminq_s16(vld1q_s16(&input[i]), max);
+		const int16x8_t b = vminq_s16(vld1q_s16(&input[i + 8]), max);
+		vst1q_u8(&output[i],
+			 vcombine_u8(vqmovun_s16(a), vqmovun_s16(b)));
+	}
+#elif defined(USE_WASM_SIMD)
+	const v128_t max = wasm_i16x8_splat(ACTIVATION_MAX);
+	for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; i += 16) {
+		const v128_t a = wasm_i16x8_min(wasm_v128_load(&input[i]), max);
+		const v128_t b =
+			wasm_i16x8_min(wasm_v128_load(&input[i + 8]), max);
+		wasm_v128_store(&output[i], wasm_u8x16_narrow_i16x8(a, b));
+	}
+#else
+	for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; ++i) {
+		if (input[i] <= 0)
+			output[i] = 0;
+		else if (input[i] > ACTIVATION_MAX)
+			output[i] = ACTIVATION_MAX;
+		else
+			output[i] = (u8)input[i];
+	}
+#endif
+}
+
+/*
+ * Computes a dense layer with clipped ReLU activation.
+ */
+static void propagate(u8 *restrict output, const u8 *restrict input,
+		      const i8 *restrict weights, const i32 *restrict biases,
+		      int input_size, int output_size)
+{
+	for (int i = 0; i < output_size; ++i) {
+		const i32 sum =
+			biases[i] + dot_product(input, &weights[i * input_size],
+						input_size);
+		if (sum <= 0)
+			output[i] = 0;
+		else if (sum >> WEIGHT_SHIFT > ACTIVATION_MAX)
+			output[i] = ACTIVATION_MAX;
+		else
+			output[i] = (u8)(sum >> WEIGHT_SHIFT);
+	}
+}
+
+/*
+ * The size must be a multiple of 32. The inputs are activations, so they are
+ * at most ACTIVATION_MAX and the 16-bit sums of pairs of products used by the
+ * x86 and ARM instructions can't overflow.
+ */
+static i32 dot_product(const u8 *restrict input, const i8 *restrict weights,
+		       int size)
+{
+#if defined(ARCH_x64)
+	switch (kernels) {
+	case KERNELS_AVX512:
+		return dot_product_avx512(input, weights, size);
+	case KERNELS_AVX2:
+		return dot_product_avx2(input, weights, size);
+	default:
+		return dot_product_sse2(input, weights, size);
+	}
+#elif defined(USE_NEON)
+	int32x4_t sum = vdupq_n_s32(0);
+	for (int i = 0; i < size; i += 16) {
+		/* The inputs fit in a signed byte. */
+		const int8x16_t x = vreinterpretq_s8_u8(vld1q_u8(&input[i]));
+		const int8x16_t w = vld1q_s8(&weights[i]);
+		int16x8_t products = vmull_s8(vget_low_s8(x), vget_low_s8(w));
+		products = vmlal_s8(products, vget_high_s8(x), vget_high_s8(w));
+		sum = vpadalq_s16(sum, products);
+	}
+	return vaddvq_s32(sum);
+#elif defined(USE_WASM_SIMD)
+	v128_t sum = wasm_i32x4_splat(0);
+	for (int i = 0; i < size; i += 16) {
+		const v128_t x = wasm_v128_load(&input[i]);
+		const v128_t w = wasm_v128_load(&weights[i]);
+		const v128_t x_low = wasm_u16x8_extend_low_u8x16(x);
+		const v128_t x_high = wasm_u16x8_extend_high_u8x16(x);
+		const v128_t w_low = wasm_i16x8_extend_low_i8x16(w);
+		const v128_t w_high = wasm_i16x8_extend_high_i8x16(w);
+		sum = wasm_i32x4_add(sum, wasm_i32x4_dot_i16x8(x_low, w_low));
+		sum = wasm_i32x4_add(sum, wasm_i32x4_dot_i16x8(x_high, w_high));
+	}
+	return wasm_i32x4_extract_lane(sum, 0) +
+	       wasm_i32x4_extract_lane(sum, 1) +
+	       wasm_i32x4_extract_lane(sum, 2) +
+	       wasm_i32x4_extract_lane(sum, 3);
+#else
+	i32 result = 0;
+	for (int i = 0; i < size; ++i)
+		result += (i32)input[i] * weights[i];
+	return result;
+#endif
+}
+
+#ifdef ARCH_x64
+static void add_weights_sse2(i16 *restrict values,
+			     const i16 *restrict weights)
+{
+	for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; i += 8) {
+		__m128i *const v = (__m128i *)(void *)&values[i];
+		const __m128i *const w = (const void *)&weights[i];
+		_mm_storeu_si128(v, _mm_add_epi16(_mm_loadu_si128(v),
+						 _mm_loadu_si128(w)));
+	}
+}
+
+static void subtract_weights_sse2(i16 *restrict values,
+				  const i16 *restrict weights)
+{
+	for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; i += 8) {
+		__m128i *const v = (__m128i *)(void *)&values[i];
+		const __m128i *const w = (const void *)&weights[i];
+		_mm_storeu_si128(v, _mm_sub_epi16(_mm_loadu_si128(v),
+						 _mm_loadu_si128(w)));
+	}
+}
+
+static void transform_sse2(u8 *restrict output, const i16 *restrict input)
+{
+	const __m128i max = _mm_set1_epi16(ACTIVATION_MAX);
+	for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; i += 16) {
+		const __m128i *const in = (const void *)&input[i];
+		const __m128i a = _mm_min_epi16(_mm_loadu_si128(in), max);
+		const __m128i b = _mm_min_epi16(_mm_loadu_si128(in + 1), max);
+		_mm_storeu_si128((__m128i *)(void *)&output[i],
+				 _mm_packus_epi16(a, b));
+	}
+}
+
+/*
+ * There is no instruction to multiply unsigned and signed bytes, so they are
+ * widened to 16 bits first.
+ */
+static i32 dot_product_sse2(const u8 *restrict input,
+			    const i8 *restrict weights, int size)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sum = zero;
+	for (int i = 0; i < size; i += 16) {
+		const __m128i x = _mm_loadu_si128((const void *)&input[i]);
+		const __m128i w = _mm_loadu_si128((const void *)&weights[i]);
+		const __m128i x_low = _mm_unpacklo_epi8(x, zero);
+		const __m128i x_high = _mm_unpackhi_epi8(x, zero);
+		/* Each weight goes to the high byte and is shifted back with
+		 * its sign. */
+		const __m128i w_low =
+			_mm_srai_epi16(_mm_unpacklo_epi8(w, w), 8);
+		const __m128i w_high =
+			_mm_srai_epi16(_mm_unpackhi_epi8(w, w), 8);
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(x_low, w_low));
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(x_high, w_high));
+	}
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+	return _mm_cvtsi128_si32(sum);
+}
+
+TARGET_AVX2 static void add_weights_avx2(i16 *restrict values,
+					 const i16 *restrict weights)
+{
+	for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; i += 16) {
+		__m256i *const v = (__m256i *)(void *)&values[i];
+		const __m256i *const w = (const void *)&weights[i];
+		_mm256_storeu_si256(v, _mm256_add_epi16(_mm256_loadu_si256(v),
+							_mm256_loadu_si256(w)));
+	}
+}
+
+TARGET_AVX2 static void subtract_weights_avx2(i16 *restrict values,
+					      const i16 *restrict weights)
+{
+	for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; i += 16) {
+		__m256i *const v = (__m256i *)(void *)&values[i];
+		const __m256i *const w = (const void *)&weights[i];
+		_mm256_storeu_si256(v, _mm256_sub_epi16(_mm256_loadu_si256(v),
+							_mm256_loadu_si256(w)));
+	}
+}
+
+TARGET_AVX2 static void transform_avx2(u8 *restrict output,
+				       const i16 *restrict input)
+{
+	const __m256i max = _mm256_set1_epi16(ACTIVATION_MAX);
+	for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; i += 32) {
+		const __m256i *const in = (const void *)&input[i];
+		const __m256i a = _mm256_min_epi16(_mm256_loadu_si256(in), max);
+		const __m256i b =
+			_mm256_min_epi16(_mm256_loadu_si256(in + 1), max);
+		/* The negative values are saturated to 0 by the packing, which
+		 * works on each 128-bit lane separately so the 64-bit blocks
+		 * have to be put back in order. */
+		const __m256i packed = _mm256_permute4x64_epi64(
+			_mm256_packus_epi16(a, b), 0xd8);
+		_mm256_storeu_si256((__m256i *)(void *)&output[i], packed);
+	}
+}
+
+TARGET_AVX2 static i32 dot_product_avx2(const u8 *restrict input,
+					const i8 *restrict weights, int size)
+{
+	__m256i sum = _mm256_setzero_si256();
+	for (int i = 0; i < size; i += 32) {
+		const __m256i *const x = (const void *)&input[i];
+		const __m256i *const w = (const void *)&weights[i];
+		const __m256i products = _mm256_maddubs_epi16(
+			_mm256_loadu_si256(x), _mm256_loadu_si256(w));
+		sum = _mm256_add_epi32(
+			sum, _mm256_madd_epi16(products, _mm256_set1_epi16(1)));
+	}
+	__m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(sum),
+				       _mm256_extracti128_si256(sum, 1));
+	sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0x4e));
+	sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0xb1));
+	return _mm_cvtsi128_si32(sum128);
+}
+
+TARGET_AVX512 static void add_weights_avx512(i16 *restrict values,
+					     const i16 *restrict weights)
+{
+	for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; i += 32) {
+		void *const v = &values[i];
+		const void *const w = &weights[i];
+		_mm512_storeu_si512(v, _mm512_add_epi16(_mm512_loadu_si512(v),
+							_mm512_loadu_si512(w)));
+	}
+}
+
+TARGET_AVX512 static void subtract_weights_avx512(i16 *restrict values,
+						  const i16 *restrict weights)
+{
+	for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; i += 32) {
+		void *const v = &values[i];
+		const void *const w = &weights[i];
+		_mm512_storeu_si512(v, _mm512_sub_epi16(_mm512_loadu_si512(v),
+							_mm512_loadu_si512(w)));
+	}
+}
+
+/*
+ * The sizes that are not a multiple of 64 are finished with AVX2.
+ */
+TARGET_AVX512 static i32 dot_product_avx512(const u8 *restrict input,
+					    const i8 *restrict weights,
+					    int size)
+{
+	int i = 0;
+	__m512i sum = _mm512_setzero_si512();
+	for (; i + 64 <= size; i += 64) {
+		const __m512i x = _mm512_loadu_si512((const void *)&input[i]);
+		const __m512i w = _mm512_loadu_si512((const void *)&weights[i]);
+		const __m512i products = _mm512_maddubs_epi16(x, w);
+		sum = _mm512_add_epi32(
+			sum, _mm512_madd_epi16(products, _mm512_set1_epi16(1)));
+	}
+	i32 result = _mm512_reduce_add_epi32(sum);
+	if (i < size)
+		result += dot_product_avx2(&input[i], &weights[i], size - i);
+	return result;
+}
+#endif
+
+/*
+ * Picks the best kernels for the CPU, which must have been detected with
+ * init_cpu_features.
+ */
+static void select_kernels(void)
+{
+#ifdef ARCH_x64
+	if (cpu_has_avx512())
+		kernels = KERNELS_AVX512;
+	else if (cpu_has_avx2())
+		kernels = KERNELS_AVX2;
+	else
+		kernels = KERNELS_SSE2;
+#endif
+}
+
+/*
+ * Reads nb little-endian integers of the given size in bytes and stores them
+ * in the native byte order.
+ */
+static bool read_integers(FILE *fp, void *ptr, size_t size, size_t nb)
+{
+	u8 *const bytes = ptr;
+	if (fread(bytes, size, nb, fp) != nb)
+		return false;
+	if (size == 1)
+		return true;
+
+	for (size_t i = 0; i < nb; ++i) {
+		u8 *const p = &bytes[i * size];
+		u32 n = 0;
+		for (size_t j = 0; j < size; ++j)
+			n |= (u32)p[j] << (8 * j);
+		if (size == 2) {
+			const u16 n16 = (u16)n;
+			memcpy(p, &n16, sizeof(n16));
+		} else {
+			memcpy(p, &n, sizeof(n));
+		}
+	}
+	return true;
+}
+
+static bool read_dimension(FILE *fp, u32 expected)
+{
+	u32 n;
+	return read_integers(fp, &n, sizeof(n), 1) && n == expected;
+}
+
+#ifdef TEST
+
+#include <unity/unity.h>
+
+#include <move.h>
+#include <movegen.h>
+
+#define TEST_MOVES_NB 48
+
+static void check_network(Position *pos);
+static int evaluate_reference(const Position *pos,
+			      i32 values[2][NNUE_ACCUMULATOR_SIZE]);
+static void init_test_network(struct network *net);
+static int get_random(u64 *state, int min, int max);
+
+/*
+ * The network has random weights, small enough for the accumulators to stay in
+ * 16 bits. Random moves are made and undone from each position, and after each
+ * of them the accumulators updated incrementally must be equal to the ones
+ * refreshed from scratch, and the evaluation must be the one of a plain C
+ * version of the network. This is done with each kernel the CPU supports.
+ */
+void test_nnue(void)
+{
+	/* clang-format off */
+	const char *const fens[] = {
+		"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+		"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+		"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+		"n1n5/PPPk4/8/8/8/8/4Kppp/5N1N b - - 0 1",
+	};
+	/* clang-format on */
+
+	struct network *const net = aligned_alloc(64, sizeof(struct network));
+	if (!net) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	init_test_network(net);
+	struct network *const saved_network = network;
+	const bool saved_enabled = enabled;
+	network = net;
+	enabled = true;
+
+#ifdef ARCH_x64
+	const bool supported[] = { true, cpu_has_avx2(), cpu_has_avx512() };
+	const int kernels_nb = 3;
+#else
+	const int kernels_nb = 1;
+#endif
+	Position *pos = malloc(sizeof(Position));
+	for (int k = 0; k < kernels_nb; ++k) {
+#ifdef ARCH_x64
+		if (!supported[k])
+			continue;
+		kernels = (enum kernels)k;
+#endif
+		u64 state = 1;
+		for (size_t i = 0; i < sizeof(fens) / sizeof(fens[0]); ++i) {
+			init_position(pos, fens[i]);
+			check_network(pos);
+			Move moves[TEST_MOVES_NB];
+			int moves_nb = 0;
+			while (moves_nb < TEST_MOVES_NB) {
+				struct move_with_score legal_moves[256];
+				const int legal_moves_nb = get_legal_moves(
+					legal_moves, MOVE_GEN_TYPE_ALL, pos);
+				if (!legal_moves_nb)
+					break;
+				const int j =
+					get_random(&state, 0,
+						   legal_moves_nb - 1);
+				moves[moves_nb] = legal_moves[j].move;
+				do_move(pos, moves[moves_nb++]);
+				check_network(pos);
+			}
+			while (moves_nb) {
+				undo_move(pos, moves[--moves_nb]);
+				check_network(pos);
+			}
+			free_position(pos);
+		}
+	}
+	free(pos);
+
+	network = saved_network;
+	enabled = saved_enabled;
+	select_kernels();
+	free(net);
+}
+
+static void check_network(Position *pos)
+{
+	i32 expected[2][NNUE_ACCUMULATOR_SIZE];
+	const int expected_score = evaluate_reference(pos, expected);
+	const int score = evaluate_nnue(pos);
+
+	Position *copy = malloc(sizeof(Position));
+	copy_position(copy, pos);
+	invalidate_accumulators(copy);
+	const int refreshed_score = evaluate_nnue(copy);
+	for (Color c = COLOR_WHITE; c <= COLOR_BLACK; ++c) {
+		const i16 *const values = pos->accumulator.values[c];
+		const i16 *const refreshed = copy->accumulator.values[c];
+		for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; ++i) {
+			TEST_ASSERT_MESSAGE(values[i] == refreshed[i],
+					    "Wrong incremental update.");
+			TEST_ASSERT_MESSAGE(refreshed[i] == expected[c][i],
+					    "Wrong refresh.");
+		}
+	}
+	free_position(copy);
+	free(copy);
+
+	TEST_ASSERT_MESSAGE(score == refreshed_score,
+			    "Wrong incremental evaluation.");
+	TEST_ASSERT_MESSAGE(score == expected_score, "Wrong evaluation.");
+}
+
+/*
+ * Computes the network without the accumulators of the position.
+ */
+static int evaluate_reference(const Position *pos,
+			      i32 values[2][NNUE_ACCUMULATOR_SIZE])
+{
+	for (Color c = COLOR_WHITE; c <= COLOR_BLACK; ++c) {
+		for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; ++i)
+			values[c][i] = network->feature_biases[i];
+		const Square king_sq = get_king_square(pos, c);
+		for (Square sq = A1; sq <= H8; ++sq) {
+			const Piece piece = get_piece_at(pos, sq);
+			if (piece == PIECE_NONE ||
+			    get_piece_type(piece) == PIECE_TYPE_KING)
+				continue;
+			const int index =
+				get_feature_index(c, king_sq, piece, sq);
+			for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; ++i)
+				values[c][i] +=
+					network->feature_weights[index][i];
+		}
+	}
+
+	u8 input[INPUT_SIZE];
+	const Color color = get_side_to_move(pos);
+	for (int i = 0; i < INPUT_SIZE; ++i) {
+		const Color c = i < NNUE_ACCUMULATOR_SIZE ? color : !color;
+		const i32 value = values[c][i % NNUE_ACCUMULATOR_SIZE];
+		input[i] = (u8)(value < 0		 ? 0 :
+				value > ACTIVATION_MAX ? ACTIVATION_MAX :
+							 value);
+	}
+	u8 hidden1[HIDDEN1_SIZE];
+	for (int i = 0; i < HIDDEN1_SIZE; ++i) {
+		i32 sum = network->hidden1_biases[i];
+		for (int j = 0; j < INPUT_SIZE; ++j)
+			sum += input[j] * network->hidden1_weights[i][j];
+		sum = sum < 0 ? 0 : sum >> WEIGHT_SHIFT;
+		hidden1[i] = (u8)(sum > ACTIVATION_MAX ? ACTIVATION_MAX : sum);
+	}
+	u8 hidden2[HIDDEN2_SIZE];
+	for (int i = 0; i < HIDDEN2_SIZE; ++i) {
+		i32 sum = network->hidden2_biases[i];
+		for (int j = 0; j < HIDDEN1_SIZE; ++j)
+			sum += hidden1[j] * network->hidden2_weights[i][j];
+		sum = sum < 0 ? 0 : sum >> WEIGHT_SHIFT;
+		hidden2[i] = (u8)(sum > ACTIVATION_MAX ? ACTIVATION_MAX : sum);
+	}
+	i32 output = network->output_bias;
+	for (int i = 0; i < HIDDEN2_SIZE; ++i)
+		output += hidden2[i] * network->output_weights[i];
+
+	const int score = output / OUTPUT_SCALE;
+	return score > MAX_SCORE  ? MAX_SCORE :
+	       score < -MAX_SCORE ? -MAX_SCORE :
+				    score;
+}
+
+/*
+ * The accumulators go both below 0 and above ACTIVATION_MAX, so the clipping
+ * is tested too.
+ */
+static void init_test_network(struct network *net)
+{
+	u64 state = 0x9e3779b97f4a7c15;
+	for (int i = 0; i < NNUE_ACCUMULATOR_SIZE; ++i)
+		net->feature_biases[i] = (i16)get_random(&state, -64, 64);
+	for (int i = 0; i < FEATURES_NB; ++i) {
+		for (int j = 0; j < NNUE_ACCUMULATOR_SIZE; ++j) {
+			net->feature_weights[i][j] =
+				(i16)get_random(&state, -32, 32);
+		}
+	}
+	for (int i = 0; i < HIDDEN1_SIZE; ++i) {
+		net->hidden1_biases[i] = get_random(&state, -4096, 4096);
+		for (int j = 0; j < INPUT_SIZE; ++j) {
+			net->hidden1_weights[i][j] =
+				(i8)get_random(&state, -8, 8);
+		}
+	}
+	for (int i = 0; i < HIDDEN2_SIZE; ++i) {
+		net->hidden2_biases[i] = get_random(&state, -4096, 4096);
+		for (int j = 0; j < HIDDEN1_SIZE; ++j) {
+			net->hidden2_weights[i][j] =
+				(i8)get_random(&state, -64, 64);
+		}
+	}
+	for (int i = 0; i < HIDDEN2_SIZE; ++i)
+		net->output_weights[i] = (i8)get_random(&state, -127, 127);
+	net->output_bias = get_random(&state, -1024, 1024);
+}
+
+/*
+ * Returns a number in [min, max] with xorshift64.
+ */
+static int get_random(u64 *state, int min, int max)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return min + (int)(*state % (u64)(max - min + 1));
+}
+#endif
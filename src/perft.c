@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2023 Sayu <mail@sayurc.moe>
+ *
+ * This file is part of Athena.
+ *
+ * Athena is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ * 
+ * Athena is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include <bit.h>
+#include <pos.h>
+#include <move.h>
+#include <movegen.h>
+#include <perft.h>
+
+#define DEPTH_BITS 8
+#define DEPTH_MASK ((1 << DEPTH_BITS) - 1)
+
+/*
+ * The entries pack the node count and the depth of the subtree in a single
+ * word. The key is the hash of the position XORed with that word, so an entry
+ * that was written by two threads at the same time doesn't match any position
+ * and is just a miss.
+ */
+struct perft_entry {
+	u64 key;
+	u64 data;
+};
+
+/*
+ * The number of entries is a power of two so the index is just the lower bits
+ * of the hash. A table without entries is never probed.
+ */
+struct perft_table {
+	struct perft_entry *entries;
+	size_t mask;
+};
+
+/*
+ * The root moves are split between the threads: each one takes the next move
+ * that wasn't searched yet until there are no moves left. All the threads
+ * share the same hash table.
+ */
+struct shared_data {
+	const struct move_with_score *moves;
+	u64 *nodes;
+	int moves_nb;
+	int depth;
+	atomic_int next_move;
+	struct perft_table table;
+};
+
+struct worker {
+	Position pos;
+	struct shared_data *shared;
+};
+
+static void *run_worker(void *worker);
+static u64 count_nodes(Position *pos, int depth, struct perft_table *table);
+static bool probe_table(u64 *nodes, const struct perft_table *table, u64 hash,
+			int depth);
+static void store_in_table(struct perft_table *table, u64 hash, int depth,
+			   u64 nodes);
+static void init_table(struct perft_table *table, size_t size);
+
+/*
+ * Counts the leaves of the game tree with the given depth, using the given
+ * number of threads and a hash table with the given size in MiB. If the size is
+ * 0 no table is used. The position is left unchanged.
+ *
+ * If divide_sender is not NULL it is called with each root move and the number
+ * of leaves under it, in the order the moves were generated.
+ */
+u64 perft(Position *pos, int depth, int threads, size_t hash_size,
+	  void (*divide_sender)(Move, u64))
+{
+	if (depth <= 0)
+		return 1;
+
+	struct move_with_score moves[256];
+	const int len = get_legal_moves(moves, MOVE_GEN_TYPE_ALL, pos);
+
+	struct shared_data shared;
+	shared.moves = moves;
+	shared.moves_nb = len;
+	shared.depth = depth;
+	atomic_init(&shared.next_move, 0);
+	init_table(&shared.table, hash_size);
+	shared.nodes = malloc((size_t)len * sizeof(*shared.nodes));
+
+	if (threads > len)
+		threads = len;
+	if (threads < 1)
+		threads = 1;
+	struct worker *const workers =
+		malloc((size_t)threads * sizeof(*workers));
+	pthread_t *const helpers = malloc((size_t)threads * sizeof(*helpers));
+	if ((len && !shared.nodes) || !workers || !helpers) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	for (int i = 0; i < threads; ++i) {
+		copy_position(&workers[i].pos, pos);
+		workers[i].shared = &shared;
+	}
+
+	/* If a helper thread can't be created the remaining moves are searched
+	 * by the threads we already have. */
+	int helpers_nb = 0;
+	for (int i = 1; i < threads; ++i) {
+		if (pthread_create(&helpers[helpers_nb], NULL, run_worker,
+				   &workers[i])) {
+			perror("Athena");
+			break;
+		}
+		++helpers_nb;
+	}
+	run_worker(&workers[0]);
+	for (int i = 0; i < helpers_nb; ++i) {
+		if (pthread_join(helpers[i], NULL)) {
+			fprintf(stderr, "Internal error.\n");
+			exit(1);
+		}
+	}
+
+	u64 nodes = 0;
+	for (int i = 0; i < len; ++i) {
+		nodes += shared.nodes[i];
+		if (divide_sender)
+			divide_sender(moves[i].move, shared.nodes[i]);
+	}
+
+	for (int i = 0; i < threads; ++i)
+		free_position(&workers[i].pos);
+	free(helpers);
+	free(workers);
+	free(shared.nodes);
+	free(shared.table.entries);
+
+	return nodes;
+}
+
+static void *run_worker(void *worker)
+{
+	struct worker *const w = worker;
+	struct shared_data *const shared = w->shared;
+
+	int i = atomic_fetch_add(&shared->next_move, 1);
+	while (i < shared->moves_nb) {
+		const Move move = shared->moves[i].move;
+		do_move(&w->pos, move);
+		shared->nodes[i] =
+			count_nodes(&w->pos, shared->depth - 1, &shared->table);
+		undo_move(&w->pos, move);
+		i = atomic_fetch_add(&shared->next_move, 1);
+	}
+
+	return NULL;
+}
+
+/*
+ * At depth 1 the leaves are just the legal moves, so we count them without
+ * making them. The subtrees at depth 1 are too cheap to be worth an entry in
+ * the table.
+ */
+static u64 count_nodes(Position *pos, int depth, struct perft_table *table)
+{
+	if (!depth)
+		return 1;
+
+	const u64 hash = get_position_hash(pos);
+	u64 nodes;
+	if (depth > 1 && probe_table(&nodes, table, hash, depth))
+		return nodes;
+
+	struct move_with_score moves[256];
+	const int len = get_legal_moves(moves, MOVE_GEN_TYPE_ALL, pos);
+	if (depth == 1)
+		return (u64)len;
+
+	nodes = 0;
+	for (int i = 0; i < len; ++i) {
+		const Move move = moves[i].move;
+		do_move(pos, move);
+		nodes += count_nodes(pos, depth - 1, table);
+		undo_move(pos, move);
+	}
+	store_in_table(table, hash, depth, nodes);
+
+	return nodes;
+}
+
+static bool probe_table(u64 *nodes, const struct perft_table *table, u64 hash,
+			int depth)
+{
+	if (!table->entries)
+		return false;
+
+	const struct perft_entry *const entry = &table->entries[hash &
+								table->mask];
+	const u64 data = entry->data;
+	if ((entry->key ^ data) != hash || (int)(data & DEPTH_MASK) != depth)
+		return false;
+	*nodes = data >> DEPTH_BITS;
+	return true;
+}
+
+/*
+ * The entries are always replaced. The subtrees closer to the root are bigger
+ * but much less frequent, so the table is mostly filled by the small ones
+ * either way.
+ */
+static void store_in_table(struct perft_table *table, u64 hash, int depth,
+			   u64 nodes)
+{
+	if (!table->entries)
+		return;
+
+	struct perft_entry *const entry = &table->entries[hash & table->mask];
+	const u64 data = nodes << DEPTH_BITS | (u64)depth;
+	entry->key = hash ^ data;
+	entry->data = data;
+}
+
+/*
+ * The table gets the largest power of two number of entries that fits in the
+ * given size in MiB.
+ */
+static void init_table(struct perft_table *table, size_t size)
+{
+	table->entries = NULL;
+	table->mask = 0;
+	if (!size)
+		return;
+
+	size_t capacity = 1;
+	while (2 * capacity * sizeof(struct perft_entry) <= size * 1048576)
+		capacity *= 2;
+	table->entries = calloc(capacity, sizeof(struct perft_entry));
+	if (!table->entries) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	table->mask = capacity - 1;
+}
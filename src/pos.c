@@ -29,6 +29,8 @@
 #include <pos.h>
 #include <move.h>
 #include <movegen.h>
+#include <eval.h>
+#include <nnue.h>
 
 /*
  * The piece placement is stored in two formats, in piece-centric bitboard
@@ -293,6 +295,15 @@ static int zobrist_piece_table[] = {
 	[PIECE_BLACK_KING] = 10,  [PIECE_WHITE_KING] = 11,
 };
 
+/*
+ * How much each piece contributes to the game phase, see get_phase.
+ */
+static const int phase_weights[] = {
+	[PIECE_TYPE_PAWN] = 0, [PIECE_TYPE_KNIGHT] = 1,
+	[PIECE_TYPE_BISHOP] = 1, [PIECE_TYPE_ROOK] = 2,
+	[PIECE_TYPE_QUEEN] = 4, [PIECE_TYPE_KING] = 0,
+};
+
 /*
  * Check if ch is one of the characters in str, where str is a string containing
  * all characters to be checked and not separated by space.
@@ -351,7 +362,18 @@ static u64 hash_irreversible_part(const Position *pos)
 
 u64 get_position_hash(const Position *pos)
 {
-	return pos->hash ^ pos->irr_states[pos->irr_state_idx].hash;
+	return pos->irr_states[pos->irr_state_idx].hash;
+}
+
+/*
+ * Returns the key of the position in Polyglot opening books. The Zobrist keys
+ * are the random numbers of Polyglot in the same order, and like Polyglot we
+ * only hash the en passant file when a pawn of the side to move can capture, so
+ * the key is the hash of the position itself.
+ */
+u64 get_polyglot_key(const Position *pos)
+{
+	return get_position_hash(pos);
 }
 
 static size_t parse_pieces(Position *pos, const char *str)
@@ -536,6 +558,22 @@ static size_t parse_fen(Position *pos, const char *fen)
 	return rc;
 }
 
+/*
+ * Changes the capacity of the stack of irreversible states. The states past the
+ * new capacity are lost.
+ */
+static void resize_irreversible_states(Position *pos, size_t cap)
+{
+	struct irreversible_state *states =
+		realloc(pos->irr_states, cap * sizeof(*states));
+	if (!states) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	pos->irr_states = states;
+	pos->irr_state_cap = cap;
+}
+
 /*
  * This function returns a number between 0 and 256 representing the game phase
  * where 0 is the initial phase and 256 is the final phase. This approach of
@@ -543,29 +581,61 @@ static size_t parse_fen(Position *pos, const char *fen)
  */
 int get_phase(const Position *pos)
 {
-	const int weights[] = { [PIECE_TYPE_PAWN] = 0,
-				[PIECE_TYPE_KNIGHT] = 1,
-				[PIECE_TYPE_BISHOP] = 1,
-				[PIECE_TYPE_ROOK] = 2,
-				[PIECE_TYPE_QUEEN] = 4 };
-	const int neutral =
-		16 * weights[PIECE_TYPE_PAWN] + 4 * weights[PIECE_TYPE_KNIGHT] +
-		4 * weights[PIECE_TYPE_BISHOP] + 4 * weights[PIECE_TYPE_ROOK] +
-		2 * weights[PIECE_TYPE_QUEEN];
-
-	int phase = neutral;
+	const int neutral = 16 * phase_weights[PIECE_TYPE_PAWN] +
+			    4 * phase_weights[PIECE_TYPE_KNIGHT] +
+			    4 * phase_weights[PIECE_TYPE_BISHOP] +
+			    4 * phase_weights[PIECE_TYPE_ROOK] +
+			    2 * phase_weights[PIECE_TYPE_QUEEN];
+
+	const int phase = neutral - pos->phase_weight;
+	return (256 * phase + (neutral / 2)) / neutral;
+}
 
-	for (Color c = COLOR_WHITE; c <= COLOR_BLACK; ++c) {
-		for (PieceType pt = PIECE_TYPE_PAWN; pt <= PIECE_TYPE_QUEEN;
-		     ++pt) {
-			Piece piece = create_piece(pt, c);
-			int num = get_number_of_pieces(pos, piece);
-			phase -= num * weights[pt];
-		}
-	}
-	phase = (256 * phase + (neutral / 2)) / neutral;
+/*
+ * Returns the Zobrist key of the pawn structure. It is the XOR of the keys of
+ * the pawns only, so positions with the same pawns on the same squares have
+ * the same key regardless of the other pieces.
+ */
+u64 get_pawn_hash(const Position *pos)
+{
+	return pos->pawn_hash;
+}
 
-	return phase;
+/*
+ * Returns the bitboard of the enemy pieces giving check to the side to move.
+ */
+u64 get_checkers(const Position *pos)
+{
+	return pos->irr_states[pos->irr_state_idx].checkers;
+}
+
+/*
+ * Returns the bitboard of the pieces of the side to move that can't leave the
+ * line between their king and an enemy slider without exposing the king.
+ */
+u64 get_pinned_pieces(const Position *pos)
+{
+	return pos->irr_states[pos->irr_state_idx].pinned;
+}
+
+/*
+ * The check information is part of the irreversible state, so it's restored
+ * for free when a move is undone. It's set by update_check_info after every
+ * move.
+ */
+void set_check_info(Position *pos, u64 checkers, u64 pinned)
+{
+	pos->irr_states[pos->irr_state_idx].checkers = checkers;
+	pos->irr_states[pos->irr_state_idx].pinned = pinned;
+}
+
+/*
+ * Returns the sum of the material and piece-square table values of all the
+ * pieces on the board from white's point of view.
+ */
+int get_psqt_score(const Position *pos, bool middle_game)
+{
+	return middle_game ? pos->mg_psqt : pos->eg_psqt;
 }
 
 /*
@@ -605,6 +675,28 @@ bool pos_equal(const Position *pos1, const Position *pos2)
 	return true;
 }
 
+/*
+ * Returns true if the position has the same key as an earlier position of the
+ * game. Only the positions since the last capture or pawn move can be the same,
+ * and only every other one has the same side to move, so we just look at those.
+ * The position two plies before can never be the same either, so we start four
+ * plies before.
+ */
+bool is_repetition(const Position *pos)
+{
+	const size_t idx = pos->irr_state_idx;
+	const u64 hash = pos->irr_states[idx].hash;
+	size_t end = pos->irr_states[idx].halfmove_clock;
+	if (end > idx)
+		end = idx;
+
+	for (size_t i = 4; i <= end; i += 2) {
+		if (pos->irr_states[idx - i].hash == hash)
+			return true;
+	}
+	return false;
+}
+
 void decrement_fullmove_counter(Position *pos)
 {
 	--pos->fullmove_counter;
@@ -675,7 +767,7 @@ void add_castling(Position *pos, Color c, CastlingSide side)
 
 void flip_side_to_move(Position *pos)
 {
-	pos->hash ^= zobrist_side[0];
+	pos->irr_states[pos->irr_state_idx].hash ^= zobrist_side[0];
 
 	if (pos->side_to_move == COLOR_WHITE)
 		pos->side_to_move = COLOR_BLACK;
@@ -689,6 +781,32 @@ void set_captured_piece(Position *pos, Piece piece)
 	pos->irr_states[idx].captured_piece = (u8)piece;
 }
 
+/*
+ * Returns the value XORed into the position hash when the piece is placed on or
+ * removed from the square.
+ */
+u64 get_piece_square_hash(Piece piece, Square sq)
+{
+	return zobrist_piece[64 * zobrist_piece_table[piece] + (int)sq];
+}
+
+/*
+ * Returns the value XORed into the position hash when the side to move changes.
+ */
+u64 get_side_to_move_hash(void)
+{
+	return zobrist_side[0];
+}
+
+/*
+ * Returns the value XORed into the position hash when en passant becomes
+ * possible or impossible on the file.
+ */
+u64 get_en_passant_hash(File file)
+{
+	return zobrist_en_passant[file];
+}
+
 /*
  * Remove a piece from a square.
  */
@@ -698,8 +816,14 @@ void remove_piece(Position *pos, Square sq)
 	if (piece == PIECE_NONE)
 		return;
 
-	const int zobrist_idx = 64 * zobrist_piece_table[piece] + (int)sq;
-	pos->hash ^= zobrist_piece[zobrist_idx];
+	pos->irr_states[pos->irr_state_idx].hash ^=
+		get_piece_square_hash(piece, sq);
+	if (get_piece_type(piece) == PIECE_TYPE_PAWN)
+		pos->pawn_hash ^= get_piece_square_hash(piece, sq);
+	pos->mg_psqt -= get_piece_square_value(piece, sq, true);
+	pos->eg_psqt -= get_piece_square_value(piece, sq, false);
+	pos->phase_weight -= phase_weights[get_piece_type(piece)];
+	remove_from_accumulators(pos, piece, sq);
 
 	const u64 bb = U64(0x1) << sq;
 	pos->color_bb[get_piece_color(piece)] &= ~bb;
@@ -726,8 +850,14 @@ void place_piece(Position *pos, Square sq, Piece piece)
 		remove_piece(pos, sq);
 
 	const u64 bb = U64(0x1) << sq;
-	const int zobrist_idx = 64 * zobrist_piece_table[piece] + (int)sq;
-	pos->hash ^= zobrist_piece[zobrist_idx];
+	pos->irr_states[pos->irr_state_idx].hash ^=
+		get_piece_square_hash(piece, sq);
+	if (get_piece_type(piece) == PIECE_TYPE_PAWN)
+		pos->pawn_hash ^= get_piece_square_hash(piece, sq);
+	pos->mg_psqt += get_piece_square_value(piece, sq, true);
+	pos->eg_psqt += get_piece_square_value(piece, sq, false);
+	pos->phase_weight += phase_weights[get_piece_type(piece)];
+	add_to_accumulators(pos, piece, sq);
 
 	pos->color_bb[get_piece_color(piece)] |= bb;
 	pos->type_bb[get_piece_type(piece)] |= bb;
@@ -979,18 +1109,39 @@ void start_new_irreversible_state(Position *pos)
 {
 	pos->irr_state_idx += 1;
 	size_t idx = pos->irr_state_idx;
-	if (idx == POSITION_STACK_CAPACITY) {
-		fprintf(stderr, "Error.");
-		exit(1);
-	}
+	if (idx == pos->irr_state_cap)
+		resize_irreversible_states(pos, 2 * pos->irr_state_cap);
 	pos->irr_states[idx] = pos->irr_states[idx - 1];
 }
 
+/*
+ * Makes copy a deep copy of pos. Only the states up to the current one are
+ * copied, and the copy has room for POSITION_STACK_RESERVE more states before
+ * its stack has to grow. The copy must not own a stack already, otherwise it is
+ * leaked.
+ */
 void copy_position(Position *copy, const Position *pos)
 {
-	memcpy(copy, pos, sizeof(Position));
+	const size_t len = pos->irr_state_idx + 1;
+
+	*copy = *pos;
+	copy->irr_states = NULL;
+	copy->irr_state_cap = 0;
+	resize_irreversible_states(copy, len + POSITION_STACK_RESERVE);
 	memcpy(copy->irr_states, pos->irr_states,
-	       copy->irr_state_cap * sizeof(struct irreversible_state));
+	       len * sizeof(struct irreversible_state));
+}
+
+/*
+ * Releases the stack of irreversible states. The position can't be used after
+ * this unless it is initialized again.
+ */
+void free_position(Position *pos)
+{
+	free(pos->irr_states);
+	pos->irr_states = NULL;
+	pos->irr_state_cap = 0;
+	pos->irr_state_idx = 0;
 }
 
 /*
@@ -1003,6 +1154,10 @@ void copy_position(Position *copy, const Position *pos)
  * it is possible to set up a position using a FEN string that describes a board
  * with 9 pawns. This is intentional, as the user might want to set up a
  * non-standard board.
+ *
+ * The position must not own a stack of irreversible states, it gets a new one
+ * that has to be released with free_position. If the FEN is invalid the stack
+ * is released before returning.
  */
 int init_position(Position *pos, const char *fen)
 {
@@ -1011,8 +1166,10 @@ int init_position(Position *pos, const char *fen)
 		exit(1);
 	}
 
-	pos->irr_state_cap = 2048;
+	pos->irr_states = NULL;
+	pos->irr_state_cap = 0;
 	pos->irr_state_idx = 0;
+	resize_irreversible_states(pos, POSITION_STACK_RESERVE);
 
 	pos->fullmove_counter = 0;
 	pos->irr_states[pos->irr_state_idx].captured_piece = PIECE_NONE;
@@ -1028,13 +1185,21 @@ int init_position(Position *pos, const char *fen)
 		pos->type_bb[i] = 0;
 	for (size_t i = 0; i < 2; ++i)
 		pos->color_bb[i] = 0;
+	pos->mg_psqt = 0;
+	pos->eg_psqt = 0;
+	pos->phase_weight = 0;
+	pos->pawn_hash = 0;
+	invalidate_accumulators(pos);
 
 	size_t rc = parse_fen(pos, fen);
-	if (rc != strlen(fen))
+	if (rc != strlen(fen)) {
+		free_position(pos);
 		return 1;
+	}
 
-	pos->hash = hash_reversible_part(pos);
-	pos->irr_states[pos->irr_state_idx].hash = hash_irreversible_part(pos);
+	pos->irr_states[pos->irr_state_idx].hash =
+		hash_reversible_part(pos) ^ hash_irreversible_part(pos);
+	update_check_info(pos);
 
 	return 0;
 }
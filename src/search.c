@@ -16,6 +16,7 @@
  * this program. If not, see <https://www.gnu.org/licenses/>. 
  */
 
+#include <limits.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -35,18 +36,34 @@
 #include <movegen.h>
 #include <eval.h>
 #include <tt.h>
+#include <tb.h>
 #include <search.h>
 
 #define MAX_DEPTH 256
 #define MAX_PLY MAX_DEPTH
-#define MAX_PREVIOUS_POSITIONS POSITION_STACK_CAPACITY
+/* A tablebase win found at the root. The wins found deeper are worth less, and
+ * they are all below the mate scores since a mate is surer than a table. */
+#define TB_WIN (INF - 2 * MAX_PLY)
 
 #define FUTILITY_FACTOR 150
 #define NULL_MOVE_MINIMUM_DEPTH 5
 #define NULL_MOVE_REDUCTION 4
 #define LMR_DEPTH_THRESHOLD 4
 #define LMR_MOVE_THRESHOLD 5
+/* The reduction table stops growing at this depth and number of moves. */
+#define LMR_TABLE_SIZE 64
+#define LMR_HISTORY_DIVISOR 8192
+#define LMP_MAXIMUM_DEPTH 8
 #define QS_SEE_PRUNING_SCORE_MARGIN 100
+#define ASPIRATION_MINIMUM_DEPTH 4
+#define ASPIRATION_WINDOW 25
+/* The soft and hard time limits in percents of the optimal time. An iteration
+ * that starts before the soft limit usually ends after it, so the soft limit is
+ * below the optimal time to spend about the optimal time on average. */
+#define SOFT_TIME_PERCENT 70
+#define HARD_TIME_PERCENT 300
+/* We assume an iteration takes at most this many times the previous one. */
+#define ITERATION_TIME_FACTOR 2
 
 enum node_type {
 	NODE_TYPE_ROOT,
@@ -61,195 +78,640 @@ enum node_type {
  */
 struct stack_element {
 	int ply;
-	u64 position_hash;
 	/* These are quiet moves that cause a beta-cutoff, A.K.A killer
 	 * moves. We only store at most two moves at a time, and both must be
 	 * distinct. If a new move is added one is discarded. If refutations[i]
 	 * is 0 then this element is empty. */
 	Move refutations[2];
-	/* If this is true then the last move played from this node was a null
-	 * move. */
-	bool current_move_is_null;
+	/* The last move played from this node and the piece that moved, the
+	 * move is 0 if it was a null move. The continuation history of the
+	 * move is also kept so the nodes below can use it, it's NULL for null
+	 * moves. */
+	Move current_move;
+	Piece moved_piece;
+	PieceToHistory *continuation_history;
 };
 
-#ifdef SEARCH_STATISTICS
-struct iteration_statistics {
-	long long nodes;
-	long long quiescence_nodes;
+/*
+ * A principal variation, the moves the search expects to be played from a
+ * node on.
+ */
+struct pv_line {
+	int length;
+	Move moves[MAX_PLY];
+};
+
+/*
+ * One of the best lines from the root found by a MultiPV search.
+ */
+struct root_line {
+	int score;
+	struct pv_line pv;
 };
-#endif
+
+struct shared_data;
 
 /*
  * This is the state of the search. The value running points to may be modified
  * by the caller to signal that the search should stop.
+ *
+ * Each search thread has its own state, the thread with id 0 is the main
+ * thread. The nodes counter is only written by the thread that owns the state
+ * but the main thread reads the counters of all threads to report the total, so
+ * it is accessed with relaxed atomic operations.
  */
 struct state {
 	Position pos;
+	int id;
+	struct shared_data *shared;
 	Move best_move;
+	/* The second move of the PV of the last completed iteration. */
+	Move ponder_move;
 	int completed_depth;
-	long long nodes; /* All nodes, including quiescence nodes. */
-#ifdef SEARCH_STATISTICS
-	long long quiescence_nodes;
-	FILE *log_file;
-#endif
+	/* The PV of the node at each ply, it's built from the bottom up by
+	 * copying the PV of the child at the next ply. */
+	struct pv_line *pv_table;
+	/* The best moves already found by the current iteration, which are
+	 * skipped at the root. */
+	Move excluded_moves[MAX_MULTIPV];
+	int excluded_moves_nb;
+	atomic_llong nodes; /* All nodes, including quiescence nodes. */
+	struct search_statistics *stats;
 	struct timespec start_time;
 	atomic_bool *stop;
-	int previous_positions_nb;
-	/* These are the hashes of the positions before the search. This
-	 * excludes the position of the root node. */
-	u64 previous_positions_hashes[MAX_PREVIOUS_POSITIONS];
 	int (*butterfly_history)[64][64];
+	PieceToHistory (*continuation_history)[64];
+	Move (*counter_moves)[64];
+	struct pawn_table *pawn_table;
 };
 
 /*
  * All searches need a depth, for infinite searches we just set the depth to a
- * very high number. It is a mate search only if mate > 0. And if there is no
- * time limit limited_time is set to false.
+ * very high number. It is a mate search only if mate > 0. The search stops
+ * after nodes nodes, which is LLONG_MAX when there is no node limit. And if
+ * there is no time limit limited_time is set to false.
+ *
+ * The times are in milliseconds since start_time. The search is stopped as soon
+ * as the hard time is reached, while the soft time is only checked between
+ * iterations and is scaled by how stable the best move is. With a fixed move
+ * time there is no soft time and adaptive_time is false. While the value ponder
+ * points to is true the time limits are ignored, ponder is NULL if the search
+ * can't ponder.
  */
 struct limits {
 	int depth;
 	int mate;
-	struct timespec stop_time;
+	long long nodes;
+	struct timespec start_time;
+	long long soft_time;
+	long long hard_time;
 	bool limited_time;
+	bool adaptive_time;
+	const atomic_bool *ponder;
+};
+
+/*
+ * The search uses Lazy SMP: all threads search the same root position and only
+ * communicate through the transposition table. The threads finish iterations at
+ * different times and the entries one thread stores change the move ordering
+ * and the cutoffs of the others, which makes them explore different parts of
+ * the tree. Only the main thread talks to the caller, the helper threads exist
+ * just to fill the transposition table.
+ */
+struct shared_data {
+	const struct search_argument *arg;
+	struct limits limits;
+	struct state *states;
+	int threads_nb;
+	/* The moves searched at the root when the tablebases rule out some
+	 * of them, there is no restriction when root_moves_nb is 0. */
+	Move root_moves[256];
+	int root_moves_nb;
 };
 
+static void *helper_search(void *state);
+static Move iterative_deepening(struct state *state);
+static Move get_ponder_move(struct state *state, Move best_move);
+static int aspiration_search(struct state *state, struct stack_element *stack,
+			     struct limits *limits, int depth,
+			     int previous_score, int multipv,
+			     const struct timespec *t1, long long old_nodes);
+static void send_info(const struct state *state, int depth, int score,
+		      enum info_flag bound_flag, int multipv,
+		      const struct pv_line *pv, const struct timespec *t1,
+		      long long old_nodes);
+static int count_root_lines(struct state *state);
+static void sort_root_lines(struct root_line *lines, int lines_nb);
+static bool is_excluded_move(const struct state *state, Move move);
+static void filter_root_moves_with_tb(struct shared_data *shared);
+static void update_pv(struct state *state, int ply, Move move);
 static int negamax(enum node_type node_type, struct state *state,
 		   struct stack_element *stack, struct limits *limits,
 		   int alpha, int beta, int depth);
 static int qsearch(enum node_type node_type, struct state *state,
 		   struct stack_element *stack, struct limits *limits,
 		   int alpha, int beta, int depth);
-static void update_history(struct state *state, Move move, Move *quiet_moves,
-			   int quiet_moves_nb, Color side, int depth);
+static void update_history(struct state *state,
+			   const struct stack_element *stack, Move move,
+			   Move *quiet_moves, int quiet_moves_nb, Color side,
+			   int depth);
+static int scale_history_bonus(int old_value, int bonus);
+static Move get_counter_move(const struct state *state,
+			     const struct stack_element *stack);
 static bool is_zugzwang_unlikely(const Position *pos);
 static void add_refutation(struct stack_element *stack, Move move);
-static bool is_repetition(const struct state *state,
-			  const struct stack_element *stack_top);
+static bool probe_tablebase(int *score, struct state *state, int ply);
 static bool is_mate_score(int score);
 static int tt_score_to_score(int score, int ply);
 static int score_to_tt_score(int score, int ply);
-static void init_stack(struct stack_element *stack, int capacity,
-		       const struct state *state);
+static void init_stack(struct stack_element *stack, int capacity);
 static void init_limits(struct limits *limits,
-			const struct search_argument *arg);
-static void init_state(struct state *state, struct search_argument *arg);
+			const struct search_argument *arg,
+			const Position *pos);
+static void init_state(struct state *state, struct shared_data *shared,
+		       int id);
+static void increment_nodes(struct state *state);
+static long long get_nodes(const struct state *state);
+static long long get_total_nodes(const struct shared_data *shared);
 static int max(int a, int b);
+static int min(int a, int b);
+static int get_reduction(int depth, int moves_cnt);
+static int get_late_move_count(int depth);
 static long long compute_nps(const struct timespec *t1,
 			     const struct timespec *t2, long long nodes);
 static long long timespec_to_milliseconds(const struct timespec *ts);
 static struct timespec compute_elapsed_time(const struct timespec *t1,
 					    const struct timespec *t2);
-static bool time_is_up(const struct timespec *stop_time);
+static long long get_elapsed_time(const struct limits *limits);
+static bool time_is_up(const struct limits *limits);
+static bool is_pondering(const struct limits *limits);
+static bool should_stop(const struct state *state,
+			const struct limits *limits);
+static bool should_stop_iterating(const struct limits *limits,
+				  long long iteration_time, int stability);
 static bool is_in_check(const Position *pos);
-static void add_time(struct timespec *ts, long long time);
 static long long compute_search_time(const Position *pos, long long time,
-				     int movestogo);
-#ifdef SEARCH_STATISTICS
-static void log_position(FILE *fp, const Position *pos);
-static void log_iteration_statistics(FILE *fp, int depth,
-				     const struct iteration_statistics *stats);
-#endif
+				     long long inc, int movestogo);
+
+/*
+ * Base reductions of LMR indexed by depth and number of moves searched. The
+ * reduction grows logarithmically with both.
+ */
+static int reductions[LMR_TABLE_SIZE][LMR_TABLE_SIZE];
 
+/*
+ * Initializes the tables of the search, it must be called once before the
+ * first search.
+ */
+void search_init(void)
+{
+	for (int depth = 1; depth < LMR_TABLE_SIZE; ++depth) {
+		for (int moves = 1; moves < LMR_TABLE_SIZE; ++moves)
+			reductions[depth][moves] =
+				(int)(log(depth * moves) / 2.);
+	}
+}
+
+/*
+ * Searches the position of the argument and sends the best move. It can be the
+ * start routine of a thread or be called directly, it always returns NULL.
+ */
 void *search(void *search_arg)
 {
 	struct search_argument *arg = (struct search_argument *)search_arg;
 
-	struct state *const state = malloc(sizeof(struct state));
-	init_state(state, arg);
+	increment_tt_generation();
+
+	struct shared_data shared;
+	shared.arg = arg;
+	shared.threads_nb = arg->threads;
+	shared.states =
+		malloc((size_t)shared.threads_nb * sizeof(*shared.states));
+	pthread_t *const helpers =
+		malloc((size_t)shared.threads_nb * sizeof(*helpers));
+	if (!shared.states || !helpers) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	for (int i = 0; i < shared.threads_nb; ++i)
+		init_state(&shared.states[i], &shared, i);
+	init_limits(&shared.limits, arg, &shared.states[0].pos);
+	filter_root_moves_with_tb(&shared);
+
+	/* If a helper thread can't be created we just search with the threads
+	 * we already have. */
+	int helpers_nb = 0;
+	for (int i = 1; i < shared.threads_nb; ++i) {
+		if (pthread_create(&helpers[helpers_nb], NULL, helper_search,
+				   &shared.states[i])) {
+			perror("Athena");
+			break;
+		}
+		++helpers_nb;
+	}
 
-	struct stack_element stack[MAX_PLY + 1];
-	init_stack(stack, sizeof(stack) / sizeof(stack[0]), state);
+	const Move best_move = iterative_deepening(&shared.states[0]);
+	const Move ponder_move = get_ponder_move(&shared.states[0], best_move);
 
-	struct limits limits;
-	init_limits(&limits, arg);
+	/* The helper threads only stop by themselves when they reach the depth
+	 * limit, so we have to tell them the main thread is done. */
+	*arg->stop = true;
+	for (int i = 0; i < helpers_nb; ++i) {
+		if (pthread_join(helpers[i], NULL)) {
+			fprintf(stderr, "Internal error.\n");
+			exit(1);
+		}
+	}
 
-#ifdef SEARCH_STATISTICS
-	log_position(state.log_file, state.pos);
-#endif
+	for (int i = 0; i < shared.threads_nb; ++i)
+		arg->ctx[i].stats.nodes = get_nodes(&shared.states[i]);
+	if (arg->statistics_sender) {
+		struct search_statistics stats;
+		sum_search_statistics(&stats, arg->ctx, shared.threads_nb);
+		arg->statistics_sender(&stats);
+	}
+
+	/* Here best_move will always be a valid move because the negamax
+	 * function ensures that we search at least depth 1. */
+	arg->best_move_sender(best_move, ponder_move);
+
+	for (int i = 0; i < shared.threads_nb; ++i) {
+		free_position(&shared.states[i].pos);
+		free(shared.states[i].pv_table);
+	}
+	free(helpers);
+	free(shared.states);
+	return NULL;
+}
+
+void init_search_context(struct search_context *ctx)
+{
+	memset(ctx->butterfly_history, 0, sizeof(ctx->butterfly_history));
+	memset(ctx->continuation_history, 0,
+	       sizeof(ctx->continuation_history));
+	memset(ctx->counter_moves, 0, sizeof(ctx->counter_moves));
+	clear_pawn_table(&ctx->pawn_table);
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+}
+
+/*
+ * Adds up the statistics of the contexts of all the threads.
+ */
+void sum_search_statistics(struct search_statistics *total,
+			   const struct search_context *ctx, int threads_nb)
+{
+	memset(total, 0, sizeof(*total));
+	for (int i = 0; i < threads_nb; ++i) {
+		const struct search_statistics *const s = &ctx[i].stats;
+		total->nodes += s->nodes;
+		total->quiescence_nodes += s->quiescence_nodes;
+		total->tt_probes += s->tt_probes;
+		total->tt_hits += s->tt_hits;
+		total->tt_cutoffs += s->tt_cutoffs;
+		total->tb_hits += s->tb_hits;
+		total->null_move_prunes += s->null_move_prunes;
+		total->reverse_futility_prunes += s->reverse_futility_prunes;
+		total->futility_prunes += s->futility_prunes;
+		total->late_move_prunes += s->late_move_prunes;
+		total->lmr_researches += s->lmr_researches;
+		total->fail_highs += s->fail_highs;
+		total->first_move_fail_highs += s->first_move_fail_highs;
+		total->qsearch_see_prunes += s->qsearch_see_prunes;
+		total->illegal_moves += s->illegal_moves;
+	}
+}
+
+static void *helper_search(void *state)
+{
+	iterative_deepening(state);
+	return NULL;
+}
+
+/*
+ * Searches the root position with increasing depths until the depth limit is
+ * reached or the search is stopped, and returns the best move of the last
+ * completed iteration. Only the main thread sends information about the
+ * iterations.
+ *
+ * With MultiPV each iteration searches the root once for each line, skipping
+ * the best moves of the lines already searched in the iteration, so the lines
+ * come out from the best to the worst. The helper threads only search one line.
+ *
+ * Half of the helper threads start at depth 2 so that the threads are not all
+ * searching the same depth at the same time.
+ */
+static Move iterative_deepening(struct state *state)
+{
+	struct limits *limits = &state->shared->limits;
+
+	/* The root is the third element, the first two stand for the moves
+	 * before it so the nodes close to the root can look back two plies. */
+	struct stack_element stack_elements[MAX_PLY + 3];
+	init_stack(stack_elements,
+		   sizeof(stack_elements) / sizeof(stack_elements[0]));
+	struct stack_element *const stack = stack_elements + 2;
+
+	const int lines_nb = state->id ? 1 : count_root_lines(state);
+	struct root_line *const lines =
+		malloc((size_t)lines_nb * sizeof(*lines));
+	if (!lines) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	for (int i = 0; i < lines_nb; ++i) {
+		lines[i].score = 0;
+		lines[i].pv.length = 0;
+	}
 
 	Move best_move = 0;
-	for (int depth = 1; depth <= limits.depth; ++depth) {
+	/* Number of consecutive iterations that returned the same best move. */
+	int stability = 0;
+	for (int depth = 1 + state->id % 2; depth <= limits->depth; ++depth) {
 		struct timespec t1;
 		timespec_get(&t1, TIME_UTC);
 
-		const long long old_nodes = state->nodes;
-#ifdef SEARCH_STATISTICS
-		const long long old_qnodes = state.quiescence_nodes;
-#endif
+		const long long old_nodes = get_total_nodes(state->shared);
 
-		const int score = negamax(NODE_TYPE_ROOT, state, stack, &limits,
-					  -INF, INF, depth);
+		int line = 0;
+		for (; line < lines_nb; ++line) {
+			state->excluded_moves_nb = line;
+			const int score = aspiration_search(
+				state, stack, limits, depth, lines[line].score,
+				line + 1, &t1, old_nodes);
+			if (*state->stop)
+				break;
+			lines[line].score = score;
+			lines[line].pv = state->pv_table[0];
+			if (line + 1 < lines_nb)
+				state->excluded_moves[line] =
+					lines[line].pv.moves[0];
+		}
 		if (*state->stop) {
 			/* If the search stops in the first iteration we use
 			 * its best move anyway since we have no choice. */
-			if (depth == 1)
-				best_move = state->best_move;
+			if (!best_move)
+				best_move = line ? lines[0].pv.moves[0] :
+						   state->best_move;
 			break;
 		}
+		/* A later line can get a better score than the ones before it
+		 * since they were searched with different trees. */
+		sort_root_lines(lines, lines_nb);
+		state->completed_depth = depth;
+		const Move iteration_best_move =
+			lines[0].pv.length ? lines[0].pv.moves[0] : 0;
+		stability = iteration_best_move == best_move ? stability + 1 :
+							       0;
+		best_move = iteration_best_move;
+		state->ponder_move =
+			lines[0].pv.length > 1 ? lines[0].pv.moves[1] : 0;
+
+		if (state->id)
+			continue;
+
+		for (int i = 0; i < lines_nb; ++i)
+			send_info(state, depth, lines[i].score, 0, i + 1,
+				  &lines[i].pv, &t1, old_nodes);
 
 		struct timespec t2;
 		timespec_get(&t2, TIME_UTC);
+		const struct timespec iteration_time =
+			compute_elapsed_time(&t1, &t2);
+		if (should_stop_iterating(
+			    limits, timespec_to_milliseconds(&iteration_time),
+			    stability))
+			break;
+	}
 
-#ifdef SEARCH_STATISTICS
-		struct iteration_statistics stats;
-		stats.nodes = state.nodes - old_nodes;
-		stats.quiescence_nodes = state.quiescence_nodes - old_qnodes;
-		log_iteration_statistics(state.log_file, depth, &stats);
-#endif
+	free(lines);
+	return best_move;
+}
+
+/*
+ * Returns the expected reply to the best move. The PV is often cut short by the
+ * cutoffs of the transposition table, so when it doesn't have a second move we
+ * use the best move of the entry of the position after the best move, if there
+ * is one and it is legal.
+ */
+static Move get_ponder_move(struct state *state, Move best_move)
+{
+	if (!best_move)
+		return 0;
+	if (state->ponder_move)
+		return state->ponder_move;
+
+	Position *const pos = &state->pos;
+	Move ponder_move = 0;
+	do_move(pos, best_move);
+	NodeData tt_data;
+	if (get_tt_entry(&tt_data, pos) && tt_data.best_move &&
+	    move_is_pseudo_legal(tt_data.best_move, pos) &&
+	    move_is_legal(pos, tt_data.best_move))
+		ponder_move = tt_data.best_move;
+	undo_move(pos, best_move);
+	return ponder_move;
+}
+
+/*
+ * Searches the root with a window around the score of the previous iteration,
+ * since the score usually doesn't change much between iterations and a narrow
+ * window gives many more cutoffs. When the score falls outside the window the
+ * root is searched again with a wider window on that side until the score is
+ * exact. The first iterations and mate scores use the full window.
+ *
+ * The main thread reports each failed search as a bound of the given MultiPV
+ * line.
+ */
+static int aspiration_search(struct state *state, struct stack_element *stack,
+			     struct limits *limits, int depth,
+			     int previous_score, int multipv,
+			     const struct timespec *t1, long long old_nodes)
+{
+	int delta = ASPIRATION_WINDOW;
+	int alpha = -INF;
+	int beta = INF;
+	if (depth >= ASPIRATION_MINIMUM_DEPTH &&
+	    !is_mate_score(previous_score)) {
+		alpha = max(previous_score - delta, -INF);
+		beta = min(previous_score + delta, INF);
+	}
 
-		long long nps = compute_nps(&t1, &t2, state->nodes - old_nodes);
-		struct timespec time_since_start =
-			compute_elapsed_time(&state->start_time, &t2);
-
-		struct info info;
-		info.flags = INFO_FLAG_DEPTH;
-		info.flags |= INFO_FLAG_NODES;
-		info.flags |= INFO_FLAG_NPS;
-		info.flags |= INFO_FLAG_TIME;
-		info.depth = depth;
-		info.nodes = state->nodes;
-		info.nps = nps;
-		info.time = timespec_to_milliseconds(&time_since_start);
-		/* When the score is a mate score we use the mate flag instead
-		 * of the cp flag and extract the moves to mate from the score.
-		 */
-		if (score >= INF - MAX_PLY) {
-			info.flags |= INFO_FLAG_MATE;
-			info.mate = (INF - score + 1) / 2;
-		} else if (score <= -INF + MAX_PLY) {
-			info.flags |= INFO_FLAG_MATE;
-			info.mate = -(INF + score + 1) / 2;
+	while (true) {
+		const int score = negamax(NODE_TYPE_ROOT, state, stack, limits,
+					  alpha, beta, depth);
+		if (*state->stop)
+			return score;
+
+		/* A side of the window that is already full can't fail, the
+		 * score is -INF when the root is checkmated for example. */
+		enum info_flag bound_flag;
+		if (score <= alpha && alpha > -INF) {
+			/* After a fail low we also bring beta closer to the
+			 * new window since the score is probably lower. */
+			beta = (alpha + beta) / 2;
+			alpha = max(score - delta, -INF);
+			bound_flag = INFO_FLAG_UBOUND;
+		} else if (score >= beta && beta < INF) {
+			beta = min(score + delta, INF);
+			bound_flag = INFO_FLAG_LBOUND;
 		} else {
-			info.flags |= INFO_FLAG_CP;
-			info.cp = score;
+			return score;
 		}
-		arg->info_sender(&info);
+		if (!state->id)
+			send_info(state, depth, score, bound_flag, multipv,
+				  &state->pv_table[0], t1, old_nodes);
+		delta += delta / 2;
+	}
+}
 
-		best_move = state->best_move;
+/*
+ * Sends the result of a search of the root at the given depth that started at
+ * t1, when the search had searched old_nodes nodes. The bound flag is 0 if the
+ * score is exact. The PV is not sent if it's empty, which happens when the root
+ * fails low.
+ */
+static void send_info(const struct state *state, int depth, int score,
+		      enum info_flag bound_flag, int multipv,
+		      const struct pv_line *pv, const struct timespec *t1,
+		      long long old_nodes)
+{
+	struct timespec t2;
+	timespec_get(&t2, TIME_UTC);
+
+	const long long nodes = get_total_nodes(state->shared);
+	long long nps = compute_nps(t1, &t2, nodes - old_nodes);
+	struct timespec time_since_start =
+		compute_elapsed_time(&state->start_time, &t2);
+
+	struct info info;
+	info.flags = INFO_FLAG_DEPTH;
+	info.flags |= INFO_FLAG_NODES;
+	info.flags |= INFO_FLAG_NPS;
+	info.flags |= INFO_FLAG_TIME;
+	info.flags |= INFO_FLAG_MULTIPV;
+	info.flags |= bound_flag;
+	if (pv->length)
+		info.flags |= INFO_FLAG_PV;
+	info.depth = depth;
+	info.multipv = multipv;
+	info.pv = pv->moves;
+	info.pv_length = pv->length;
+	info.nodes = nodes;
+	info.nps = nps;
+	info.time = timespec_to_milliseconds(&time_since_start);
+	/* When the score is a mate score we use the mate flag instead of the
+	 * cp flag and extract the moves to mate from the score. */
+	if (score >= INF - MAX_PLY) {
+		info.flags |= INFO_FLAG_MATE;
+		info.mate = (INF - score + 1) / 2;
+	} else if (score <= -INF + MAX_PLY) {
+		info.flags |= INFO_FLAG_MATE;
+		info.mate = -(INF + score + 1) / 2;
+	} else {
+		info.flags |= INFO_FLAG_CP;
+		info.cp = score;
 	}
+	state->shared->arg->info_sender(&info);
+}
 
-	/* Here state.best_move will always be a valid move because the negamax
-	 * function ensures that we search at least depth 1. */
-	arg->best_move_sender(best_move);
-	*state->stop = true;
+/*
+ * Returns the number of MultiPV lines to search, which can't be more than the
+ * number of legal moves. There is always at least one line so the search still
+ * gives a score when there are no moves.
+ */
+static int count_root_lines(struct state *state)
+{
+	struct move_with_score moves[256];
+	const int moves_nb =
+		state->shared->root_moves_nb ?
+			state->shared->root_moves_nb :
+			get_legal_moves(moves, MOVE_GEN_TYPE_ALL, &state->pos);
+	const int multipv = state->shared->arg->multipv;
+	return max(min(multipv, moves_nb), 1);
+}
 
-	free(state);
-	pthread_exit(NULL);
+/*
+ * Sorts the lines from the highest score to the lowest, the lines with the same
+ * score keep their order.
+ */
+static void sort_root_lines(struct root_line *lines, int lines_nb)
+{
+	for (int i = 1; i < lines_nb; ++i) {
+		const struct root_line line = lines[i];
+		int j = i - 1;
+		for (; j >= 0 && lines[j].score < line.score; --j)
+			lines[j + 1] = lines[j];
+		lines[j + 1] = line;
+	}
 }
 
-void init_search_context(struct search_context *ctx)
+/*
+ * The moves excluded at the root are the best moves of the lines already
+ * searched in the iteration and the moves ruled out by the tablebases.
+ */
+static bool is_excluded_move(const struct state *state, Move move)
 {
-	memset(ctx->butterfly_history, 0, sizeof(ctx->butterfly_history));
+	for (int i = 0; i < state->excluded_moves_nb; ++i) {
+		if (state->excluded_moves[i] == move)
+			return true;
+	}
+	const struct shared_data *const shared = state->shared;
+	if (!shared->root_moves_nb)
+		return false;
+	for (int i = 0; i < shared->root_moves_nb; ++i) {
+		if (shared->root_moves[i] == move)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * When the root is in the tablebases only the moves that keep its result are
+ * searched, and when it is won only the ones that get closest to the next
+ * capture or pawn move, which the search alone could miss and then never make
+ * progress.
+ */
+static void filter_root_moves_with_tb(struct shared_data *shared)
+{
+	shared->root_moves_nb = 0;
+	Position *const pos = &shared->states[0].pos;
+	const int pieces_nb = get_number_of_pieces_of_color(pos, COLOR_WHITE) +
+			      get_number_of_pieces_of_color(pos, COLOR_BLACK);
+	if (pieces_nb > get_tb_largest())
+		return;
+
+	struct move_with_score moves[256];
+	const int moves_nb = get_legal_moves(moves, MOVE_GEN_TYPE_ALL, pos);
+	for (int i = 0; i < moves_nb; ++i)
+		shared->root_moves[i] = moves[i].move;
+	const int kept = filter_root_moves(shared->root_moves, moves_nb, pos);
+	shared->root_moves_nb = kept < moves_nb ? kept : 0;
+}
+
+/*
+ * The PV of the node at ply becomes the move followed by the PV of the child.
+ */
+static void update_pv(struct state *state, int ply, Move move)
+{
+	struct pv_line *const pv = &state->pv_table[ply];
+	const struct pv_line *const child_pv = &state->pv_table[ply + 1];
+	pv->moves[0] = move;
+	const int length = min(child_pv->length, MAX_PLY - 1);
+	memcpy(pv->moves + 1, child_pv->moves,
+	       (size_t)length * sizeof(pv->moves[0]));
+	pv->length = length + 1;
 }
 
 static int negamax(enum node_type node_type, struct state *state,
 		   struct stack_element *stack, struct limits *limits,
 		   int alpha, int beta, int depth)
 {
-	/* Only check time every 1024 nodes to avoid making system calls which
-	 * slows down the search. */
-	if (!(state->nodes % 1024) && limits->limited_time)
-		*state->stop = time_is_up(&limits->stop_time);
+	/* The PV of the parent takes the PV of this node, which stays empty if
+	 * we return before searching the moves. */
+	state->pv_table[stack->ply].length = 0;
+
+	if (should_stop(state, limits))
+		*state->stop = true;
 	/* Only stop when it is not the root node, this ensures we have a best
 	 * move to send. */
 	if (node_type != NODE_TYPE_ROOT && *state->stop)
@@ -261,42 +723,59 @@ static int negamax(enum node_type node_type, struct state *state,
 			       beta, depth);
 
 	Position *pos = &state->pos;
-	stack->position_hash = get_position_hash(pos);
 
 	/* We don't count the start position. */
 	if (node_type != NODE_TYPE_ROOT)
-		++state->nodes;
+		increment_nodes(state);
 
 	/* Here we enforce the three-fold repetition rule. Although the rule
 	 * says the player can claim a draw on the third repetition of the same
 	 * position, we consider the second repetition a draw because the third
-	 * is usually forced. */
-	if (is_repetition(state, stack))
+	 * is usually forced. The root is always searched so we have a move to
+	 * play even if the game already repeated. */
+	if (node_type != NODE_TYPE_ROOT && is_repetition(pos))
 		return 0;
 
-	/* TT lookup */
+	/* The positions in the tablebases have a known result, so they don't
+	 * have to be searched. The root is searched anyway for its best move,
+	 * with the moves chosen from the DTZ files. */
+	int tb_score;
+	if (node_type != NODE_TYPE_ROOT &&
+	    probe_tablebase(&tb_score, state, stack->ply))
+		return tb_score;
+
+	/* TT lookup. The PV nodes are always searched, since a cutoff would
+	 * leave their PV empty and cut the PV of the lines going through
+	 * them. */
 	bool found_tt_entry = false;
 	NodeData tt_data;
 	found_tt_entry = get_tt_entry(&tt_data, pos);
-	if (node_type != NODE_TYPE_ROOT && found_tt_entry &&
+	++state->stats->tt_probes;
+	state->stats->tt_hits += found_tt_entry;
+	if (node_type == NODE_TYPE_NON_PV && found_tt_entry &&
 	    tt_data.depth >= depth) {
 		const int score = tt_score_to_score(tt_data.score, stack->ply);
 		switch (tt_data.bound) {
 		case BOUND_EXACT:
+			++state->stats->tt_cutoffs;
 			return score;
 		case BOUND_LOWER:
 			/* If this score is a lower bound and it is greater than
 			 * or equal to beta then we are guaranteed a fail-high
 			 * in this node, so we prune this branch in advance. */
-			if (score >= beta)
+			if (score >= beta) {
+				++state->stats->tt_cutoffs;
 				return score;
+			}
 			break;
 		case BOUND_UPPER:
 			/* Iff the score is an upper bound and less than or
 			 * equal to alpha then we are guaranteed a fail-low and
 			 * we can just return this upper bound. */
-			if (score <= alpha)
+			if (score <= alpha) {
+				++state->stats->tt_cutoffs;
 				return score;
+			}
 			break;
 		default:
 			abort();
@@ -310,7 +789,11 @@ static int negamax(enum node_type node_type, struct state *state,
 	int moves_cnt = 0;
 
 	const bool in_check = is_in_check(pos);
-	const int static_evaluation = evaluate(pos);
+	/* Every entry of the transposition table has the static evaluation of
+	 * its position, so transpositions are only evaluated once. */
+	const int static_evaluation =
+		found_tt_entry ? tt_data.eval :
+				 evaluate(pos, state->pawn_table);
 
 	if (!in_check) {
 		/* Null move pruning. This heuristic is based on the null move
@@ -328,17 +811,21 @@ static int negamax(enum node_type node_type, struct state *state,
 		 * consecutive null moves. */
 		if (node_type != NODE_TYPE_ROOT &&
 		    depth >= NULL_MOVE_MINIMUM_DEPTH &&
-		    !(stack - 1)->current_move_is_null &&
-		    is_zugzwang_unlikely(pos) && static_evaluation >= beta) {
-			stack->current_move_is_null = true;
+		    (stack - 1)->current_move && is_zugzwang_unlikely(pos) &&
+		    static_evaluation >= beta) {
+			stack->current_move = 0;
+			stack->continuation_history = NULL;
 			do_null_move(pos);
+			prefetch_tt(get_position_hash(pos));
 			const int score = -negamax(NODE_TYPE_NON_PV, state,
 						   stack + 1, limits, -beta,
 						   -alpha,
 						   depth - NULL_MOVE_REDUCTION);
 			undo_null_move(pos);
-			if (score >= beta)
+			if (score >= beta) {
+				++state->stats->null_move_prunes;
 				return beta;
+			}
 		}
 
 		/* Reverse futility pruning. The idea is the same as in regular
@@ -352,10 +839,14 @@ static int negamax(enum node_type node_type, struct state *state,
 		 * guarantee these moves actually will beat beta. We also check
 		 * if beta is a mate score because if that is the case then we
 		 * have to continue searching to find lines better than getting
-		 * checkmated. */
-		if (static_evaluation - depth * FUTILITY_FACTOR >= beta &&
-		    !is_mate_score(beta))
+		 * checkmated. The PV nodes are always searched, so the root
+		 * has a best move and the PV is not cut. */
+		if (node_type == NODE_TYPE_NON_PV &&
+		    static_evaluation - depth * FUTILITY_FACTOR >= beta &&
+		    !is_mate_score(beta)) {
+			++state->stats->reverse_futility_prunes;
 			return static_evaluation - depth * FUTILITY_FACTOR;
+		}
 	}
 
 	Move quiet_moves[256];
@@ -363,53 +854,109 @@ static int negamax(enum node_type node_type, struct state *state,
 
 	const Move tt_move = found_tt_entry ? tt_data.best_move : 0;
 	struct move_picker_context mp_ctx;
+	/* The killer moves are tried first and then the counter move, if it's
+	 * not one of them. */
+	Move refutations[3];
 	int refutations_nb = 0;
-	if (stack->refutations[0]) {
+	for (int i = 0; i < 2 && stack->refutations[i]; ++i) {
+		refutations[refutations_nb] = stack->refutations[i];
 		++refutations_nb;
-		if (stack->refutations[1])
-			++refutations_nb;
 	}
-	init_move_picker_context(&mp_ctx, tt_move, stack->refutations,
-				 refutations_nb, state->butterfly_history,
+	const Move counter_move = get_counter_move(state, stack);
+	if (counter_move && counter_move != stack->refutations[0] &&
+	    counter_move != stack->refutations[1]) {
+		refutations[refutations_nb] = counter_move;
+		++refutations_nb;
+	}
+	const PieceToHistory *const continuation_history[2] = {
+		(stack - 1)->continuation_history,
+		(stack - 2)->continuation_history,
+	};
+	init_move_picker_context(&mp_ctx, tt_move, refutations, refutations_nb,
+				 state->butterfly_history, continuation_history,
 				 false);
 	for (Move move = pick_next_move(&mp_ctx, pos); move;
 	     move = pick_next_move(&mp_ctx, pos)) {
-		if (!move_is_legal(pos, move))
+		if (node_type == NODE_TYPE_ROOT &&
+		    is_excluded_move(state, move))
 			continue;
+		/* The bucket of the child is loaded while we check the move
+		 * and make it. */
+		prefetch_tt(get_hash_after_move(pos, move));
+		if (!move_is_legal(pos, move)) {
+			++state->stats->illegal_moves;
+			continue;
+		}
 		++moves_cnt;
+		const bool is_quiet = !move_is_capture(move);
+
+		/* Late move pruning. In shallow nodes that are not expected to
+		 * be in the PV, after trying enough moves the remaining quiet
+		 * moves are so unlikely to be the best that we don't even
+		 * generate them. The captures are still searched. We only do it
+		 * when we already have a score that is not a mate score, so we
+		 * don't miss the only move that avoids getting checkmated. The
+		 * initial -INF counts as a mate score, so we never prune before
+		 * a move got a real score. */
+		if (node_type == NODE_TYPE_NON_PV && !in_check &&
+		    depth <= LMP_MAXIMUM_DEPTH &&
+		    moves_cnt > get_late_move_count(depth) &&
+		    !is_mate_score(best_score) && !mp_ctx.skip_quiets) {
+			skip_quiet_moves(&mp_ctx);
+			++state->stats->late_move_prunes;
+		}
 
 		/* Futility pruning. If adding a large factor to the static
 		 * evaluation is not enough to raise alpha, it is extremely
-		 * unlikely that any move will do so we just stop.
+		 * unlikely that any quiet move will do so we skip them all.
 		 *
 		 * The reason why this factor depends on the depth is to make
 		 * sure we don't skip important tactical moves at the top of the
 		 * tree. The deeper we are in the tree the more nodes we see and
 		 * the less likely we are to completely skip something
 		 * important. */
-		if (moves_cnt > 1 && !move_is_capture(move) &&
-		    static_evaluation + depth * FUTILITY_FACTOR <= alpha)
-			break;
+		if (moves_cnt > 1 && is_quiet && !mp_ctx.skip_quiets &&
+		    static_evaluation + depth * FUTILITY_FACTOR <= alpha) {
+			skip_quiet_moves(&mp_ctx);
+			++state->stats->futility_prunes;
+		}
+
+		if (is_quiet && mp_ctx.skip_quiets)
+			continue;
 
-		if (!move_is_capture(move)) {
+		const Color side = get_side_to_move(pos);
+		int history = 0;
+		if (is_quiet) {
 			quiet_moves[quiet_moves_nb] = move;
 			++quiet_moves_nb;
+			const Square from = get_move_origin(move);
+			const Square to = get_move_target(move);
+			history = state->butterfly_history[side][from][to];
 		}
 
-		stack->current_move_is_null = false;
+		const Square to = get_move_target(move);
+		const Piece piece = get_piece_at(pos, get_move_origin(move));
+		stack->current_move = move;
+		stack->moved_piece = piece;
+		stack->continuation_history =
+			&state->continuation_history[piece][to];
 		do_move(pos, move);
 
 		int score;
 
 		const bool lmr_safe = !in_check &&
 				      move != stack->refutations[0] &&
-				      move != stack->refutations[1] &&
-				      node_type != NODE_TYPE_PV;
+				      move != stack->refutations[1];
 		/* It is important to search at least the first move using the
-		 * full depth and full window. */
+		 * full depth and full window. The first move of a PV node is
+		 * the one expected to be in the PV. */
 		if (moves_cnt == 1) {
-			score = -negamax(NODE_TYPE_NON_PV, state, stack + 1,
-					 limits, -beta, -alpha, depth - 1);
+			const enum node_type child_type =
+				node_type == NODE_TYPE_NON_PV ?
+					NODE_TYPE_NON_PV :
+					NODE_TYPE_PV;
+			score = -negamax(child_type, state, stack + 1, limits,
+					 -beta, -alpha, depth - 1);
 		} else {
 			/* LMR (Late Move Reduction) reduces the search depth
 			 * for moves that come late in the move ordering. A
@@ -417,15 +964,20 @@ static int negamax(enum node_type node_type, struct state *state,
 			 * that the move can't raise alpha. */
 			if (depth >= LMR_DEPTH_THRESHOLD &&
 			    moves_cnt >= LMR_MOVE_THRESHOLD && lmr_safe) {
-				/* The reduction grows logarithmically with the
-				 * depth and moves searched. */
-				const int r =
-					(int)(log(depth * moves_cnt) / 2.);
-				const int new_depth = max(depth - r, 2);
+				/* Nodes in the PV and quiet moves with a good
+				 * history are reduced less, and quiet moves
+				 * with a bad history are reduced more. */
+				int r = get_reduction(depth, moves_cnt);
+				if (node_type == NODE_TYPE_PV)
+					--r;
+				r -= history / LMR_HISTORY_DIVISOR;
+				const int new_depth =
+					min(max(depth - r, 2), depth);
 				score = -negamax(NODE_TYPE_NON_PV, state,
 						 stack + 1, limits,
 						 -(alpha + 1), -alpha,
 						 new_depth - 1);
+				state->stats->lmr_researches += score > alpha;
 			} else {
 				/* If LMR couldn't be used then we use this
 				 * trick to make score > alpha so that a
@@ -465,15 +1017,20 @@ static int negamax(enum node_type node_type, struct state *state,
 		if (node_type != NODE_TYPE_ROOT && *state->stop)
 			return 0;
 
-		const Color side = get_side_to_move(pos);
 		if (score > best_score) {
 			best_score = score;
 			if (score > alpha) {
 				best_move = move;
+				if (node_type != NODE_TYPE_NON_PV)
+					update_pv(state, stack->ply, move);
 				if (score >= beta) {
+					++state->stats->fail_highs;
+					state->stats->first_move_fail_highs +=
+						moves_cnt == 1;
 					if (!move_is_capture(move)) {
 						add_refutation(stack, move);
-						update_history(state, move,
+						update_history(state, stack,
+							       move,
 							       quiet_moves,
 							       quiet_moves_nb,
 							       side, depth);
@@ -491,14 +1048,16 @@ static int negamax(enum node_type node_type, struct state *state,
 		best_score = in_check ? -INF + stack->ply : 0;
 
 	const int tt_score = score_to_tt_score(best_score, stack->ply);
-	init_tt_entry(&tt_data, tt_score, depth, bound, best_move, pos);
+	init_tt_entry(&tt_data, tt_score, static_evaluation, depth, bound,
+		      best_move, pos);
 	/* Add this node to the TT when it's not the root node since there is
 	 * no point in saving the root node. */
 	if (node_type != NODE_TYPE_ROOT)
 		store_tt_entry(&tt_data);
 
-	/* Update best move from the root. */
-	if (node_type == NODE_TYPE_ROOT)
+	/* Update best move from the root. When the root fails low there is no
+	 * best move and we keep the one of the previous search. */
+	if (node_type == NODE_TYPE_ROOT && best_move)
 		state->best_move = best_move;
 
 	return best_score;
@@ -512,55 +1071,70 @@ static int qsearch(enum node_type node_type, struct state *state,
 		   struct stack_element *stack, struct limits *limits,
 		   int alpha, int beta, int depth)
 {
-	/* Only check time each 1024 nodes to avoid making system calls which
-	 * slows down the search. */
-	if (!(state->nodes % 1024) && limits->limited_time)
-		*state->stop = time_is_up(&limits->stop_time);
+	if (should_stop(state, limits))
+		*state->stop = true;
 	if (*state->stop)
 		return 0;
 
 	Position *pos = &state->pos;
-	stack->position_hash = get_position_hash(pos);
 
-	++state->nodes;
-#ifdef SEARCH_STATISTICS
-	++state->quiescence_nodes;
-#endif
+	increment_nodes(state);
+	++state->stats->quiescence_nodes;
 
-	if (is_repetition(state, stack))
+	if (is_repetition(pos))
 		return 0;
 
 	bool found_tt_entry = false;
 	NodeData tt_data;
 	found_tt_entry = get_tt_entry(&tt_data, pos);
+	++state->stats->tt_probes;
+	state->stats->tt_hits += found_tt_entry;
 	if (node_type != NODE_TYPE_ROOT && found_tt_entry &&
 	    tt_data.depth >= depth) {
 		const int score = tt_score_to_score(tt_data.score, stack->ply);
 		switch (tt_data.bound) {
 		case BOUND_EXACT:
+			++state->stats->tt_cutoffs;
 			return score;
 		case BOUND_LOWER:
 			/* If this score is a lower bound and it is greater than
 			 * or equal to beta then we are guaranteed a fail-high
 			 * in this node, so we prune this branch in advance. */
-			if (score >= beta)
+			if (score >= beta) {
+				++state->stats->tt_cutoffs;
 				return score;
+			}
 			break;
 		case BOUND_UPPER:
 			/* If the score is an upper bound and less than or equal
 			 * to alpha then we are guaranteed a fail-low and we can
 			 * just return this upper bound. */
-			if (score <= alpha)
+			if (score <= alpha) {
+				++state->stats->tt_cutoffs;
 				return score;
+			}
 			break;
 		default:
 			abort();
 		}
 	}
 
-	int best_score = evaluate(pos);
-	if (!is_in_check(pos) && best_score >= beta)
+	const int static_evaluation =
+		found_tt_entry ? tt_data.eval :
+				 evaluate(pos, state->pawn_table);
+	int best_score = static_evaluation;
+	if (!is_in_check(pos) && best_score >= beta) {
+		/* Most of the quiescence nodes end here, so we store the
+		 * stand pat as a lower bound to keep their evaluation. */
+		if (!found_tt_entry) {
+			init_tt_entry(&tt_data,
+				      score_to_tt_score(best_score, stack->ply),
+				      static_evaluation, depth, BOUND_LOWER, 0,
+				      pos);
+			store_tt_entry(&tt_data);
+		}
 		return best_score;
+	}
 	if (best_score > alpha)
 		alpha = best_score;
 
@@ -572,16 +1146,21 @@ static int qsearch(enum node_type node_type, struct state *state,
 	const Move tt_move = found_tt_entry ? tt_data.best_move : 0;
 	struct move_picker_context mp_ctx;
 	init_move_picker_context(&mp_ctx, tt_move, NULL, 0,
-				 state->butterfly_history, true);
+				 state->butterfly_history, NULL, true);
 	for (Move move = pick_next_move(&mp_ctx, pos); move;
 	     move = pick_next_move(&mp_ctx, pos)) {
-		if (!move_is_legal(pos, move))
+		prefetch_tt(get_hash_after_move(pos, move));
+		if (!move_is_legal(pos, move)) {
+			++state->stats->illegal_moves;
 			continue;
+		}
 
 		if (!in_check &&
 		    best_score + QS_SEE_PRUNING_SCORE_MARGIN < alpha &&
-		    !wins_exchange(move, 1, pos))
+		    !move_picker_wins_exchange(&mp_ctx, move, 1, pos)) {
+			++state->stats->qsearch_see_prunes;
 			continue;
+		}
 
 		do_move(pos, move);
 		const int score = -qsearch(NODE_TYPE_NON_PV, state, stack + 1,
@@ -606,39 +1185,85 @@ static int qsearch(enum node_type node_type, struct state *state,
 	}
 
 	const int tt_score = score_to_tt_score(best_score, stack->ply);
-	init_tt_entry(&tt_data, tt_score, depth, bound, best_move, pos);
+	init_tt_entry(&tt_data, tt_score, static_evaluation, depth, bound,
+		      best_move, pos);
 	if (node_type != NODE_TYPE_ROOT)
 		store_tt_entry(&tt_data);
 
 	return best_score;
 }
 
-static void update_history(struct state *state, Move fail_high_move,
-			   Move *quiet_moves, int quiet_moves_nb, Color side,
-			   int depth)
+/*
+ * The quiet move that failed high becomes the counter move of the previous
+ * move, and the butterfly and continuation histories of all the quiet moves
+ * searched in the node are updated.
+ */
+static void update_history(struct state *state,
+			   const struct stack_element *stack,
+			   Move fail_high_move, Move *quiet_moves,
+			   int quiet_moves_nb, Color side, int depth)
 {
-	const int max_value = 16384;
+	const struct stack_element *const previous = stack - 1;
+	if (previous->current_move) {
+		const Square to = get_move_target(previous->current_move);
+		state->counter_moves[previous->moved_piece][to] =
+			fail_high_move;
+	}
 
 	for (int i = 0; i < quiet_moves_nb; ++i) {
 		const Move move = quiet_moves[i];
 		const Square from = get_move_origin(move);
 		const Square to = get_move_target(move);
+		const Piece piece = get_piece_at(&state->pos, from);
 
-		const int old_value = state->butterfly_history[side][from][to];
 		/* We increase the history points of the move that failed high
 		 * and decrease the points of the other moves. */
-		int bonus = move == fail_high_move ? 150 * depth : -150 * depth;
-		/* We have to make sure the bonus is in
-		 * [-max_value, max_value] */
-		if (bonus > max_value)
-			bonus = max_value;
-		else if (bonus < -max_value)
-			bonus = -max_value;
-		bonus = (int)(bonus - (long)old_value * abs(bonus) / max_value);
-		state->butterfly_history[side][from][to] += bonus;
+		const int bonus = move == fail_high_move ? 150 * depth :
+							   -150 * depth;
+		int *const value = &state->butterfly_history[side][from][to];
+		*value += scale_history_bonus(*value, bonus);
+		for (int j = 1; j <= 2; ++j) {
+			PieceToHistory *const history =
+				(stack - j)->continuation_history;
+			if (!history)
+				continue;
+			const int old = (*history)[piece][to];
+			(*history)[piece][to] =
+				(i16)(old + scale_history_bonus(old, bonus));
+		}
 	}
 }
 
+/*
+ * The bonus is clamped to [-max_value, max_value] and scaled so that the
+ * history values never leave that range, values that are already large change
+ * less.
+ */
+static int scale_history_bonus(int old_value, int bonus)
+{
+	const int max_value = 16384;
+
+	if (bonus > max_value)
+		bonus = max_value;
+	else if (bonus < -max_value)
+		bonus = -max_value;
+	return (int)(bonus - (long)old_value * abs(bonus) / max_value);
+}
+
+/*
+ * Returns the quiet move that last refuted the previous move, or 0 if there is
+ * none or the previous move was a null move.
+ */
+static Move get_counter_move(const struct state *state,
+			     const struct stack_element *stack)
+{
+	const struct stack_element *const previous = stack - 1;
+	if (!previous->current_move)
+		return 0;
+	const Square to = get_move_target(previous->current_move);
+	return state->counter_moves[previous->moved_piece][to];
+}
+
 /*
  * This function heuristically tests if it is unlikely that the side to move
  * is in zugzwang. Right now it only checks if the side has only the king and
@@ -668,55 +1293,48 @@ static void add_refutation(struct stack_element *stack, Move move)
 }
 
 /*
- * Returns true if the position at the top of the stack has repeated and false
- * otherwise. The state should contain this position.
+ * Returns true if the position of the state is in the tablebases, in which case
+ * score is set to a win, a loss or a draw. Only positions with a halfmove clock
+ * of 0 are probed, right after a capture or a pawn move, since the clock can
+ * turn a win into a draw and the WDL files only know about the clock being 0.
+ * The cursed wins and the blessed losses are draws because of the fifty-move
+ * rule.
  */
-static bool is_repetition(const struct state *state,
-			  const struct stack_element *stack_top)
+static bool probe_tablebase(int *score, struct state *state, int ply)
 {
-	const u64 top_hash = stack_top->position_hash;
-
-	const int max_distance = get_halfmove_clock(&state->pos);
-	int distance = 0;
-
-	/* Positions in the search. */
-	if (stack_top->ply > 1) {
-		const struct stack_element *elem = stack_top - 2;
-		while (true) {
-			if (distance == max_distance)
-				return false;
-			++distance;
-
-			const u64 hash = elem->position_hash;
-			if (top_hash == hash)
-				return true;
-
-			if (elem->ply < 2)
-				break;
-			elem = elem - 2;
-		}
-	}
-
-	/* Positions from before the search. */
-	for (int i = state->previous_positions_nb - 1; i >= 2; i -= 2) {
-		if (distance == max_distance)
-			return false;
-		const u64 hash = state->previous_positions_hashes[i];
-		if (top_hash == hash)
-			return true;
+	Position *const pos = &state->pos;
+	const int pieces_nb = get_number_of_pieces_of_color(pos, COLOR_WHITE) +
+			      get_number_of_pieces_of_color(pos, COLOR_BLACK);
+	Wdl wdl;
+	if (pieces_nb > get_tb_largest() || get_halfmove_clock(pos) ||
+	    !probe_wdl(&wdl, pos))
+		return false;
+
+	++state->stats->tb_hits;
+	switch (wdl) {
+	case WDL_WIN:
+		*score = TB_WIN - ply;
+		break;
+	case WDL_LOSS:
+		*score = -TB_WIN + ply;
+		break;
+	default:
+		*score = 0;
+		break;
 	}
-
-	return false;
+	return true;
 }
 
 /*
- * Returns true is the score is a mate score. A mate score from the point of
- * view of the player delivering mate is INF + ply, while for the opponent it is
- * -(INF + ply). So we take the absolute value of the score to test.
+ * Returns true if the score is a mate score or a tablebase score. A mate score
+ * from the point of view of the player delivering mate is INF - ply, while for
+ * the opponent it is -(INF - ply), and the tablebase scores are the same with
+ * TB_WIN, so we test the absolute value of the score against the lowest of
+ * them. The bounds of the full window, -INF and INF, are mate scores too.
  */
 static bool is_mate_score(int score)
 {
-	if (abs(score) >= INF)
+	if (abs(score) >= TB_WIN - MAX_PLY)
 		return true;
 	return false;
 }
@@ -729,9 +1347,9 @@ static bool is_mate_score(int score)
  */
 static int tt_score_to_score(int score, int ply)
 {
-	if (score >= INF - MAX_PLY)
+	if (score >= TB_WIN - MAX_PLY)
 		return score - ply;
-	else if (score <= -(INF - MAX_PLY))
+	else if (score <= -(TB_WIN - MAX_PLY))
 		return score + ply;
 	else
 		return score;
@@ -751,87 +1369,128 @@ static int tt_score_to_score(int score, int ply)
  * distance from the node that is storing the entry. So whenever we find the
  * same node again in a different line we can add/subtract the new ply to/from
  * the TT score and we will get a score based on the ply of the new variation.
+ * The tablebase wins and losses depend on the ply in the same way, so they are
+ * adjusted too.
  */
 static int score_to_tt_score(int score, int ply)
 {
-	if (score >= INF - MAX_PLY)
+	if (score >= TB_WIN - MAX_PLY)
 		return score + ply;
-	else if (score <= -(INF - MAX_PLY))
+	else if (score <= -(TB_WIN - MAX_PLY))
 		return score - ply;
 	else
 		return score;
 }
 
-static void init_stack(struct stack_element *stack, int capacity,
-		       const struct state *state)
+static void init_stack(struct stack_element *stack, int capacity)
 {
-	for (int i = 0; i < capacity; ++i)
-		stack[i].ply = i;
-	stack[0].position_hash = get_position_hash(&state->pos);
-	stack->refutations[0] = 0;
-	stack->refutations[1] = 0;
-	stack->current_move_is_null = false;
+	for (int i = 0; i < capacity; ++i) {
+		stack[i].ply = i - 2;
+		stack[i].refutations[0] = 0;
+		stack[i].refutations[1] = 0;
+		stack[i].current_move = 0;
+		stack[i].moved_piece = PIECE_NONE;
+		stack[i].continuation_history = NULL;
+	}
 }
 
+/*
+ * With a clock the soft and hard times are computed from the optimal time for
+ * the move, but they are never more than what is safe to use of the time left.
+ * See compute_search_time().
+ *
+ * The position is the root of the search, since the clock that matters is the
+ * one of its side to move.
+ */
 static void init_limits(struct limits *limits,
-			const struct search_argument *arg)
+			const struct search_argument *arg,
+			const Position *pos)
 {
-	Color c = get_side_to_move(&arg->pos);
+	Color c = get_side_to_move(pos);
 
 	limits->depth = arg->depth < MAX_DEPTH ? arg->depth : MAX_DEPTH;
 	limits->mate = arg->mate;
+	limits->nodes = arg->nodes > 0 ? arg->nodes : LLONG_MAX;
+	limits->ponder = arg->ponder;
+	timespec_get(&limits->start_time, TIME_UTC);
 	if (arg->time[c]) {
 		limits->limited_time = true;
-		timespec_get(&limits->stop_time, TIME_UTC);
-		long long time = compute_search_time(&arg->pos, arg->time[c],
-						     arg->movestogo);
-		add_time(&limits->stop_time, time);
+		limits->adaptive_time = true;
+		/* The GUI may send a negative time when we are late. */
+		const long long time = arg->time[c] > 1 ? arg->time[c] : 1;
+		const long long optimal_time = compute_search_time(
+			pos, time, arg->inc[c], arg->movestogo);
+		const long long safe_time =
+			compute_search_time(pos, time, 0, 1);
+		limits->soft_time = optimal_time * SOFT_TIME_PERCENT / 100;
+		limits->hard_time = optimal_time * HARD_TIME_PERCENT / 100;
+		if (limits->hard_time > safe_time)
+			limits->hard_time = safe_time;
+		if (limits->soft_time > limits->hard_time)
+			limits->soft_time = limits->hard_time;
 	} else if (arg->movetime) {
 		limits->limited_time = true;
-		timespec_get(&limits->stop_time, TIME_UTC);
-		add_time(&limits->stop_time, arg->movetime);
+		limits->adaptive_time = false;
+		limits->soft_time = arg->movetime;
+		limits->hard_time = arg->movetime;
 	} else {
 		limits->limited_time = false;
+		limits->adaptive_time = false;
 	}
 }
 
-static void init_state(struct state *state, struct search_argument *arg)
+static void init_state(struct state *state, struct shared_data *shared,
+		       int id)
 {
+	const struct search_argument *arg = shared->arg;
+
+	state->id = id;
+	state->shared = shared;
 	copy_position(&state->pos, &arg->pos);
-	state->previous_positions_nb = arg->moves_nb;
-	state->previous_positions_hashes[0] = get_position_hash(&state->pos);
-	for (int i = 0; i < arg->moves_nb; ++i) {
-		const Move move = arg->moves[i];
-		do_move(&state->pos, move);
-		/* We don't store the final position here. It is part of the
-		 * search so it should go in the search stack. */
-		if (i + 1 < arg->moves_nb) {
-			if (i + 1 == MAX_PREVIOUS_POSITIONS) {
-				fprintf(stderr, "Error.");
-				exit(1);
-			}
-			state->previous_positions_hashes[i + 1] =
-				get_position_hash(&state->pos);
-		}
-	}
-	state->butterfly_history = arg->ctx.butterfly_history;
+	state->butterfly_history = arg->ctx[id].butterfly_history;
+	state->continuation_history = arg->ctx[id].continuation_history;
+	state->counter_moves = arg->ctx[id].counter_moves;
+	state->pawn_table = &arg->ctx[id].pawn_table;
 
 	state->best_move = 0;
+	state->ponder_move = 0;
 	state->completed_depth = 0;
-	state->nodes = 0;
-#ifdef SEARCH_STATISTICS
-	state->quiescence_nodes = 0;
-	state->log_file = ((struct search_argument *)arg)->log_file;
-#endif
+	state->pv_table = malloc((MAX_PLY + 1) * sizeof(*state->pv_table));
+	if (!state->pv_table) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	state->excluded_moves_nb = 0;
+	atomic_init(&state->nodes, 0);
+	state->stats = &arg->ctx[id].stats;
+	memset(state->stats, 0, sizeof(*state->stats));
 	timespec_get(&state->start_time, TIME_UTC);
 	state->stop = ((struct search_argument *)arg)->stop;
 }
 
+static void increment_nodes(struct state *state)
+{
+	const long long nodes =
+		atomic_load_explicit(&state->nodes, memory_order_relaxed);
+	atomic_store_explicit(&state->nodes, nodes + 1, memory_order_relaxed);
+}
+
+static long long get_nodes(const struct state *state)
+{
+	return atomic_load_explicit(&state->nodes, memory_order_relaxed);
+}
+
+static long long get_total_nodes(const struct shared_data *shared)
+{
+	long long nodes = 0;
+	for (int i = 0; i < shared->threads_nb; ++i)
+		nodes += get_nodes(&shared->states[i]);
+	return nodes;
+}
+
 static bool is_in_check(const Position *pos)
 {
-	const Color c = get_side_to_move(pos);
-	const Square king_sq = get_king_square(pos, c);
-	return is_square_attacked(king_sq, !c, pos);
+	return get_checkers(pos);
 }
 
 static int max(int a, int b)
@@ -839,6 +1498,25 @@ static int max(int a, int b)
 	return a > b ? a : b;
 }
 
+static int min(int a, int b)
+{
+	return a < b ? a : b;
+}
+
+static int get_reduction(int depth, int moves_cnt)
+{
+	return reductions[min(depth, LMR_TABLE_SIZE - 1)]
+			 [min(moves_cnt, LMR_TABLE_SIZE - 1)];
+}
+
+/*
+ * Number of moves after which the quiet moves are pruned in shallow nodes.
+ */
+static int get_late_move_count(int depth)
+{
+	return 3 + depth * depth;
+}
+
 static long long compute_nps(const struct timespec *t1,
 			     const struct timespec *t2, long long nodes)
 {
@@ -872,36 +1550,74 @@ static struct timespec compute_elapsed_time(const struct timespec *t1,
 	return diff;
 }
 
-static bool time_is_up(const struct timespec *stop_time)
+/*
+ * Returns the time in milliseconds since the search started.
+ */
+static long long get_elapsed_time(const struct limits *limits)
 {
 	struct timespec now;
 	timespec_get(&now, TIME_UTC);
-	if (now.tv_sec > stop_time->tv_sec ||
-	    (now.tv_sec == stop_time->tv_sec &&
-	     now.tv_nsec > stop_time->tv_nsec)) {
+	const struct timespec elapsed =
+		compute_elapsed_time(&limits->start_time, &now);
+	return timespec_to_milliseconds(&elapsed);
+}
+
+static bool time_is_up(const struct limits *limits)
+{
+	return get_elapsed_time(limits) >= limits->hard_time;
+}
+
+static bool is_pondering(const struct limits *limits)
+{
+	return limits->ponder && *limits->ponder;
+}
+
+/*
+ * The node limit is checked in every node so that it is honored exactly, at
+ * least with a single thread. Time is only checked every 1024 nodes to avoid
+ * making system calls which slows down the search, and the main thread is the
+ * only one that keeps track of it.
+ */
+static bool should_stop(const struct state *state,
+			const struct limits *limits)
+{
+	if (limits->nodes != LLONG_MAX &&
+	    get_total_nodes(state->shared) >= limits->nodes)
 		return true;
-	}
-	return false;
+	return !state->id && !(get_nodes(state) % 1024) &&
+	       limits->limited_time && !is_pondering(limits) &&
+	       time_is_up(limits);
 }
 
 /*
- * Adds time in milliseconds to ts.
+ * Decides if the main thread should start another iteration after finishing
+ * one. The iteration would probably be thrown away if it can't finish before
+ * the hard time, so we don't start it. We also stop once the soft time is
+ * reached, and the soft time is extended while the best move keeps changing
+ * and shrunk when it has been the same for several iterations.
  */
-static void add_time(struct timespec *ts, long long time)
+static bool should_stop_iterating(const struct limits *limits,
+				  long long iteration_time, int stability)
 {
-	time_t sec = (time_t)floor((double)time / 1e3);
-	long nsec = (long)floor(((double)time / 1e3 - (double)sec) * 1e9);
-	ts->tv_sec += sec;
-	ts->tv_nsec += nsec;
-	if (ts->tv_nsec >= 1000000000L) {
-		++ts->tv_sec;
-		ts->tv_nsec %= 1000000000L;
-	}
+	static const double stability_scales[] = { 2.0, 1.4, 1.1, 0.9, 0.7 };
+	const int scales_nb =
+		sizeof(stability_scales) / sizeof(stability_scales[0]);
+
+	if (!limits->limited_time || is_pondering(limits))
+		return false;
+	const long long elapsed = get_elapsed_time(limits);
+	if (elapsed + ITERATION_TIME_FACTOR * iteration_time >=
+	    limits->hard_time)
+		return true;
+	if (!limits->adaptive_time)
+		return false;
+	const double scale = stability_scales[min(stability, scales_nb - 1)];
+	return (double)elapsed >= (double)limits->soft_time * scale;
 }
 
 /*
- * Receives a position and the total time left in milliseconds and returns the
- * amount of time the search can use, also in milliseconds.
+ * Receives a position, the total time left and the increment in milliseconds
+ * and returns the amount of time the search can use, also in milliseconds.
  * 
  * We need to divide the time we have available among the moves that will be
  * played throughout the game, but the number of future moves depends on how
@@ -926,40 +1642,122 @@ static void add_time(struct timespec *ts, long long time)
  * time in milliseconds to a value between 0 and 1.
  * 
  * f(x) = (x / 1000)^1.1 / (x / 1000 + 1)^1.1
+ *
+ * Most of the increment is added to the time of the move, since we get it back
+ * after moving, but the result never goes over the safe portion of the time
+ * left.
  */
 static long long compute_search_time(const Position *pos, long long time,
-				     int movestogo)
+				     long long inc, int movestogo)
 {
 	const int average_game_length = 40;
 
-	if (movestogo == 1) {
-		double factor = pow((double)time / 1000., 1.1);
-		factor /= pow((double)time / 1000. + 1., 1.1);
-		return (long long)((double)time * factor);
-	}
+	double factor = pow((double)time / 1000., 1.1);
+	factor /= pow((double)time / 1000. + 1., 1.1);
+	const double safe_time = (double)time * factor;
+	if (movestogo == 1)
+		return (long long)safe_time;
 	const int phase = get_phase(pos);
 	const double max = movestogo && movestogo < average_game_length ?
 				   movestogo :
 				   average_game_length;
 	const double divisor = (max * (256 - phase) + 8 * phase) / 256;
-	const double search_time = (double)time / divisor;
+	double search_time = (double)time / divisor + (double)inc * 3 / 4;
+	if (search_time > safe_time)
+		search_time = safe_time;
 	return (long long)search_time;
 }
 
-#ifdef SEARCH_STATISTICS
-static void log_position(FILE *fp, const Position *pos)
+#ifdef TEST
+
+#include <unity/unity.h>
+
+#define TEST_MULTIPV 3
+
+static void test_multipv_pv_length(void);
+static void receive_test_info(const struct info *info);
+static void receive_test_best_move(Move best_move, Move ponder_move);
+
+/* The length of the last exact PV of each line at the depth of the test. */
+static int test_depth;
+static int test_pv_lengths[TEST_MULTIPV];
+
+void test_search(void)
 {
-	char fen[512];
-	get_fen(fen, pos);
-	fprintf(fp, "Position %s\n", fen);
+	test_multipv_pv_length();
 }
 
-static void log_iteration_statistics(FILE *fp, int depth,
-				     const struct iteration_statistics *stats)
+/*
+ * None of the PVs of these positions ends in a mate or a repetition before the
+ * depth of the search, so every line has a PV as long as the depth.
+ */
+static void test_multipv_pv_length(void)
 {
-	fprintf(fp, "Depth %d\n", depth);
-	fprintf(fp, "Total nodes: %lld\nQuiescence nodes: %lld\n", stats->nodes,
-		stats->quiescence_nodes);
-	fflush(fp);
+	/* clang-format off */
+	const char *const fens[] = {
+		"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+		"r1bqkb1r/pppp1ppp/2n2n2/4p3/2B1P3/5N2/PPPP1PPP/RNBQK2R w KQkq - 4 4",
+	};
+	/* clang-format on */
+	static struct search_argument arg;
+	atomic_bool stop;
+
+	search_init();
+	tt_init(16, 1);
+	test_depth = 10;
+	arg.depth = test_depth;
+	arg.mate = 0;
+	arg.movestogo = 0;
+	arg.multipv = TEST_MULTIPV;
+	arg.nodes = LLONG_MAX;
+	arg.time[COLOR_WHITE] = arg.time[COLOR_BLACK] = 0;
+	arg.inc[COLOR_WHITE] = arg.inc[COLOR_BLACK] = 0;
+	arg.movetime = 0;
+	arg.info_sender = receive_test_info;
+	arg.best_move_sender = receive_test_best_move;
+	arg.statistics_sender = NULL;
+	arg.stop = &stop;
+	arg.ponder = NULL;
+	arg.threads = 1;
+	arg.ctx = malloc(sizeof(*arg.ctx));
+	TEST_ASSERT_MESSAGE(arg.ctx, "Out of memory.");
+
+	for (size_t i = 0; i < sizeof(fens) / sizeof(fens[0]); ++i) {
+		TEST_ASSERT_MESSAGE(!init_position(&arg.pos, fens[i]),
+				    fens[i]);
+		clear_tt(1);
+		init_search_context(arg.ctx);
+		atomic_init(&stop, false);
+		for (int j = 0; j < TEST_MULTIPV; ++j)
+			test_pv_lengths[j] = 0;
+		search(&arg);
+		free_position(&arg.pos);
+		for (int j = 0; j < TEST_MULTIPV; ++j) {
+			TEST_ASSERT_MESSAGE(test_pv_lengths[j] == test_depth,
+					    fens[i]);
+		}
+	}
+
+	free(arg.ctx);
+	tt_free();
 }
+
+static void receive_test_info(const struct info *info)
+{
+	if (info->depth != test_depth ||
+	    info->flags & (INFO_FLAG_LBOUND | INFO_FLAG_UBOUND) ||
+	    !(info->flags & INFO_FLAG_MULTIPV))
+		return;
+	if (info->multipv >= 1 && info->multipv <= TEST_MULTIPV) {
+		test_pv_lengths[info->multipv - 1] =
+			info->flags & INFO_FLAG_PV ? info->pv_length : 0;
+	}
+}
+
+static void receive_test_best_move(Move best_move, Move ponder_move)
+{
+	(void)best_move;
+	(void)ponder_move;
+}
+
 #endif
@@ -0,0 +1,2489 @@
+/*
+ * Copyright (C) 2023 Sayu <mail@sayurc.moe>
+ *
+ * This file is part of Athena.
+ *
+ * Athena is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ * 
+ * Athena is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <https://www.gnu.org/licenses/>. 
+ */
+
+/*
+ * Syzygy tablebases. A table holds every position with a given material, like
+ * KQvKR, and comes in two files: the WDL file (.rtbw) tells if the position is
+ * won, drawn or lost under the fifty-move rule, and the DTZ file (.rtbz) holds
+ * the number of plies to the next capture or pawn move that keeps the result.
+ * The search probes the WDL files and only the root probes the DTZ files, to
+ * pick the moves that make progress.
+ *
+ * The files are read in the format of Ronald de Man, whose generator made
+ * them. The board is flipped and mirrored so that the symmetric positions share
+ * an entry, and the pieces are numbered in groups to give the index of the
+ * position in the table. The data is compressed by replacing pairs of symbols
+ * with new symbols, which are then Huffman coded in blocks, so the value of an
+ * index is found by decoding its block and expanding the pairs.
+ *
+ * The tables don't know about castling, so positions with castling rights are
+ * never probed. They don't know about en passant either, and when a capture is
+ * the best move they store whatever value compresses best, so the captures are
+ * always searched before a table is probed. Each file is mapped into memory the
+ * first time it is needed and is then shared by all the search threads.
+ *
+ * Inside the tables the pieces are numbered from 1 to 6 for the white pawn to
+ * the white king and from 9 to 14 for the black ones.
+ */
+
+/* Needed for mmap on Linux. */
+#define _DEFAULT_SOURCE
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#if defined(__linux__) && !defined(ARCH_WASM)
+#define USE_MMAP
+#include <sys/mman.h>
+#endif
+
+#include <bit.h>
+#include <pos.h>
+#include <move.h>
+#include <movegen.h>
+#include <tb.h>
+
+#define TB_PIECES 7
+#define MAX_MOVES 256
+
+#define WDL_MAGIC 0x5d23e871
+#define DTZ_MAGIC 0xa50c66d7
+#define WDL_SUFFIX ".rtbw"
+#define DTZ_SUFFIX ".rtbz"
+
+/* Bits of the first byte of a file. */
+#define FILE_FLAG_SPLIT 1
+#define FILE_FLAG_HAS_PAWNS 2
+
+/* Bits of the flags of a table. */
+#define TABLE_FLAG_STM 1
+#define TABLE_FLAG_MAPPED 2
+#define TABLE_FLAG_WIN_PLIES 4
+#define TABLE_FLAG_LOSS_PLIES 8
+#define TABLE_FLAG_WIDE 16
+#define TABLE_FLAG_SINGLE_VALUE 128
+
+/* Number of ways to place the leading group of 3 different pieces and of the 2
+ * kings when there are no unique pieces. */
+#define UNIQUE_PIECES_SIZE 31332
+#define KINGS_SIZE 462
+
+enum probe_result {
+	PROBE_FAIL,
+	PROBE_OK,
+	/* The DTZ file only has the other side to move. */
+	PROBE_CHANGE_STM,
+	/* The best move is a capture or a pawn move, so the DTZ in the file
+	 * can't be trusted. */
+	PROBE_ZEROING_BEST_MOVE,
+};
+
+enum file_state {
+	FILE_STATE_UNMAPPED,
+	FILE_STATE_MAPPED,
+	FILE_STATE_MISSING,
+};
+
+/*
+ * A table of a file. There is one for each side to move in the WDL files with
+ * different material on each side, and with pawns there is one for each file of
+ * the leading pawn from a to d.
+ *
+ * The symbols of a block are coded with a canonical Huffman code, where the
+ * codes of length min_sym_len + i start at base64[i] when padded to 64 bits,
+ * and each symbol is either a value or a pair of symbols stored in btree with
+ * symlen[sym] + 1 values. The sparse index gives the block holding every span
+ * indices, and block_length is the number of values of each block minus one.
+ */
+struct pairs_data {
+	u8 flags;
+	u8 max_sym_len;
+	u8 min_sym_len; /* The value of the table if it has a single value. */
+	u32 blocks_nb;
+	u64 sizeof_block;
+	u64 span;
+	size_t sparse_index_size;
+	size_t block_length_size;
+	const u8 *sparse_index;
+	const u8 *block_length;
+	const u8 *lowest_sym;
+	const u8 *btree;
+	const u8 *data;
+	u64 *base64;
+	u8 *symlen;
+	size_t symlen_size;
+	u64 group_idx[TB_PIECES + 1];
+	int group_len[TB_PIECES + 1];
+	u8 pieces[TB_PIECES];
+	u16 map_idx[4];
+};
+
+struct tb_file {
+	atomic_int state;
+	const u8 *data;
+	size_t size;
+	bool mapped; /* The data was mapped with mmap. */
+	const u8 *dtz_map;
+	struct pairs_data pairs[2][4];
+};
+
+/*
+ * The name of a table has the strongest side first, which is white in the
+ * tables, and key is the key of the material with the colors of the name while
+ * key2 is the key with the colors swapped. The leading color is the one with
+ * fewer pawns, since the pawns of that color are encoded first.
+ */
+struct tb_entry {
+	u64 key;
+	u64 key2;
+	char name[TB_PIECES + 2];
+	int pieces_nb;
+	bool has_pawns;
+	bool has_unique_pieces;
+	u8 pawn_count[2]; /* The leading color first. */
+	struct tb_file wdl;
+	struct tb_file dtz;
+};
+
+struct tb_slot {
+	u64 key;
+	struct tb_entry *entry;
+};
+
+static void init_index_tables(void);
+static int get_off_diagonal(int sq);
+static int get_square_distance(int sq1, int sq2);
+static void find_tables(void);
+static void add_table(const u8 counts[2][5]);
+static void init_entry(struct tb_entry *e, const u8 counts[2][5]);
+static void get_table_name(char *name, const u8 counts[2][5]);
+static FILE *open_table_file(const char *name, const char *suffix);
+static void insert_entry(struct tb_entry *e, u64 key);
+static struct tb_entry *get_entry(u64 key);
+static u64 get_counts_key(const u8 counts[2][5], bool swap);
+static u64 get_material_key(const Position *pos);
+static bool map_table_file(struct tb_entry *e, bool dtz);
+static bool read_table_file(struct tb_entry *e, bool dtz);
+static bool parse_table_file(struct tb_entry *e, bool dtz);
+static void free_table_file(struct tb_file *tf);
+static void set_groups(struct pairs_data *d, const struct tb_entry *e,
+		       const int order[2], int file);
+static const u8 *set_sizes(struct pairs_data *d, const u8 *data);
+static const u8 *set_dtz_map(struct tb_file *tf, const u8 *data,
+			     const u8 *base, int files_nb);
+static u8 set_symlen(struct pairs_data *d, u32 sym, bool *visited);
+static int get_btree_left(const struct pairs_data *d, u32 sym);
+static int get_btree_right(const struct pairs_data *d, u32 sym);
+static int decompress_pairs(const struct pairs_data *d, u64 idx);
+static int probe_table(const Position *pos, bool dtz, Wdl wdl,
+		       enum probe_result *result);
+static u64 get_position_index(int *stm, int *file, const struct tb_entry *e,
+			      const struct tb_file *tf, bool dtz,
+			      const Position *pos);
+static u64 encode_position(const struct tb_entry *e,
+			   const struct pairs_data *d, int *squares,
+			   int *pieces, int size, int lead_pawns_nb);
+static int map_dtz_score(const struct tb_file *tf, int file, int value,
+			 Wdl wdl);
+static Wdl search_captures(Position *pos, bool check_zeroing_moves,
+			   enum probe_result *result);
+static int get_dtz(Position *pos, enum probe_result *result);
+static bool get_root_dtz(int *dtz, Position *pos, Move move);
+static int dtz_before_zeroing(Wdl wdl);
+static int sign(int n);
+static bool is_zeroing_move(const Position *pos, Move move);
+static bool has_legal_moves(const Position *pos);
+static bool has_castling_rights(const Position *pos);
+static int get_pieces_count(const Position *pos);
+static int get_tb_piece(Piece piece);
+static void sort_squares(int *squares, int n, const int *order);
+static u64 read_little_endian(const u8 *bytes, int len);
+static u64 read_big_endian(const u8 *bytes, int len);
+
+static int map_a1d1d4[64];
+static int map_b1h1h7[64];
+static int map_kk[10][64];
+static int binomial[6][64];
+static int map_pawns[64];
+static int lead_pawn_idx[6][64];
+static int lead_pawns_size[6][4];
+/* The identity, to sort the squares by their number. */
+static int square_order[64];
+
+/* Protects the mapping of the files, which happens during the search. */
+static pthread_mutex_t map_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+	char *paths; /* The directories, each ending with a '\0'. */
+	int paths_nb;
+	struct tb_entry *entries;
+	int entries_nb;
+	struct tb_slot *slots;
+	size_t slots_mask;
+	int largest;
+} tb = { .paths = NULL, .paths_nb = 0, .entries = NULL, .entries_nb = 0,
+	 .slots = NULL, .slots_mask = 0, .largest = 0 };
+
+/*
+ * Looks for the tables in the directories of paths, which are separated by
+ * colons, and returns the number of WDL files found. The tables we had before
+ * are dropped. The files are only opened to check that they exist, they are
+ * mapped when they are first probed.
+ */
+int tb_init(const char *paths)
+{
+	tb_free();
+	init_index_tables();
+
+	const size_t len = strlen(paths);
+	tb.paths = malloc(len + 1);
+	if (!tb.paths) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	memcpy(tb.paths, paths, len + 1);
+	tb.paths_nb = 1;
+	for (size_t i = 0; i < len; ++i) {
+		if (tb.paths[i] == ':') {
+			tb.paths[i] = '\0';
+			++tb.paths_nb;
+		}
+	}
+
+	find_tables();
+
+	/* The table of slots is kept at most half full. */
+	size_t slots_nb = 16;
+	while (slots_nb < 4 * (size_t)tb.entries_nb)
+		slots_nb *= 2;
+	tb.slots = calloc(slots_nb, sizeof(*tb.slots));
+	if (!tb.slots) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	tb.slots_mask = slots_nb - 1;
+	for (int i = 0; i < tb.entries_nb; ++i) {
+		struct tb_entry *const e = &tb.entries[i];
+		atomic_init(&e->wdl.state, FILE_STATE_UNMAPPED);
+		atomic_init(&e->dtz.state, FILE_STATE_UNMAPPED);
+		insert_entry(e, e->key);
+		if (e->key2 != e->key)
+			insert_entry(e, e->key2);
+		tb.largest = e->pieces_nb > tb.largest ? e->pieces_nb
+						       : tb.largest;
+	}
+	return tb.entries_nb;
+}
+
+void tb_free(void)
+{
+	for (int i = 0; i < tb.entries_nb; ++i) {
+		free_table_file(&tb.entries[i].wdl);
+		free_table_file(&tb.entries[i].dtz);
+	}
+	free(tb.entries);
+	free(tb.slots);
+	free(tb.paths);
+	tb.paths = NULL;
+	tb.paths_nb = 0;
+	tb.entries = NULL;
+	tb.entries_nb = 0;
+	tb.slots = NULL;
+	tb.slots_mask = 0;
+	tb.largest = 0;
+}
+
+/*
+ * Returns the number of pieces of the largest table, including the kings, or 0
+ * if there are no tables.
+ */
+int get_tb_largest(void)
+{
+	return tb.largest;
+}
+
+/*
+ * Gets the result of the position for the side to move. Returns false if the
+ * position is not in the tablebases. The position must have a halfmove clock
+ * of 0 for the cursed wins and the blessed losses to be right, otherwise the
+ * fifty-move rule may come earlier.
+ */
+bool probe_wdl(Wdl *wdl, Position *pos)
+{
+	if (has_castling_rights(pos) || get_pieces_count(pos) > tb.largest)
+		return false;
+	enum probe_result result = PROBE_OK;
+	*wdl = search_captures(pos, false, &result);
+	return result != PROBE_FAIL;
+}
+
+/*
+ * Gets the number of plies to the next capture or pawn move with the best play,
+ * positive if the side to move wins and negative if it loses, or 0 for a draw.
+ * With more than 100 plies the win or the loss is cursed or blessed. Returns
+ * false if the position is not in the tablebases.
+ */
+bool probe_dtz(int *dtz, Position *pos)
+{
+	if (has_castling_rights(pos) || get_pieces_count(pos) > tb.largest)
+		return false;
+	enum probe_result result = PROBE_OK;
+	*dtz = get_dtz(pos, &result);
+	return result != PROBE_FAIL;
+}
+
+/*
+ * Keeps in moves only the legal moves of the root that preserve its result and
+ * returns how many are left. When the position is won only the moves with the
+ * smallest DTZ are kept, so the engine always makes progress without relying on
+ * the search, which can't see that far. When it is drawn only the drawing moves
+ * are kept. When it is lost all the moves are kept, unless some of them reach
+ * the fifty-move rule before the opponent can zero the clock, then only those
+ * are kept. If the root is not in the tablebases the moves are left unchanged.
+ */
+int filter_root_moves(Move *moves, int moves_nb, Position *pos)
+{
+	if (!moves_nb || moves_nb > MAX_MOVES || has_castling_rights(pos) ||
+	    get_pieces_count(pos) > tb.largest)
+		return moves_nb;
+
+	int dtz[MAX_MOVES];
+	int best_win = INT_MAX;
+	int best_loss = 0;
+	bool has_draw = false;
+	for (int i = 0; i < moves_nb; ++i) {
+		if (!get_root_dtz(&dtz[i], pos, moves[i]))
+			return moves_nb;
+		if (dtz[i] > 0 && dtz[i] < best_win)
+			best_win = dtz[i];
+		else if (dtz[i] < 0 && dtz[i] < best_loss)
+			best_loss = dtz[i];
+		else if (!dtz[i])
+			has_draw = true;
+	}
+
+	const int clock = get_halfmove_clock(pos);
+	int kept = 0;
+	for (int i = 0; i < moves_nb; ++i) {
+		bool keep;
+		if (best_win != INT_MAX)
+			keep = dtz[i] == best_win;
+		else if (has_draw)
+			keep = !dtz[i];
+		else if (clock - best_loss > 100)
+			keep = clock - dtz[i] > 100;
+		else
+			keep = true;
+		if (keep)
+			moves[kept++] = moves[i];
+	}
+	return kept;
+}
+
+static void init_index_tables(void)
+{
+	for (int sq = 0; sq < 64; ++sq)
+		square_order[sq] = sq;
+
+	/* The squares below the a1-h8 diagonal. */
+	int code = 0;
+	for (int sq = A1; sq <= H8; ++sq) {
+		if (get_off_diagonal(sq) < 0)
+			map_b1h1h7[sq] = code++;
+	}
+
+	/* The squares of the a1-d1-d4 triangle, with the ones on the diagonal
+	 * last. */
+	int diagonal[4];
+	int diagonal_nb = 0;
+	code = 0;
+	for (int sq = A1; sq <= D4; ++sq) {
+		if (get_off_diagonal(sq) < 0 && (sq & 7) <= FILE_D)
+			map_a1d1d4[sq] = code++;
+		else if (!get_off_diagonal(sq) && (sq & 7) <= FILE_D)
+			diagonal[diagonal_nb++] = sq;
+	}
+	for (int i = 0; i < diagonal_nb; ++i)
+		map_a1d1d4[diagonal[i]] = code++;
+
+	/* The legal positions of two kings with the first one in the a1-d1-d4
+	 * triangle. If the first king is on the diagonal the second one can't
+	 * be above it, and the positions with both kings on the diagonal are
+	 * last. B1 is the only square mapped to 0 since the squares outside
+	 * the triangle are 0 too. */
+	int diagonal_kings[64][2];
+	int diagonal_kings_nb = 0;
+	code = 0;
+	for (int idx = 0; idx < 10; ++idx) {
+		for (int sq1 = A1; sq1 <= D4; ++sq1) {
+			if (map_a1d1d4[sq1] != idx || (!idx && sq1 != B1))
+				continue;
+			for (int sq2 = A1; sq2 <= H8; ++sq2) {
+				if (get_square_distance(sq1, sq2) <= 1)
+					continue;
+				if (!get_off_diagonal(sq1) &&
+				    get_off_diagonal(sq2) > 0)
+					continue;
+				if (!get_off_diagonal(sq1) &&
+				    !get_off_diagonal(sq2)) {
+					diagonal_kings[diagonal_kings_nb][0] =
+						idx;
+					diagonal_kings[diagonal_kings_nb][1] =
+						sq2;
+					++diagonal_kings_nb;
+				} else {
+					map_kk[idx][sq2] = code++;
+				}
+			}
+		}
+	}
+	for (int i = 0; i < diagonal_kings_nb; ++i)
+		map_kk[diagonal_kings[i][0]][diagonal_kings[i][1]] = code++;
+
+	/* binomial[k][n] is the number of ways to choose k squares among n. */
+	binomial[0][0] = 1;
+	for (int n = 1; n < 64; ++n) {
+		for (int k = 0; k < 6 && k <= n; ++k) {
+			binomial[k][n] = (k > 0 ? binomial[k - 1][n - 1] : 0) +
+					 (k < n ? binomial[k][n - 1] : 0);
+		}
+	}
+
+	/* The pawns on a2 to h7 are numbered so that the leading pawn, the one
+	 * closest to the edge and then with the lowest rank, has the highest
+	 * number, which is also the number of squares left for the other
+	 * pawns. The indices of the leading group restart at each file since
+	 * there is a table for each file. */
+	int available_squares = 47;
+	for (int lead_pawns_nb = 1; lead_pawns_nb <= 5; ++lead_pawns_nb) {
+		for (int file = FILE_A; file <= FILE_D; ++file) {
+			int idx = 0;
+			for (int rank = RANK_2; rank <= RANK_7; ++rank) {
+				const int sq = 8 * rank + file;
+				if (lead_pawns_nb == 1) {
+					map_pawns[sq] = available_squares--;
+					map_pawns[sq ^ 7] = available_squares--;
+				}
+				lead_pawn_idx[lead_pawns_nb][sq] = idx;
+				idx += binomial[lead_pawns_nb - 1]
+					       [map_pawns[sq]];
+			}
+			lead_pawns_size[lead_pawns_nb][file] = idx;
+		}
+	}
+}
+
+/*
+ * Returns a negative number below the a1-h8 diagonal, 0 on it and a positive
+ * number above it.
+ */
+static int get_off_diagonal(int sq)
+{
+	return (sq >> 3) - (sq & 7);
+}
+
+static int get_square_distance(int sq1, int sq2)
+{
+	const int file_distance = abs((sq1 & 7) - (sq2 & 7));
+	const int rank_distance = abs((sq1 >> 3) - (sq2 >> 3));
+	return file_distance > rank_distance ? file_distance : rank_distance;
+}
+
+/*
+ * Tries every material with up to TB_PIECES pieces. The material of a side is
+ * the number of pawns, knights, bishops, rooks and queens, and each pair of
+ * materials is tried in both orders since only one of them is in the name.
+ */
+static void find_tables(void)
+{
+	u8 sides[256][5];
+	int sides_nb = 0;
+	for (int p = 0; p <= TB_PIECES - 2; ++p) {
+		for (int n = 0; p + n <= TB_PIECES - 2; ++n) {
+			for (int b = 0; p + n + b <= TB_PIECES - 2; ++b) {
+				for (int r = 0; p + n + b + r <= TB_PIECES - 2;
+				     ++r) {
+					for (int q = 0;
+					     p + n + b + r + q <= TB_PIECES - 2;
+					     ++q) {
+						u8 *const s = sides[sides_nb++];
+						s[PIECE_TYPE_PAWN] = (u8)p;
+						s[PIECE_TYPE_KNIGHT] = (u8)n;
+						s[PIECE_TYPE_BISHOP] = (u8)b;
+						s[PIECE_TYPE_ROOK] = (u8)r;
+						s[PIECE_TYPE_QUEEN] = (u8)q;
+					}
+				}
+			}
+		}
+	}
+
+	for (int i = 0; i < sides_nb; ++i) {
+		for (int j = i; j < sides_nb; ++j) {
+			int pieces_nb = 2;
+			for (int pt = PIECE_TYPE_PAWN; pt < PIECE_TYPE_KING;
+			     ++pt)
+				pieces_nb += sides[i][pt] + sides[j][pt];
+			/* There is no KvK file, it is always a draw. */
+			if (pieces_nb > TB_PIECES || pieces_nb == 2)
+				continue;
+			u8 counts[2][5];
+			memcpy(counts[0], sides[j], sizeof(counts[0]));
+			memcpy(counts[1], sides[i], sizeof(counts[1]));
+			add_table(counts);
+			if (i != j) {
+				memcpy(counts[0], sides[i], sizeof(counts[0]));
+				memcpy(counts[1], sides[j], sizeof(counts[1]));
+				add_table(counts);
+			}
+		}
+	}
+}
+
+/*
+ * Adds the table of the material if its WDL file exists, so a table is only
+ * added once even if the file is in several directories or both orders of the
+ * material have a file.
+ */
+static void add_table(const u8 counts[2][5])
+{
+	const u64 key = get_counts_key(counts, false);
+	const u64 key2 = get_counts_key(counts, true);
+	for (int i = 0; i < tb.entries_nb; ++i) {
+		if (tb.entries[i].key == key || tb.entries[i].key == key2)
+			return;
+	}
+
+	char name[TB_PIECES + 2];
+	get_table_name(name, counts);
+	FILE *const fp = open_table_file(name, WDL_SUFFIX);
+	if (!fp)
+		return;
+	fclose(fp);
+
+	struct tb_entry *const entries =
+		realloc(tb.entries,
+			(size_t)(tb.entries_nb + 1) * sizeof(*tb.entries));
+	if (!entries) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	tb.entries = entries;
+	init_entry(&tb.entries[tb.entries_nb], counts);
+	++tb.entries_nb;
+}
+
+static void init_entry(struct tb_entry *e, const u8 counts[2][5])
+{
+	memset(e, 0, sizeof(*e));
+	e->key = get_counts_key(counts, false);
+	e->key2 = get_counts_key(counts, true);
+	get_table_name(e->name, counts);
+	e->pieces_nb = 2;
+	for (int c = COLOR_WHITE; c <= COLOR_BLACK; ++c) {
+		for (int pt = PIECE_TYPE_PAWN; pt < PIECE_TYPE_KING; ++pt) {
+			e->pieces_nb += counts[c][pt];
+			if (counts[c][pt] == 1)
+				e->has_unique_pieces = true;
+		}
+	}
+
+	const u8 white_pawns = counts[COLOR_WHITE][PIECE_TYPE_PAWN];
+	const u8 black_pawns = counts[COLOR_BLACK][PIECE_TYPE_PAWN];
+	e->has_pawns = white_pawns || black_pawns;
+	const bool white_leads =
+		!black_pawns || (white_pawns && black_pawns >= white_pawns);
+	e->pawn_count[0] = white_leads ? white_pawns : black_pawns;
+	e->pawn_count[1] = white_leads ? black_pawns : white_pawns;
+}
+
+/*
+ * The name has the pieces of white and then the ones of black, each starting
+ * with the king and going from the queen to the pawn, like KQRvKR.
+ */
+static void get_table_name(char *name, const u8 counts[2][5])
+{
+	static const char letters[] = "PNBRQ";
+	size_t len = 0;
+	for (int c = COLOR_WHITE; c <= COLOR_BLACK; ++c) {
+		if (c == COLOR_BLACK)
+			name[len++] = 'v';
+		name[len++] = 'K';
+		for (int pt = PIECE_TYPE_QUEEN; pt >= PIECE_TYPE_PAWN; --pt) {
+			for (int i = 0; i < counts[c][pt]; ++i)
+				name[len++] = letters[pt];
+		}
+	}
+	name[len] = '\0';
+}
+
+/*
+ * Opens the file of the table in the first directory that has it, or returns
+ * NULL.
+ */
+static FILE *open_table_file(const char *name, const char *suffix)
+{
+	const char *dir = tb.paths;
+	for (int i = 0; i < tb.paths_nb; ++i, dir += strlen(dir) + 1) {
+		if (!*dir)
+			continue;
+		const size_t size = strlen(dir) + strlen(name) +
+				    strlen(suffix) + 2;
+		char *const path = malloc(size);
+		if (!path) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+		snprintf(path, size, "%s/%s%s", dir, name, suffix);
+		FILE *const fp = fopen(path, "rb");
+		free(path);
+		if (fp)
+			return fp;
+	}
+	return NULL;
+}
+
+static void insert_entry(struct tb_entry *e, u64 key)
+{
+	size_t i = (size_t)((key * 0x9e3779b97f4a7c15) >> 32) & tb.slots_mask;
+	while (tb.slots[i].entry)
+		i = (i + 1) & tb.slots_mask;
+	tb.slots[i].key = key;
+	tb.slots[i].entry = e;
+}
+
+static struct tb_entry *get_entry(u64 key)
+{
+	if (!tb.slots)
+		return NULL;
+	size_t i = (size_t)((key * 0x9e3779b97f4a7c15) >> 32) & tb.slots_mask;
+	for (; tb.slots[i].entry; i = (i + 1) & tb.slots_mask) {
+		if (tb.slots[i].key == key)
+			return tb.slots[i].entry;
+	}
+	return NULL;
+}
+
+/*
+ * The key of a material has the number of pieces of each type and color in 4
+ * bits. With swap the colors are swapped.
+ */
+static u64 get_counts_key(const u8 counts[2][5], bool swap)
+{
+	u64 key = 0;
+	for (int c = COLOR_WHITE; c <= COLOR_BLACK; ++c) {
+		for (int pt = PIECE_TYPE_PAWN; pt < PIECE_TYPE_KING; ++pt) {
+			const u64 n = counts[swap ? !c : c][pt];
+			key |= n << (4 * (5 * c + pt));
+		}
+	}
+	return key;
+}
+
+static u64 get_material_key(const Position *pos)
+{
+	u8 counts[2][5];
+	for (Color c = COLOR_WHITE; c <= COLOR_BLACK; ++c) {
+		for (PieceType pt = PIECE_TYPE_PAWN; pt < PIECE_TYPE_KING;
+		     ++pt) {
+			const u64 bb = get_piece_bitboard(pos,
+							  create_piece(pt, c));
+			counts[c][pt] = (u8)popcnt(bb);
+		}
+	}
+	return get_counts_key(counts, false);
+}
+
+/*
+ * Maps the file the first time it is needed. The state is read without the
+ * lock once the file is mapped, so it is only written after the tables of the
+ * file are ready. A missing or corrupted file is not tried again.
+ */
+static bool map_table_file(struct tb_entry *e, bool dtz)
+{
+	struct tb_file *const tf = dtz ? &e->dtz : &e->wdl;
+	int state = atomic_load_explicit(&tf->state, memory_order_acquire);
+	if (state != FILE_STATE_UNMAPPED)
+		return state == FILE_STATE_MAPPED;
+
+	pthread_mutex_lock(&map_mutex);
+	state = atomic_load_explicit(&tf->state, memory_order_relaxed);
+	if (state == FILE_STATE_UNMAPPED) {
+		state = read_table_file(e, dtz) ? FILE_STATE_MAPPED
+						: FILE_STATE_MISSING;
+		atomic_store_explicit(&tf->state, state, memory_order_release);
+	}
+	pthread_mutex_unlock(&map_mutex);
+	return state == FILE_STATE_MAPPED;
+}
+
+/*
+ * Without mmap the file is read into memory, which for the largest tables takes
+ * a lot of memory.
+ */
+static bool read_table_file(struct tb_entry *e, bool dtz)
+{
+	struct tb_file *const tf = dtz ? &e->dtz : &e->wdl;
+	FILE *fp = open_table_file(e->name, dtz ? DTZ_SUFFIX : WDL_SUFFIX);
+	if (!fp)
+		return false;
+
+	long size = -1;
+	if (!fseek(fp, 0, SEEK_END))
+		size = ftell(fp);
+	if (size < 0 || size % 64 != 16 || fseek(fp, 0, SEEK_SET)) {
+		fclose(fp);
+		return false;
+	}
+
+	const u8 *data = NULL;
+	bool mapped = false;
+#ifdef USE_MMAP
+	void *const ptr = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED,
+			       fileno(fp), 0);
+	if (ptr != MAP_FAILED) {
+		data = ptr;
+		mapped = true;
+	}
+#endif
+	if (!data) {
+		u8 *const buf = malloc((size_t)size);
+		if (!buf) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+		if (fread(buf, 1, (size_t)size, fp) != (size_t)size) {
+			free(buf);
+			fclose(fp);
+			return false;
+		}
+		data = buf;
+	}
+	fclose(fp);
+
+	tf->data = data;
+	tf->size = (size_t)size;
+	tf->mapped = mapped;
+	if (read_little_endian(data, 4) != (dtz ? DTZ_MAGIC : WDL_MAGIC) ||
+	    !parse_table_file(e, dtz)) {
+		free_table_file(tf);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * The file starts with its flags and, for each file of the leading pawn, the
+ * order of the groups and the pieces of each side, followed by the sizes of the
+ * tables, the DTZ map, the sparse indices, the block lengths and the data. The
+ * WDL files have the tables of both sides interleaved unless both sides have
+ * the same material, while the DTZ files only have one side.
+ */
+static bool parse_table_file(struct tb_entry *e, bool dtz)
+{
+	struct tb_file *const tf = dtz ? &e->dtz : &e->wdl;
+	const u8 *const base = tf->data;
+	const u8 *data = base + 4;
+
+	if (!(*data & FILE_FLAG_HAS_PAWNS) != !e->has_pawns)
+		return false;
+	++data;
+
+	const int sides_nb = !dtz && e->key != e->key2 ? 2 : 1;
+	const int files_nb = e->has_pawns ? 4 : 1;
+	const bool pp = e->has_pawns && e->pawn_count[1];
+
+	for (int f = 0; f < files_nb; ++f) {
+		const int order[2][2] = {
+			{ *data & 0xf, pp ? data[1] & 0xf : 0xf },
+			{ *data >> 4, pp ? data[1] >> 4 : 0xf },
+		};
+		data += 1 + pp;
+		for (int k = 0; k < e->pieces_nb; ++k, ++data) {
+			for (int i = 0; i < sides_nb; ++i)
+				tf->pairs[i][f].pieces[k] =
+					(u8)(i ? *data >> 4 : *data & 0xf);
+		}
+		for (int i = 0; i < sides_nb; ++i)
+			set_groups(&tf->pairs[i][f], e, order[i], f);
+	}
+	data += (data - base) & 1;
+
+	for (int f = 0; f < files_nb; ++f) {
+		for (int i = 0; i < sides_nb; ++i)
+			data = set_sizes(&tf->pairs[i][f], data);
+	}
+	if (dtz)
+		data = set_dtz_map(tf, data, base, files_nb);
+
+	for (int f = 0; f < files_nb; ++f) {
+		for (int i = 0; i < sides_nb; ++i) {
+			struct pairs_data *const d = &tf->pairs[i][f];
+			d->sparse_index = data;
+			data += 6 * d->sparse_index_size;
+		}
+	}
+	for (int f = 0; f < files_nb; ++f) {
+		for (int i = 0; i < sides_nb; ++i) {
+			struct pairs_data *const d = &tf->pairs[i][f];
+			d->block_length = data;
+			data += 2 * d->block_length_size;
+		}
+	}
+	for (int f = 0; f < files_nb; ++f) {
+		for (int i = 0; i < sides_nb; ++i) {
+			struct pairs_data *const d = &tf->pairs[i][f];
+			data = base + (((size_t)(data - base) + 0x3f) &
+				       ~(size_t)0x3f);
+			d->data = data;
+			data += (size_t)d->blocks_nb * d->sizeof_block;
+		}
+	}
+	return data <= base + tf->size;
+}
+
+static void free_table_file(struct tb_file *tf)
+{
+	for (int i = 0; i < 2; ++i) {
+		for (int f = 0; f < 4; ++f) {
+			free(tf->pairs[i][f].base64);
+			free(tf->pairs[i][f].symlen);
+			tf->pairs[i][f].base64 = NULL;
+			tf->pairs[i][f].symlen = NULL;
+		}
+	}
+#ifdef USE_MMAP
+	if (tf->mapped)
+		munmap((void *)tf->data, tf->size);
+	else
+		free((void *)tf->data);
+#else
+	free((void *)tf->data);
+#endif
+	tf->data = NULL;
+	tf->size = 0;
+	tf->mapped = false;
+}
+
+/*
+ * The pieces are split in groups of pieces of the same kind, except for the
+ * leading group, which has the leading pawns or, without pawns, the kings or
+ * three unique pieces. The index of a position is a number in a mixed radix
+ * where each group is a digit, so group_idx[i] is the product of the number of
+ * placements of the groups that come before group i in the order of the file,
+ * and the last element is the size of the table.
+ */
+static void set_groups(struct pairs_data *d, const struct tb_entry *e,
+		       const int order[2], int file)
+{
+	int n = 0;
+	int first_len = e->has_pawns ? 0 : e->has_unique_pieces ? 3 : 2;
+	d->group_len[n] = 1;
+	for (int i = 1; i < e->pieces_nb; ++i) {
+		if (--first_len > 0 || d->pieces[i] == d->pieces[i - 1])
+			++d->group_len[n];
+		else
+			d->group_len[++n] = 1;
+	}
+	d->group_len[++n] = 0;
+
+	/* With pawns on both sides the second group is the pawns of the other
+	 * color, which can't be on the squares of the leading pawns. */
+	const bool pp = e->has_pawns && e->pawn_count[1];
+	int next = pp ? 2 : 1;
+	int free_squares = 64 - d->group_len[0] - (pp ? d->group_len[1] : 0);
+	u64 idx = 1;
+	for (int k = 0; next < n || k == order[0] || k == order[1]; ++k) {
+		if (k == order[0]) {
+			d->group_idx[0] = idx;
+			idx *= (u64)(e->has_pawns ?
+				lead_pawns_size[d->group_len[0]][file] :
+				e->has_unique_pieces ? UNIQUE_PIECES_SIZE :
+						       KINGS_SIZE);
+		} else if (k == order[1]) {
+			d->group_idx[1] = idx;
+			idx *= (u64)binomial[d->group_len[1]]
+					    [48 - d->group_len[0]];
+		} else {
+			d->group_idx[next] = idx;
+			idx *= (u64)binomial[d->group_len[next]][free_squares];
+			free_squares -= d->group_len[next++];
+		}
+	}
+	d->group_idx[n] = idx;
+}
+
+/*
+ * The lowest symbol of each code length is used to compute base64. The codes
+ * are canonical with the longer codes having the lower values, so base64[i] is
+ * the first code of length min_sym_len + i padded to 64 bits.
+ */
+static const u8 *set_sizes(struct pairs_data *d, const u8 *data)
+{
+	d->flags = *data++;
+	if (d->flags & TABLE_FLAG_SINGLE_VALUE) {
+		d->blocks_nb = 0;
+		d->span = 0;
+		d->sparse_index_size = 0;
+		d->block_length_size = 0;
+		d->min_sym_len = *data++;
+		return data;
+	}
+
+	int n = 0;
+	while (d->group_len[n])
+		++n;
+	const u64 tb_size = d->group_idx[n];
+
+	d->sizeof_block = (u64)1 << *data++;
+	d->span = (u64)1 << *data++;
+	d->sparse_index_size = (size_t)((tb_size + d->span - 1) / d->span);
+	const u8 padding = *data++;
+	d->blocks_nb = (u32)read_little_endian(data, 4);
+	data += 4;
+	/* The padding keeps the sparse index from pointing outside. */
+	d->block_length_size = (size_t)d->blocks_nb + padding;
+	d->max_sym_len = *data++;
+	d->min_sym_len = *data++;
+	d->lowest_sym = data;
+
+	const int base64_size = d->max_sym_len - d->min_sym_len + 1;
+	if (base64_size <= 0)
+		return data;
+	d->base64 = calloc((size_t)base64_size, sizeof(*d->base64));
+	if (!d->base64) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	for (int i = base64_size - 2; i >= 0; --i) {
+		d->base64[i] = (d->base64[i + 1] +
+				read_little_endian(&d->lowest_sym[2 * i], 2) -
+				read_little_endian(&d->lowest_sym[2 * i + 2],
+						   2)) / 2;
+	}
+	for (int i = 0; i < base64_size; ++i)
+		d->base64[i] <<= 64 - i - d->min_sym_len;
+	data += 2 * base64_size;
+
+	d->symlen_size = (size_t)read_little_endian(data, 2);
+	data += 2;
+	d->btree = data;
+	d->symlen = calloc(d->symlen_size ? d->symlen_size : 1,
+			   sizeof(*d->symlen));
+	bool *const visited = calloc(d->symlen_size ? d->symlen_size : 1,
+				     sizeof(*visited));
+	if (!d->symlen || !visited) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	for (u32 sym = 0; sym < d->symlen_size; ++sym) {
+		if (!visited[sym])
+			d->symlen[sym] = set_symlen(d, sym, visited);
+	}
+	free(visited);
+	return data + 3 * d->symlen_size + (d->symlen_size & 1);
+}
+
+/*
+ * The DTZ values are stored in a smaller range and the map gives the real
+ * values for each result, in bytes or, with wide maps, in 16-bit words.
+ */
+static const u8 *set_dtz_map(struct tb_file *tf, const u8 *data,
+			     const u8 *base, int files_nb)
+{
+	tf->dtz_map = data;
+	for (int f = 0; f < files_nb; ++f) {
+		struct pairs_data *const d = &tf->pairs[0][f];
+		if (!(d->flags & TABLE_FLAG_MAPPED))
+			continue;
+		if (d->flags & TABLE_FLAG_WIDE) {
+			data += (data - base) & 1;
+			for (int i = 0; i < 4; ++i) {
+				d->map_idx[i] =
+					(u16)((data - tf->dtz_map) / 2 + 1);
+				data += 2 * read_little_endian(data, 2) + 2;
+			}
+		} else {
+			for (int i = 0; i < 4; ++i) {
+				d->map_idx[i] = (u16)(data - tf->dtz_map + 1);
+				data += *data + 1;
+			}
+		}
+	}
+	return data + ((data - base) & 1);
+}
+
+/*
+ * Returns the number of values of the symbol minus one. A symbol with 0xfff
+ * on the right is a value, the other ones are pairs of symbols.
+ */
+static u8 set_symlen(struct pairs_data *d, u32 sym, bool *visited)
+{
+	visited[sym] = true;
+	const int right = get_btree_right(d, sym);
+	if (right == 0xfff)
+		return 0;
+	const int left = get_btree_left(d, sym);
+	if ((size_t)left >= d->symlen_size || (size_t)right >= d->symlen_size)
+		return 0;
+	if (!visited[left])
+		d->symlen[left] = set_symlen(d, (u32)left, visited);
+	if (!visited[right])
+		d->symlen[right] = set_symlen(d, (u32)right, visited);
+	return (u8)(d->symlen[left] + d->symlen[right] + 1);
+}
+
+/*
+ * Each symbol has 3 bytes with two 12-bit symbols, the left one first.
+ */
+static int get_btree_left(const struct pairs_data *d, u32 sym)
+{
+	const u8 *const lr = &d->btree[3 * sym];
+	return ((lr[1] & 0xf) << 8) | lr[0];
+}
+
+static int get_btree_right(const struct pairs_data *d, u32 sym)
+{
+	const u8 *const lr = &d->btree[3 * sym];
+	return (lr[2] << 4) | (lr[1] >> 4);
+}
+
+/*
+ * Finds the value of the index. The sparse index gives a block and an offset
+ * for the middle of each span of indices, from which we walk to the block that
+ * has the index. Then the symbols of the block are decoded until the one
+ * holding the index, and its pairs are expanded until we reach a value.
+ */
+static int decompress_pairs(const struct pairs_data *d, u64 idx)
+{
+	if (d->flags & TABLE_FLAG_SINGLE_VALUE)
+		return d->min_sym_len;
+
+	const u8 *const entry = &d->sparse_index[6 * (idx / d->span)];
+	u32 block = (u32)read_little_endian(entry, 4);
+	int offset = (int)read_little_endian(entry + 4, 2);
+	offset += (int)(idx % d->span) - (int)(d->span / 2);
+	while (offset < 0) {
+		--block;
+		offset += (int)read_little_endian(&d->block_length[2 * block],
+						  2) + 1;
+	}
+	for (int len = (int)read_little_endian(&d->block_length[2 * block], 2);
+	     offset > len;
+	     len = (int)read_little_endian(&d->block_length[2 * block], 2)) {
+		offset -= len + 1;
+		++block;
+	}
+
+	const u8 *ptr = d->data + (u64)block * d->sizeof_block;
+	u64 buf64 = read_big_endian(ptr, 8);
+	ptr += 8;
+	int buf64_size = 64;
+	u32 sym;
+	for (;;) {
+		int len = 0;
+		while (buf64 < d->base64[len])
+			++len;
+		sym = (u32)((buf64 - d->base64[len]) >>
+			    (64 - len - d->min_sym_len));
+		sym += (u32)read_little_endian(&d->lowest_sym[2 * len], 2);
+		if (offset < d->symlen[sym] + 1)
+			break;
+		offset -= d->symlen[sym] + 1;
+		len += d->min_sym_len;
+		buf64 <<= len;
+		buf64_size -= len;
+		if (buf64_size <= 32) {
+			buf64_size += 32;
+			buf64 |= read_big_endian(ptr, 4) << (64 - buf64_size);
+			ptr += 4;
+		}
+	}
+
+	while (d->symlen[sym]) {
+		const int left = get_btree_left(d, sym);
+		if (offset < d->symlen[left] + 1) {
+			sym = (u32)left;
+		} else {
+			offset -= d->symlen[left] + 1;
+			sym = (u32)get_btree_right(d, sym);
+		}
+	}
+	return get_btree_left(d, sym);
+}
+
+/*
+ * Reads the value of the position in the WDL or the DTZ file of its material.
+ * With the DTZ file the result must be known, since the map depends on it, and
+ * the result is PROBE_CHANGE_STM if the file only has the other side to move.
+ *
+ * The tables have the strongest side as white, so when black has the material
+ * of white in the name the colors are swapped and the board is flipped. When
+ * both sides have the same material only white to move is stored.
+ */
+static int probe_table(const Position *pos, bool dtz, Wdl wdl,
+		       enum probe_result *result)
+{
+	if (get_pieces_count(pos) == 2)
+		return 0;
+
+	struct tb_entry *const e = get_entry(get_material_key(pos));
+	if (!e || !map_table_file(e, dtz)) {
+		*result = PROBE_FAIL;
+		return 0;
+	}
+	const struct tb_file *const tf = dtz ? &e->dtz : &e->wdl;
+
+	int stm;
+	int file;
+	const u64 idx = get_position_index(&stm, &file, e, tf, dtz, pos);
+	if (dtz) {
+		const u8 flags = tf->pairs[0][file].flags;
+		if ((flags & TABLE_FLAG_STM) != stm &&
+		    (e->key != e->key2 || e->has_pawns)) {
+			*result = PROBE_CHANGE_STM;
+			return 0;
+		}
+	}
+
+	const struct pairs_data *const d = &tf->pairs[dtz ? 0 : stm][file];
+	const int value = decompress_pairs(d, idx);
+	if (dtz)
+		return map_dtz_score(tf, file, value, wdl);
+	return value - 2;
+}
+
+/*
+ * Returns the index of the position in the table of the file and gives the side
+ * to move and the file of the leading pawn in the tables, which pick the table.
+ */
+static u64 get_position_index(int *stm, int *file, const struct tb_entry *e,
+			      const struct tb_file *tf, bool dtz,
+			      const Position *pos)
+{
+	const Color side_to_move = get_side_to_move(pos);
+	const bool flip = (e->key == e->key2 && side_to_move == COLOR_BLACK) ||
+			  get_material_key(pos) != e->key;
+	const int flip_color = flip ? 8 : 0;
+	const int flip_squares = flip ? 56 : 0;
+	*stm = (int)flip ^ (int)side_to_move;
+
+	int squares[TB_PIECES] = { 0 };
+	int pieces[TB_PIECES];
+	int size = 0;
+	int lead_pawns_nb = 0;
+	u64 lead_pawns = 0;
+	*file = FILE_A;
+
+	/* The pawns are always first in the tables and their color is the
+	 * leading color. The leading pawn is the one with the highest number
+	 * and it gives the table. */
+	if (e->has_pawns) {
+		const int piece = tf->pairs[0][0].pieces[0] ^ flip_color;
+		const Color c = piece & 8 ? COLOR_BLACK : COLOR_WHITE;
+		lead_pawns = get_piece_bitboard(
+			pos, create_piece(PIECE_TYPE_PAWN, c));
+		for (u64 bb = lead_pawns; bb;)
+			squares[size++] = unset_ls1b(&bb) ^ flip_squares;
+		lead_pawns_nb = size;
+		int lead = 0;
+		for (int i = 1; i < lead_pawns_nb; ++i) {
+			if (map_pawns[squares[i]] > map_pawns[squares[lead]])
+				lead = i;
+		}
+		const int tmp = squares[0];
+		squares[0] = squares[lead];
+		squares[lead] = tmp;
+		*file = squares[0] & 7;
+		*file = *file > FILE_D ? 7 - *file : *file;
+	}
+
+	const u64 occ = get_color_bitboard(pos, COLOR_WHITE) |
+			get_color_bitboard(pos, COLOR_BLACK);
+	for (u64 bb = occ ^ lead_pawns; bb;) {
+		const int sq = unset_ls1b(&bb);
+		squares[size] = sq ^ flip_squares;
+		const Piece piece = get_piece_at(pos, (Square)sq);
+		pieces[size++] = get_tb_piece(piece) ^ flip_color;
+	}
+
+	const struct pairs_data *const d = &tf->pairs[dtz ? 0 : *stm][*file];
+	return encode_position(e, d, squares, pieces, size, lead_pawns_nb);
+}
+
+/*
+ * Computes the index of the position in the table. The pieces are put in the
+ * order of the table, and the board is mirrored so that the leading piece is
+ * on the files a to d and, without pawns, in the a1-d1-d4 triangle and below
+ * the diagonal. Then each group is encoded by the squares of its pieces from
+ * the lowest, skipping the squares of the groups before it.
+ */
+static u64 encode_position(const struct tb_entry *e,
+			   const struct pairs_data *d, int *squares,
+			   int *pieces, int size, int lead_pawns_nb)
+{
+	for (int i = lead_pawns_nb; i < size - 1; ++i) {
+		for (int j = i + 1; j < size; ++j) {
+			if (d->pieces[i] != pieces[j])
+				continue;
+			int tmp = pieces[i];
+			pieces[i] = pieces[j];
+			pieces[j] = tmp;
+			tmp = squares[i];
+			squares[i] = squares[j];
+			squares[j] = tmp;
+			break;
+		}
+	}
+
+	if ((squares[0] & 7) > FILE_D) {
+		for (int i = 0; i < size; ++i)
+			squares[i] ^= 7;
+	}
+
+	u64 idx;
+	if (e->has_pawns) {
+		idx = (u64)lead_pawn_idx[lead_pawns_nb][squares[0]];
+		sort_squares(squares + 1, lead_pawns_nb - 1, map_pawns);
+		for (int i = 1; i < lead_pawns_nb; ++i)
+			idx += (u64)binomial[i][map_pawns[squares[i]]];
+	} else {
+		if ((squares[0] >> 3) > RANK_4) {
+			for (int i = 0; i < size; ++i)
+				squares[i] ^= 56;
+		}
+
+		/* The first piece of the leading group that is not on the
+		 * diagonal must be below it. */
+		for (int i = 0; i < d->group_len[0]; ++i) {
+			if (!get_off_diagonal(squares[i]))
+				continue;
+			if (get_off_diagonal(squares[i]) > 0) {
+				for (int j = i; j < size; ++j) {
+					squares[j] = ((squares[j] >> 3) |
+						      (squares[j] << 3)) & 63;
+				}
+			}
+			break;
+		}
+
+		if (e->has_unique_pieces) {
+			const int s0 = squares[0];
+			const int s1 = squares[1];
+			const int s2 = squares[2];
+			const int adjust1 = s1 > s0;
+			const int adjust2 = (s2 > s0) + (s2 > s1);
+			int n;
+			if (get_off_diagonal(s0)) {
+				n = (map_a1d1d4[s0] * 63 + (s1 - adjust1)) *
+					    62 +
+				    s2 - adjust2;
+			} else if (get_off_diagonal(s1)) {
+				n = (6 * 63 + (s0 >> 3) * 28 + map_b1h1h7[s1]) *
+					    62 +
+				    s2 - adjust2;
+			} else if (get_off_diagonal(s2)) {
+				n = 6 * 63 * 62 + 4 * 28 * 62 +
+				    (s0 >> 3) * 7 * 28 +
+				    ((s1 >> 3) - adjust1) * 28 + map_b1h1h7[s2];
+			} else {
+				n = 6 * 63 * 62 + 4 * 28 * 62 + 4 * 7 * 28 +
+				    (s0 >> 3) * 7 * 6 +
+				    ((s1 >> 3) - adjust1) * 6 +
+				    ((s2 >> 3) - adjust2);
+			}
+			idx = (u64)n;
+		} else {
+			idx = (u64)map_kk[map_a1d1d4[squares[0]]][squares[1]];
+		}
+	}
+
+	idx *= d->group_idx[0];
+	int *group_squares = squares + d->group_len[0];
+	/* The pawns of the other color can't be on the first and last ranks. */
+	int remaining_pawns = e->has_pawns && e->pawn_count[1];
+	for (int next = 1; d->group_len[next]; ++next) {
+		const int len = d->group_len[next];
+		sort_squares(group_squares, len, square_order);
+		u64 n = 0;
+		for (int i = 0; i < len; ++i) {
+			int adjust = 0;
+			for (const int *sq = squares; sq < group_squares; ++sq)
+				adjust += group_squares[i] > *sq;
+			n += (u64)binomial[i + 1][group_squares[i] - adjust -
+						  8 * remaining_pawns];
+		}
+		remaining_pawns = 0;
+		idx += n * d->group_idx[next];
+		group_squares += len;
+	}
+	return idx;
+}
+
+/*
+ * The DTZ files store moves instead of plies for the results where it doesn't
+ * matter, so they are doubled. The cursed and the blessed results are always
+ * stored in moves.
+ */
+static int map_dtz_score(const struct tb_file *tf, int file, int value,
+			 Wdl wdl)
+{
+	static const int wdl_map[] = { 1, 3, 0, 2, 0 };
+	const struct pairs_data *const d = &tf->pairs[0][file];
+	if (d->flags & TABLE_FLAG_MAPPED) {
+		const size_t idx = (size_t)d->map_idx[wdl_map[wdl + 2]] +
+				   (size_t)value;
+		if (d->flags & TABLE_FLAG_WIDE)
+			value = (int)read_little_endian(&tf->dtz_map[2 * idx],
+							2);
+		else
+			value = tf->dtz_map[idx];
+	}
+	if ((wdl == WDL_WIN && !(d->flags & TABLE_FLAG_WIN_PLIES)) ||
+	    (wdl == WDL_LOSS && !(d->flags & TABLE_FLAG_LOSS_PLIES)) ||
+	    wdl == WDL_CURSED_WIN || wdl == WDL_BLESSED_LOSS)
+		value *= 2;
+	return value + 1;
+}
+
+/*
+ * Searches the captures, and with check_zeroing_moves the pawn moves too,
+ * before probing the table, since the table may be wrong when one of them is
+ * the best move. The result is PROBE_ZEROING_BEST_MOVE when one of them is at
+ * least as good as the table, which the DTZ probe needs to know. If all the
+ * legal moves were searched the table is not probed at all.
+ */
+static Wdl search_captures(Position *pos, bool check_zeroing_moves,
+			   enum probe_result *result)
+{
+	struct move_with_score moves[MAX_MOVES];
+	const int moves_nb = get_legal_moves(moves, MOVE_GEN_TYPE_ALL, pos);
+	int searched_nb = 0;
+	Wdl best = WDL_LOSS;
+	for (int i = 0; i < moves_nb; ++i) {
+		const Move move = moves[i].move;
+		if (!move_is_capture(move) &&
+		    (!check_zeroing_moves || !is_zeroing_move(pos, move)))
+			continue;
+		++searched_nb;
+		do_move(pos, move);
+		const Wdl wdl = (Wdl)-search_captures(pos, false, result);
+		undo_move(pos, move);
+		if (*result == PROBE_FAIL)
+			return WDL_DRAW;
+		if (wdl > best) {
+			best = wdl;
+			if (wdl >= WDL_WIN) {
+				*result = PROBE_ZEROING_BEST_MOVE;
+				return wdl;
+			}
+		}
+	}
+
+	const bool no_more_moves = searched_nb && searched_nb == moves_nb;
+	Wdl wdl = best;
+	if (!no_more_moves) {
+		wdl = (Wdl)probe_table(pos, false, WDL_DRAW, result);
+		if (*result == PROBE_FAIL)
+			return WDL_DRAW;
+	}
+	if (best >= wdl) {
+		*result = best > WDL_DRAW || no_more_moves ?
+				  PROBE_ZEROING_BEST_MOVE :
+				  PROBE_OK;
+		return best;
+	}
+	*result = PROBE_OK;
+	return wdl;
+}
+
+/*
+ * When the DTZ file only has the other side to move we search one ply and take
+ * the best DTZ of the moves that keep the result.
+ */
+static int get_dtz(Position *pos, enum probe_result *result)
+{
+	*result = PROBE_OK;
+	const Wdl wdl = search_captures(pos, true, result);
+	/* The DTZ files don't store the draws. */
+	if (*result == PROBE_FAIL || wdl == WDL_DRAW)
+		return 0;
+	if (*result == PROBE_ZEROING_BEST_MOVE)
+		return dtz_before_zeroing(wdl);
+
+	int dtz = probe_table(pos, true, wdl, result);
+	if (*result == PROBE_FAIL)
+		return 0;
+	if (*result != PROBE_CHANGE_STM) {
+		const bool over_fifty =
+			wdl == WDL_BLESSED_LOSS || wdl == WDL_CURSED_WIN;
+		return (dtz + 100 * over_fifty) * sign(wdl);
+	}
+
+	struct move_with_score moves[MAX_MOVES];
+	const int moves_nb = get_legal_moves(moves, MOVE_GEN_TYPE_ALL, pos);
+	int min_dtz = INT_MAX;
+	for (int i = 0; i < moves_nb; ++i) {
+		const Move move = moves[i].move;
+		const bool zeroing = is_zeroing_move(pos, move);
+		do_move(pos, move);
+		/* For a zeroing move we want the DTZ before the move, so we
+		 * only need the result of the position after it. */
+		if (zeroing) {
+			dtz = -dtz_before_zeroing(
+				search_captures(pos, false, result));
+		} else {
+			dtz = -get_dtz(pos, result);
+		}
+		if (dtz == 1 && get_checkers(pos) && !has_legal_moves(pos))
+			min_dtz = 1;
+		if (!zeroing)
+			dtz += sign(dtz);
+		if (dtz < min_dtz && sign(dtz) == sign(wdl))
+			min_dtz = dtz;
+		undo_move(pos, move);
+		if (*result == PROBE_FAIL)
+			return 0;
+	}
+	/* Without legal moves the position is mate. */
+	return min_dtz == INT_MAX ? -1 : min_dtz;
+}
+
+/*
+ * Gets the DTZ of the root after the move. A move that leads to a repetition or
+ * to the fifty-move rule is a draw, and a mate is given the DTZ of a zeroing
+ * move.
+ */
+static bool get_root_dtz(int *dtz, Position *pos, Move move)
+{
+	enum probe_result result = PROBE_OK;
+	do_move(pos, move);
+	if (!get_halfmove_clock(pos)) {
+		*dtz = dtz_before_zeroing(
+			(Wdl)-search_captures(pos, false, &result));
+	} else if (is_repetition(pos) || get_halfmove_clock(pos) >= 100) {
+		*dtz = 0;
+	} else {
+		*dtz = -get_dtz(pos, &result);
+		*dtz += sign(*dtz);
+	}
+	if (*dtz == 2 && get_checkers(pos) && !has_legal_moves(pos))
+		*dtz = 1;
+	undo_move(pos, move);
+	return result != PROBE_FAIL;
+}
+
+static int dtz_before_zeroing(Wdl wdl)
+{
+	switch (wdl) {
+	case WDL_WIN:
+		return 1;
+	case WDL_CURSED_WIN:
+		return 101;
+	case WDL_BLESSED_LOSS:
+		return -101;
+	case WDL_LOSS:
+		return -1;
+	default:
+		return 0;
+	}
+}
+
+static int sign(int n)
+{
+	return (n > 0) - (n < 0);
+}
+
+static bool is_zeroing_move(const Position *pos, Move move)
+{
+	const Piece piece = get_piece_at(pos, get_move_origin(move));
+	return move_is_capture(move) ||
+	       get_piece_type(piece) == PIECE_TYPE_PAWN;
+}
+
+static bool has_legal_moves(const Position *pos)
+{
+	struct move_with_score moves[MAX_MOVES];
+	return get_legal_moves(moves, MOVE_GEN_TYPE_ALL, pos) > 0;
+}
+
+static bool has_castling_rights(const Position *pos)
+{
+	for (Color c = COLOR_WHITE; c <= COLOR_BLACK; ++c) {
+		if (has_castling_right(pos, c, CASTLING_SIDE_KING) ||
+		    has_castling_right(pos, c, CASTLING_SIDE_QUEEN))
+			return true;
+	}
+	return false;
+}
+
+static int get_pieces_count(const Position *pos)
+{
+	return get_number_of_pieces_of_color(pos, COLOR_WHITE) +
+	       get_number_of_pieces_of_color(pos, COLOR_BLACK);
+}
+
+static int get_tb_piece(Piece piece)
+{
+	return ((int)get_piece_type(piece) + 1) |
+	       (get_piece_color(piece) == COLOR_BLACK ? 8 : 0);
+}
+
+/*
+ * Sorts the squares by their value in order with an insertion sort, which keeps
+ * the order of the squares with the same value.
+ */
+static void sort_squares(int *squares, int n, const int *order)
+{
+	for (int i = 1; i < n; ++i) {
+		const int sq = squares[i];
+		int j = i - 1;
+		for (; j >= 0 && order[squares[j]] > order[sq]; --j)
+			squares[j + 1] = squares[j];
+		squares[j + 1] = sq;
+	}
+}
+
+static u64 read_little_endian(const u8 *bytes, int len)
+{
+	u64 n = 0;
+	for (int i = len - 1; i >= 0; --i)
+		n = n << 8 | bytes[i];
+	return n;
+}
+
+static u64 read_big_endian(const u8 *bytes, int len)
+{
+	u64 n = 0;
+	for (int i = 0; i < len; ++i)
+		n = n << 8 | bytes[i];
+	return n;
+}
+
+#ifdef TEST
+
+#include <unistd.h>
+
+#include <unity/unity.h>
+
+/*
+ * The probes are tested on a KQvK table that the test writes itself in the
+ * format of the files, with the results found by a retrograde analysis with
+ * our move generator. The WDL file has a table with a single value for white to
+ * move and a table coded with pairs for black to move, and the DTZ file has a
+ * mapped table for white to move, so black to move needs a search of one ply.
+ */
+
+#define TEST_BLOCK_LOG 6
+#define TEST_SPAN_LOG 8
+#define TEST_MAX_SYMBOLS 16
+#define TEST_MAX_NODES (10 * 64 * 64)
+
+struct test_buffer {
+	u8 *data;
+	size_t size;
+	size_t cap;
+};
+
+/*
+ * A canonical Huffman code where the symbols with the longer codes come first,
+ * like in the files. A symbol is a value if its right symbol is 0xfff and a
+ * pair of symbols that come before it otherwise.
+ */
+struct test_code {
+	int min_len;
+	int max_len;
+	int symbols_nb;
+	const int *lens;
+	const int (*btree)[2];
+};
+
+/* The parts of a table, which are interleaved with the other tables. */
+struct test_table {
+	struct test_buffer sizes;
+	struct test_buffer sparse_index;
+	struct test_buffer block_length;
+	struct test_buffer data;
+};
+
+/*
+ * A legal KQvK position with the white king in the a1-d1-d4 triangle, which
+ * has all the positions up to the symmetries, and the indices of the positions
+ * after its moves.
+ */
+struct test_node {
+	/* The white king, the white queen and the black king. */
+	int squares[3];
+	u64 idx;
+	size_t first_succ;
+	int succ_nb;
+	bool can_capture; /* Black can capture the queen. */
+	bool mated;
+};
+
+/*
+ * The white nodes are indexed in the DTZ table and the black nodes in the WDL
+ * table of black to move. The distances to mate are in plies and are -1 for
+ * the positions that are not lost or won.
+ */
+struct test_kqvk {
+	struct tb_entry entry;
+	struct test_node *nodes[2];
+	int nodes_nb[2];
+	u64 *succ;
+	size_t succ_nb;
+	int dtm[2][UNIQUE_PIECES_SIZE];
+};
+
+/* The order of the pieces in the WDL tables of each side and the DTZ table. */
+static const u8 kqvk_pieces[3][3] = {
+	{ 6, 5, 14 },
+	{ 5, 14, 6 },
+	{ 14, 6, 5 },
+};
+
+static void test_index_tables(void);
+static void test_kings_encoding(void);
+static void test_unique_pieces_encoding(void);
+static void test_pawn_encoding(void);
+static void test_kqvk_probes(void);
+static void check_encoding(const struct tb_entry *e,
+			   const struct pairs_data *d, const int *squares,
+			   const int *pieces, int size, int symmetries_nb,
+			   int *owners);
+static int transform_square(int sq, int symmetry);
+static u64 get_table_size(const struct pairs_data *d);
+static void init_kqvk_entry(struct tb_entry *e);
+static void add_kqvk_nodes(struct test_kqvk *kqvk, Color c);
+static void solve_kqvk(struct test_kqvk *kqvk);
+static void write_kqvk_wdl(const char *path, const struct test_kqvk *kqvk);
+static void write_kqvk_dtz(const char *path, const struct test_kqvk *kqvk);
+static void check_kqvk_probes(const struct test_kqvk *kqvk, bool mirror);
+static void check_kqvk_root_moves(const struct test_kqvk *kqvk);
+static void get_kqvk_fen(char *fen, const int squares[3], Color c, bool mirror);
+static void encode_table(struct test_table *t, const struct test_code *code,
+			 const int *tokens, size_t tokens_nb, u64 table_size,
+			 u8 flags);
+static void write_test_file(const char *path, u32 magic, const u8 *pieces,
+			    struct test_table *tables, int tables_nb,
+			    const struct test_buffer *dtz_map);
+static void free_test_table(struct test_table *t);
+static void put_bytes(struct test_buffer *buf, u64 n, int len);
+static void append_buffer(struct test_buffer *buf,
+			  const struct test_buffer *src);
+static void align_buffer(struct test_buffer *buf, size_t alignment);
+
+void test_tb(void)
+{
+	init_index_tables();
+	test_index_tables();
+	test_kings_encoding();
+	test_unique_pieces_encoding();
+	test_pawn_encoding();
+	test_kqvk_probes();
+}
+
+static void test_index_tables(void)
+{
+	/* The squares below the diagonal come before the ones on it. */
+	const int triangle[10] = { B1, C1, D1, C2, D2, D3, A1, B2, C3, D4 };
+	for (int i = 0; i < 10; ++i) {
+		TEST_ASSERT_MESSAGE(map_a1d1d4[triangle[i]] == i,
+				    "Wrong triangle index.");
+	}
+
+	for (int n = 0; n < 64; ++n) {
+		long expected = 1;
+		for (int k = 0; k < 6; ++k) {
+			TEST_ASSERT_MESSAGE(binomial[k][n] == expected,
+					    "Wrong binomial coefficient.");
+			expected = expected * (n - k) / (k + 1);
+		}
+	}
+
+	bool seen[48] = { false };
+	for (int sq = A2; sq <= H7; ++sq) {
+		const int n = map_pawns[sq];
+		TEST_ASSERT_MESSAGE(n >= 0 && n < 48 && !seen[n],
+				    "Pawn squares with the same number.");
+		seen[n] = true;
+	}
+	/* The files closest to the edge and then the lowest ranks first. */
+	TEST_ASSERT_MESSAGE(map_pawns[A2] == 47 && map_pawns[H2] == 46,
+			    "Wrong pawn numbering.");
+	TEST_ASSERT_MESSAGE(map_pawns[A7] == 37 && map_pawns[B2] == 35,
+			    "Wrong pawn numbering.");
+	TEST_ASSERT_MESSAGE(map_pawns[E7] == 0, "Wrong pawn numbering.");
+
+	for (int file = FILE_A; file <= FILE_D; ++file) {
+		TEST_ASSERT_MESSAGE(lead_pawns_size[1][file] == 6,
+				    "Wrong number of leading pawns.");
+	}
+	/* 47 + 45 + 43 + 41 + 39 + 37 squares for the second pawn. */
+	TEST_ASSERT_MESSAGE(lead_pawns_size[2][FILE_A] == 252,
+			    "Wrong number of leading pawns.");
+	/* C(11, 4) + C(9, 4) + C(7, 4) + C(5, 4) with the leading pawn on the
+	 * d-file. */
+	TEST_ASSERT_MESSAGE(lead_pawns_size[5][FILE_D] == 496,
+			    "Wrong number of leading pawns.");
+}
+
+/*
+ * Every code of the kings must be used, since there is one for each legal
+ * position of the kings up to the symmetries.
+ */
+static void test_kings_encoding(void)
+{
+	const u8 counts[2][5] = { { 0 } };
+	struct tb_entry e;
+	init_entry(&e, counts);
+	struct pairs_data *const d = &e.wdl.pairs[0][0];
+	d->pieces[0] = 6;
+	d->pieces[1] = 14;
+	set_groups(d, &e, (const int[2]){ 0, 0xf }, FILE_A);
+	TEST_ASSERT_MESSAGE(get_table_size(d) == KINGS_SIZE,
+			    "Wrong size of KvK.");
+
+	int owners[KINGS_SIZE];
+	for (int i = 0; i < KINGS_SIZE; ++i)
+		owners[i] = -1;
+	const int pieces[2] = { 6, 14 };
+	for (int sq1 = A1; sq1 <= H8; ++sq1) {
+		for (int sq2 = A1; sq2 <= H8; ++sq2) {
+			if (get_square_distance(sq1, sq2) <= 1)
+				continue;
+			const int squares[2] = { sq1, sq2 };
+			check_encoding(&e, d, squares, pieces, 2, 8, owners);
+		}
+	}
+	for (int i = 0; i < KINGS_SIZE; ++i)
+		TEST_ASSERT_MESSAGE(owners[i] >= 0, "Unused code of KvK.");
+}
+
+static void test_unique_pieces_encoding(void)
+{
+	const u8 counts[2][5] = { { 0, 0, 0, 0, 1 }, { 0 } };
+	struct tb_entry e;
+	init_entry(&e, counts);
+	struct pairs_data *const d = &e.wdl.pairs[0][0];
+	memcpy(d->pieces, kqvk_pieces[0], 3);
+	set_groups(d, &e, (const int[2]){ 0, 0xf }, FILE_A);
+	TEST_ASSERT_MESSAGE(get_table_size(d) == UNIQUE_PIECES_SIZE,
+			    "Wrong size of KQvK.");
+
+	int *const owners = malloc(UNIQUE_PIECES_SIZE * sizeof(*owners));
+	for (int i = 0; i < UNIQUE_PIECES_SIZE; ++i)
+		owners[i] = -1;
+	const int pieces[3] = { 6, 5, 14 };
+	for (int sq1 = A1; sq1 <= H8; ++sq1) {
+		for (int sq2 = A1; sq2 <= H8; ++sq2) {
+			for (int sq3 = A1; sq3 <= H8; ++sq3) {
+				if (sq1 == sq2 || sq1 == sq3 || sq2 == sq3)
+					continue;
+				const int squares[3] = { sq1, sq2, sq3 };
+				check_encoding(&e, d, squares, pieces, 3, 8,
+					       owners);
+			}
+		}
+	}
+	free(owners);
+}
+
+/*
+ * With pawns the only symmetry is the mirror of the files, and each file of the
+ * leading pawn has its own table.
+ */
+static void test_pawn_encoding(void)
+{
+	const u8 counts[2][5] = { { 1 }, { 0 } };
+	struct tb_entry e;
+	init_entry(&e, counts);
+	const int pieces[3] = { 1, 6, 14 };
+	for (int file = FILE_A; file <= FILE_D; ++file) {
+		struct pairs_data *const d = &e.wdl.pairs[0][file];
+		memcpy(d->pieces, (const u8[3]){ 1, 6, 14 }, 3);
+		set_groups(d, &e, (const int[2]){ 0, 0xf }, file);
+		const u64 size = get_table_size(d);
+		TEST_ASSERT_MESSAGE(size == 6 * 63 * 62, "Wrong size of KPvK.");
+
+		int *const owners = malloc(size * sizeof(*owners));
+		for (u64 i = 0; i < size; ++i)
+			owners[i] = -1;
+		for (int pawn = A2; pawn <= H7; ++pawn) {
+			if ((pawn & 7) != file && (pawn & 7) != 7 - file)
+				continue;
+			for (int sq1 = A1; sq1 <= H8; ++sq1) {
+				for (int sq2 = A1; sq2 <= H8; ++sq2) {
+					if (sq1 == pawn || sq2 == pawn ||
+					    sq1 == sq2)
+						continue;
+					const int squares[3] = { pawn, sq1,
+								 sq2 };
+					check_encoding(&e, d, squares, pieces,
+						       3, 2, owners);
+				}
+			}
+		}
+		free(owners);
+	}
+}
+
+static void test_kqvk_probes(void)
+{
+	char dir[] = "/tmp/athena-tb-XXXXXX";
+	TEST_ASSERT_MESSAGE(mkdtemp(dir), "Can't create the directory.");
+	char wdl_path[64];
+	char dtz_path[64];
+	snprintf(wdl_path, sizeof(wdl_path), "%s/KQvK%s", dir, WDL_SUFFIX);
+	snprintf(dtz_path, sizeof(dtz_path), "%s/KQvK%s", dir, DTZ_SUFFIX);
+
+	struct test_kqvk *const kqvk = calloc(1, sizeof(*kqvk));
+	if (!kqvk) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	kqvk->nodes[COLOR_WHITE] =
+		malloc(TEST_MAX_NODES * sizeof(*kqvk->nodes[COLOR_WHITE]));
+	kqvk->nodes[COLOR_BLACK] =
+		malloc(TEST_MAX_NODES * sizeof(*kqvk->nodes[COLOR_BLACK]));
+	/* A queen has at most 27 moves and a king 8. */
+	kqvk->succ = malloc(TEST_MAX_NODES * 2 * 35 * sizeof(*kqvk->succ));
+	if (!kqvk->nodes[COLOR_WHITE] || !kqvk->nodes[COLOR_BLACK] ||
+	    !kqvk->succ) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	init_kqvk_entry(&kqvk->entry);
+	add_kqvk_nodes(kqvk, COLOR_WHITE);
+	add_kqvk_nodes(kqvk, COLOR_BLACK);
+	solve_kqvk(kqvk);
+	write_kqvk_wdl(wdl_path, kqvk);
+	write_kqvk_dtz(dtz_path, kqvk);
+
+	TEST_ASSERT_MESSAGE(tb_init(dir) == 1 && get_tb_largest() == 3,
+			    "KQvK not found.");
+	check_kqvk_probes(kqvk, false);
+	check_kqvk_probes(kqvk, true);
+	check_kqvk_root_moves(kqvk);
+	tb_free();
+
+	remove(wdl_path);
+	remove(dtz_path);
+	rmdir(dir);
+	free(kqvk->nodes[COLOR_WHITE]);
+	free(kqvk->nodes[COLOR_BLACK]);
+	free(kqvk->succ);
+	free(kqvk);
+}
+
+/*
+ * Checks that the index of the position is in the table, that the positions
+ * given by the symmetries have the same index and that the other positions have
+ * different ones. The owner of an index is the smallest key of the squares of
+ * the positions that had it.
+ */
+static void check_encoding(const struct tb_entry *e,
+			   const struct pairs_data *d, const int *squares,
+			   const int *pieces, int size, int symmetries_nb,
+			   int *owners)
+{
+	u64 idx = 0;
+	int key = INT_MAX;
+	for (int symmetry = 0; symmetry < symmetries_nb; ++symmetry) {
+		int sq[TB_PIECES];
+		int pc[TB_PIECES];
+		int k = 0;
+		for (int i = 0; i < size; ++i) {
+			sq[i] = transform_square(squares[i], symmetry);
+			pc[i] = pieces[i];
+			k = 64 * k + sq[i];
+		}
+		const u64 n = encode_position(e, d, sq, pc, size,
+					      e->has_pawns ? 1 : 0);
+		TEST_ASSERT_MESSAGE(!symmetry || n == idx,
+				    "Symmetric positions with different "
+				    "indices.");
+		idx = n;
+		key = k < key ? k : key;
+	}
+	TEST_ASSERT_MESSAGE(idx < get_table_size(d), "Index out of the table.");
+	TEST_ASSERT_MESSAGE(owners[idx] < 0 || owners[idx] == key,
+			    "Different positions with the same index.");
+	owners[idx] = key;
+}
+
+/*
+ * Bit 0 of the symmetry mirrors the files, bit 1 mirrors the ranks and bit 2
+ * swaps the files and the ranks.
+ */
+static int transform_square(int sq, int symmetry)
+{
+	if (symmetry & 4)
+		sq = ((sq >> 3) | (sq << 3)) & 63;
+	if (symmetry & 1)
+		sq ^= 7;
+	if (symmetry & 2)
+		sq ^= 56;
+	return sq;
+}
+
+static u64 get_table_size(const struct pairs_data *d)
+{
+	int n = 0;
+	while (d->group_len[n])
+		++n;
+	return d->group_idx[n];
+}
+
+/*
+ * Sets the groups of the tables like the files we write, so that we can get the
+ * indices of the positions before the files exist.
+ */
+static void init_kqvk_entry(struct tb_entry *e)
+{
+	const u8 counts[2][5] = { { 0, 0, 0, 0, 1 }, { 0 } };
+	init_entry(e, counts);
+	struct pairs_data *const d[3] = {
+		&e->wdl.pairs[0][0],
+		&e->wdl.pairs[1][0],
+		&e->dtz.pairs[0][0],
+	};
+	for (int i = 0; i < 3; ++i) {
+		memcpy(d[i]->pieces, kqvk_pieces[i], 3);
+		set_groups(d[i], e, (const int[2]){ 0, 0xf }, FILE_A);
+	}
+}
+
+static void add_kqvk_nodes(struct test_kqvk *kqvk, Color c)
+{
+	const struct tb_entry *const e = &kqvk->entry;
+	Position *pos = malloc(sizeof(Position));
+	struct move_with_score moves[MAX_MOVES];
+	for (int wk = A1; wk <= D4; ++wk) {
+		if ((wk & 7) > FILE_D || get_off_diagonal(wk) > 0)
+			continue;
+		for (int wq = A1; wq <= H8; ++wq) {
+			for (int bk = A1; bk <= H8; ++bk) {
+				if (wq == wk || bk == wq ||
+				    get_square_distance(wk, bk) <= 1)
+					continue;
+				struct test_node *const node =
+					&kqvk->nodes[c][kqvk->nodes_nb[c]];
+				node->squares[0] = wk;
+				node->squares[1] = wq;
+				node->squares[2] = bk;
+				char fen[FEN_MAX_LEN];
+				get_kqvk_fen(fen, node->squares, c, false);
+				init_position(pos, fen);
+				if (c == COLOR_WHITE &&
+				    is_square_attacked((Square)bk, COLOR_WHITE,
+						       pos)) {
+					free_position(pos);
+					continue;
+				}
+
+				int stm;
+				int file;
+				node->idx = get_position_index(
+					&stm, &file, e,
+					c == COLOR_WHITE ? &e->dtz : &e->wdl,
+					c == COLOR_WHITE, pos);
+				node->first_succ = kqvk->succ_nb;
+				node->succ_nb = 0;
+				node->can_capture = false;
+				const int moves_nb = get_legal_moves(
+					moves, MOVE_GEN_TYPE_ALL, pos);
+				node->mated = !moves_nb && get_checkers(pos);
+				for (int i = 0; i < moves_nb; ++i) {
+					const Move move = moves[i].move;
+					if (move_is_capture(move)) {
+						node->can_capture = true;
+						continue;
+					}
+					do_move(pos, move);
+					kqvk->succ[kqvk->succ_nb++] =
+						get_position_index(
+							&stm, &file, e,
+							c == COLOR_WHITE ?
+								&e->wdl :
+								&e->dtz,
+							c != COLOR_WHITE, pos);
+					undo_move(pos, move);
+					++node->succ_nb;
+				}
+				free_position(pos);
+				++kqvk->nodes_nb[c];
+			}
+		}
+	}
+	free(pos);
+}
+
+/*
+ * The positions won in n plies are found from the ones lost in n - 1 plies,
+ * and the positions lost in n plies are the ones where all the moves lead to
+ * positions won in at most n - 1 plies, with at least one in exactly n - 1.
+ */
+static void solve_kqvk(struct test_kqvk *kqvk)
+{
+	for (int c = COLOR_WHITE; c <= COLOR_BLACK; ++c) {
+		for (int i = 0; i < UNIQUE_PIECES_SIZE; ++i)
+			kqvk->dtm[c][i] = -1;
+	}
+	for (int i = 0; i < kqvk->nodes_nb[COLOR_BLACK]; ++i) {
+		const struct test_node *const node =
+			&kqvk->nodes[COLOR_BLACK][i];
+		if (node->mated)
+			kqvk->dtm[COLOR_BLACK][node->idx] = 0;
+	}
+
+	for (int ply = 1, idle = 0; idle < 2; ++ply) {
+		const Color c = ply & 1 ? COLOR_WHITE : COLOR_BLACK;
+		bool found = false;
+		for (int i = 0; i < kqvk->nodes_nb[c]; ++i) {
+			const struct test_node *const node = &kqvk->nodes[c][i];
+			if (kqvk->dtm[c][node->idx] >= 0 ||
+			    node->can_capture || !node->succ_nb)
+				continue;
+			/* The fastest win for white and the slowest loss
+			 * for black, which is unknown if a move is not
+			 * lost yet. */
+			int best = c == COLOR_WHITE ? INT_MAX : 0;
+			const u64 *const succ = &kqvk->succ[node->first_succ];
+			for (int j = 0; j < node->succ_nb; ++j) {
+				const int dtm = kqvk->dtm[!c][succ[j]];
+				if (c == COLOR_WHITE) {
+					if (dtm >= 0 && dtm < best)
+						best = dtm;
+				} else if (dtm < 0 || best < 0) {
+					best = -1;
+				} else if (dtm > best) {
+					best = dtm;
+				}
+			}
+			if (best == ply - 1) {
+				kqvk->dtm[c][node->idx] = ply;
+				found = true;
+			}
+		}
+		idle = found ? 0 : idle + 1;
+	}
+
+	for (int i = 0; i < kqvk->nodes_nb[COLOR_WHITE]; ++i) {
+		const struct test_node *const node =
+			&kqvk->nodes[COLOR_WHITE][i];
+		TEST_ASSERT_MESSAGE(kqvk->dtm[COLOR_WHITE][node->idx] > 0,
+				    "KQvK not won with white to move.");
+	}
+}
+
+/*
+ * The table of black to move is coded with symbols for a loss, a draw, two
+ * losses and four losses. The positions that are not legal are draws.
+ */
+static void write_kqvk_wdl(const char *path, const struct test_kqvk *kqvk)
+{
+	static const int lens[4] = { 3, 3, 2, 1 };
+	static const int btree[4][2] = {
+		{ WDL_LOSS + 2, 0xfff },
+		{ WDL_DRAW + 2, 0xfff },
+		{ 0, 0 },
+		{ 2, 2 },
+	};
+	const struct test_code code = { .min_len = 1,
+					.max_len = 3,
+					.symbols_nb = 4,
+					.lens = lens,
+					.btree = btree };
+
+	int *const tokens = malloc(UNIQUE_PIECES_SIZE * sizeof(*tokens));
+	size_t tokens_nb = 0;
+	for (int i = 0; i < UNIQUE_PIECES_SIZE;) {
+		int losses = 0;
+		while (losses < 4 && i + losses < UNIQUE_PIECES_SIZE &&
+		       kqvk->dtm[COLOR_BLACK][i + losses] >= 0)
+			++losses;
+		const int sym = losses == 4 ? 3 :
+				losses >= 2 ? 2 :
+				losses	    ? 0 :
+					      1;
+		tokens[tokens_nb++] = sym;
+		i += sym == 3 ? 4 : sym == 2 ? 2 : 1;
+	}
+
+	struct test_table tables[2] = { 0 };
+	put_bytes(&tables[0].sizes, TABLE_FLAG_SINGLE_VALUE, 1);
+	put_bytes(&tables[0].sizes, WDL_WIN + 2, 1);
+	encode_table(&tables[1], &code, tokens, tokens_nb, UNIQUE_PIECES_SIZE,
+		     0);
+	u8 pieces[3];
+	for (int i = 0; i < 3; ++i)
+		pieces[i] = (u8)(kqvk_pieces[0][i] | kqvk_pieces[1][i] << 4);
+	write_test_file(path, WDL_MAGIC, pieces, tables, 2, NULL);
+	free_test_table(&tables[0]);
+	free_test_table(&tables[1]);
+	free(tokens);
+}
+
+/*
+ * The DTZ with white to move is the distance to mate, since white can't zero
+ * the clock, and each distance has its own symbol through the map.
+ */
+static void write_kqvk_dtz(const char *path, const struct test_kqvk *kqvk)
+{
+	int map[TEST_MAX_SYMBOLS];
+	int map_nb = 0;
+	int *const tokens = malloc(UNIQUE_PIECES_SIZE * sizeof(*tokens));
+	for (int i = 0; i < UNIQUE_PIECES_SIZE; ++i) {
+		const int dtm = kqvk->dtm[COLOR_WHITE][i];
+		int sym = 0;
+		if (dtm > 0) {
+			while (sym < map_nb && map[sym] != dtm - 1)
+				++sym;
+			if (sym == map_nb) {
+				TEST_ASSERT_MESSAGE(map_nb < TEST_MAX_SYMBOLS,
+						    "Too many distances.");
+				map[map_nb++] = dtm - 1;
+			}
+		}
+		tokens[i] = sym;
+	}
+
+	int lens[TEST_MAX_SYMBOLS];
+	int btree[TEST_MAX_SYMBOLS][2];
+	for (int sym = 0; sym < TEST_MAX_SYMBOLS; ++sym) {
+		lens[sym] = 4;
+		btree[sym][0] = sym;
+		btree[sym][1] = 0xfff;
+	}
+	const struct test_code code = { .min_len = 4,
+					.max_len = 4,
+					.symbols_nb = map_nb,
+					.lens = lens,
+					.btree = (const int(*)[2])btree };
+
+	struct test_buffer dtz_map = { 0 };
+	put_bytes(&dtz_map, (u64)map_nb, 1);
+	for (int i = 0; i < map_nb; ++i)
+		put_bytes(&dtz_map, (u64)map[i], 1);
+	put_bytes(&dtz_map, 0, 3);
+
+	struct test_table table = { 0 };
+	encode_table(&table, &code, tokens, UNIQUE_PIECES_SIZE,
+		     UNIQUE_PIECES_SIZE,
+		     TABLE_FLAG_MAPPED | TABLE_FLAG_WIN_PLIES);
+	write_test_file(path, DTZ_MAGIC, kqvk_pieces[2], &table, 1, &dtz_map);
+	free_test_table(&table);
+	free(dtz_map.data);
+	free(tokens);
+}
+
+/*
+ * The mirror swaps the colors, which the probes must undo with the tables of
+ * KQvK.
+ */
+static void check_kqvk_probes(const struct test_kqvk *kqvk, bool mirror)
+{
+	Position *pos = malloc(sizeof(Position));
+	for (int c = COLOR_WHITE; c <= COLOR_BLACK; ++c) {
+		for (int i = 0; i < kqvk->nodes_nb[c]; ++i) {
+			const struct test_node *const node = &kqvk->nodes[c][i];
+			const int dtm = kqvk->dtm[c][node->idx];
+			Wdl expected_wdl = WDL_WIN;
+			int expected_dtz = dtm;
+			if (c == COLOR_BLACK) {
+				TEST_ASSERT_MESSAGE(dtm >= 0 ||
+							    node->can_capture ||
+							    !node->succ_nb,
+						    "KQvK not solved.");
+				expected_wdl = dtm >= 0 ? WDL_LOSS : WDL_DRAW;
+				expected_dtz = dtm > 0	 ? -dtm :
+					       node->mated ? -1 :
+							     0;
+			}
+
+			char fen[FEN_MAX_LEN];
+			get_kqvk_fen(fen, node->squares, (Color)c, mirror);
+			init_position(pos, fen);
+			Wdl wdl;
+			int dtz;
+			TEST_ASSERT_MESSAGE(probe_wdl(&wdl, pos) &&
+						    wdl == expected_wdl,
+					    fen);
+			TEST_ASSERT_MESSAGE(probe_dtz(&dtz, pos) &&
+						    dtz == expected_dtz,
+					    fen);
+			free_position(pos);
+		}
+	}
+	free(pos);
+}
+
+/*
+ * Only the moves to the positions lost the fastest must be kept.
+ */
+static void check_kqvk_root_moves(const struct test_kqvk *kqvk)
+{
+	const struct tb_entry *const e = &kqvk->entry;
+	Position *pos = malloc(sizeof(Position));
+	for (int i = 0; i < kqvk->nodes_nb[COLOR_WHITE]; ++i) {
+		const struct test_node *const node =
+			&kqvk->nodes[COLOR_WHITE][i];
+		char fen[FEN_MAX_LEN];
+		get_kqvk_fen(fen, node->squares, COLOR_WHITE, false);
+		init_position(pos, fen);
+
+		struct move_with_score scored_moves[MAX_MOVES];
+		Move moves[MAX_MOVES];
+		const int moves_nb = get_legal_moves(scored_moves,
+						     MOVE_GEN_TYPE_ALL, pos);
+		for (int j = 0; j < moves_nb; ++j)
+			moves[j] = scored_moves[j].move;
+		const int kept = filter_root_moves(moves, moves_nb, pos);
+		TEST_ASSERT_MESSAGE(kept > 0 && kept <= moves_nb, fen);
+		for (int j = 0; j < kept; ++j) {
+			int stm;
+			int file;
+			do_move(pos, moves[j]);
+			const u64 idx = get_position_index(&stm, &file, e,
+							   &e->wdl, false, pos);
+			undo_move(pos, moves[j]);
+			TEST_ASSERT_MESSAGE(kqvk->dtm[COLOR_BLACK][idx] ==
+						    kqvk->dtm[COLOR_WHITE]
+							     [node->idx] -
+							    1,
+					    fen);
+		}
+		free_position(pos);
+	}
+	free(pos);
+}
+
+static void get_kqvk_fen(char *fen, const int squares[3], Color c, bool mirror)
+{
+	const char *const pieces = mirror ? "kqK" : "KQk";
+	char board[64] = { 0 };
+	for (int i = 0; i < 3; ++i)
+		board[mirror ? squares[i] ^ 56 : squares[i]] = pieces[i];
+
+	int n = 0;
+	for (int rank = RANK_8; rank >= RANK_1; --rank) {
+		int empty = 0;
+		for (int file = FILE_A; file <= FILE_H; ++file) {
+			const char piece = board[8 * rank + file];
+			if (!piece) {
+				++empty;
+				continue;
+			}
+			if (empty)
+				fen[n++] = (char)('0' + empty);
+			empty = 0;
+			fen[n++] = piece;
+		}
+		if (empty)
+			fen[n++] = (char)('0' + empty);
+		if (rank > RANK_1)
+			fen[n++] = '/';
+	}
+	const bool white = (c == COLOR_WHITE) != mirror;
+	snprintf(fen + n, (size_t)(FEN_MAX_LEN - n), " %c - - 0 1",
+		 white ? 'w' : 'b');
+}
+
+/*
+ * Encodes the symbols into blocks, starting a new block when the next symbol
+ * doesn't fit, and writes the sizes of the table with the code.
+ */
+static void encode_table(struct test_table *t, const struct test_code *code,
+			 const int *tokens, size_t tokens_nb, u64 table_size,
+			 u8 flags)
+{
+	const int lens_nb = code->max_len - code->min_len + 1;
+	int values_nb[TEST_MAX_SYMBOLS];
+	int lowest_sym[TEST_MAX_SYMBOLS];
+	u64 base[TEST_MAX_SYMBOLS];
+	for (int sym = 0; sym < code->symbols_nb; ++sym) {
+		const int left = code->btree[sym][0];
+		const int right = code->btree[sym][1];
+		values_nb[sym] = right == 0xfff ?
+					 1 :
+					 values_nb[left] + values_nb[right];
+	}
+	for (int i = lens_nb - 1; i >= 0; --i) {
+		lowest_sym[i] = 0;
+		while (code->lens[lowest_sym[i]] != code->min_len + i)
+			++lowest_sym[i];
+		base[i] = i == lens_nb - 1 ?
+				  0 :
+				  (base[i + 1] + (u64)lowest_sym[i] -
+				   (u64)lowest_sym[i + 1]) / 2;
+	}
+
+	const size_t block_size = (size_t)1 << TEST_BLOCK_LOG;
+	u8 block[(size_t)1 << TEST_BLOCK_LOG] = { 0 };
+	struct test_buffer starts = { 0 };
+	size_t bits = 0;
+	u64 values = 0;
+	u64 start = 0;
+	for (size_t i = 0; i <= tokens_nb; ++i) {
+		const int sym = i < tokens_nb ? tokens[i] : 0;
+		const int len = code->lens[sym];
+		if (i == tokens_nb || bits + (size_t)len > 8 * block_size) {
+			for (size_t j = 0; j < block_size; ++j)
+				put_bytes(&t->data, block[j], 1);
+			put_bytes(&t->block_length, values - 1, 2);
+			put_bytes(&starts, start, 8);
+			memset(block, 0, sizeof(block));
+			start += values;
+			values = 0;
+			bits = 0;
+			if (i == tokens_nb)
+				break;
+		}
+		const int i_len = len - code->min_len;
+		const u64 c = base[i_len] + (u64)(sym - lowest_sym[i_len]);
+		for (int b = len - 1; b >= 0; --b, ++bits) {
+			if (c >> b & 1)
+				block[bits / 8] |= (u8)(0x80 >> bits % 8);
+		}
+		values += (u64)values_nb[sym];
+	}
+
+	/* Each entry of the sparse index is for the middle of its span. */
+	const u64 span = (u64)1 << TEST_SPAN_LOG;
+	const u32 blocks_nb = (u32)(t->block_length.size / 2);
+	u32 b = 0;
+	for (u64 k = 0; k * span < table_size; ++k) {
+		const u64 idx = k * span + span / 2;
+		while (b + 1 < blocks_nb &&
+		       read_little_endian(&starts.data[8 * (b + 1)], 8) <= idx)
+			++b;
+		put_bytes(&t->sparse_index, b, 4);
+		put_bytes(&t->sparse_index,
+			  idx - read_little_endian(&starts.data[8 * b], 8), 2);
+	}
+	free(starts.data);
+
+	put_bytes(&t->sizes, flags, 1);
+	put_bytes(&t->sizes, TEST_BLOCK_LOG, 1);
+	put_bytes(&t->sizes, TEST_SPAN_LOG, 1);
+	put_bytes(&t->sizes, 0, 1);
+	put_bytes(&t->sizes, blocks_nb, 4);
+	put_bytes(&t->sizes, (u64)code->max_len, 1);
+	put_bytes(&t->sizes, (u64)code->min_len, 1);
+	for (int i = 0; i < lens_nb; ++i)
+		put_bytes(&t->sizes, (u64)lowest_sym[i], 2);
+	put_bytes(&t->sizes, (u64)code->symbols_nb, 2);
+	for (int sym = 0; sym < code->symbols_nb; ++sym) {
+		put_bytes(&t->sizes,
+			  (u64)code->btree[sym][0] |
+				  (u64)code->btree[sym][1] << 12,
+			  3);
+	}
+	if (code->symbols_nb & 1)
+		put_bytes(&t->sizes, 0, 1);
+}
+
+/*
+ * The data is followed by some padding, since the decoder reads a few bytes
+ * past the end of a block, and the size of a file is 16 modulo 64.
+ */
+static void write_test_file(const char *path, u32 magic, const u8 *pieces,
+			    struct test_table *tables, int tables_nb,
+			    const struct test_buffer *dtz_map)
+{
+	struct test_buffer file = { 0 };
+	put_bytes(&file, magic, 4);
+	put_bytes(&file, FILE_FLAG_SPLIT, 1);
+	/* The leading group is first in the order. */
+	put_bytes(&file, 0, 1);
+	for (int i = 0; i < 3; ++i)
+		put_bytes(&file, pieces[i], 1);
+	align_buffer(&file, 2);
+	for (int i = 0; i < tables_nb; ++i)
+		append_buffer(&file, &tables[i].sizes);
+	if (dtz_map) {
+		append_buffer(&file, dtz_map);
+		align_buffer(&file, 2);
+	}
+	for (int i = 0; i < tables_nb; ++i)
+		append_buffer(&file, &tables[i].sparse_index);
+	for (int i = 0; i < tables_nb; ++i)
+		append_buffer(&file, &tables[i].block_length);
+	for (int i = 0; i < tables_nb; ++i) {
+		align_buffer(&file, 64);
+		append_buffer(&file, &tables[i].data);
+	}
+	align_buffer(&file, 64);
+	for (int i = 0; i < 64 + 16; ++i)
+		put_bytes(&file, 0, 1);
+
+	FILE *fp = fopen(path, "wb");
+	TEST_ASSERT_MESSAGE(fp, path);
+	TEST_ASSERT_MESSAGE(fwrite(file.data, 1, file.size, fp) == file.size,
+			    path);
+	fclose(fp);
+	free(file.data);
+}
+
+static void free_test_table(struct test_table *t)
+{
+	free(t->sizes.data);
+	free(t->sparse_index.data);
+	free(t->block_length.data);
+	free(t->data.data);
+}
+
+/*
+ * Writes the number in little endian.
+ */
+static void put_bytes(struct test_buffer *buf, u64 n, int len)
+{
+	if (buf->size + (size_t)len > buf->cap) {
+		buf->cap = 2 * buf->cap + (size_t)len;
+		buf->data = realloc(buf->data, buf->cap);
+		if (!buf->data) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+	}
+	for (int i = 0; i < len; ++i)
+		buf->data[buf->size++] = (u8)(n >> 8 * i);
+}
+
+static void append_buffer(struct test_buffer *buf,
+			  const struct test_buffer *src)
+{
+	for (size_t i = 0; i < src->size; ++i)
+		put_bytes(buf, src->data[i], 1);
+}
+
+static void align_buffer(struct test_buffer *buf, size_t alignment)
+{
+	while (buf->size % alignment)
+		put_bytes(buf, 0, 1);
+}
+#endif
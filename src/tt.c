@@ -15,13 +15,28 @@
  * You should have received a copy of the GNU General Public License along with
  * this program. If not, see <https://www.gnu.org/licenses/>. 
  */
+/* Needed for madvise, mmap flags and syscall on Linux. */
+#define _DEFAULT_SOURCE
+
+#include <assert.h>
 #include <limits.h>
+#include <stdalign.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <pthread.h>
+
+#if defined(__linux__) && !defined(ARCH_WASM)
+#define USE_LINUX_MEMORY_HINTS
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #ifdef ARCH_x64
 #include <immintrin.h>
 #endif
@@ -33,18 +48,99 @@
 #include <movegen.h>
 #include <tt.h>
 
+#define BUCKET_SIZE 64
+#define ENTRIES_PER_BUCKET 6
+#define GENERATION_BITS 6
+#define GENERATION_MASK ((1 << GENERATION_BITS) - 1)
+/* The table is aligned to and sized in multiples of large pages, which are 2
+ * MiB on x86-64 and on most ARM systems. */
+#define LARGE_PAGE_SIZE (2 * 1048576)
+/* This is MPOL_INTERLEAVE from <linux/mempolicy.h>. */
+#define MEMORY_POLICY_INTERLEAVE 3
+/* Tables smaller than this are cleared by a single thread. */
+#define PARALLEL_CLEAR_MIN_SIZE (64 * 1048576)
+#define HASH_FILE_MAGIC "ATHENATT"
+#define HASH_FILE_MAGIC_LEN 8
+#define HASH_FILE_VERSION 1
+
+/*
+ * The entries only store the lower 16 bits of the hash, the bits used to find
+ * the bucket are taken from the upper half of the hash so the key works as an
+ * extra check. The generation is the one of the search that last used the
+ * entry and it is packed together with the bound. An entry is empty when its
+ * bound is BOUND_NONE. The static evaluation is stored so that a position
+ * found in the table never has to be evaluated again.
+ */
+struct entry {
+	u16 key;
+	Move best_move;
+	i16 score;
+	i16 eval;
+	u8 depth;
+	u8 generation_and_bound;
+};
+
+/*
+ * A bucket fills exactly one cache line, so a probe costs a single cache miss
+ * no matter which of the entries holds the position. The entries don't divide
+ * the cache line evenly, so the rest of it is padding.
+ */
+struct bucket {
+	alignas(BUCKET_SIZE) struct entry entries[ENTRIES_PER_BUCKET];
+	u8 padding[BUCKET_SIZE - ENTRIES_PER_BUCKET * sizeof(struct entry)];
+};
+
+static_assert(sizeof(struct bucket) == BUCKET_SIZE,
+	      "A bucket must fill exactly one cache line.");
+static_assert(TT_MAX_DEPTH <= UINT8_MAX,
+	      "The depth of an entry must fit in its byte.");
+
 struct transposition_table {
-	NodeData *ptr;
+	struct bucket *buckets;
+	size_t capacity; /* Number of buckets. */
+	size_t allocated_size; /* In bytes. */
+	bool mapped; /* The buckets were allocated with mmap. */
+	u8 generation;
+};
+
+struct clear_argument {
+	struct bucket *buckets;
 	size_t capacity;
 };
 
+/*
+ * The header of a saved table. The checksum of the Zobrist keys makes sure the
+ * keys in the file mean the same positions in this build.
+ */
+struct hash_file_header {
+	char magic[HASH_FILE_MAGIC_LEN];
+	u32 version;
+	u32 bucket_size;
+	u64 capacity;
+	u64 zobrist_checksum;
+	u8 generation;
+	u8 padding[7];
+};
+
+static struct bucket *get_bucket(u64 hash);
+static u16 get_key(u64 hash);
+static Bound get_entry_bound(const struct entry *entry);
+static int get_entry_age(const struct entry *entry);
+static int get_replacement_value(const struct entry *entry);
 static void init_hash(void);
 static size_t compute_capacity(size_t max_size);
-static size_t find_prime(size_t n);
-static bool is_prime(size_t n);
+static void allocate_table(size_t capacity);
+static void free_table(void);
+static void interleave_memory(void *ptr, size_t size);
+static void *clear_buckets(void *arg);
+static bool read_buckets(FILE *fp);
+static u64 get_zobrist_checksum(void);
 
-static struct transposition_table transposition_table = { .ptr = NULL,
-							  .capacity = 0 };
+static struct transposition_table transposition_table = { .buckets = NULL,
+							  .capacity = 0,
+							  .allocated_size = 0,
+							  .mapped = false,
+							  .generation = 0 };
 
 /*
  * Returns true if the node data is in the transposition table table and false
@@ -53,101 +149,311 @@ static struct transposition_table transposition_table = { .ptr = NULL,
 bool get_tt_entry(NodeData *restrict data, const Position *restrict pos)
 {
 	const u64 node_hash = get_position_hash(pos);
-	const size_t key = node_hash % transposition_table.capacity;
-	struct node_data tt_data = transposition_table.ptr[key];
-	if (node_hash == tt_data.hash) {
-		*data = tt_data;
+	struct bucket *const bucket = get_bucket(node_hash);
+	const u16 key = get_key(node_hash);
+
+	for (int i = 0; i < ENTRIES_PER_BUCKET; ++i) {
+		struct entry *const entry = &bucket->entries[i];
+		const Bound bound = get_entry_bound(entry);
+		if (entry->key != key || bound == BOUND_NONE)
+			continue;
+
+		/* The entry is still useful so we refresh its generation to
+		 * protect it from being replaced. */
+		const u8 generation_and_bound =
+			(u8)(transposition_table.generation << 2 | bound);
+		if (entry->generation_and_bound != generation_and_bound)
+			entry->generation_and_bound = generation_and_bound;
+
+		data->score = entry->score;
+		data->eval = entry->eval;
+		data->depth = entry->depth;
+		data->bound = (u8)bound;
+		data->hash = node_hash;
+		data->best_move = entry->best_move;
 		return true;
 	}
 	return false;
 }
 
+/*
+ * If the position is already in the bucket we overwrite its entry, unless the
+ * new data comes from a much shallower search. Otherwise we replace the entry
+ * with the lowest depth, where entries from old searches count as shallower
+ * than they really are.
+ */
 void store_tt_entry(const NodeData *data)
 {
-	const size_t key = data->hash % transposition_table.capacity;
-	transposition_table.ptr[key] = *data;
+	struct bucket *const bucket = get_bucket(data->hash);
+	const u16 key = get_key(data->hash);
+
+	struct entry *replace = &bucket->entries[0];
+	for (int i = 0; i < ENTRIES_PER_BUCKET; ++i) {
+		struct entry *const entry = &bucket->entries[i];
+		if (get_entry_bound(entry) == BOUND_NONE ||
+		    entry->key == key) {
+			replace = entry;
+			break;
+		}
+		if (get_replacement_value(entry) <
+		    get_replacement_value(replace))
+			replace = entry;
+	}
+
+	Move best_move = data->best_move;
+	if (replace->key == key && get_entry_bound(replace) != BOUND_NONE) {
+		if (data->bound != BOUND_EXACT &&
+		    data->depth + 2 < replace->depth &&
+		    !get_entry_age(replace))
+			return;
+		/* A fail-low doesn't have a best move, but the move from a
+		 * previous search of the same position is still good for
+		 * move ordering. */
+		if (!best_move)
+			best_move = replace->best_move;
+	}
+
+	replace->key = key;
+	replace->best_move = best_move;
+	replace->score = data->score;
+	replace->eval = data->eval;
+	replace->depth = data->depth;
+	replace->generation_and_bound =
+		(u8)(transposition_table.generation << 2 | data->bound);
 }
 
-void init_tt_entry(NodeData *data, int score, int depth, Bound bound,
-		   Move best_move, const Position *pos)
+/*
+ * The depth is clamped to TT_MAX_DEPTH, so the entries of the deepest searches
+ * don't wrap around and look like the shallowest ones.
+ */
+void init_tt_entry(NodeData *data, int score, int eval, int depth,
+		   Bound bound, Move best_move, const Position *pos)
 {
 	data->score = (i16)score;
-	data->depth = (u8)depth;
+	data->eval = (i16)eval;
+	data->depth = (u8)(depth > TT_MAX_DEPTH ? TT_MAX_DEPTH : depth);
 	data->bound = (u8)bound;
 	data->best_move = best_move;
 	data->hash = get_position_hash(pos);
 }
 
-void prefetch_tt(void)
+/*
+ * This must be called at the start of every search so the entries from
+ * previous searches can be told apart from the new ones.
+ */
+void increment_tt_generation(void)
+{
+	transposition_table.generation =
+		(u8)((transposition_table.generation + 1) & GENERATION_MASK);
+}
+
+/*
+ * Starts loading the bucket of the hash into the cache so that a later probe
+ * doesn't have to wait for the memory.
+ */
+void prefetch_tt(u64 hash)
 {
+	const struct bucket *const bucket = get_bucket(hash);
 #ifdef ARCH_x64
-	_mm_prefetch(transposition_table.ptr, _MM_HINT_T0);
+	_mm_prefetch((const char *)bucket, _MM_HINT_T0);
 #else
-	return;
+	__builtin_prefetch(bucket);
 #endif
 }
 
 /*
  * This function does nothing if the transposition table has not been
- * initialized.
+ * initialized. Large tables are split in chunks that are cleared by up to
+ * threads_nb threads at the same time, since a single thread can't saturate
+ * the memory bandwidth. If a thread can't be created its chunk is cleared by
+ * the calling thread.
  */
-void clear_tt(void)
+void clear_tt(int threads_nb)
 {
-	NodeData *const ptr = transposition_table.ptr;
-	if (!ptr)
+	struct bucket *const buckets = transposition_table.buckets;
+	if (!buckets)
 		return;
 	const size_t capacity = transposition_table.capacity;
-	memset(ptr, 0, capacity * sizeof(NodeData));
+	transposition_table.generation = 0;
+
+	if (threads_nb < 2 ||
+	    capacity * sizeof(struct bucket) < PARALLEL_CLEAR_MIN_SIZE) {
+		memset(buckets, 0, capacity * sizeof(struct bucket));
+		return;
+	}
+
+	pthread_t *const threads =
+		malloc((size_t)threads_nb * sizeof(*threads));
+	struct clear_argument *const args =
+		malloc((size_t)threads_nb * sizeof(*args));
+	bool *const created = malloc((size_t)threads_nb * sizeof(*created));
+	if (!threads || !args || !created) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	const size_t chunk = capacity / (size_t)threads_nb;
+	for (int i = 0; i < threads_nb; ++i) {
+		args[i].buckets = buckets + (size_t)i * chunk;
+		args[i].capacity = i == threads_nb - 1 ?
+					   capacity - (size_t)i * chunk :
+					   chunk;
+		created[i] = !pthread_create(&threads[i], NULL, clear_buckets,
+					     &args[i]);
+		if (!created[i])
+			clear_buckets(&args[i]);
+	}
+	for (int i = 0; i < threads_nb; ++i) {
+		if (created[i] && pthread_join(threads[i], NULL)) {
+			fprintf(stderr, "Internal error.\n");
+			exit(1);
+		}
+	}
+
+	free(created);
+	free(args);
+	free(threads);
 }
 
 /*
  * This function does nothing if the transposition table has not been
- * initialized.
+ * initialized. The buckets a position maps to depend on the capacity, so the
+ * old entries are lost.
  */
-void resize_tt(size_t size)
+void resize_tt(size_t size, int threads_nb)
 {
-	if (!transposition_table.ptr)
+	if (!transposition_table.buckets)
 		return;
-	const size_t old_capacity = transposition_table.capacity;
-	const size_t new_capacity = compute_capacity(size);
-	transposition_table.capacity = new_capacity;
-	transposition_table.ptr = realloc(transposition_table.ptr,
-					  new_capacity * sizeof(NodeData));
-	if (!transposition_table.ptr) {
-		fprintf(stderr, "Out of memory.\n");
-		exit(1);
-	}
-
-	if (new_capacity > old_capacity) {
-		memset(transposition_table.ptr + old_capacity, 0,
-		       (new_capacity - old_capacity) * sizeof(NodeData));
+	const size_t capacity = compute_capacity(size);
+	if (capacity != transposition_table.capacity) {
+		free_table();
+		allocate_table(capacity);
 	}
+	clear_tt(threads_nb);
 }
 
 /*
- * The capacity of the transposition table is calculated with the size given in
- * mebibytes. For performance reasons the capacity is a prime number less than
- * the originally calculated capacity. If the size is too big then a default
- * capacity is used instead.
+ * The size of the transposition table is given in mebibytes. The table is
+ * cleared with up to threads_nb threads, since this is the first time the
+ * memory is touched the pages end up spread over the memory of the nodes the
+ * threads run on.
  */
-void tt_init(size_t size)
+void tt_init(size_t size, int threads_nb)
 {
 	init_hash();
 
-	transposition_table.capacity = compute_capacity(size);
-	transposition_table.ptr =
-		calloc(transposition_table.capacity, sizeof(NodeData));
-	if (!transposition_table.ptr) {
-		fprintf(stderr, "Out of memory.");
-		exit(1);
-	}
+	allocate_table(compute_capacity(size));
+	clear_tt(threads_nb);
 }
 
 void tt_free(void)
 {
-	transposition_table.capacity = 0;
-	free(transposition_table.ptr);
-	transposition_table.ptr = NULL;
+	free_table();
+}
+
+/*
+ * The table is saved as a header followed by the buckets exactly as they are in
+ * memory, so the numbers are in the byte order of the machine. Returns 0 on
+ * success and 1 otherwise.
+ */
+int save_tt(const char *path)
+{
+	if (!transposition_table.buckets)
+		return 1;
+	FILE *fp = fopen(path, "wb");
+	if (!fp)
+		return 1;
+
+	struct hash_file_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, HASH_FILE_MAGIC, HASH_FILE_MAGIC_LEN);
+	header.version = HASH_FILE_VERSION;
+	header.bucket_size = sizeof(struct bucket);
+	header.capacity = transposition_table.capacity;
+	header.zobrist_checksum = get_zobrist_checksum();
+	header.generation = transposition_table.generation;
+
+	const size_t capacity = transposition_table.capacity;
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+		  fwrite(transposition_table.buckets, sizeof(struct bucket),
+			 capacity, fp) == capacity;
+	ok = !fclose(fp) && ok;
+	return ok ? 0 : 1;
+}
+
+/*
+ * Loads a table saved by save_tt. The bucket of a position depends on the
+ * capacity and the entries don't have the full hash, so the table in the file
+ * must have the same capacity as the current one. Returns 0 on success and 1
+ * otherwise, in which case the table is left as it was unless the file was
+ * truncated while reading it, then the table is cleared.
+ */
+int load_tt(const char *path)
+{
+	if (!transposition_table.buckets)
+		return 1;
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		return 1;
+
+	struct hash_file_header header;
+	bool ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+		  !memcmp(header.magic, HASH_FILE_MAGIC, HASH_FILE_MAGIC_LEN) &&
+		  header.version == HASH_FILE_VERSION &&
+		  header.bucket_size == sizeof(struct bucket) &&
+		  header.capacity == transposition_table.capacity &&
+		  header.zobrist_checksum == get_zobrist_checksum();
+	if (!ok) {
+		fclose(fp);
+		return 1;
+	}
+	ok = read_buckets(fp);
+	fclose(fp);
+
+	if (!ok)
+		return 1;
+	transposition_table.generation = header.generation & GENERATION_MASK;
+	return 0;
+}
+
+/*
+ * Maps the hash to a bucket with a multiplication and a shift instead of a
+ * modulo, which would need a slow 64-bit division on every probe. The top 32
+ * bits of the hash are scaled to [0, capacity), which works for any capacity
+ * below 2^32 buckets.
+ */
+static struct bucket *get_bucket(u64 hash)
+{
+	const u64 index = ((hash >> 32) * transposition_table.capacity) >> 32;
+	return &transposition_table.buckets[index];
+}
+
+static u16 get_key(u64 hash)
+{
+	return (u16)hash;
+}
+
+static Bound get_entry_bound(const struct entry *entry)
+{
+	return (Bound)(entry->generation_and_bound & 0x3);
+}
+
+/*
+ * Returns how many searches ago the entry was last used.
+ */
+static int get_entry_age(const struct entry *entry)
+{
+	const int generation = entry->generation_and_bound >> 2;
+	return (transposition_table.generation - generation) & GENERATION_MASK;
+}
+
+/*
+ * The entry with the lowest value is the first one to be replaced. Every
+ * search that goes by without using an entry makes it worth a few plies less.
+ */
+static int get_replacement_value(const struct entry *entry)
+{
+	return entry->depth - 8 * get_entry_age(entry);
 }
 
 /*
@@ -158,43 +464,165 @@ static void init_hash(void)
 }
 
 /*
- * To lower the chances of collisions the capacity of the transposition table
- * should be a prime number, so we return the prime number that results in a
- * table size that is closest to, but not exceeding, max_size.
+ * Returns the number of buckets that fit in max_size mebibytes. The capacity
+ * is limited to what get_bucket can index and must be at least one bucket.
  */
 static size_t compute_capacity(size_t max_size)
 {
 	const size_t mib_in_byte = 1048576;
+	const size_t max_capacity = UINT32_MAX;
 
-	size_t tmp = max_size;
+	size_t capacity;
 	/* Check for overflow when converting to bytes. */
-	if (tmp > SIZE_MAX / mib_in_byte)
-		tmp = SIZE_MAX / sizeof(NodeData);
+	if (max_size > SIZE_MAX / mib_in_byte)
+		capacity = max_capacity;
 	else
-		tmp = (tmp * mib_in_byte) / (long)sizeof(NodeData);
-	return find_prime(tmp);
+		capacity = max_size * mib_in_byte / sizeof(struct bucket);
+	if (capacity > max_capacity)
+		capacity = max_capacity;
+	if (!capacity)
+		capacity = 1;
+	return capacity;
 }
 
 /*
- * Finds the greatest prime number less than or equal to n. Notice that n must
- * be at least 2.
+ * Every probe of the table is likely a TLB miss with regular 4 KiB pages, so
+ * we try to back the table with large pages. First we try explicit huge pages,
+ * which only works if the system reserved them, and then transparent huge
+ * pages. The memory is not touched here, so the pages are only allocated when
+ * the table is cleared.
  */
-static size_t find_prime(size_t n)
+static void allocate_table(size_t capacity)
+{
+	size_t size = capacity * sizeof(struct bucket);
+	size = (size + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE * LARGE_PAGE_SIZE;
+
+	void *ptr = NULL;
+	bool mapped = false;
+#ifdef USE_LINUX_MEMORY_HINTS
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (ptr == MAP_FAILED)
+		ptr = NULL;
+	else
+		mapped = true;
+#endif
+	if (!ptr) {
+		ptr = aligned_alloc(LARGE_PAGE_SIZE, size);
+		if (!ptr) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+#if defined(USE_LINUX_MEMORY_HINTS) && defined(MADV_HUGEPAGE)
+		madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+	}
+#ifdef USE_NUMA
+	interleave_memory(ptr, size);
+#endif
+
+	transposition_table.buckets = ptr;
+	transposition_table.capacity = capacity;
+	transposition_table.allocated_size = size;
+	transposition_table.mapped = mapped;
+}
+
+static void free_table(void)
 {
-	for (size_t p = n; p > 0; --p) {
-		if (is_prime(p))
-			return p;
+#ifdef USE_LINUX_MEMORY_HINTS
+	if (transposition_table.mapped) {
+		munmap(transposition_table.buckets,
+		       transposition_table.allocated_size);
+	} else {
+		free(transposition_table.buckets);
 	}
+#else
+	free(transposition_table.buckets);
+#endif
+	transposition_table.buckets = NULL;
+	transposition_table.capacity = 0;
+	transposition_table.allocated_size = 0;
+	transposition_table.mapped = false;
+}
+
+/*
+ * On machines with several NUMA nodes the threads probe the table from all the
+ * nodes, so instead of letting each page live in the node of the thread that
+ * first touched it we spread the pages over all the nodes the process may use.
+ * The kernel ignores the nodes of the mask that are not available. This is
+ * only done when built with -Dnuma=true, which defines USE_NUMA, and only works
+ * on Linux. Failures are harmless since the memory just keeps the default
+ * policy.
+ */
+[[maybe_unused]] static void interleave_memory(void *ptr, size_t size)
+{
+#ifdef USE_LINUX_MEMORY_HINTS
+	const unsigned long nodemask = ~0UL;
+	syscall(SYS_mbind, ptr, size, MEMORY_POLICY_INTERLEAVE, &nodemask,
+		sizeof(nodemask) * CHAR_BIT, 0);
+#else
+	(void)ptr;
+	(void)size;
+#endif
+}
 
-	fprintf(stderr, "Internal error.\n");
-	exit(1);
+static void *clear_buckets(void *arg)
+{
+	const struct clear_argument *const clear_arg = arg;
+	memset(clear_arg->buckets, 0,
+	       clear_arg->capacity * sizeof(struct bucket));
+	return NULL;
 }
 
-static bool is_prime(size_t n)
+/*
+ * Reads the buckets that follow the header of a hash file into the table. With
+ * mmap the size of the file is checked before anything is copied, and the
+ * kernel copies the pages straight from the page cache into the table instead
+ * of going through the buffer of the stream.
+ */
+static bool read_buckets(FILE *fp)
 {
-	for (size_t m = n - 1; m * m >= n; --m) {
-		if (n % m == 0)
-			return false;
+	struct bucket *const buckets = transposition_table.buckets;
+	const size_t capacity = transposition_table.capacity;
+	const size_t size = capacity * sizeof(struct bucket);
+#ifdef USE_LINUX_MEMORY_HINTS
+	const size_t offset = sizeof(struct hash_file_header);
+	const int fd = fileno(fp);
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < 0 ||
+	    (size_t)st.st_size != offset + size)
+		return false;
+	void *const ptr = mmap(NULL, offset + size, PROT_READ, MAP_PRIVATE,
+			       fd, 0);
+	if (ptr == MAP_FAILED)
+		return false;
+	madvise(ptr, offset + size, MADV_SEQUENTIAL);
+	memcpy(buckets, (const char *)ptr + offset, size);
+	munmap(ptr, offset + size);
+	return true;
+#else
+	if (fread(buckets, sizeof(struct bucket), capacity, fp) != capacity ||
+	    fgetc(fp) != EOF) {
+		memset(buckets, 0, size);
+		transposition_table.generation = 0;
+		return false;
 	}
 	return true;
+#endif
+}
+
+/*
+ * Combines all the piece-square keys into one number that only changes when the
+ * Zobrist keys change.
+ */
+static u64 get_zobrist_checksum(void)
+{
+	u64 checksum = get_side_to_move_hash();
+	for (int piece = 0; piece < 12; ++piece) {
+		for (Square sq = A1; sq <= H8; ++sq) {
+			const u64 key = get_piece_square_hash((Piece)piece, sq);
+			checksum = (checksum * 31) ^ key;
+		}
+	}
+	return checksum;
 }
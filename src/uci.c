@@ -25,16 +25,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <pthread.h>
 
 #include <bit.h>
-#include <str.h>
 #include <pos.h>
 #include <move.h>
 #include <movegen.h>
+#include <eval.h>
+#include <nnue.h>
 #include <tt.h>
 #include <search.h>
+#include <perft.h>
+#include <bench.h>
+#include <book.h>
+#include <tb.h>
 #include <uci.h>
 
 #define OPTION_UCI_ANALYSISMODE_TYPE boolean
@@ -42,12 +48,41 @@
 #define OPTION_PONDER_TYPE boolean
 #define OPTION_VALUE_TYPE(name) OPTION_##name##_TYPE
 
+/*
+ * The longest command is a position command with a FEN and the moves of the
+ * longest possible game, each move taking at most MAX_LAN_LEN characters and a
+ * space. Longer commands are ignored. Sent messages longer than the output
+ * capacity are cut, the longest ones are the info messages with a PV.
+ */
+#define INPUT_CAPACITY \
+	(FEN_MAX_LEN + 32 + POSITION_STACK_CAPACITY * (MAX_LAN_LEN + 1))
+#define OUTPUT_CAPACITY 4096
+
 static struct search_argument search_arg;
 static pthread_t search_thread;
 static bool search_thread_created = false;
 static atomic_bool stop_search = false;
+/*
+ * The best move of a search that is pondering is only sent after the ponderhit
+ * or the stop command, so if the search finishes before that it waits on the
+ * condition until pondering becomes false.
+ */
+static atomic_bool pondering = false;
+static pthread_mutex_t ponder_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ponder_cond = PTHREAD_COND_INITIALIZER;
 static bool newgame_sent = false;
 static bool initialized_transposition_table = false;
+/* The line break is read into the buffer too, so it needs room for it and for
+ * the null terminator. */
+static char input[INPUT_CAPACITY + 2];
+/*
+ * The game of the last position command, the position of the search argument is
+ * its FEN with the moves played. A position command of the same game only plays
+ * the moves that are new or were taken back.
+ */
+static char game_fen[FEN_MAX_LEN];
+static Move game_moves[POSITION_STACK_CAPACITY];
+static int game_moves_nb = 0;
 
 enum option_type {
 	OPTION_TYPE_BOOLEAN,
@@ -62,139 +97,204 @@ union option_value {
 	char *string;
 };
 
+static void set_hash_size(void);
+static void clear_hash(void);
+static void set_eval_file(void);
+static void set_use_nnue(void);
+static void set_book_file(void);
+static void set_syzygy_path(void);
+
 static struct option {
 	const char *name;
 	const enum option_type type;
-	void (*func)(void); /* Only used for button type. */
+	/* Called when the button is pressed or, for the other types, after the
+	 * value is changed. It may be NULL except for buttons. */
+	void (*func)(void);
 	const union option_value default_value;
 	union option_value value;
 	const int min;
 	const int max;
 } options[] = {
 	{ .name = "Hash",
+	  .type = OPTION_TYPE_INTEGER,
+	  .func = set_hash_size,
+	  .default_value.integer = 16,
+	  .value.integer = 16,
+	  .min = 1,
+	  .max = 32768 },
+
+	{ .name = "Threads",
 	  .type = OPTION_TYPE_INTEGER,
 	  .default_value.integer = 1,
 	  .value.integer = 1,
 	  .min = 1,
-	  .max = 32768 },
+	  .max = 256 },
+
+	{ .name = "MultiPV",
+	  .type = OPTION_TYPE_INTEGER,
+	  .default_value.integer = 1,
+	  .value.integer = 1,
+	  .min = 1,
+	  .max = MAX_MULTIPV },
+
+	{ .name = "Ponder",
+	  .type = OPTION_TYPE_BOOLEAN,
+	  .default_value.boolean = false,
+	  .value.boolean = false },
 
-	/*
 	{ .name = "Clear Hash",
 	  .type = OPTION_TYPE_BUTTON,
-	  .func = clear_hash_table },
-	 */
+	  .func = clear_hash },
+
+	{ .name = "EvalFile",
+	  .type = OPTION_TYPE_STRING,
+	  .func = set_eval_file,
+	  .default_value.string = (char *)"<empty>",
+	  .value.string = NULL },
+
+	{ .name = "UseNNUE",
+	  .type = OPTION_TYPE_BOOLEAN,
+	  .func = set_use_nnue,
+	  .default_value.boolean = false,
+	  .value.boolean = false },
+
+	{ .name = "HashFile",
+	  .type = OPTION_TYPE_STRING,
+	  .default_value.string = (char *)"<empty>",
+	  .value.string = NULL },
+
+	{ .name = "OwnBook",
+	  .type = OPTION_TYPE_BOOLEAN,
+	  .default_value.boolean = false,
+	  .value.boolean = false },
+
+	{ .name = "BookFile",
+	  .type = OPTION_TYPE_STRING,
+	  .func = set_book_file,
+	  .default_value.string = (char *)"<empty>",
+	  .value.string = NULL },
+
+	{ .name = "SyzygyPath",
+	  .type = OPTION_TYPE_STRING,
+	  .func = set_syzygy_path,
+	  .default_value.string = (char *)"<empty>",
+	  .value.string = NULL },
+
+	{ .name = "SearchStatistics",
+	  .type = OPTION_TYPE_BOOLEAN,
+	  .default_value.boolean = false,
+	  .value.boolean = false },
 };
 
-static char *uci_receive(bool *eof);
+static bool uci_receive(bool *eof);
 static void uci(void);
 static void setoption(void);
 static char *read_words_until_equal(const char *str, bool *found);
 static void isready(void);
 static void position(void);
-static int parse_moves(Move *moves, int capacity, Position *pos, int *len);
+static int parse_fen(char *fen);
+static void update_game_moves(char *token);
 static void ucinewgame(void);
 static void init_search_arg(struct search_argument *arg);
+static void reset_search_limits(struct search_argument *arg);
+static void set_search_threads(struct search_argument *arg, int threads);
 static void go(void);
+static void go_perft(int depth);
 static void stop(void);
+static void ponderhit(void);
+static void stop_pondering(void);
+static void run_bench(void);
+static void stats(void);
+static void save_hash(void);
+static void load_hash(void);
 static void quit(void);
 static void info(const struct info *info);
 static void id(void);
 static void option(void);
 static void uciok(void);
 static void readyok(void);
-static void bestmove(Move move);
+static void bestmove(Move best_move, Move ponder_move);
+static void statistics(const struct search_statistics *stats);
+static void divide(Move move, u64 nodes);
 static void uci_send(const char *fmt, ...);
+static void append(char *str, size_t size, size_t *len, const char *fmt, ...);
 static int str_to_option_value(union option_value *value, const char *name,
 			       const char *str);
 static struct option *get_option(const char *name);
+static int get_integer_option(const char *name);
+static bool get_boolean_option(const char *name);
+static const char *get_string_option(const char *name);
 
 void uci_loop(void)
 {
 	movegen_init();
+	search_init();
 
 	bool quit = false;
 	while (!quit) {
 		bool eof = false;
-		char *str = uci_receive(&eof);
-		if (eof) {
+		if (uci_receive(&eof))
+			quit = !uci_interpret(input);
+		else if (eof)
 			quit = true;
-		} else if (str) {
-			quit = !uci_interpret(str);
-			free(str);
-		}
 	}
 }
 
 /*
- * Reads a UCI message from stdin and return it, or return NULL if the message
- * is invalid or an error occurred. In both cases EOF is set to false. eof is
- * set to true and returns NULL if EOF is read.
+ * Reads a UCI message from stdin into the input buffer without the line break.
+ * Returns false if the message is empty or too long, and also at EOF, in which
+ * case eof is set to true.
  */
-static char *uci_receive(bool *eof)
+static bool uci_receive(bool *eof)
 {
-	size_t max_len = BUFSIZ;
-	char *str = malloc(max_len + 1);
-	if (!str) {
-		fprintf(stderr, "Out of memory.\n");
-		exit(1);
+	*eof = false;
+	if (!fgets(input, sizeof(input), stdin)) {
+		*eof = true;
+		return false;
 	}
 
-	*eof = false;
-	size_t i = 0;
-	int ch = '\0';
-	for (ch = fgetc(stdin); ch != '\n'; ch = fgetc(stdin)) {
-		if (ch == EOF) {
-			*eof = true;
-			free(str);
-			return NULL;
-		}
-		if (i == max_len) {
-			max_len += BUFSIZ;
-			char *const tmp = realloc(str, max_len + 1);
-			if (!tmp) {
-				fprintf(stderr, "Out of memory.\n");
-				exit(1);
-			}
-			str = tmp;
+	const size_t len = strlen(input);
+	if (input[len - 1] != '\n') {
+		/* A line without a line break at the end of the file is
+		 * ignored. */
+		int ch = EOF;
+		if (!feof(stdin)) {
+			do
+				ch = getchar();
+			while (ch != '\n' && ch != EOF);
 		}
-		str[i] = (char)ch;
-		++i;
-	}
-	str[i] = '\0';
-	if (!strlen(str)) {
-		free(str);
-		return NULL;
+		*eof = ch == EOF;
+		return false;
 	}
+	input[len - 1] = '\0';
 
-	return str;
+	return len > 1;
 }
 
 /*
- * Returns true normally and false when the "quit" command is used.
+ * Returns true normally and false when the "quit" command is used. The command
+ * is split in place in the input buffer, it's moved rather than copied since it
+ * may already be there.
  */
 bool uci_interpret(const char *str)
 {
 	bool ret = true;
 	const size_t len = strlen(str);
-	char *const split_str = malloc(len + 1);
-	if (!split_str) {
-		fprintf(stderr, "Out of memory.\n");
-		exit(1);
-	}
+	if (len > INPUT_CAPACITY)
+		return ret;
 
-	strcpy(split_str, str);
-	char *const cmd = strtok(split_str, " ");
+	memmove(input, str, len + 1);
+	char *const cmd = strtok(input, " ");
 
-	if (!cmd) {
-		free(split_str);
+	if (!cmd)
 		return ret;
-	}
 
-	if (search_thread_created && !stop_search && strcmp(cmd, "stop") &&
-	    strcmp(cmd, "quit")) {
-		free(split_str);
+	/* A search that is pondering may have finished but is still waiting
+	 * for the ponderhit to send the best move. */
+	if (search_thread_created && (!stop_search || pondering) &&
+	    strcmp(cmd, "stop") && strcmp(cmd, "ponderhit") &&
+	    strcmp(cmd, "quit"))
 		return ret;
-	}
 
 	if (!strcmp(cmd, "uci")) {
 		uci();
@@ -210,12 +310,21 @@ bool uci_interpret(const char *str)
 		go();
 	} else if (!strcmp(cmd, "stop")) {
 		stop();
+	} else if (!strcmp(cmd, "ponderhit")) {
+		ponderhit();
+	} else if (!strcmp(cmd, "bench")) {
+		run_bench();
+	} else if (!strcmp(cmd, "stats")) {
+		stats();
+	} else if (!strcmp(cmd, "savehash")) {
+		save_hash();
+	} else if (!strcmp(cmd, "loadhash")) {
+		load_hash();
 	} else if (!strcmp(cmd, "quit")) {
 		quit();
 		ret = false;
 	}
 
-	free(split_str);
 	return ret;
 }
 
@@ -270,6 +379,8 @@ static void setoption(void)
 	op->value = value;
 	free(name);
 	free(value_str);
+	if (op->func)
+		op->func();
 }
 
 /*
@@ -311,110 +422,112 @@ static void isready(void)
 	readyok();
 }
 
+/*
+ * The game is only set up again from the FEN when it isn't the one of the
+ * previous command, otherwise the moves both commands have in common are kept.
+ * The moves are played up to the first invalid one.
+ */
 static void position(void)
 {
 	if (!newgame_sent)
 		ucinewgame();
-	const char *startpos = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w "
-			       "KQkq - 0 1";
-	Position pos;
 
-	const char *token = strtok(NULL, " ");
-	if (token && !strcmp(token, "startpos")) {
-		init_position(&pos, startpos);
-	} else if (token && !strcmp(token, "fen")) {
-		char *fen = NULL;
-		const size_t num_parts = 6;
-		char *parts[6];
-		for (size_t i = 0; i < num_parts; ++i) {
-			parts[i] = strtok(NULL, " ");
-			if (!parts[i])
-				return;
-		}
-		size_t fen_len = 0;
-		for (size_t i = 0; i < num_parts; ++i) {
-			size_t part_len = strlen(parts[i]);
-			fen_len += part_len + 1; /* + 1 for space or '\0'. */
-			char *tmp = realloc(fen, fen_len);
-			if (!tmp) {
-				fprintf(stderr, "Out of memory.\n");
-				exit(1);
-			}
-			fen = tmp;
-			char *part_ptr = fen + fen_len - part_len - 1;
-			strcpy(part_ptr, parts[i]);
-			if (i < num_parts - 1) {
-				fen[fen_len - 1] = ' ';
-			} else {
-				fen[fen_len - 1] = '\0';
-				/* Remove the extra length that was added when
-				 * it is reserved for '\0'. */
-				--fen_len;
-			}
-		}
-		const int error = init_position(&pos, fen);
-		free(fen);
-		if (error)
-			return;
-	} else {
+	char fen[FEN_MAX_LEN];
+	if (parse_fen(fen))
+		return;
+	const char *const token = strtok(NULL, " ");
+	if (token && strcmp(token, "moves"))
 		return;
-	}
 
-	token = strtok(NULL, " ");
-	if (!token) {
+	if (!search_arg.pos.irr_states || strcmp(fen, game_fen)) {
+		Position pos;
+		if (init_position(&pos, fen))
+			return;
+		free_position(&search_arg.pos);
 		search_arg.pos = pos;
-		return;
+		strcpy(game_fen, fen);
+		game_moves_nb = 0;
 	}
-	if (strcmp(token, "moves"))
-		return;
-
-	int moves_len;
-	int error = parse_moves(
-		search_arg.moves,
-		(int)(sizeof(search_arg.moves) / sizeof(search_arg.moves[0])),
-		&pos, &moves_len);
-	if (error)
-		return;
-	search_arg.pos = pos;
-	search_arg.moves_nb = moves_len;
+	update_game_moves(token ? strtok(NULL, " ") : NULL);
 }
 
-static int parse_moves(Move *moves, int capacity, Position *pos, int *len)
+/*
+ * Reads the position of a position command into fen, which is either startpos
+ * or a FEN split in six tokens. Returns 0 on success and 1 otherwise.
+ */
+static int parse_fen(char *fen)
 {
-	int num = 0;
-	for (char *move = strtok(NULL, " "); move; move = strtok(NULL, " ")) {
-		const size_t move_len = strlen(move);
-		if (move_len > MAX_LAN_LEN)
-			return 1;
-		++num;
-		if (num > capacity)
+	const char *token = strtok(NULL, " ");
+	if (token && !strcmp(token, "startpos")) {
+		strcpy(fen, "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w "
+			    "KQkq - 0 1");
+		return 0;
+	}
+	if (!token || strcmp(token, "fen"))
+		return 1;
+
+	size_t len = 0;
+	const int parts_nb = 6;
+	for (int i = 0; i < parts_nb; ++i) {
+		token = strtok(NULL, " ");
+		if (!token)
 			return 1;
-		bool success;
-		moves[num - 1] = lan_to_move(move, pos, &success);
-		if (!success)
+		const size_t token_len = strlen(token);
+		/* + 1 for the space or the '\0' after the part. */
+		if (len + token_len + 1 > FEN_MAX_LEN)
 			return 1;
-
-		do_move(pos, moves[num - 1]);
+		memcpy(fen + len, token, token_len);
+		len += token_len;
+		fen[len++] = i < parts_nb - 1 ? ' ' : '\0';
 	}
-	*len = num;
+	return 0;
+}
 
-	for (int i = *len - 1; i >= 0; --i)
-		undo_move(pos, moves[i]);
+/*
+ * Makes the game have the moves from token on, the first token being the first
+ * move. The moves of the game are kept while they are the same as the tokens,
+ * and the ones after that are taken back before the new ones are played.
+ */
+static void update_game_moves(char *token)
+{
+	Position *const pos = &search_arg.pos;
+	char lan[MAX_LAN_LEN + 1];
 
-	return 0;
+	int i = 0;
+	for (; token && i < game_moves_nb; ++i, token = strtok(NULL, " ")) {
+		move_to_lan(lan, game_moves[i]);
+		if (strcmp(lan, token))
+			break;
+	}
+	while (game_moves_nb > i)
+		undo_move(pos, game_moves[--game_moves_nb]);
+
+	for (; token; token = strtok(NULL, " ")) {
+		if (strlen(token) > MAX_LAN_LEN ||
+		    game_moves_nb == POSITION_STACK_CAPACITY)
+			return;
+		bool success;
+		const Move move = lan_to_move(token, pos, &success);
+		if (!success)
+			return;
+		do_move(pos, move);
+		game_moves[game_moves_nb++] = move;
+	}
 }
 
+/*
+ * The transposition table is only allocated for the first game, after that it
+ * is just cleared.
+ */
 static void ucinewgame(void)
 {
-	const struct option *const hash = get_option("Hash");
-	if (!hash) {
-		fprintf(stderr, "Internal error.\n");
-		exit(1);
+	const int threads = get_integer_option("Threads");
+	if (initialized_transposition_table) {
+		clear_tt(threads);
+	} else {
+		tt_init((size_t)get_integer_option("Hash"), threads);
+		initialized_transposition_table = true;
 	}
-	if (initialized_transposition_table)
-		tt_free();
-	tt_init(512);
-	initialized_transposition_table = true;
 
 	init_search_arg(&search_arg);
 
@@ -423,65 +536,116 @@ static void ucinewgame(void)
 
 static void init_search_arg(struct search_argument *arg)
 {
-	arg->moves_nb = 0;
 	arg->stop = &stop_search;
+	arg->ponder = &pondering;
 	arg->info_sender = info;
 	arg->best_move_sender = bestmove;
+	reset_search_limits(arg);
+	for (int i = 0; i < arg->threads; ++i)
+		init_search_context(&arg->ctx[i]);
+}
+
+/*
+ * The limits only apply to the search of one go command, so they are reset
+ * before the parameters of each command are read.
+ */
+static void reset_search_limits(struct search_argument *arg)
+{
 	arg->depth = INT_MAX;
 	arg->nodes = LLONG_MAX;
 	arg->time[COLOR_WHITE] = arg->time[COLOR_BLACK] = 0;
 	arg->inc[COLOR_WHITE] = arg->inc[COLOR_BLACK] = 0;
+	arg->movestogo = 0;
 	arg->movetime = 0;
 	arg->mate = 0;
-	init_search_context(&arg->ctx);
-#ifdef SEARCH_STATISTICS
-	arg->log_file = fopen("search.log", "w");
-	if (!arg->log_file) {
-		fprintf(stderr, "Could not create log file.\n");
+}
+
+/*
+ * Makes sure there is one search context for each search thread. The contexts
+ * of the threads that already existed are kept so they don't lose their
+ * history.
+ */
+static void set_search_threads(struct search_argument *arg, int threads)
+{
+	if (threads == arg->threads)
+		return;
+
+	struct search_context *const ctx =
+		realloc(arg->ctx, (size_t)threads * sizeof(*ctx));
+	if (!ctx) {
+		fprintf(stderr, "Out of memory.\n");
 		exit(1);
 	}
-#endif
+	for (int i = arg->threads; i < threads; ++i)
+		init_search_context(&ctx[i]);
+	arg->ctx = ctx;
+	arg->threads = threads;
 }
 
 /*
- * Infinite searches are done by maxing out the search limits.
+ * Infinite searches are done by maxing out the search limits. With "perft" the
+ * leaves of the tree are counted instead of searching. With "ponder" the limits
+ * are the ones of the move after the expected reply, and they are ignored until
+ * the ponderhit. When the position is in the book the book move is sent right
+ * away without searching, unless the search is infinite or pondering since
+ * then the GUI waits for the search and not for a move.
  */
 static void go(void)
 {
+	/* The previous search still reads the search argument, so we wait for
+	 * it before changing the limits. */
+	if (search_thread_created) {
+		search_thread_created = false;
+		if (pthread_join(search_thread, NULL)) {
+			fprintf(stderr, "Internal error.\n");
+			exit(1);
+		}
+	}
+
+	reset_search_limits(&search_arg);
+	int perft_depth = -1;
+	bool ponder = false;
+	bool infinite = false;
 	char *str = strtok(NULL, " ");
 	while (str) {
 		if (!strcmp(str, "infinite")) {
 			search_arg.depth = 100;
+			infinite = true;
+		} else if (!strcmp(str, "ponder")) {
+			ponder = true;
 		} else {
 			const char *const value = strtok(NULL, " ");
 			if (!value)
 				return;
 			char *endptr = NULL;
 			errno = 0;
-			int x = (int)strtol(value, &endptr, 10);
+			const long long n = strtoll(value, &endptr, 10);
 			if (errno == ERANGE || endptr == value)
 				return;
+			const int x = n > INT_MAX ? INT_MAX :
+				      n < INT_MIN ? INT_MIN :
+						    (int)n;
 
 			if (!strcmp(str, "depth")) {
 				search_arg.depth = x;
 			} else if (!strcmp(str, "nodes")) {
-				search_arg.nodes = x;
+				search_arg.nodes = n;
 			} else if (!strcmp(str, "mate")) {
 				search_arg.mate = x;
 			} else if (!strcmp(str, "wtime")) {
-				search_arg.time[COLOR_WHITE] = x;
+				search_arg.time[COLOR_WHITE] = n;
 			} else if (!strcmp(str, "btime")) {
-				search_arg.time[COLOR_BLACK] = x;
+				search_arg.time[COLOR_BLACK] = n;
 			} else if (!strcmp(str, "winc")) {
-				search_arg.inc[COLOR_WHITE] = x;
+				search_arg.inc[COLOR_WHITE] = n;
 			} else if (!strcmp(str, "binc")) {
-				search_arg.inc[COLOR_BLACK] = x;
+				search_arg.inc[COLOR_BLACK] = n;
 			} else if (!strcmp(str, "movestogo")) {
 				search_arg.movestogo = x;
 			} else if (!strcmp(str, "movetime")) {
-				search_arg.movetime = x;
+				search_arg.movetime = n;
 			} else if (!strcmp(str, "perft")) {
-				/* TODO. */
+				perft_depth = x;
 			} else {
 				break;
 			}
@@ -489,28 +653,72 @@ static void go(void)
 		str = strtok(NULL, " ");
 	}
 
-	if (search_thread_created) {
-		search_thread_created = false;
-		if (pthread_join(search_thread, NULL)) {
-			fprintf(stderr, "Internal error.\n");
-			exit(1);
+	/* There is nothing to search before the first position command. */
+	if (!search_arg.pos.irr_states)
+		return;
+
+	if (perft_depth >= 0) {
+		go_perft(perft_depth);
+		return;
+	}
+
+	if (get_boolean_option("OwnBook") && !infinite && !ponder) {
+		const Move book_move = probe_book(&search_arg.pos);
+		if (book_move) {
+			bestmove(book_move, 0);
+			return;
 		}
 	}
 
+	set_search_threads(&search_arg, get_integer_option("Threads"));
+	search_arg.multipv = get_integer_option("MultiPV");
+	search_arg.statistics_sender =
+		get_boolean_option("SearchStatistics") ? statistics : NULL;
+
 	stop_search = false;
+	pondering = ponder;
 	if (pthread_create(&search_thread, NULL, search, &search_arg)) {
 		search_thread_created = false;
 		stop_search = true;
+		pondering = false;
 		perror("Athena");
 	} else {
 		search_thread_created = true;
 	}
 }
 
+/*
+ * The perft runs in the UCI thread, it's only meant for testing the move
+ * generator so it doesn't need to be stopped. The nodes under each root move
+ * are printed like the divide command of other engines.
+ */
+static void go_perft(int depth)
+{
+	Position pos;
+	copy_position(&pos, &search_arg.pos);
+
+	struct timespec t1, t2;
+	timespec_get(&t1, TIME_UTC);
+	const u64 nodes = perft(&pos, depth, get_integer_option("Threads"),
+				(size_t)get_integer_option("Hash"), divide);
+	timespec_get(&t2, TIME_UTC);
+	free_position(&pos);
+
+	long long time = (t2.tv_sec - t1.tv_sec) * 1000 +
+			 (t2.tv_nsec - t1.tv_nsec) / 1000000;
+	if (time < 1)
+		time = 1;
+	uci_send("");
+	uci_send("Nodes searched: %llu", (unsigned long long)nodes);
+	uci_send("Time: %lld ms, %.2f Mnps", time,
+		 (double)nodes / (double)time / 1000.0);
+}
+
 static void stop(void)
 {
 	if (search_thread_created) {
 		search_thread_created = false;
+		stop_pondering();
 		stop_search = true;
 		if (pthread_join(search_thread, NULL)) {
 			fprintf(stderr, "Internal error.\n");
@@ -519,10 +727,129 @@ static void stop(void)
 	}
 }
 
+/*
+ * The opponent played the expected move, so the search keeps going as a normal
+ * search of the position with the time limits it already has.
+ */
+static void ponderhit(void)
+{
+	if (search_thread_created)
+		stop_pondering();
+}
+
+static void stop_pondering(void)
+{
+	pthread_mutex_lock(&ponder_mutex);
+	pondering = false;
+	pthread_cond_broadcast(&ponder_cond);
+	pthread_mutex_unlock(&ponder_mutex);
+}
+
+/*
+ * This is not a UCI command, it searches the positions of the benchmark with an
+ * optional depth and the current options. The benchmark clears the
+ * transposition table, so after it a new game has to be started.
+ */
+static void run_bench(void)
+{
+	int depth = BENCH_DEFAULT_DEPTH;
+	const char *const value = strtok(NULL, " ");
+	if (value) {
+		char *endptr = NULL;
+		errno = 0;
+		depth = (int)strtol(value, &endptr, 10);
+		if (errno == ERANGE || endptr == value || depth < 1)
+			return;
+	}
+
+	if (search_thread_created) {
+		search_thread_created = false;
+		if (pthread_join(search_thread, NULL)) {
+			fprintf(stderr, "Internal error.\n");
+			exit(1);
+		}
+	}
+
+	const int threads = get_integer_option("Threads");
+	if (!initialized_transposition_table) {
+		tt_init((size_t)get_integer_option("Hash"), threads);
+		initialized_transposition_table = true;
+	}
+	newgame_sent = false;
+
+	struct bench_result result;
+	bench(&result, depth, threads);
+	uci_send("Nodes searched: %lld", result.nodes);
+	uci_send("Time: %lld ms", result.time);
+	uci_send("Nodes/second: %lld", result.nps);
+}
+
+/*
+ * This is not a UCI command, it sends the statistics of the last search. The
+ * commands are ignored while searching, so they are never read while the
+ * search threads are still counting.
+ */
+static void stats(void)
+{
+	struct search_statistics total;
+	sum_search_statistics(&total, search_arg.ctx, search_arg.threads);
+	statistics(&total);
+}
+
+/*
+ * These are not UCI commands, they save the transposition table to the file
+ * given by HashFile and load it back, so the work of a previous session can be
+ * reused. The table is only loaded if it was saved with the same Hash size.
+ */
+static void save_hash(void)
+{
+	const char *const path = get_string_option("HashFile");
+	if (!path || !strcmp(path, "<empty>")) {
+		uci_send("info string HashFile is not set");
+		return;
+	}
+	if (search_thread_created) {
+		search_thread_created = false;
+		if (pthread_join(search_thread, NULL)) {
+			fprintf(stderr, "Internal error.\n");
+			exit(1);
+		}
+	}
+
+	if (!initialized_transposition_table || save_tt(path))
+		uci_send("info string Could not save the hash to %s", path);
+}
+
+/*
+ * The table is loaded as if a new game had started, so the position command
+ * doesn't clear it.
+ */
+static void load_hash(void)
+{
+	const char *const path = get_string_option("HashFile");
+	if (!path || !strcmp(path, "<empty>")) {
+		uci_send("info string HashFile is not set");
+		return;
+	}
+	if (search_thread_created) {
+		search_thread_created = false;
+		if (pthread_join(search_thread, NULL)) {
+			fprintf(stderr, "Internal error.\n");
+			exit(1);
+		}
+	}
+
+	if (!newgame_sent)
+		ucinewgame();
+	if (load_tt(path))
+		uci_send("info string Could not load the hash from %s", path);
+}
+
 static void quit(void)
 {
 	if (search_thread_created) {
 		search_thread_created = false;
+		stop_pondering();
 		stop_search = true;
 		if (pthread_join(search_thread, NULL)) {
 			fprintf(stderr, "Internal error.\n");
@@ -538,61 +865,134 @@ static void quit(void)
 		tt_free();
 		initialized_transposition_table = false;
 	}
+	free(search_arg.ctx);
+	search_arg.ctx = NULL;
+	search_arg.threads = 0;
+	free_position(&search_arg.pos);
+	free_network();
+	free_book();
+	tb_free();
 }
 
-static void info(const struct info *info)
+/*
+ * The transposition table is allocated in the first ucinewgame, before that we
+ * only need to remember the size.
+ */
+static void set_hash_size(void)
 {
-	char *str = malloc(6), *tmp;
-	if (!str) {
-		fprintf(stderr, "Out of memory.\n");
-		exit(1);
+	if (initialized_transposition_table) {
+		resize_tt((size_t)get_integer_option("Hash"),
+			  get_integer_option("Threads"));
 	}
+}
 
-	if (!info->flags) {
-		free(str);
+static void clear_hash(void)
+{
+	if (initialized_transposition_table)
+		clear_tt(get_integer_option("Threads"));
+}
+
+/*
+ * The default value means there is no network. If the file can't be loaded we
+ * keep the network we had before, if any. The TT is cleared because the
+ * evaluations stored in it came from the old network.
+ */
+static void set_eval_file(void)
+{
+	const char *const path = get_string_option("EvalFile");
+	if (!path || !strcmp(path, "<empty>")) {
+		free_network();
+	} else if (load_network(path)) {
+		uci_send("info string Could not load the network from %s",
+			 path);
 		return;
 	}
+	clear_hash();
+}
+
+/*
+ * Without a network we fall back to the handcrafted evaluation.
+ */
+static void set_use_nnue(void)
+{
+	const bool use_nnue = get_boolean_option("UseNNUE");
+	enable_nnue(use_nnue);
+	if (use_nnue && !nnue_is_enabled())
+		uci_send("info string No network loaded, using the "
+			 "handcrafted evaluation");
+	clear_hash();
+}
 
-	strcpy(str, "info ");
+/*
+ * The default value means there is no book. If the file can't be loaded we keep
+ * the book we had before, if any.
+ */
+static void set_book_file(void)
+{
+	const char *const path = get_string_option("BookFile");
+	if (!path || !strcmp(path, "<empty>"))
+		free_book();
+	else if (load_book(path))
+		uci_send("info string Could not load the book from %s", path);
+}
 
-	if (info->flags & INFO_FLAG_DEPTH) {
-		SAFE_ASPRINTF(&tmp, "%sdepth %d ", str, info->depth);
-		free(str);
-		str = tmp;
-	}
-	if (info->flags & INFO_FLAG_NODES) {
-		SAFE_ASPRINTF(&tmp, "%snodes %lld ", str, info->nodes);
-		free(str);
-		str = tmp;
-	}
-	if (info->flags & INFO_FLAG_CP) {
-		SAFE_ASPRINTF(&tmp, "%sscore cp %d ", str, info->cp);
-		free(str);
-		str = tmp;
-	} else if (info->flags & INFO_FLAG_MATE) {
-		SAFE_ASPRINTF(&tmp, "%sscore mate %d ", str, info->mate);
-		free(str);
-		str = tmp;
-	}
-	if (info->flags & INFO_FLAG_LBOUND) {
-		SAFE_ASPRINTF(&tmp, "%slowerbound ", str);
-		free(str);
-		str = tmp;
-	}
-	if (info->flags & INFO_FLAG_NPS) {
-		SAFE_ASPRINTF(&tmp, "%snps %lld ", str, info->nps);
-		free(str);
-		str = tmp;
+/*
+ * The path has the directories of the tables separated by colons. The default
+ * value means there are no tables.
+ */
+static void set_syzygy_path(void)
+{
+	const char *const path = get_string_option("SyzygyPath");
+	if (!path || !strcmp(path, "<empty>")) {
+		tb_free();
+		return;
 	}
-	if (info->flags & INFO_FLAG_TIME) {
-		SAFE_ASPRINTF(&tmp, "%stime %lld", str, info->time);
-		free(str);
-		str = tmp;
+	const int tables_nb = tb_init(path);
+	uci_send("info string Found %d tablebases with up to %d pieces",
+		 tables_nb, get_tb_largest());
+}
+
+static void info(const struct info *info)
+{
+	char str[OUTPUT_CAPACITY];
+	const size_t size = sizeof(str);
+	size_t len = 0;
+
+	if (!info->flags)
+		return;
+
+	append(str, size, &len, "info ");
+
+	if (info->flags & INFO_FLAG_DEPTH)
+		append(str, size, &len, "depth %d ", info->depth);
+	if (info->flags & INFO_FLAG_MULTIPV)
+		append(str, size, &len, "multipv %d ", info->multipv);
+	if (info->flags & INFO_FLAG_NODES)
+		append(str, size, &len, "nodes %lld ", info->nodes);
+	if (info->flags & INFO_FLAG_CP)
+		append(str, size, &len, "score cp %d ", info->cp);
+	else if (info->flags & INFO_FLAG_MATE)
+		append(str, size, &len, "score mate %d ", info->mate);
+	if (info->flags & INFO_FLAG_LBOUND)
+		append(str, size, &len, "lowerbound ");
+	else if (info->flags & INFO_FLAG_UBOUND)
+		append(str, size, &len, "upperbound ");
+	if (info->flags & INFO_FLAG_NPS)
+		append(str, size, &len, "nps %lld ", info->nps);
+	if (info->flags & INFO_FLAG_TIME)
+		append(str, size, &len, "time %lld", info->time);
+	/* The PV must be the last field since it takes the rest of the
+	 * line. */
+	if (info->flags & INFO_FLAG_PV) {
+		append(str, size, &len, " pv");
+		for (int i = 0; i < info->pv_length; ++i) {
+			char lan[MAX_LAN_LEN + 1];
+			move_to_lan(lan, info->pv[i]);
+			append(str, size, &len, " %s", lan);
+		}
 	}
 
-	str[strlen(str)] = 0;
-	uci_send(str);
-	free(str);
+	uci_send("%s", str);
 }
 
 static void id(void)
@@ -641,23 +1041,102 @@ static void readyok(void)
 	uci_send("readyok");
 }
 
-static void bestmove(Move move)
+/*
+ * It is called by the search thread, which waits here while pondering.
+ */
+static void bestmove(Move best_move, Move ponder_move)
+{
+	char best_lan[MAX_LAN_LEN + 1], ponder_lan[MAX_LAN_LEN + 1];
+
+	pthread_mutex_lock(&ponder_mutex);
+	while (pondering)
+		pthread_cond_wait(&ponder_cond, &ponder_mutex);
+	pthread_mutex_unlock(&ponder_mutex);
+
+	move_to_lan(best_lan, best_move);
+	if (ponder_move) {
+		move_to_lan(ponder_lan, ponder_move);
+		uci_send("bestmove %s ponder %s", best_lan, ponder_lan);
+	} else {
+		uci_send("bestmove %s", best_lan);
+	}
+}
+
+/*
+ * The rates are percentages, they are 0 when nothing was counted.
+ */
+static void statistics(const struct search_statistics *stats)
+{
+	const long long probes = stats->tt_probes ? stats->tt_probes : 1;
+	const long long fail_highs = stats->fail_highs ? stats->fail_highs : 1;
+
+	uci_send("info string nodes %lld qnodes %lld illegal %lld",
+		 stats->nodes, stats->quiescence_nodes, stats->illegal_moves);
+	uci_send("info string tt probes %lld hits %lld (%.1f%%) cutoffs %lld",
+		 stats->tt_probes, stats->tt_hits,
+		 100.0 * (double)stats->tt_hits / (double)probes,
+		 stats->tt_cutoffs);
+	uci_send("info string tb hits %lld", stats->tb_hits);
+	uci_send("info string prunes nullmove %lld rfp %lld futility %lld "
+		 "lmp %lld qsee %lld",
+		 stats->null_move_prunes, stats->reverse_futility_prunes,
+		 stats->futility_prunes, stats->late_move_prunes,
+		 stats->qsearch_see_prunes);
+	uci_send("info string failhigh %lld first %lld (%.1f%%) "
+		 "lmrresearch %lld",
+		 stats->fail_highs, stats->first_move_fail_highs,
+		 100.0 * (double)stats->first_move_fail_highs /
+			 (double)fail_highs,
+		 stats->lmr_researches);
+}
+
+static void divide(Move move, u64 nodes)
 {
 	char lan[MAX_LAN_LEN + 1];
 
 	move_to_lan(lan, move);
-	uci_send("bestmove %s", lan);
+	uci_send("%s: %llu", lan, (unsigned long long)nodes);
 }
 
+/*
+ * The message is written at once so that the messages of the search thread and
+ * of the UCI thread don't get mixed.
+ */
 static void uci_send(const char *fmt, ...)
 {
+	char str[OUTPUT_CAPACITY];
 	va_list args;
 	va_start(args, fmt);
-	vprintf(fmt, args);
-	putchar('\n');
+	int len = vsnprintf(str, sizeof(str), fmt, args);
+	va_end(args);
+	if (len < 0)
+		return;
+	if ((size_t)len >= sizeof(str))
+		len = (int)sizeof(str) - 1;
+
+	/* The line break takes the place of the '\0'. */
+	str[len] = '\n';
+	fwrite(str, 1, (size_t)len + 1, stdout);
 	fflush(stdout);
 }
 
+/*
+ * Appends to the string of length len in a buffer of the given size and
+ * updates len. The part that doesn't fit is cut.
+ */
+static void append(char *str, size_t size, size_t *len, const char *fmt, ...)
+{
+	if (*len + 1 >= size)
+		return;
+
+	va_list args;
+	va_start(args, fmt);
+	const int n = vsnprintf(str + *len, size - *len, fmt, args);
+	va_end(args);
+	if (n > 0)
+		*len = *len + (size_t)n < size ? *len + (size_t)n : size - 1;
+}
+
 /*
  * Converts a string to a value for an option and returns 0 on success and 1
  * otherwise.
@@ -721,3 +1200,36 @@ static struct option *get_option(const char *name)
 
 	return NULL;
 }
+
+static int get_integer_option(const char *name)
+{
+	const struct option *const op = get_option(name);
+	if (!op || op->type != OPTION_TYPE_INTEGER) {
+		fprintf(stderr, "Internal error.\n");
+		exit(1);
+	}
+	return op->value.integer;
+}
+
+static bool get_boolean_option(const char *name)
+{
+	const struct option *const op = get_option(name);
+	if (!op || op->type != OPTION_TYPE_BOOLEAN) {
+		fprintf(stderr, "Internal error.\n");
+		exit(1);
+	}
+	return op->value.boolean;
+}
+
+/*
+ * Returns NULL if the option was never set.
+ */
+static const char *get_string_option(const char *name)
+{
+	const struct option *const op = get_option(name);
+	if (!op || op->type != OPTION_TYPE_STRING) {
+		fprintf(stderr, "Internal error.\n");
+		exit(1);
+	}
+	return op->value.string;
+}